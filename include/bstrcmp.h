@@ -0,0 +1,514 @@
+// bstrcmp.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::BstrEqual, BstrCompareNoCase, BstrFind, BstrHashNoCase: Compare
+// and search BSTR contents
+//
+// The ComTools BSTR comparison functions are released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef BSTRCMP_H
+#define BSTRCMP_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include "ubstr.h"
+
+// On x64, the kernels use SSE2, which every x64 processor has, or AVX2 if
+// the processor and operating system support it
+#if defined(_M_X64)
+#define BSTRCMP_SIMD
+#include <intrin.h>
+#if defined(__clang__) || defined(__GNUC__)
+#define BSTRCMP_AVX2 __attribute__((target("avx2")))
+#else
+#define BSTRCMP_AVX2
+#endif
+#endif
+
+namespace ComTools {
+
+    // The functions here read BSTR contents in place, using the length
+    // prefix, so they do not stop at embedded nulls. A null BSTR is
+    // empty. The pointer and length overloads work on any UTF-16 text.
+    //
+    // The NoCase functions compare the invariant uppercase of each UTF-16
+    // code unit, as CompareStringOrdinal() does when it ignores case. Runs
+    // of ASCII are folded and compared in vector registers; a block that
+    // contains other characters is uppercased with LCMapStringEx() and the
+    // invariant locale, so the result is the same either way.
+
+    constexpr size_t BstrNotFound = static_cast<size_t>(-1);
+
+    // Uppercases n code units of src into dst
+    inline void InternalBstrUpper(wchar_t const* src, size_t n, wchar_t* dst) noexcept
+    {
+        bool ascii = true;
+        for (size_t i = 0; i < n; ++i)
+        {
+            wchar_t c = src[i];
+            if (c >= 0x80) ascii = false;
+            dst[i] = c >= L'a' && c <= L'z' ? static_cast<wchar_t>(c - 0x20) : c;
+        }
+
+        if (!ascii)
+        {
+            LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE,
+                src, static_cast<int>(n), dst, static_cast<int>(n), nullptr, nullptr, 0);
+        }
+    }
+
+#ifdef BSTRCMP_SIMD
+    inline bool InternalBstrAvx2() noexcept
+    {
+        static bool const avx2 = []() {
+            int info[4];
+            __cpuidex(info, 0, 0);
+            if (info[0] < 7) return false;
+
+            // The processor supports AVX and the OS saves the YMM registers
+            __cpuidex(info, 1, 0);
+            if ((info[2] & (3 << 27)) != (3 << 27)) return false;
+            if ((_xgetbv(0) & 6) != 6) return false;
+
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+        }();
+
+        return avx2;
+    }
+
+    // The SSE2 and AVX2 kernels below work on 16-bit code units of type Ch.
+    // Each returns the number of units it has handled; the caller finishes
+    // the rest.
+
+    // The index of the first unit that differs
+    template<typename Ch>
+    size_t InternalSse2Mismatch(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i));
+            unsigned diff = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(x, y))) ^ 0xFFFFu;
+            if (diff) return i + std::countr_zero(diff) / 2;
+        }
+
+        return i;
+    }
+
+    template<typename Ch>
+    BSTRCMP_AVX2 size_t InternalAvx2Mismatch(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i));
+            __m256i y = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i));
+            unsigned diff = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, y)));
+            if (diff) return i + std::countr_zero(diff) / 2;
+        }
+
+        return i;
+    }
+
+    // The index of the first unit that differs after ASCII uppercasing, or
+    // of the first block with a unit outside ASCII
+    template<typename Ch>
+    size_t InternalSse2MismatchNoCase(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        __m128i const high = _mm_set1_epi16(static_cast<short>(0xFF80));
+        __m128i const before = _mm_set1_epi16(L'a' - 1);
+        __m128i const after = _mm_set1_epi16(L'z' + 1);
+        __m128i const flip = _mm_set1_epi16(0x20);
+        __m128i const zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i));
+            __m128i wide = _mm_cmpeq_epi16(_mm_and_si128(_mm_or_si128(x, y), high), zero);
+            if (_mm_movemask_epi8(wide) != 0xFFFF) return i;
+
+            __m128i lx = _mm_and_si128(_mm_cmpgt_epi16(x, before), _mm_cmplt_epi16(x, after));
+            __m128i ly = _mm_and_si128(_mm_cmpgt_epi16(y, before), _mm_cmplt_epi16(y, after));
+            x = _mm_sub_epi16(x, _mm_and_si128(lx, flip));
+            y = _mm_sub_epi16(y, _mm_and_si128(ly, flip));
+            unsigned diff = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi16(x, y))) ^ 0xFFFFu;
+            if (diff) return i + std::countr_zero(diff) / 2;
+        }
+
+        return i;
+    }
+
+    template<typename Ch>
+    BSTRCMP_AVX2 size_t InternalAvx2MismatchNoCase(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        __m256i const high = _mm256_set1_epi16(static_cast<short>(0xFF80));
+        __m256i const before = _mm256_set1_epi16(L'a' - 1);
+        __m256i const after = _mm256_set1_epi16(L'z' + 1);
+        __m256i const flip = _mm256_set1_epi16(0x20);
+        __m256i const zero = _mm256_setzero_si256();
+
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i));
+            __m256i y = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i));
+            __m256i wide = _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_or_si256(x, y), high), zero);
+            if (_mm256_movemask_epi8(wide) != -1) return i;
+
+            __m256i lx = _mm256_and_si256(_mm256_cmpgt_epi16(x, before), _mm256_cmpgt_epi16(after, x));
+            __m256i ly = _mm256_and_si256(_mm256_cmpgt_epi16(y, before), _mm256_cmpgt_epi16(after, y));
+            x = _mm256_sub_epi16(x, _mm256_and_si256(lx, flip));
+            y = _mm256_sub_epi16(y, _mm256_and_si256(ly, flip));
+            unsigned diff = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, y)));
+            if (diff) return i + std::countr_zero(diff) / 2;
+        }
+
+        return i;
+    }
+
+    // Uppercases ASCII blocks of src into dst, up to the first block with
+    // a unit outside ASCII
+    template<typename Ch>
+    size_t InternalSse2UpperAscii(Ch const* src, size_t n, Ch* dst) noexcept
+    {
+        __m128i const high = _mm_set1_epi16(static_cast<short>(0xFF80));
+        __m128i const before = _mm_set1_epi16(L'a' - 1);
+        __m128i const after = _mm_set1_epi16(L'z' + 1);
+        __m128i const flip = _mm_set1_epi16(0x20);
+        __m128i const zero = _mm_setzero_si128();
+
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(x, high), zero)) != 0xFFFF) return i;
+
+            __m128i lx = _mm_and_si128(_mm_cmpgt_epi16(x, before), _mm_cmplt_epi16(x, after));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_sub_epi16(x, _mm_and_si128(lx, flip)));
+        }
+
+        return i;
+    }
+
+    template<typename Ch>
+    BSTRCMP_AVX2 size_t InternalAvx2UpperAscii(Ch const* src, size_t n, Ch* dst) noexcept
+    {
+        __m256i const high = _mm256_set1_epi16(static_cast<short>(0xFF80));
+        __m256i const before = _mm256_set1_epi16(L'a' - 1);
+        __m256i const after = _mm256_set1_epi16(L'z' + 1);
+        __m256i const flip = _mm256_set1_epi16(0x20);
+        __m256i const zero = _mm256_setzero_si256();
+
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(x, high), zero)) != -1) return i;
+
+            __m256i lx = _mm256_and_si256(_mm256_cmpgt_epi16(x, before), _mm256_cmpgt_epi16(after, x));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_sub_epi16(x, _mm256_and_si256(lx, flip)));
+        }
+
+        return i;
+    }
+
+    // Searches for p (m units, 1 <= m <= n) in s (n units) at the positions
+    // handled. Returns the position found or BstrNotFound, and sets *done
+    // to the number of positions handled. Positions whose first and last
+    // units match are compared in full.
+    template<typename Ch>
+    size_t InternalSse2Find(Ch const* s, size_t n, Ch const* p, size_t m, size_t* done) noexcept
+    {
+        __m128i const first = _mm_set1_epi16(static_cast<short>(p[0]));
+        __m128i const last = _mm_set1_epi16(static_cast<short>(p[m - 1]));
+
+        size_t i = 0;
+        for (; i + m - 1 + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(s + i));
+            __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const*>(s + i + m - 1));
+            __m128i both = _mm_and_si128(_mm_cmpeq_epi16(x, first), _mm_cmpeq_epi16(y, last));
+            unsigned hits = static_cast<unsigned>(_mm_movemask_epi8(both)) & 0x5555u;
+            while (hits)
+            {
+                size_t j = i + std::countr_zero(hits) / 2;
+                if (m <= 2 || std::memcmp(s + j + 1, p + 1, (m - 2) * sizeof(Ch)) == 0)
+                {
+                    *done = j;
+                    return j;
+                }
+
+                hits &= hits - 1;
+            }
+        }
+
+        *done = i;
+        return BstrNotFound;
+    }
+
+    template<typename Ch>
+    BSTRCMP_AVX2 size_t InternalAvx2Find(Ch const* s, size_t n, Ch const* p, size_t m, size_t* done) noexcept
+    {
+        __m256i const first = _mm256_set1_epi16(static_cast<short>(p[0]));
+        __m256i const last = _mm256_set1_epi16(static_cast<short>(p[m - 1]));
+
+        size_t i = 0;
+        for (; i + m - 1 + 16 <= n; i += 16)
+        {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i));
+            __m256i y = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s + i + m - 1));
+            __m256i both = _mm256_and_si256(_mm256_cmpeq_epi16(x, first), _mm256_cmpeq_epi16(y, last));
+            unsigned hits = static_cast<unsigned>(_mm256_movemask_epi8(both)) & 0x55555555u;
+            while (hits)
+            {
+                size_t j = i + std::countr_zero(hits) / 2;
+                if (m <= 2 || std::memcmp(s + j + 1, p + 1, (m - 2) * sizeof(Ch)) == 0)
+                {
+                    *done = j;
+                    return j;
+                }
+
+                hits &= hits - 1;
+            }
+        }
+
+        *done = i;
+        return BstrNotFound;
+    }
+#endif
+
+    // Dispatch to the widest kernel available. The scalar loops finish
+    // what the kernels leave.
+
+    template<typename Ch>
+    size_t InternalBstrMismatch(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        size_t i = 0;
+#ifdef BSTRCMP_SIMD
+        if constexpr (sizeof(Ch) == 2)
+        {
+            i = InternalBstrAvx2() ? InternalAvx2Mismatch(a, b, n) : InternalSse2Mismatch(a, b, n);
+        }
+#endif
+        while (i < n && a[i] == b[i]) ++i;
+        return i;
+    }
+
+    // The index of the first unit that differs after ASCII uppercasing or
+    // is outside ASCII
+    template<typename Ch>
+    size_t InternalBstrMismatchNoCase(Ch const* a, Ch const* b, size_t n) noexcept
+    {
+        size_t i = 0;
+#ifdef BSTRCMP_SIMD
+        if constexpr (sizeof(Ch) == 2)
+        {
+            i = InternalBstrAvx2() ? InternalAvx2MismatchNoCase(a, b, n) : InternalSse2MismatchNoCase(a, b, n);
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            Ch x = a[i];
+            Ch y = b[i];
+            if (x >= 0x80 || y >= 0x80) break;
+            if (x >= 'a' && x <= 'z') x = static_cast<Ch>(x - 0x20);
+            if (y >= 'a' && y <= 'z') y = static_cast<Ch>(y - 0x20);
+            if (x != y) break;
+        }
+
+        return i;
+    }
+
+    template<typename Ch>
+    size_t InternalBstrFind(Ch const* s, size_t n, Ch const* p, size_t m) noexcept
+    {
+        if (m == 0) return 0;
+        if (m > n) return BstrNotFound;
+
+        size_t i = 0;
+#ifdef BSTRCMP_SIMD
+        if constexpr (sizeof(Ch) == 2)
+        {
+            size_t found = InternalBstrAvx2() ? InternalAvx2Find(s, n, p, m, &i) : InternalSse2Find(s, n, p, m, &i);
+            if (found != BstrNotFound) return found;
+        }
+#endif
+        for (; i + m <= n; ++i)
+        {
+            if (s[i] == p[0] && std::memcmp(s + i, p, m * sizeof(Ch)) == 0) return i;
+        }
+
+        return BstrNotFound;
+    }
+
+    // Uppercases n code units of src into dst
+    inline void InternalBstrUpperFast(wchar_t const* src, size_t n, wchar_t* dst) noexcept
+    {
+        size_t i = 0;
+#ifdef BSTRCMP_SIMD
+        if constexpr (sizeof(wchar_t) == 2)
+        {
+            i = InternalBstrAvx2() ? InternalAvx2UpperAscii(src, n, dst) : InternalSse2UpperAscii(src, n, dst);
+        }
+#endif
+        if (i < n) InternalBstrUpper(src + i, n - i, dst + i);
+    }
+
+    // Ordinal equality
+    inline bool BstrEqual(wchar_t const* a, size_t na, wchar_t const* b, size_t nb) noexcept
+    {
+        return na == nb && InternalBstrMismatch(a, b, na) == na;
+    }
+
+    // Case-insensitive ordering: negative if a sorts before b, zero if they
+    // are equal, or positive if a sorts after b
+    inline int BstrCompareNoCase(wchar_t const* a, size_t na, wchar_t const* b, size_t nb) noexcept
+    {
+        size_t const n = (std::min)(na, nb);
+        size_t i = 0;
+        while (i < n)
+        {
+            i += InternalBstrMismatchNoCase(a + i, b + i, n - i);
+            if (i == n) break;
+
+            // Uppercase a chunk that starts with a difference or a unit
+            // outside ASCII
+            wchar_t ua[64];
+            wchar_t ub[64];
+            size_t chunk = (std::min)(n - i, size_t(64));
+            InternalBstrUpper(a + i, chunk, ua);
+            InternalBstrUpper(b + i, chunk, ub);
+            for (size_t j = 0; j < chunk; ++j)
+            {
+                if (ua[j] != ub[j]) return static_cast<unsigned>(ua[j]) < static_cast<unsigned>(ub[j]) ? -1 : 1;
+            }
+
+            i += chunk;
+        }
+
+        return na < nb ? -1 : na > nb ? 1 : 0;
+    }
+
+    inline bool BstrEqualNoCase(wchar_t const* a, size_t na, wchar_t const* b, size_t nb) noexcept
+    {
+        return na == nb && BstrCompareNoCase(a, na, b, nb) == 0;
+    }
+
+    // The position of the first occurrence of p in s (ordinal), or
+    // BstrNotFound
+    inline size_t BstrFind(wchar_t const* s, size_t ns, wchar_t const* p, size_t np) noexcept
+    {
+        return InternalBstrFind(s, ns, p, np);
+    }
+
+    // Hash that is equal for strings that BstrEqualNoCase() finds equal
+    inline size_t BstrHashNoCase(wchar_t const* s, size_t n) noexcept
+    {
+        unsigned long long h = 0xCBF29CE484222325ULL ^ n;
+        wchar_t upper[64];
+        for (size_t i = 0; i < n; i += 64)
+        {
+            size_t chunk = (std::min)(n - i, size_t(64));
+            InternalBstrUpperFast(s + i, chunk, upper);
+            for (size_t j = 0; j < chunk; j += 4)
+            {
+                unsigned long long word = 0;
+                for (size_t k = j; k < j + 4 && k < chunk; ++k)
+                {
+                    word |= static_cast<unsigned long long>(upper[k] & 0xFFFF) << (16 * (k - j));
+                }
+
+                h = (h ^ word) * 0x9E3779B97F4A7C15ULL;
+                h ^= h >> 32;
+            }
+        }
+
+        return static_cast<size_t>(h);
+    }
+
+    // BSTR overloads
+
+    inline bool BstrEqual(BSTR a, BSTR b) noexcept
+    {
+        return BstrEqual(a, SysStringLen(a), b, SysStringLen(b));
+    }
+
+    inline bool BstrEqualNoCase(BSTR a, BSTR b) noexcept
+    {
+        return BstrEqualNoCase(a, SysStringLen(a), b, SysStringLen(b));
+    }
+
+    inline int BstrCompareNoCase(BSTR a, BSTR b) noexcept
+    {
+        return BstrCompareNoCase(a, SysStringLen(a), b, SysStringLen(b));
+    }
+
+    inline size_t BstrFind(BSTR s, BSTR p) noexcept
+    {
+        return BstrFind(s, SysStringLen(s), p, SysStringLen(p));
+    }
+
+    inline size_t BstrHashNoCase(BSTR s) noexcept
+    {
+        return BstrHashNoCase(s, SysStringLen(s));
+    }
+
+    // UBSTR overloads
+
+    inline bool BstrEqual(UBSTR const& a, UBSTR const& b) noexcept
+    {
+        return BstrEqual(a.get(), b.get());
+    }
+
+    inline bool BstrEqualNoCase(UBSTR const& a, UBSTR const& b) noexcept
+    {
+        return BstrEqualNoCase(a.get(), b.get());
+    }
+
+    inline int BstrCompareNoCase(UBSTR const& a, UBSTR const& b) noexcept
+    {
+        return BstrCompareNoCase(a.get(), b.get());
+    }
+
+    inline size_t BstrFind(UBSTR const& s, UBSTR const& p) noexcept
+    {
+        return BstrFind(s.get(), p.get());
+    }
+
+    inline size_t BstrHashNoCase(UBSTR const& s) noexcept
+    {
+        return BstrHashNoCase(s.get());
+    }
+}
+
+#endif  // BSTRCMP_H
+
+///////////////////////////////////////////////////////////////////////////////
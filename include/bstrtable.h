@@ -0,0 +1,332 @@
+// bstrtable.h ////////////////////////////////////////////////////////////////
+//
+// ComTools::BstrTableWriter, BstrTable: Tables of GUIDs and strings stored in
+// a binary image that is loaded by mapping it into memory
+//
+// ComTools::BstrTableWriter and BstrTable are released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef BSTRTABLE_H
+#define BSTRTABLE_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "mmstream.h"
+
+namespace ComTools {
+
+    // A table is a list of rows, each with a GUID and a string, such as the
+    // names of interfaces or the descriptions of errors. BstrTableWriter
+    // saves a table as a binary image, and BstrTable maps the image into
+    // memory and returns its strings as BSTRs without copying them.
+    //
+    // The image is laid out as follows. Offsets are from the start of the
+    // image.
+    //
+    //     BstrTableHeader header;
+    //     BstrTableRow rows[count];    // In the order they were added
+    //     UINT32 order[count];         // Row numbers sorted by GUID
+    //     Strings, each aligned to 4 bytes, with the layout of a BSTR: the
+    //     length in bytes (UINT32), the characters, and a null character.
+    //
+    // Identical strings are stored once.
+
+    constexpr UINT32 BstrTableMagic = 0x54425443;   // "CTBT"
+    constexpr UINT32 BstrTableVersion = 1;
+    constexpr size_t BstrTableNotFound = static_cast<size_t>(-1);
+
+    struct BstrTableHeader {
+        UINT32 magic;
+        UINT32 version;
+        UINT32 unit;        // sizeof(wchar_t) where the image was written
+        UINT32 count;       // Number of rows
+        UINT64 size;        // Size of the image in bytes
+    };
+
+    struct BstrTableRow {
+        GUID guid;
+        UINT32 offset;      // Offset of the characters, after the length
+        UINT32 length;      // Length of the string in bytes
+    };
+
+    // BstrTableWriter: Builds a table image
+    class BstrTableWriter {
+        std::vector<BstrTableRow> m_rows;       // Offsets are into m_strings
+        std::vector<BYTE> m_strings;
+        std::unordered_map<std::wstring, UINT32> m_offsets;
+
+    public:
+        BstrTableWriter() noexcept = default;
+
+        size_t Size() const noexcept { return m_rows.size(); }
+
+        HRESULT Add(REFGUID guid, std::wstring_view s) noexcept
+        {
+            if (m_rows.size() >= MAXUINT32) return E_OUTOFMEMORY;
+
+            size_t const cb = s.size() * sizeof(wchar_t);
+            if (cb > MAXUINT32 - m_strings.size() - 2 * sizeof(UINT32) - sizeof(wchar_t))
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            try
+            {
+                auto found = m_offsets.find(std::wstring(s));
+                if (found != m_offsets.end())
+                {
+                    m_rows.push_back({ guid, found->second, static_cast<UINT32>(cb) });
+                    return S_OK;
+                }
+
+                size_t const start = m_strings.size();
+                size_t const offset = start + sizeof(UINT32);
+                size_t const end = (offset + cb + sizeof(wchar_t) + 3) & ~size_t(3);
+                m_rows.reserve(m_rows.size() + 1);
+                m_strings.resize(end);
+
+                UINT32 const length = static_cast<UINT32>(cb);
+                std::memcpy(m_strings.data() + start, &length, sizeof(UINT32));
+                if (cb) std::memcpy(m_strings.data() + offset, s.data(), cb);
+                m_offsets.emplace(s, static_cast<UINT32>(offset));
+                m_rows.push_back({ guid, static_cast<UINT32>(offset), length });
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        HRESULT Build(std::vector<BYTE>& image) const noexcept
+        {
+            size_t const count = m_rows.size();
+            size_t const base = (sizeof(BstrTableHeader) +
+                count * (sizeof(BstrTableRow) + sizeof(UINT32)) + 3) & ~size_t(3);
+            if (base + m_strings.size() > MAXUINT32) return E_OUTOFMEMORY;
+
+            try
+            {
+                std::vector<UINT32> order(count);
+                for (size_t i = 0; i < count; ++i) order[i] = static_cast<UINT32>(i);
+                std::stable_sort(order.begin(), order.end(), [this](UINT32 a, UINT32 b) {
+                    return std::memcmp(&m_rows[a].guid, &m_rows[b].guid, sizeof(GUID)) < 0;
+                });
+
+                image.assign(base + m_strings.size(), 0);
+                BstrTableHeader header = { BstrTableMagic, BstrTableVersion,
+                    static_cast<UINT32>(sizeof(wchar_t)), static_cast<UINT32>(count), image.size() };
+                std::memcpy(image.data(), &header, sizeof(header));
+
+                BYTE* p = image.data() + sizeof(header);
+                for (auto row : m_rows)
+                {
+                    row.offset += static_cast<UINT32>(base);
+                    std::memcpy(p, &row, sizeof(row));
+                    p += sizeof(row);
+                }
+
+                if (count) std::memcpy(p, order.data(), count * sizeof(UINT32));
+                if (!m_strings.empty()) std::memcpy(image.data() + base, m_strings.data(), m_strings.size());
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        HRESULT Save(wchar_t const* path) const noexcept
+        {
+            if (!path) return E_INVALIDARG;
+
+            std::vector<BYTE> image;
+            HRESULT hr = Build(image);
+            if (FAILED(hr)) return hr;
+
+            HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0,
+                nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                return HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            DWORD written = 0;
+            if (!WriteFile(hFile, image.data(), static_cast<DWORD>(image.size()), &written, nullptr))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else if (written != image.size())
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+            }
+
+            CloseHandle(hFile);
+            return hr;
+        }
+    };
+
+    // BstrTable: Table image mapped into memory. Opening a table checks the
+    // header and the location of the rows; each string is checked when it
+    // is returned, so strings that are not used are not read from disk.
+    //
+    // Bstr() returns a BSTR that points into the read-only view and remains
+    // valid while the BstrTable exists. It can be passed to methods that
+    // take a BSTR argument, but it must not be freed or modified.
+    class BstrTable {
+        std::shared_ptr<FileMapping const> m_map;
+        BYTE const* m_data = nullptr;
+        ULONGLONG m_size = 0;
+        BstrTableRow const* m_rows = nullptr;
+        UINT32 const* m_order = nullptr;
+        size_t m_count = 0;
+
+        BstrTable() = default;
+
+        // The characters of row i, or nullptr if the row is not valid
+        wchar_t const* InternalChars(size_t i) const noexcept
+        {
+            if (i >= m_count) return nullptr;
+
+            auto const& row = m_rows[i];
+            ULONGLONG const end = ULONGLONG(row.offset) + row.length + sizeof(wchar_t);
+            if (row.offset < sizeof(UINT32) || row.offset % sizeof(UINT32) || end > m_size) return nullptr;
+
+            UINT32 length;
+            std::memcpy(&length, m_data + row.offset - sizeof(UINT32), sizeof(UINT32));
+            if (length != row.length || length % sizeof(wchar_t)) return nullptr;
+
+            // A BSTR is also terminated, for callers that treat it as a C string
+            auto chars = reinterpret_cast<wchar_t const*>(m_data + row.offset);
+            if (chars[length / sizeof(wchar_t)] != L'\0') return nullptr;
+            return chars;
+        }
+
+    public:
+        BstrTable(BstrTable const&) = delete;
+        BstrTable& operator=(BstrTable const&) = delete;
+
+        static HRESULT Open(
+            wchar_t const* path,
+            std::shared_ptr<BstrTable const>* ppTable) noexcept
+        {
+            if (!ppTable) return E_POINTER;
+            ppTable->reset();
+
+            std::shared_ptr<FileMapping const> map;
+            HRESULT hr = FileMapping::Open(path, &map);
+            if (FAILED(hr)) return hr;
+            return Open(std::move(map), ppTable);
+        }
+
+        static HRESULT Open(
+            std::shared_ptr<FileMapping const> map,
+            std::shared_ptr<BstrTable const>* ppTable) noexcept
+        {
+            if (!ppTable) return E_POINTER;
+            ppTable->reset();
+            if (!map) return E_INVALIDARG;
+
+            BstrTableHeader header = { };
+            if (map->size() < sizeof(header)) return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+            std::memcpy(&header, map->data(), sizeof(header));
+            if (header.magic != BstrTableMagic ||
+                header.version != BstrTableVersion ||
+                header.unit != sizeof(wchar_t) ||
+                header.size != map->size() ||
+                (map->size() - sizeof(header)) / (sizeof(BstrTableRow) + sizeof(UINT32)) < header.count)
+            {
+                return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+            }
+
+            std::shared_ptr<BstrTable> table;
+            try
+            {
+                table.reset(new BstrTable);
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            table->m_data = map->data();
+            table->m_size = map->size();
+            table->m_count = header.count;
+            table->m_rows = reinterpret_cast<BstrTableRow const*>(map->data() + sizeof(header));
+            table->m_order = reinterpret_cast<UINT32 const*>(table->m_rows + header.count);
+            table->m_map = std::move(map);
+            *ppTable = std::move(table);
+            return S_OK;
+        }
+
+        size_t Size() const noexcept { return m_count; }
+
+        // The GUID of row i, which must be less than Size()
+        GUID const& Guid(size_t i) const noexcept { return m_rows[i].guid; }
+
+        // The string of row i, or nullptr if i is out of range or the row is
+        // not valid
+        BSTR Bstr(size_t i) const noexcept
+        {
+            return const_cast<BSTR>(InternalChars(i));
+        }
+
+        std::wstring_view View(size_t i) const noexcept
+        {
+            auto chars = InternalChars(i);
+            return chars ? std::wstring_view(chars, m_rows[i].length / sizeof(wchar_t)) : std::wstring_view();
+        }
+
+        // The first row added with guid, or BstrTableNotFound
+        size_t Find(REFGUID guid) const noexcept
+        {
+            auto it = std::lower_bound(m_order, m_order + m_count, guid, [this](UINT32 row, REFGUID key) {
+                return row < m_count && std::memcmp(&m_rows[row].guid, &key, sizeof(GUID)) < 0;
+            });
+
+            if (it == m_order + m_count || *it >= m_count) return BstrTableNotFound;
+            if (std::memcmp(&m_rows[*it].guid, &guid, sizeof(GUID)) != 0) return BstrTableNotFound;
+            return *it;
+        }
+    };
+}
+
+#endif  // BSTRTABLE_H
+
+///////////////////////////////////////////////////////////////////////////////
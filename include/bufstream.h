@@ -0,0 +1,587 @@
+// bufstream.h ////////////////////////////////////////////////////////////////
+//
+// ComTools::StreamReader, StreamWriter, BufferedStream: Buffered IStream I/O
+//
+// ComTools::StreamReader, StreamWriter, and BufferedStream are released under
+// the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef BUFSTREAM_H
+#define BUFSTREAM_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <new>
+#include <utility>
+#include "comobject.h"
+#include "iptr.h"
+
+namespace ComTools {
+
+    // BufferOptions: Buffer configuration for StreamReader, StreamWriter,
+    // and BufferedStream
+    struct BufferOptions {
+        // Reads are issued, and writes are flushed, in blocks of this size
+        ULONG size = 0x10000;
+
+        // Read the next block on a background thread while the current
+        // block is consumed. The stream is then called from another thread,
+        // so only set this for free-threaded or agile streams.
+        bool readAhead = false;
+    };
+
+    // StreamReader: Buffered reads from an IStream. Get() and Peek() are
+    // inline while the buffer holds data; the stream is called once per
+    // block. Reads of at least one block bypass the buffer.
+    //
+    // A reader whose buffer could not be allocated is empty, and its
+    // methods return E_UNEXPECTED.
+    class StreamReader {
+        struct Block {
+            HRESULT hr;
+            ULONG cb;
+        };
+
+        IPtr<IStream> m_stream;
+        std::unique_ptr<BYTE[]> m_buf;
+        std::unique_ptr<BYTE[]> m_next;
+        ULONG m_size = 0;
+        ULONG m_pos = 0;
+        ULONG m_end = 0;
+        bool m_readAhead = false;
+        bool m_haveNext = false;
+        Block m_nextBlock = { S_OK, 0 };
+        std::future<Block> m_pending;
+
+        // Completes a read-ahead, if one is running
+        void InternalWait() noexcept
+        {
+            if (!m_pending.valid()) return;
+            m_nextBlock = m_pending.get();
+            m_haveNext = true;
+        }
+
+        void InternalStartReadAhead() noexcept
+        {
+            IStream* stream = get(m_stream);
+            BYTE* data = m_next.get();
+            ULONG size = m_size;
+            try
+            {
+                m_pending = std::async(std::launch::async, [=]() noexcept
+                    {
+                        Block block = { S_OK, 0 };
+                        block.hr = stream->Read(data, size, &block.cb);
+                        return block;
+                    });
+            }
+            catch (...)
+            {
+                // No thread is available: continue with synchronous reads
+                m_readAhead = false;
+            }
+        }
+
+        // Refills the empty buffer. m_end is 0 at the end of the stream.
+        HRESULT InternalFill() noexcept
+        {
+            if (!m_buf) return E_UNEXPECTED;
+
+            InternalWait();
+            Block block = { S_OK, 0 };
+            if (m_haveNext)
+            {
+                m_haveNext = false;
+                block = m_nextBlock;
+                std::swap(m_buf, m_next);
+            }
+            else
+            {
+                block.hr = m_stream->Read(m_buf.get(), m_size, &block.cb);
+            }
+
+            m_pos = 0;
+            m_end = SUCCEEDED(block.hr) ? (std::min)(block.cb, m_size) : 0;
+            if (FAILED(block.hr)) return block.hr;
+
+            // A short block means the end of the stream is near
+            if (m_readAhead && m_end == m_size) InternalStartReadAhead();
+            return S_OK;
+        }
+
+    public:
+        StreamReader() noexcept = default;
+
+        explicit StreamReader(
+            IPtr<IStream> stream,
+            BufferOptions const& options = { }) noexcept :
+            m_stream(std::move(stream)),
+            m_buf(new (std::nothrow) BYTE[options.size ? options.size : 1]),
+            m_size(options.size ? options.size : 1)
+        {
+            if (options.readAhead && m_buf)
+            {
+                m_next.reset(new (std::nothrow) BYTE[m_size]);
+                m_readAhead = m_next != nullptr;
+            }
+
+            if (!m_stream || !m_buf)
+            {
+                m_stream = nullptr;
+                m_buf.reset();
+                m_next.reset();
+                m_size = 0;
+                m_readAhead = false;
+            }
+        }
+
+        StreamReader(StreamReader const&) = delete;
+        StreamReader& operator=(StreamReader const&) = delete;
+
+        explicit operator bool() const noexcept { return m_buf != nullptr; }
+
+        // Bytes that have been read from the stream but not from the reader
+        ULONG Unread() noexcept
+        {
+            InternalWait();
+            return (m_end - m_pos) +
+                (m_haveNext && SUCCEEDED(m_nextBlock.hr) ? m_nextBlock.cb : 0);
+        }
+
+        // Completes a read-ahead, if one is running, so that the stream can
+        // be used directly. The buffered data is kept.
+        void Wait() noexcept
+        {
+            InternalWait();
+        }
+
+        // Reads up to cb bytes. pcbRead is less than cb only at the end of
+        // the stream or on failure.
+        HRESULT Read(void* pv, ULONG cb, ULONG* pcbRead) noexcept
+        {
+            if (pcbRead) *pcbRead = 0;
+            if (!pv && cb) return STG_E_INVALIDPOINTER;
+
+            auto dst = static_cast<BYTE*>(pv);
+            ULONG total = 0;
+            HRESULT hr = S_OK;
+            while (total < cb)
+            {
+                if (m_pos == m_end)
+                {
+                    ULONG const remaining = cb - total;
+                    if (m_buf && remaining >= m_size && !m_pending.valid() && !m_haveNext)
+                    {
+                        ULONG n = 0;
+                        hr = m_stream->Read(dst + total, remaining, &n);
+                        total += SUCCEEDED(hr) ? n : 0;
+                        break;
+                    }
+
+                    hr = InternalFill();
+                    if (FAILED(hr) || m_end == 0) break;
+                }
+
+                ULONG const n = (std::min)(cb - total, m_end - m_pos);
+                std::memcpy(dst + total, m_buf.get() + m_pos, n);
+                m_pos += n;
+                total += n;
+            }
+
+            if (pcbRead) *pcbRead = total;
+            return FAILED(hr) ? hr : S_OK;
+        }
+
+        // Reads one byte. Returns S_FALSE at the end of the stream.
+        HRESULT Get(BYTE* pb) noexcept
+        {
+            if (m_pos < m_end)
+            {
+                *pb = m_buf[m_pos++];
+                return S_OK;
+            }
+
+            ULONG n = 0;
+            HRESULT hr = Read(pb, 1, &n);
+            return FAILED(hr) ? hr : (n ? S_OK : S_FALSE);
+        }
+
+        // Returns the buffered data without consuming it, refilling the
+        // buffer if it is empty. *pcb is 0 at the end of the stream.
+        HRESULT Peek(BYTE const** ppData, ULONG* pcb) noexcept
+        {
+            if (!ppData || !pcb) return E_POINTER;
+            HRESULT hr = m_pos < m_end ? S_OK : InternalFill();
+            *ppData = m_buf ? m_buf.get() + m_pos : nullptr;
+            *pcb = m_end - m_pos;
+            return hr;
+        }
+
+        // Consumes up to cb bytes of the data returned by Peek()
+        void Skip(ULONG cb) noexcept
+        {
+            m_pos += (std::min)(cb, m_end - m_pos);
+        }
+
+        // Drops the buffered data and moves the stream back to the position
+        // of the reader, so the stream can be used directly
+        HRESULT Discard() noexcept
+        {
+            LONGLONG const unread = Unread();
+            m_pos = m_end = 0;
+            m_haveNext = false;
+            if (!unread) return S_OK;
+
+            LARGE_INTEGER move = { };
+            move.QuadPart = -unread;
+            return m_stream->Seek(move, STREAM_SEEK_CUR, nullptr);
+        }
+    };
+
+    // StreamWriter: Buffered writes to an IStream. Writes are coalesced and
+    // flushed to the stream when the buffer is full; writes of at least one
+    // block bypass the buffer. The destructor flushes, but cannot report
+    // errors: call Flush() to check for them.
+    //
+    // A writer whose buffer could not be allocated is empty, and its
+    // methods return E_UNEXPECTED.
+    class StreamWriter {
+        IPtr<IStream> m_stream;
+        std::unique_ptr<BYTE[]> m_buf;
+        ULONG m_size = 0;
+        ULONG m_used = 0;
+
+        HRESULT InternalWriteAll(BYTE const* p, ULONG cb, ULONG* pcbWritten) noexcept
+        {
+            ULONG total = 0;
+            HRESULT hr = S_OK;
+            while (total < cb)
+            {
+                ULONG n = 0;
+                hr = m_stream->Write(p + total, cb - total, &n);
+                if (FAILED(hr)) break;
+                if (!n)
+                {
+                    hr = STG_E_MEDIUMFULL;
+                    break;
+                }
+
+                total += n;
+            }
+
+            *pcbWritten = total;
+            return hr;
+        }
+
+    public:
+        StreamWriter() noexcept = default;
+
+        explicit StreamWriter(
+            IPtr<IStream> stream,
+            BufferOptions const& options = { }) noexcept :
+            m_stream(std::move(stream)),
+            m_buf(new (std::nothrow) BYTE[options.size ? options.size : 1]),
+            m_size(options.size ? options.size : 1)
+        {
+            if (!m_stream || !m_buf)
+            {
+                m_stream = nullptr;
+                m_buf.reset();
+                m_size = 0;
+            }
+        }
+
+        ~StreamWriter() noexcept { Flush(); }
+
+        StreamWriter(StreamWriter const&) = delete;
+        StreamWriter& operator=(StreamWriter const&) = delete;
+
+        explicit operator bool() const noexcept { return m_buf != nullptr; }
+
+        // Bytes that have been written to the writer but not to the stream
+        ULONG Pending() const noexcept { return m_used; }
+
+        // Buffered bytes count as written
+        HRESULT Write(void const* pv, ULONG cb, ULONG* pcbWritten) noexcept
+        {
+            if (pcbWritten) *pcbWritten = 0;
+            if (!m_buf) return E_UNEXPECTED;
+            if (!pv && cb) return STG_E_INVALIDPOINTER;
+
+            auto src = static_cast<BYTE const*>(pv);
+            if (cb > m_size - m_used)
+            {
+                HRESULT hr = Flush();
+                if (FAILED(hr)) return hr;
+
+                if (cb >= m_size)
+                {
+                    ULONG n = 0;
+                    hr = InternalWriteAll(src, cb, &n);
+                    if (pcbWritten) *pcbWritten = n;
+                    return hr;
+                }
+            }
+
+            std::memcpy(m_buf.get() + m_used, src, cb);
+            m_used += cb;
+            if (pcbWritten) *pcbWritten = cb;
+            return S_OK;
+        }
+
+        // Writes one byte
+        HRESULT Put(BYTE b) noexcept
+        {
+            if (m_used < m_size)
+            {
+                m_buf[m_used++] = b;
+                return S_OK;
+            }
+
+            return Write(&b, 1, nullptr);
+        }
+
+        // Writes the buffered bytes to the stream. On failure, the bytes
+        // that were not written remain buffered.
+        HRESULT Flush() noexcept
+        {
+            if (!m_used) return S_OK;
+
+            ULONG n = 0;
+            HRESULT hr = InternalWriteAll(m_buf.get(), m_used, &n);
+            if (n < m_used) std::memmove(m_buf.get(), m_buf.get() + n, m_used - n);
+            m_used -= n;
+            return hr;
+        }
+
+        // Drops the buffered bytes without writing them
+        void Clear() noexcept { m_used = 0; }
+    };
+
+    // BufferedStream: IStream facade over StreamReader and StreamWriter.
+    // Switching between reading and writing, and seeking, flush the writer
+    // and discard the reader, so the inner stream always sees the same
+    // sequence of bytes as the caller.
+    class BufferedStream final : public Object<BufferedStream, IStream> {
+        IPtr<IStream> m_inner;
+        BufferOptions m_options;
+        StreamReader m_reader;
+        StreamWriter m_writer;
+
+        HRESULT InternalSync() noexcept
+        {
+            HRESULT hr = m_writer.Flush();
+            return FAILED(hr) ? hr : m_reader.Discard();
+        }
+
+    public:
+        BufferedStream(IPtr<IStream> inner, BufferOptions const& options) :
+            m_inner(std::move(inner)),
+            m_options(options),
+            m_reader(m_inner, options),
+            m_writer(m_inner, options)
+        {
+            if (!m_reader || !m_writer) throw std::bad_alloc();
+        }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            if (riid == IID_IStream || riid == IID_ISequentialStream)
+            {
+                return static_cast<IStream*>(this);
+            }
+
+            return nullptr;
+        }
+
+        // ISequentialStream
+
+        STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) noexcept override
+        {
+            HRESULT hr = m_writer.Flush();
+            if (FAILED(hr))
+            {
+                if (pcbRead) *pcbRead = 0;
+                return hr;
+            }
+
+            return m_reader.Read(pv, cb, pcbRead);
+        }
+
+        STDMETHODIMP Write(void const* pv, ULONG cb, ULONG* pcbWritten) noexcept override
+        {
+            HRESULT hr = m_reader.Discard();
+            if (FAILED(hr))
+            {
+                if (pcbWritten) *pcbWritten = 0;
+                return hr;
+            }
+
+            return m_writer.Write(pv, cb, pcbWritten);
+        }
+
+        // IStream
+
+        STDMETHODIMP Seek(
+            LARGE_INTEGER dlibMove,
+            DWORD dwOrigin,
+            ULARGE_INTEGER* plibNewPosition) noexcept override
+        {
+            // Position queries keep the buffers. Unread() waits for any
+            // read-ahead first, so the inner stream is not in use and its
+            // position includes the block that was read ahead.
+            if (dwOrigin == STREAM_SEEK_CUR && dlibMove.QuadPart == 0)
+            {
+                ULONG const unread = m_reader.Unread();
+                ULARGE_INTEGER pos = { };
+                HRESULT hr = m_inner->Seek(dlibMove, STREAM_SEEK_CUR, &pos);
+                if (SUCCEEDED(hr) && plibNewPosition)
+                {
+                    plibNewPosition->QuadPart = pos.QuadPart - unread + m_writer.Pending();
+                }
+
+                return hr;
+            }
+
+            HRESULT hr = InternalSync();
+            return FAILED(hr) ? hr : m_inner->Seek(dlibMove, dwOrigin, plibNewPosition);
+        }
+
+        STDMETHODIMP SetSize(ULARGE_INTEGER libNewSize) noexcept override
+        {
+            HRESULT hr = InternalSync();
+            return FAILED(hr) ? hr : m_inner->SetSize(libNewSize);
+        }
+
+        STDMETHODIMP CopyTo(
+            IStream* pstm,
+            ULARGE_INTEGER cb,
+            ULARGE_INTEGER* pcbRead,
+            ULARGE_INTEGER* pcbWritten) noexcept override
+        {
+            if (pcbRead) pcbRead->QuadPart = 0;
+            if (pcbWritten) pcbWritten->QuadPart = 0;
+            if (!pstm) return STG_E_INVALIDPOINTER;
+
+            HRESULT hr = m_writer.Flush();
+            ULONGLONG read = 0;
+            ULONGLONG written = 0;
+            while (SUCCEEDED(hr) && read < cb.QuadPart)
+            {
+                BYTE const* p = nullptr;
+                ULONG n = 0;
+                hr = m_reader.Peek(&p, &n);
+                if (FAILED(hr) || !n) break;
+
+                n = static_cast<ULONG>((std::min)(static_cast<ULONGLONG>(n), cb.QuadPart - read));
+                ULONG cbWritten = 0;
+                hr = pstm->Write(p, n, &cbWritten);
+                m_reader.Skip(n);
+                read += n;
+                written += cbWritten;
+            }
+
+            if (pcbRead) pcbRead->QuadPart = read;
+            if (pcbWritten) pcbWritten->QuadPart = written;
+            return FAILED(hr) ? hr : S_OK;
+        }
+
+        STDMETHODIMP Commit(DWORD grfCommitFlags) noexcept override
+        {
+            m_reader.Wait();
+            HRESULT hr = m_writer.Flush();
+            return FAILED(hr) ? hr : m_inner->Commit(grfCommitFlags);
+        }
+
+        STDMETHODIMP Revert() noexcept override
+        {
+            m_writer.Clear();
+            HRESULT hr = m_reader.Discard();
+            return FAILED(hr) ? hr : m_inner->Revert();
+        }
+
+        STDMETHODIMP LockRegion(
+            ULARGE_INTEGER libOffset,
+            ULARGE_INTEGER cb,
+            DWORD dwLockType) noexcept override
+        {
+            m_reader.Wait();
+            return m_inner->LockRegion(libOffset, cb, dwLockType);
+        }
+
+        STDMETHODIMP UnlockRegion(
+            ULARGE_INTEGER libOffset,
+            ULARGE_INTEGER cb,
+            DWORD dwLockType) noexcept override
+        {
+            m_reader.Wait();
+            return m_inner->UnlockRegion(libOffset, cb, dwLockType);
+        }
+
+        STDMETHODIMP Stat(STATSTG* pstatstg, DWORD grfStatFlag) noexcept override
+        {
+            m_reader.Wait();
+            HRESULT hr = m_writer.Flush();
+            return FAILED(hr) ? hr : m_inner->Stat(pstatstg, grfStatFlag);
+        }
+
+        STDMETHODIMP Clone(IStream** ppstm) noexcept override
+        {
+            if (!ppstm) return STG_E_INVALIDPOINTER;
+            *ppstm = nullptr;
+
+            HRESULT hr = InternalSync();
+            if (FAILED(hr)) return hr;
+
+            IPtr<IStream> clone;
+            hr = m_inner->Clone(set(clone));
+            if (FAILED(hr)) return hr;
+
+            return Create(IID_IStream, reinterpret_cast<void**>(ppstm),
+                std::move(clone), m_options);
+        }
+    };
+
+    // Wraps inner in a BufferedStream
+    inline HRESULT CreateBufferedStream(
+        IStream* inner,
+        BufferOptions const& options,
+        IStream** ppstm) noexcept
+    {
+        if (!ppstm) return E_POINTER;
+        *ppstm = nullptr;
+        if (!inner) return E_INVALIDARG;
+
+        IPtr<IStream> temp;
+        temp.CopyFrom(inner);
+        return BufferedStream::Create(IID_IStream, reinterpret_cast<void**>(ppstm),
+            std::move(temp), options);
+    }
+}
+
+#endif  // BUFSTREAM_H
+
+///////////////////////////////////////////////////////////////////////////////
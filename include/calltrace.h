@@ -0,0 +1,255 @@
+// calltrace.h ////////////////////////////////////////////////////////////////
+//
+// ComTools::TraceRecorder: Records IPtr, UBSTR, and ComException operations
+// to a trace file
+//
+// ComTools::TraceRecorder is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef CALLTRACE_H
+#define CALLTRACE_H
+
+// Recording is turned on by defining COMTOOLS_CALLTRACE for the whole
+// program, for example in the project's preprocessor definitions. iptr.h,
+// ubstr.h, and comexcept.h then include this header first and report their
+// operations through COMTOOLS_RECORD. UBSTR and ComException are not
+// templates, so a translation unit compiled without COMTOOLS_CALLTRACE
+// would give the linker versions that do not record to choose from.
+
+#ifndef COMTOOLS_CALLTRACE
+#error Define COMTOOLS_CALLTRACE for the whole program instead of including calltrace.h
+#endif
+
+#if defined(IPTR_H) || defined(UBSTR_H) || defined(COMEXCEPT_H)
+#error calltrace.h must be included before iptr.h, ubstr.h, and comexcept.h
+#endif
+
+#include <Windows.h>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include "tracefmt.h"
+
+#define COMTOOLS_RECORD(op, T, object, size) \
+    (::ComTools::TraceRecorder::Recording() ? \
+        ::ComTools::TraceRecorder::Record(::ComTools::TraceOp::op, \
+            ::ComTools::TraceRecorder::TypeId<T>(), \
+            ::ComTools::TraceRecorder::Key(object), \
+            static_cast<std::uint32_t>(size)) : \
+        (void)0)
+
+namespace ComTools {
+
+    // TraceRecorder: Collects the records made between Start() and Stop().
+    // Each thread buffers its records and hands them over when the buffer
+    // is full, when the thread exits, and when it calls Stop() or Save().
+    // Records that other threads have not handed over yet are not saved.
+    // Each Start() begins a new session, and records buffered in an earlier
+    // session are dropped instead of being handed over.
+    class TraceRecorder {
+        static constexpr size_t BufferSize = 1024;
+        static constexpr std::uint32_t NoType = 0xFFFFFFFF;
+
+        struct State {
+            std::mutex lock;
+            std::vector<TraceRecord> records;
+            std::vector<std::string> types;
+            std::uint16_t threads = 0;
+        };
+
+        static inline std::atomic<bool> s_recording = false;
+        static inline std::atomic<unsigned> s_session = 0;
+
+        static State& InternalState() noexcept
+        {
+            static State state;
+            return state;
+        }
+
+        // Thread buffer; the destructor hands over what is left when the
+        // thread exits
+        struct Buffer {
+            std::vector<TraceRecord> records;
+            unsigned session = 0;       // Session the records belong to
+            std::uint16_t thread = 0;
+            bool numbered = false;
+
+            ~Buffer() { InternalFlush(*this); }
+        };
+
+        static Buffer& InternalBuffer() noexcept
+        {
+            thread_local Buffer buffer;
+            return buffer;
+        }
+
+        static void InternalFlush(Buffer& buffer) noexcept
+        {
+            if (buffer.records.empty()) return;
+            auto& state = InternalState();
+            try
+            {
+                std::lock_guard<std::mutex> guard(state.lock);
+                if (buffer.session == s_session.load(std::memory_order_relaxed))
+                {
+                    state.records.insert(state.records.end(), buffer.records.begin(), buffer.records.end());
+                }
+            }
+            catch (...)
+            {
+                // The records are dropped
+            }
+
+            buffer.records.clear();
+        }
+
+        static std::uint32_t InternalTypeId(char const* name) noexcept
+        {
+            auto& state = InternalState();
+            try
+            {
+                std::lock_guard<std::mutex> guard(state.lock);
+                state.types.emplace_back(name);
+                return static_cast<std::uint32_t>(state.types.size() - 1);
+            }
+            catch (...)
+            {
+                return NoType;
+            }
+        }
+
+    public:
+        static bool Recording() noexcept
+        {
+            return s_recording.load(std::memory_order_relaxed);
+        }
+
+        // Discards any earlier records and starts recording
+        static void Start() noexcept
+        {
+            auto& state = InternalState();
+            InternalBuffer().records.clear();
+            {
+                std::lock_guard<std::mutex> guard(state.lock);
+                state.records.clear();
+                s_session.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            s_recording = true;
+        }
+
+        static void Stop() noexcept
+        {
+            s_recording = false;
+            InternalFlush(InternalBuffer());
+        }
+
+        // Number of the type T in the trace
+        template<typename T>
+        static std::uint32_t TypeId() noexcept
+        {
+            static std::uint32_t const id = InternalTypeId(typeid(T).name());
+            return id;
+        }
+
+        // Objects and strings are recorded by their full address, so two
+        // that are alive at once cannot be mistaken for each other; an
+        // HRESULT is recorded as is
+        static std::uint64_t Key(void const* p) noexcept
+        {
+            return reinterpret_cast<std::uintptr_t>(p);
+        }
+
+        static std::uint64_t Key(HRESULT hr) noexcept
+        {
+            return static_cast<std::uint32_t>(hr);
+        }
+
+        static void Record(TraceOp op, std::uint32_t type, std::uint64_t address, std::uint32_t size) noexcept
+        {
+            if (type == NoType) return;
+            auto& buffer = InternalBuffer();
+            unsigned const session = s_session.load(std::memory_order_relaxed);
+            if (buffer.session != session)
+            {
+                buffer.records.clear();
+                buffer.session = session;
+            }
+
+            try
+            {
+                if (!buffer.numbered)
+                {
+                    auto& state = InternalState();
+                    std::lock_guard<std::mutex> guard(state.lock);
+                    buffer.thread = state.threads++;
+                    buffer.records.reserve(BufferSize);
+                    buffer.numbered = true;
+                }
+
+                buffer.records.push_back({ op, 0, buffer.thread, type, 0, size, address });
+            }
+            catch (...)
+            {
+                return;
+            }
+
+            if (buffer.records.size() >= BufferSize) InternalFlush(buffer);
+        }
+
+        // Writes the records handed over so far, including the calling
+        // thread's, to the file at path
+        static HRESULT Save(std::filesystem::path const& path) noexcept
+        {
+            InternalFlush(InternalBuffer());
+            try
+            {
+                Trace trace;
+                auto& state = InternalState();
+                {
+                    std::lock_guard<std::mutex> guard(state.lock);
+                    trace.records = state.records;
+                    trace.types = state.types;
+                }
+
+                return trace.Save(path) ? S_OK : E_FAIL;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+    };
+}
+
+#endif  // CALLTRACE_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,320 @@
+// classreg.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::ClassTable, ClassRegistry: In-process activation by CLSID
+//
+// ComTools::ClassTable and ComTools::ClassRegistry are released under the MIT
+// license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef CLASSREG_H
+#define CLASSREG_H
+
+#include <Windows.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "comobject.h"
+#include "iptr.h"
+
+namespace ComTools {
+
+    // Creates an object and returns the interface riid. For classes built
+    // on Object, &T::Create<> has this type.
+    using CreateFunction = HRESULT(*)(REFIID riid, void** ppv) noexcept;
+
+    // ClassEntry: A class that can be activated in process
+    struct ClassEntry {
+        CLSID clsid;
+        CreateFunction create;
+    };
+
+    // ClassTable: Perfect hash table from CLSID to ClassEntry, built at
+    // compile time when declared constexpr. The CLSIDs must be constexpr
+    // and distinct; a duplicate CLSID is a compile-time error.
+    //
+    // The hash of a CLSID selects a bucket, and the seed stored for that
+    // bucket remixes the hash to place the bucket's CLSIDs in distinct
+    // slots. Lookups never probe.
+    template<size_t N>
+    class ClassTable {
+        static_assert(N > 0, "ClassTable requires at least one class");
+
+    public:
+        static constexpr size_t buckets = std::bit_ceil(N);
+        static constexpr size_t slots = std::bit_ceil(2 * N);
+
+    private:
+        std::array<uint32_t, buckets> m_seeds = { };
+        std::array<ClassEntry, slots> m_entries = { };
+
+        static constexpr bool InternalEqual(REFGUID a, REFGUID b) noexcept
+        {
+            if (!std::is_constant_evaluated()) return std::memcmp(&a, &b, sizeof(GUID)) == 0;
+
+            if (a.Data1 != b.Data1 || a.Data2 != b.Data2 || a.Data3 != b.Data3) return false;
+            for (int i = 0; i < 8; ++i)
+            {
+                if (a.Data4[i] != b.Data4[i]) return false;
+            }
+
+            return true;
+        }
+
+        static constexpr uint32_t InternalHash(REFGUID g) noexcept
+        {
+            uint32_t const words[4] = {
+                static_cast<uint32_t>(g.Data1),
+                static_cast<uint32_t>(g.Data2) | static_cast<uint32_t>(g.Data3) << 16,
+                static_cast<uint32_t>(g.Data4[0]) | static_cast<uint32_t>(g.Data4[1]) << 8 |
+                    static_cast<uint32_t>(g.Data4[2]) << 16 | static_cast<uint32_t>(g.Data4[3]) << 24,
+                static_cast<uint32_t>(g.Data4[4]) | static_cast<uint32_t>(g.Data4[5]) << 8 |
+                    static_cast<uint32_t>(g.Data4[6]) << 16 | static_cast<uint32_t>(g.Data4[7]) << 24 };
+
+            uint32_t h = 0x27D4EB2FU;
+            for (uint32_t w : words)
+            {
+                h = (h ^ w) * 0x9E3779B1U;
+                h ^= h >> 15;
+            }
+
+            return h;
+        }
+
+        // Slot for a CLSID with hash h in a bucket with the given seed
+        static constexpr size_t InternalSlot(uint32_t h, uint32_t seed) noexcept
+        {
+            h ^= seed * 0x9E3779B1U;
+            h ^= h >> 16;
+            h *= 0x85EBCA6BU;
+            h ^= h >> 13;
+            h *= 0xC2B2AE35U;
+            h ^= h >> 16;
+            return h & (slots - 1);
+        }
+
+    public:
+        constexpr explicit ClassTable(ClassEntry const (&entries)[N])
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                for (size_t j = i + 1; j < N; ++j)
+                {
+                    if (InternalEqual(entries[i].clsid, entries[j].clsid))
+                    {
+                        throw "ClassTable: duplicate CLSID";
+                    }
+                }
+            }
+
+            std::array<uint32_t, N> hash = { };
+            std::array<size_t, N> bucket = { };
+            std::array<size_t, buckets> sizes = { };
+            for (size_t i = 0; i < N; ++i)
+            {
+                hash[i] = InternalHash(entries[i].clsid);
+                bucket[i] = hash[i] & (buckets - 1);
+                ++sizes[bucket[i]];
+            }
+
+            // Place the largest buckets first, while the most slots are free
+            std::array<bool, slots> used = { };
+            for (size_t size = N; size > 0; --size)
+            {
+                for (size_t b = 0; b < buckets; ++b)
+                {
+                    if (sizes[b] != size) continue;
+
+                    for (uint32_t seed = 1; ; ++seed)
+                    {
+                        if (seed == 0x100000) throw "ClassTable: no perfect hash";
+
+                        std::array<size_t, N> placed = { };
+                        std::array<size_t, N> placedSlots = { };
+                        size_t count = 0;
+                        for (size_t i = 0; i < N && count < size; ++i)
+                        {
+                            if (bucket[i] != b) continue;
+
+                            size_t slot = InternalSlot(hash[i], seed);
+                            bool free = !used[slot];
+                            for (size_t k = 0; free && k < count; ++k)
+                            {
+                                free = placedSlots[k] != slot;
+                            }
+
+                            if (!free) break;
+                            placed[count] = i;
+                            placedSlots[count++] = slot;
+                        }
+
+                        if (count < size) continue;
+
+                        m_seeds[b] = seed;
+                        for (size_t k = 0; k < count; ++k)
+                        {
+                            used[placedSlots[k]] = true;
+                            m_entries[placedSlots[k]] = entries[placed[k]];
+                        }
+
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Slot index of clsid, or slots if clsid is not in the table
+        constexpr size_t Lookup(REFCLSID clsid) const noexcept
+        {
+            uint32_t h = InternalHash(clsid);
+            size_t slot = InternalSlot(h, m_seeds[h & (buckets - 1)]);
+            auto const& entry = m_entries[slot];
+            return entry.create && InternalEqual(entry.clsid, clsid) ? slot : slots;
+        }
+
+        // Entry for clsid, or nullptr if clsid is not in the table
+        constexpr ClassEntry const* Find(REFCLSID clsid) const noexcept
+        {
+            size_t slot = Lookup(clsid);
+            return slot < slots ? &m_entries[slot] : nullptr;
+        }
+
+        constexpr ClassEntry const& operator[](size_t slot) const noexcept
+        {
+            return m_entries[slot];
+        }
+    };
+
+    // ClassFactory: IClassFactory for a CreateFunction
+    class ClassFactory final : public Object<ClassFactory, IClassFactory> {
+        CreateFunction m_create;
+
+    public:
+        explicit ClassFactory(CreateFunction create) noexcept : m_create(create) { }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == IID_IClassFactory ? static_cast<IClassFactory*>(this) : nullptr;
+        }
+
+        STDMETHODIMP CreateInstance(IUnknown* pUnkOuter, REFIID riid, void** ppv) noexcept override
+        {
+            if (!ppv) return E_POINTER;
+            *ppv = nullptr;
+            if (pUnkOuter) return CLASS_E_NOAGGREGATION;
+            return m_create(riid, ppv);
+        }
+
+        STDMETHODIMP LockServer(BOOL) noexcept override
+        {
+            return S_OK;
+        }
+    };
+
+    // ClassRegistry: Activates the classes in a ClassTable without going
+    // through the system registry. CreateInstance() calls the class's
+    // CreateFunction directly. GetClassObject() returns one IClassFactory
+    // per class, created on first use and shared by all callers, for use in
+    // DllGetClassObject() or CoRegisterClassObject().
+    template<size_t N>
+    class ClassRegistry {
+        ClassTable<N> m_table;
+        mutable std::array<std::atomic<IClassFactory*>, ClassTable<N>::slots> m_factories = { };
+
+    public:
+        constexpr explicit ClassRegistry(ClassTable<N> const& table) noexcept :
+            m_table(table) { }
+
+        ~ClassRegistry() noexcept
+        {
+            for (auto& factory : m_factories)
+            {
+                if (auto p = factory.load(std::memory_order_acquire)) p->Release();
+            }
+        }
+
+        ClassRegistry(ClassRegistry const&) = delete;
+        ClassRegistry& operator=(ClassRegistry const&) = delete;
+
+        bool Contains(REFCLSID clsid) const noexcept
+        {
+            return m_table.Find(clsid) != nullptr;
+        }
+
+        HRESULT CreateInstance(REFCLSID clsid, REFIID riid, void** ppv) const noexcept
+        {
+            if (!ppv) return E_POINTER;
+            *ppv = nullptr;
+
+            auto entry = m_table.Find(clsid);
+            return entry ? entry->create(riid, ppv) : REGDB_E_CLASSNOTREG;
+        }
+
+        template<typename I>
+        IPtr<I> CreateInstance(REFCLSID clsid, REFIID riid) const noexcept
+        {
+            IPtr<I> temp;
+            CreateInstance(clsid, riid, reinterpret_cast<void**>(set(temp)));
+            return temp;
+        }
+
+        HRESULT GetClassObject(REFCLSID clsid, REFIID riid, void** ppv) const noexcept
+        {
+            if (!ppv) return E_POINTER;
+            *ppv = nullptr;
+
+            size_t slot = m_table.Lookup(clsid);
+            if (slot == ClassTable<N>::slots) return CLASS_E_CLASSNOTAVAILABLE;
+
+            auto& cached = m_factories[slot];
+            IClassFactory* p = cached.load(std::memory_order_acquire);
+            if (!p)
+            {
+                IClassFactory* created = nullptr;
+                HRESULT hr = ClassFactory::Create(IID_IClassFactory,
+                    reinterpret_cast<void**>(&created), m_table[slot].create);
+                if (FAILED(hr)) return hr;
+
+                // Another thread may have created the factory first
+                if (cached.compare_exchange_strong(p, created,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+                {
+                    p = created;
+                }
+                else
+                {
+                    created->Release();
+                }
+            }
+
+            return p->QueryInterface(riid, ppv);
+        }
+    };
+}
+
+#endif  // CLASSREG_H
+
+///////////////////////////////////////////////////////////////////////////////
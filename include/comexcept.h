@@ -26,11 +26,15 @@
 //
 
 #ifndef COMEXCEPT_H
+#ifdef COMTOOLS_CALLTRACE
+#include "calltrace.h"
+#endif
 #define COMEXCEPT_H
 
 #include <Windows.h>
 #include <utility>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include "ubstr.h"
 
@@ -40,10 +44,13 @@ namespace ComTools {
         // Note that ComException does not derive from std::exception because
         // the ComException copy constructor is not noexcept
 
+        // The strings are kept as UTF-16, as IErrorInfo returns them, so the
+        // u16 accessors return them without converting
+
         HRESULT m_hr = 0;
-        std::wstring m_source;
-        std::wstring m_description;
-        std::wstring m_help_file;
+        std::u16string m_source;
+        std::u16string m_description;
+        std::u16string m_help_file;
         DWORD m_help_context = 0;
         GUID m_guid = IID_NULL;
 
@@ -59,7 +66,7 @@ namespace ComTools {
         }
 
         ComException()
-            noexcept(std::is_nothrow_default_constructible<std::wstring>::value) = default;
+            noexcept(std::is_nothrow_default_constructible<std::u16string>::value) = default;
 
         ComException(HRESULT const hr) :
             m_hr(hr),
@@ -74,13 +81,13 @@ namespace ComTools {
             if (hr2 == S_OK && pei)
             {
                 UBSTR source;
-                if (SUCCEEDED(pei->GetSource(set(source)))) m_source = source.to_wstring();
+                if (SUCCEEDED(pei->GetSource(set(source)))) m_source = source.u16view();
 
                 UBSTR description;
-                if (SUCCEEDED(pei->GetDescription(set(description)))) m_description = description.to_wstring();
+                if (SUCCEEDED(pei->GetDescription(set(description)))) m_description = description.u16view();
 
                 UBSTR help_file;
-                if (SUCCEEDED(pei->GetHelpFile(set(help_file)))) m_help_file = help_file.to_wstring();
+                if (SUCCEEDED(pei->GetHelpFile(set(help_file)))) m_help_file = help_file.u16view();
 
                 DWORD help_context{};
                 if (SUCCEEDED(pei->GetHelpContext(&help_context))) m_help_context = help_context;
@@ -90,6 +97,9 @@ namespace ComTools {
 
                 pei->Release();
             }
+
+            COMTOOLS_RECORD(Error, ComException, m_hr,
+                m_source.size() + m_description.size() + m_help_file.size());
         }
 
         virtual ~ComException() noexcept { };
@@ -103,7 +113,7 @@ namespace ComTools {
             m_guid(obj.m_guid) { }
 
         ComException(ComException&& obj)
-            noexcept(std::is_nothrow_default_constructible<std::wstring>::value) :
+            noexcept(std::is_nothrow_default_constructible<std::u16string>::value) :
             ComException()
         {
             swap(*this, obj);
@@ -116,9 +126,12 @@ namespace ComTools {
         }
 
         HRESULT hr() const noexcept { return m_hr; }
-        std::wstring source() const { return m_source; }
-        std::wstring description() const { return m_description; }
-        std::wstring help_file() const { return m_help_file; }
+        std::wstring source() const { return Utf16ToWide(m_source); }
+        std::wstring description() const { return Utf16ToWide(m_description); }
+        std::wstring help_file() const { return Utf16ToWide(m_help_file); }
+        std::u16string_view u16source() const noexcept { return m_source; }
+        std::u16string_view u16description() const noexcept { return m_description; }
+        std::u16string_view u16help_file() const noexcept { return m_help_file; }
         DWORD help_context() const noexcept { return m_help_context; }
         GUID guid() const noexcept { return m_guid; }
     };
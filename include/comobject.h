@@ -0,0 +1,175 @@
+// comobject.h ////////////////////////////////////////////////////////////////
+//
+// ComTools::Object: IUnknown implementation for COM objects
+//
+// ComTools::Object is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef COMOBJECT_H
+#define COMOBJECT_H
+
+#include <Windows.h>
+#include <new>
+#include <utility>
+
+namespace ComTools {
+
+    // Object: Implements IUnknown for Derived, which implements the COM
+    // interfaces in Interfaces. Derived provides the interface map:
+    //
+    //     void* Cast(REFIID riid) noexcept;
+    //
+    // Cast returns the interface pointer for riid, or nullptr if Derived
+    // does not implement riid. IID_IUnknown is handled by Object and always
+    // resolves to the first interface in Interfaces.
+    //
+    // Objects start with a reference count of one and are deleted when the
+    // count returns to zero. If Derived has a non-public constructor or
+    // destructor, it must declare Object as a friend. Derived may hide the
+    // Construct() and Destroy() hooks to change how objects are allocated
+    // and freed (see PooledObject in objpool.h).
+    template<typename Derived, typename First, typename... Rest>
+    class Object : public First, public Rest... {
+        LONG m_rc = 1;
+
+    protected:
+        Object() noexcept = default;
+        ~Object() noexcept = default;
+
+        Object(Object const&) = delete;
+        Object& operator=(Object const&) = delete;
+
+        template<typename... Args>
+        static Derived* Construct(Args&&... args)
+        {
+            return new Derived(std::forward<Args>(args)...);
+        }
+
+        static void Destroy(Derived* p) noexcept
+        {
+            delete p;
+        }
+
+        // Restores the initial reference count of an object that is reused
+        // after its final Release()
+        void InternalRevive() noexcept
+        {
+            m_rc = 1;
+        }
+
+    public:
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv) noexcept override
+        {
+            if (!ppv) return E_POINTER;
+
+            void* p = riid == IID_IUnknown ?
+                static_cast<IUnknown*>(static_cast<First*>(this)) :
+                static_cast<Derived*>(this)->Cast(riid);
+            *ppv = p;
+            if (!p) return E_NOINTERFACE;
+
+            AddRef();
+            return S_OK;
+        }
+
+        STDMETHODIMP_(ULONG) AddRef() noexcept override
+        {
+            return static_cast<ULONG>(InterlockedIncrement(&m_rc));
+        }
+
+        STDMETHODIMP_(ULONG) Release() noexcept override
+        {
+            auto rc = InterlockedDecrement(&m_rc);
+            if (rc == 0) Derived::Destroy(static_cast<Derived*>(this));
+            return static_cast<ULONG>(rc);
+        }
+
+        // AddRef() and Release() without interlocked instructions, for an
+        // object that is only used on one thread (see UnsyncRefs in
+        // implptr.h)
+        ULONG AddRefUnsync() noexcept
+        {
+            return static_cast<ULONG>(++m_rc);
+        }
+
+        ULONG ReleaseUnsync() noexcept
+        {
+            auto rc = --m_rc;
+            if (rc == 0) Derived::Destroy(static_cast<Derived*>(this));
+            return static_cast<ULONG>(rc);
+        }
+
+        // Creates a Derived object from args and returns it with one
+        // reference. Exceptions from the constructor are converted to
+        // HRESULTs.
+        template<typename... Args>
+        static HRESULT CreateImpl(Derived** ppObject, Args&&... args) noexcept
+        {
+            if (!ppObject) return E_POINTER;
+            *ppObject = nullptr;
+
+            try
+            {
+                *ppObject = Derived::Construct(std::forward<Args>(args)...);
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Creates a Derived object from args and returns the interface riid.
+        // Exceptions from the constructor are converted to HRESULTs.
+        template<typename... Args>
+        static HRESULT Create(REFIID riid, void** ppv, Args&&... args) noexcept
+        {
+            if (!ppv) return E_POINTER;
+            *ppv = nullptr;
+
+            try
+            {
+                auto p = Derived::Construct(std::forward<Args>(args)...);
+                HRESULT hr = p->QueryInterface(riid, ppv);
+                p->Release();
+                return hr;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+    };
+}
+
+#endif  // COMOBJECT_H
+
+///////////////////////////////////////////////////////////////////////////////
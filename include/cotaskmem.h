@@ -0,0 +1,223 @@
+// cotaskmem.h ////////////////////////////////////////////////////////////////
+//
+// ComTools::UCoTaskMem, CoTaskMemScope: Buffers allocated by CoTaskMemAlloc()
+//
+// ComTools::UCoTaskMem and CoTaskMemScope are released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef COTASKMEM_H
+#define COTASKMEM_H
+
+#include <Windows.h>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace ComTools {
+
+    // CoTaskMemScope: Defers CoTaskMemFree() for the buffers that UCoTaskMem
+    // objects on this thread free while the scope is open, and frees them
+    // together when the scope closes (or when Capacity buffers are
+    // waiting). Use a scope around a loop or a request that gets many
+    // short-lived buffers from COM:
+    //
+    //     CoTaskMemScope scope;
+    //     for (auto& item : items)
+    //     {
+    //         UCoTaskMem<wchar_t> name;
+    //         if (SUCCEEDED(item->GetName(set(name)))) ...
+    //     }
+    //
+    // Scopes nest; buffers go to the innermost scope open on the thread.
+    // A scope must be closed on the thread that opened it.
+    class CoTaskMemScope {
+    public:
+        static constexpr size_t Capacity = 256;
+
+    private:
+        CoTaskMemScope* m_outer;
+        size_t m_count = 0;
+        void* m_pending[Capacity];
+
+        static CoTaskMemScope*& InternalCurrent() noexcept
+        {
+            thread_local CoTaskMemScope* current = nullptr;
+            return current;
+        }
+
+    public:
+        CoTaskMemScope() noexcept : m_outer(InternalCurrent())
+        {
+            InternalCurrent() = this;
+        }
+
+        ~CoTaskMemScope() noexcept
+        {
+            Flush();
+            InternalCurrent() = m_outer;
+        }
+
+        CoTaskMemScope(CoTaskMemScope const&) = delete;
+        CoTaskMemScope& operator=(CoTaskMemScope const&) = delete;
+
+        // Frees the buffers waiting in this scope
+        void Flush() noexcept
+        {
+            for (size_t i = 0; i < m_count; ++i) CoTaskMemFree(m_pending[i]);
+            m_count = 0;
+        }
+
+        // The number of buffers waiting in this scope
+        size_t Pending() const noexcept { return m_count; }
+
+        // Frees p now, or later if a scope is open on this thread
+        static void Free(void* p) noexcept
+        {
+            if (!p) return;
+
+            auto scope = InternalCurrent();
+            if (!scope)
+            {
+                CoTaskMemFree(p);
+                return;
+            }
+
+            if (scope->m_count == Capacity) scope->Flush();
+            scope->m_pending[scope->m_count++] = p;
+        }
+    };
+
+    // UCoTaskMem: Owns a buffer of T allocated with CoTaskMemAlloc(), such
+    // as a string or an array of structures returned by a COM method. The
+    // buffer is freed with CoTaskMemFree() (see CoTaskMemScope). For an
+    // array, the number of elements is kept with the buffer when it is
+    // known, so that span() can return the array.
+    //
+    // The elements are not destroyed, so buffers of structures that own
+    // other memory must have that memory freed separately.
+    template<typename T>
+    class UCoTaskMem {
+        static_assert(std::is_trivially_destructible<T>::value,
+            "CoTaskMem buffers hold trivially destructible types");
+
+        T* m_ptr = nullptr;
+        size_t m_size = 0;
+
+    public:
+        friend void swap(UCoTaskMem& a, UCoTaskMem& b) noexcept
+        {
+            std::swap(a.m_ptr, b.m_ptr);
+            std::swap(a.m_size, b.m_size);
+        }
+
+        // Frees the buffer and returns the address of the pointer, for use
+        // as an out parameter. Use set_size() to record the number of
+        // elements returned.
+        friend T** set(UCoTaskMem& obj) noexcept
+        {
+            attach(obj, nullptr);
+            return &obj.m_ptr;
+        }
+
+        friend void attach(UCoTaskMem& obj, T* p, size_t size = 0) noexcept
+        {
+            CoTaskMemScope::Free(obj.m_ptr);
+            obj.m_ptr = p;
+            obj.m_size = p ? size : 0;
+        }
+
+        friend T* detach(UCoTaskMem& obj) noexcept
+        {
+            T* temp = obj.m_ptr;
+            obj.m_ptr = nullptr;
+            obj.m_size = 0;
+            return temp;
+        }
+
+        UCoTaskMem() noexcept = default;
+
+        ~UCoTaskMem() noexcept { CoTaskMemScope::Free(m_ptr); }
+
+        UCoTaskMem(UCoTaskMem const&) = delete;
+
+        UCoTaskMem(UCoTaskMem&& obj) noexcept { swap(*this, obj); }
+
+        UCoTaskMem& operator=(UCoTaskMem const&) = delete;
+
+        UCoTaskMem& operator=(UCoTaskMem&& obj) noexcept
+        {
+            UCoTaskMem temp(std::move(obj));
+            swap(*this, temp);
+            return *this;
+        }
+
+        // Allocates an uninitialized buffer of size elements. The result is
+        // empty if the buffer cannot be allocated.
+        static UCoTaskMem Alloc(size_t size) noexcept
+        {
+            UCoTaskMem obj;
+            if (size && size <= static_cast<size_t>(-1) / sizeof(T))
+            {
+                attach(obj, static_cast<T*>(CoTaskMemAlloc(size * sizeof(T))), size);
+            }
+
+            return obj;
+        }
+
+        explicit operator bool() const noexcept { return m_ptr != nullptr; }
+
+        T* get() const noexcept { return m_ptr; }
+
+        T& operator*() const noexcept { return *m_ptr; }
+
+        T* operator->() const noexcept { return m_ptr; }
+
+        T& operator[](size_t i) const noexcept { return m_ptr[i]; }
+
+        // The number of elements, or zero if it is not known
+        size_t size() const noexcept { return m_size; }
+
+        void set_size(size_t size) noexcept { m_size = m_ptr ? size : 0; }
+
+        std::span<T> span() const noexcept { return std::span<T>(m_ptr, m_size); }
+
+        // For a null-terminated string
+        std::wstring_view view() const noexcept requires std::is_same_v<T, wchar_t>
+        {
+            return m_ptr ? std::wstring_view(m_ptr) : std::wstring_view();
+        }
+
+        std::wstring to_wstring() const requires std::is_same_v<T, wchar_t>
+        {
+            return std::wstring(view());
+        }
+    };
+}
+
+#endif  // COTASKMEM_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,434 @@
+// dispatch.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::Dispatch: Late-bound calls through IDispatch
+//
+// ComTools::Dispatch is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <Windows.h>
+#include <dispex.h>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bstrcmp.h"
+#include "iptr.h"
+#include "ubstr.h"
+
+namespace ComTools {
+
+    // DispIdCache: Name-to-DISPID map shared by all objects of one type.
+    // Names are matched without regard to case, as GetIDsOfNames() does.
+    class DispIdCache {
+        struct NameLess {
+            using is_transparent = void;
+
+            bool operator()(std::wstring_view a, std::wstring_view b) const noexcept
+            {
+                return BstrCompareNoCase(a.data(), a.size(), b.data(), b.size()) < 0;
+            }
+        };
+
+        mutable std::shared_mutex m_mutex;
+        std::map<std::wstring, DISPID, NameLess> m_ids;
+
+        struct GuidLess {
+            bool operator()(GUID const& a, GUID const& b) const noexcept
+            {
+                return memcmp(&a, &b, sizeof(GUID)) < 0;
+            }
+        };
+
+    public:
+        bool Find(std::wstring_view name, DISPID* pid) const
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            auto it = m_ids.find(name);
+            if (it == m_ids.end()) return false;
+            *pid = it->second;
+            return true;
+        }
+
+        void Add(std::wstring_view name, DISPID id)
+        {
+            std::unique_lock<std::shared_mutex> lock(m_mutex);
+            m_ids.emplace(std::wstring(name), id);
+        }
+
+        // Returns the cache for the type described by the object's type
+        // information. Objects that do not provide type information get a
+        // private cache, as do objects that implement IDispatchEx, whose
+        // members (such as expando properties) are not fixed by their type.
+        static std::shared_ptr<DispIdCache> ForObject(IDispatch* pdisp)
+        {
+            GUID guid = GUID_NULL;
+            IPtr<IDispatchEx> ex;
+            IPtr<ITypeInfo> ti;
+            if (pdisp &&
+                FAILED(pdisp->QueryInterface(IID_IDispatchEx, reinterpret_cast<void**>(set(ex)))) &&
+                SUCCEEDED(pdisp->GetTypeInfo(0, LOCALE_USER_DEFAULT, set(ti))) &&
+                ti)
+            {
+                TYPEATTR* pta = nullptr;
+                if (SUCCEEDED(ti->GetTypeAttr(&pta)) && pta)
+                {
+                    guid = pta->guid;
+                    ti->ReleaseTypeAttr(pta);
+                }
+            }
+
+            if (guid == GUID_NULL) return std::make_shared<DispIdCache>();
+
+            static std::mutex mutex;
+            static std::map<GUID, std::shared_ptr<DispIdCache>, GuidLess> caches;
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& cache = caches[guid];
+            if (!cache) cache = std::make_shared<DispIdCache>();
+            return cache;
+        }
+    };
+
+    // Argument conversion for Dispatch. The VARIANTARG refers to the caller's
+    // data (strings and interfaces are not copied or AddRef'd), so arguments
+    // must outlive the call and are never cleared afterward.
+    inline void to_variantarg(VARIANTARG& v, bool b) noexcept
+    {
+        v.vt = VT_BOOL;
+        v.boolVal = b ? VARIANT_TRUE : VARIANT_FALSE;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, short i) noexcept
+    {
+        v.vt = VT_I2;
+        v.iVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, unsigned short i) noexcept
+    {
+        v.vt = VT_UI2;
+        v.uiVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, int i) noexcept
+    {
+        v.vt = VT_I4;
+        v.lVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, unsigned int i) noexcept
+    {
+        v.vt = VT_UI4;
+        v.ulVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, long i) noexcept
+    {
+        v.vt = VT_I4;
+        v.lVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, unsigned long i) noexcept
+    {
+        v.vt = VT_UI4;
+        v.ulVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, long long i) noexcept
+    {
+        v.vt = VT_I8;
+        v.llVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, unsigned long long i) noexcept
+    {
+        v.vt = VT_UI8;
+        v.ullVal = i;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, float f) noexcept
+    {
+        v.vt = VT_R4;
+        v.fltVal = f;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, double d) noexcept
+    {
+        v.vt = VT_R8;
+        v.dblVal = d;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, BSTR bstr) noexcept
+    {
+        v.vt = VT_BSTR;
+        v.bstrVal = bstr;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, UBSTR const& s) noexcept
+    {
+        v.vt = VT_BSTR;
+        v.bstrVal = s.get();
+    }
+
+    inline void to_variantarg(VARIANTARG& v, VARIANT const& var) noexcept
+    {
+        // Shallow copy: the callee does not own [in] arguments
+        v = var;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, long* p) noexcept
+    {
+        v.vt = VT_I4 | VT_BYREF;
+        v.plVal = p;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, double* p) noexcept
+    {
+        v.vt = VT_R8 | VT_BYREF;
+        v.pdblVal = p;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, BSTR* p) noexcept
+    {
+        v.vt = VT_BSTR | VT_BYREF;
+        v.pbstrVal = p;
+    }
+
+    inline void to_variantarg(VARIANTARG& v, VARIANT* p) noexcept
+    {
+        v.vt = VT_VARIANT | VT_BYREF;
+        v.pvarVal = p;
+    }
+
+    // T is a COM interface
+    template<typename T>
+    inline void to_variantarg(VARIANTARG& v, T* p) noexcept
+    {
+        static_assert(std::is_base_of<IUnknown, T>::value,
+            "Dispatch arguments that are pointers must be COM interfaces "
+            "(pass strings as BSTR or UBSTR)");
+
+        if constexpr (std::is_base_of<IDispatch, T>::value)
+        {
+            v.vt = VT_DISPATCH;
+            v.pdispVal = p;
+        }
+        else
+        {
+            v.vt = VT_UNKNOWN;
+            v.punkVal = p;
+        }
+    }
+
+    template<typename T>
+    inline void to_variantarg(VARIANTARG& v, IPtr<T> const& p) noexcept
+    {
+        to_variantarg(v, get(p));
+    }
+
+    // Dispatch: IPtr<IDispatch> with cached DISPIDs. Because the local list
+    // of DISPIDs is not locked, a Dispatch object must not be used by more
+    // than one thread at a time. Calls may be reentered on the same thread
+    // (for example, from an event sink in an STA).
+    class Dispatch {
+        // The first few names used with this object are also kept in a small
+        // unlocked list, which is faster than the shared cache for the
+        // handful of names that a caller typically uses with one object
+        static size_t const local_max = 8;
+
+        IPtr<IDispatch> m_ptr;
+        std::shared_ptr<DispIdCache> m_cache;
+        std::vector<std::pair<std::wstring, DISPID>> m_local;
+
+        // Transfers the contents of EXCEPINFO to the thread's error object
+        // so that callers can use ComException
+        static HRESULT InternalSetErrorInfo(EXCEPINFO& ei) noexcept
+        {
+            if (ei.pfnDeferredFillIn) ei.pfnDeferredFillIn(&ei);
+
+            IPtr<ICreateErrorInfo> pcei;
+            if (SUCCEEDED(CreateErrorInfo(set(pcei))) && pcei)
+            {
+                pcei->SetSource(ei.bstrSource);
+                pcei->SetDescription(ei.bstrDescription);
+                pcei->SetHelpFile(ei.bstrHelpFile);
+                pcei->SetHelpContext(ei.dwHelpContext);
+                auto pei = pcei.As<IErrorInfo>(IID_IErrorInfo);
+                if (pei) SetErrorInfo(0, get(pei));
+            }
+
+            SysFreeString(ei.bstrSource);
+            SysFreeString(ei.bstrDescription);
+            SysFreeString(ei.bstrHelpFile);
+
+            return FAILED(ei.scode) ? ei.scode : DISP_E_EXCEPTION;
+        }
+
+    public:
+        Dispatch() noexcept = default;
+
+        explicit Dispatch(IPtr<IDispatch> ptr) :
+            m_ptr(std::move(ptr)),
+            m_cache(DispIdCache::ForObject(get(m_ptr))),
+            m_local() { }
+
+        Dispatch(IPtr<IDispatch> ptr, std::shared_ptr<DispIdCache> cache) noexcept :
+            m_ptr(std::move(ptr)),
+            m_cache(std::move(cache)),
+            m_local() { }
+
+        explicit operator bool() const noexcept
+        {
+            return m_ptr && m_cache;
+        }
+
+        friend IDispatch* get(Dispatch const& obj) noexcept
+        {
+            return get(obj.m_ptr);
+        }
+
+        HRESULT GetDispId(wchar_t const* name, DISPID* pid) noexcept
+        {
+            if (!name || !pid || !*this) return E_POINTER;
+
+            for (auto const& entry : m_local)
+            {
+                if (entry.first == name)
+                {
+                    *pid = entry.second;
+                    return S_OK;
+                }
+            }
+
+            try
+            {
+                HRESULT hr = S_OK;
+                if (!m_cache->Find(name, pid))
+                {
+                    hr = m_ptr->GetIDsOfNames(
+                        IID_NULL,
+                        const_cast<LPOLESTR*>(&name),
+                        1,
+                        LOCALE_USER_DEFAULT,
+                        pid);
+                    if (FAILED(hr)) return hr;
+                    m_cache->Add(name, *pid);
+                }
+
+                if (m_local.size() < local_max) m_local.emplace_back(name, *pid);
+                return hr;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // result may be nullptr. Otherwise, it must be initialized and its
+        // previous contents are cleared, like set().
+        template<typename... Args>
+        HRESULT Invoke(DISPID id, WORD flags, VARIANT* result, Args const&... args) noexcept
+        {
+            if (!m_ptr) return E_POINTER;
+            if (result) VariantClear(result);
+
+            // The arguments are on the stack, not in a member, so a call
+            // that reenters this object cannot move them out from under the
+            // DISPPARAMS of an outer call
+            UINT const cArgs = sizeof...(Args);
+            VARIANTARG argv[cArgs ? cArgs : 1];
+
+            // DISPPARAMS holds arguments in reverse order
+            UINT i = cArgs;
+            (to_variantarg(argv[--i], args), ...);
+            (void)i;
+
+            DISPID put = DISPID_PROPERTYPUT;
+            DISPPARAMS dp{ cArgs ? argv : nullptr, nullptr, cArgs, 0 };
+            if (flags & (DISPATCH_PROPERTYPUT | DISPATCH_PROPERTYPUTREF))
+            {
+                dp.rgdispidNamedArgs = &put;
+                dp.cNamedArgs = 1;
+            }
+
+            EXCEPINFO ei{};
+            HRESULT hr = m_ptr->Invoke(
+                id,
+                IID_NULL,
+                LOCALE_USER_DEFAULT,
+                flags,
+                &dp,
+                result,
+                &ei,
+                nullptr);
+            if (hr == DISP_E_EXCEPTION) hr = InternalSetErrorInfo(ei);
+            return hr;
+        }
+
+        template<typename... Args>
+        HRESULT Call(wchar_t const* name, VARIANT* result, Args const&... args) noexcept
+        {
+            DISPID id = DISPID_UNKNOWN;
+            HRESULT hr = GetDispId(name, &id);
+            if (FAILED(hr)) return hr;
+            return Invoke(id, DISPATCH_METHOD, result, args...);
+        }
+
+        template<typename... Args>
+        HRESULT Get(wchar_t const* name, VARIANT* result, Args const&... args) noexcept
+        {
+            DISPID id = DISPID_UNKNOWN;
+            HRESULT hr = GetDispId(name, &id);
+            if (FAILED(hr)) return hr;
+            return Invoke(id, DISPATCH_PROPERTYGET, result, args...);
+        }
+
+        // The last argument is the new value of the property
+        template<typename... Args>
+        HRESULT Put(wchar_t const* name, Args const&... args) noexcept
+        {
+            static_assert(sizeof...(Args) > 0, "Put requires a value");
+            DISPID id = DISPID_UNKNOWN;
+            HRESULT hr = GetDispId(name, &id);
+            if (FAILED(hr)) return hr;
+            return Invoke(id, DISPATCH_PROPERTYPUT, nullptr, args...);
+        }
+    };
+}
+
+#endif  // DISPATCH_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,196 @@
+// errinfo.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::ErrorInfo, StaticError, RaiseError: Raise errors from servers
+//
+// ComTools::ErrorInfo, StaticError, and RaiseError are released under the MIT
+// license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef ERRINFO_H
+#define ERRINFO_H
+
+#include <Windows.h>
+#include <string>
+#include <string_view>
+#include "iptr.h"
+#include "objpool.h"
+
+namespace ComTools {
+
+    // A server raises an error by setting the thread's error object and
+    // returning a failure HRESULT. Callers read the error object with
+    // GetErrorInfo() or ComException (see comexcept.h).
+    //
+    // CreateErrorInfo() allocates a new error object, and each Set call
+    // allocates a new BSTR, even when the server raises the same error
+    // every time. Here, StaticError creates its error object once and sets
+    // the same object each time it is raised, and RaiseError() takes its
+    // error objects from a pool (see objpool.h), reusing their strings'
+    // storage.
+
+    // ErrorInfo: Error object whose contents are set when it is created and
+    // do not change. The getters return new BSTRs, which the caller frees.
+    class ErrorInfo final : public PooledObject<ErrorInfo, IErrorInfo> {
+        GUID m_guid;
+        std::wstring m_source;
+        std::wstring m_description;
+        std::wstring m_help_file;
+        DWORD m_help_context;
+
+        static HRESULT InternalCopy(std::wstring const& s, BSTR* pbstr) noexcept
+        {
+            if (!pbstr) return E_POINTER;
+            *pbstr = SysAllocStringLen(s.data(), static_cast<UINT>(s.size()));
+            return *pbstr ? S_OK : E_OUTOFMEMORY;
+        }
+
+    public:
+        ErrorInfo(
+            REFGUID guid,
+            std::wstring_view source,
+            std::wstring_view description,
+            std::wstring_view help_file,
+            DWORD help_context) :
+            m_guid(guid),
+            m_source(source),
+            m_description(description),
+            m_help_file(help_file),
+            m_help_context(help_context) { }
+
+        // The strings keep their capacity while the object is pooled
+        void Recycle() noexcept
+        {
+            m_source.clear();
+            m_description.clear();
+            m_help_file.clear();
+        }
+
+        void Reset(
+            REFGUID guid,
+            std::wstring_view source,
+            std::wstring_view description,
+            std::wstring_view help_file,
+            DWORD help_context)
+        {
+            m_guid = guid;
+            m_source.assign(source);
+            m_description.assign(description);
+            m_help_file.assign(help_file);
+            m_help_context = help_context;
+        }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == IID_IErrorInfo ? static_cast<IErrorInfo*>(this) : nullptr;
+        }
+
+        STDMETHODIMP GetGUID(GUID* pguid) noexcept override
+        {
+            if (!pguid) return E_POINTER;
+            *pguid = m_guid;
+            return S_OK;
+        }
+
+        STDMETHODIMP GetSource(BSTR* pbstr) noexcept override
+        {
+            return InternalCopy(m_source, pbstr);
+        }
+
+        STDMETHODIMP GetDescription(BSTR* pbstr) noexcept override
+        {
+            return InternalCopy(m_description, pbstr);
+        }
+
+        STDMETHODIMP GetHelpFile(BSTR* pbstr) noexcept override
+        {
+            return InternalCopy(m_help_file, pbstr);
+        }
+
+        STDMETHODIMP GetHelpContext(DWORD* pdw) noexcept override
+        {
+            if (!pdw) return E_POINTER;
+            *pdw = m_help_context;
+            return S_OK;
+        }
+    };
+
+    // Sets the thread's error object and returns hr. If the error object
+    // cannot be created, the thread's error object is cleared.
+    inline HRESULT RaiseError(
+        HRESULT hr,
+        std::wstring_view source,
+        std::wstring_view description,
+        REFGUID guid = GUID_NULL,
+        std::wstring_view help_file = std::wstring_view(),
+        DWORD help_context = 0) noexcept
+    {
+        IPtr<IErrorInfo> pei;
+        ErrorInfo::Create(IID_IErrorInfo, reinterpret_cast<void**>(set(pei)),
+            guid, source, description, help_file, help_context);
+        SetErrorInfo(0, get(pei));
+        return hr;
+    }
+
+    // StaticError: Error with a fixed message, for use as a function-local
+    // static, which threads can raise concurrently:
+    //
+    //     static StaticError const not_found(E_INVALIDARG, L"My.Object",
+    //         L"The item was not found.");
+    //     return not_found.Raise();
+    class StaticError {
+        HRESULT m_hr;
+        IPtr<IErrorInfo> m_info;
+
+    public:
+        StaticError(
+            HRESULT hr,
+            std::wstring_view source,
+            std::wstring_view description,
+            REFGUID guid = GUID_NULL,
+            std::wstring_view help_file = std::wstring_view(),
+            DWORD help_context = 0) noexcept :
+            m_hr(hr),
+            m_info()
+        {
+            ErrorInfo::Create(IID_IErrorInfo, reinterpret_cast<void**>(set(m_info)),
+                guid, source, description, help_file, help_context);
+        }
+
+        StaticError(StaticError const&) = delete;
+        StaticError& operator=(StaticError const&) = delete;
+
+        HRESULT hr() const noexcept { return m_hr; }
+
+        // Sets the thread's error object and returns the HRESULT
+        HRESULT Raise() const noexcept
+        {
+            SetErrorInfo(0, get(m_info));
+            return m_hr;
+        }
+    };
+}
+
+#endif  // ERRINFO_H
+
+///////////////////////////////////////////////////////////////////////////////
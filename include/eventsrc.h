@@ -0,0 +1,371 @@
+// eventsrc.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::EventSource: Event sinks for a connection point
+//
+// ComTools::EventSource is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef EVENTSRC_H
+#define EVENTSRC_H
+
+#include <Windows.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "iptr.h"
+
+namespace ComTools {
+
+    // EventSource: The sinks advised for events of interface I, as kept by
+    // a connection point. The sinks are held in an immutable snapshot that
+    // Advise() and Unadvise() replace; Fire() loads the current snapshot
+    // once and calls the sinks in it without locking or calling AddRef() on
+    // each sink. A sink that unadvises while an event is being fired can
+    // still receive that event.
+    //
+    // Fire() does not touch a reference count shared with other threads.
+    // Each firing thread counts itself on one of several cache lines, picked
+    // by thread ID, in the half for the epoch it started in. A replaced
+    // snapshot is released once the threads that were firing when it was
+    // replaced have returned: at once if none were, and otherwise by the
+    // next Advise(), Unadvise(), or Clear(), or by the last of those Fire()
+    // calls to return. Threads that start firing later do not delay it.
+    //
+    // Advise() and Unadvise() copy the snapshot and are serialized by a
+    // mutex, which is not held while sinks are released, so sinks can
+    // advise and unadvise from their event handlers.
+    template<typename I>
+    class EventSource {
+    public:
+        struct Connection {
+            DWORD cookie;
+            IPtr<I> sink;
+        };
+
+        using Snapshot = std::shared_ptr<std::vector<Connection> const>;
+
+    private:
+        static constexpr size_t Stripes = 8;
+
+        struct alignas(64) Stripe {
+            std::atomic<long> firing[2]{};
+        };
+
+        struct Node {
+            Snapshot sinks;
+            unsigned epoch = 0;         // Epoch in which it was replaced
+            Node* next = nullptr;       // Next replaced node
+        };
+
+        // Nodes deleted on destruction, after m_lock is unlocked
+        class InternalReleased {
+            Node* m_head = nullptr;
+
+        public:
+            InternalReleased() noexcept = default;
+
+            ~InternalReleased() noexcept
+            {
+                while (m_head)
+                {
+                    Node* node = m_head;
+                    m_head = node->next;
+                    delete node;
+                }
+            }
+
+            InternalReleased(InternalReleased const&) = delete;
+            InternalReleased& operator=(InternalReleased const&) = delete;
+
+            void push(Node* node) noexcept
+            {
+                node->next = m_head;
+                m_head = node;
+            }
+        };
+
+        // Counts the calling thread as firing while it is in scope. The
+        // count is made in the current epoch, checked again afterwards, so
+        // an epoch is not left while a thread that started in it may still
+        // be loading the snapshot.
+        class InternalFiring {
+            std::atomic<long>& m_count;
+
+            static std::atomic<long>& Enter(EventSource const& source) noexcept
+            {
+                auto& stripe = source.m_stripes[(GetCurrentThreadId() >> 2) % Stripes];
+                for (;;)
+                {
+                    unsigned const epoch = source.m_epoch.load();
+                    auto& count = stripe.firing[epoch & 1];
+                    count.fetch_add(1);
+                    if (source.m_epoch.load() == epoch) return count;
+                    count.fetch_sub(1);
+                }
+            }
+
+        public:
+            explicit InternalFiring(EventSource const& source) noexcept :
+                m_count(Enter(source)) { }
+
+            ~InternalFiring() noexcept
+            {
+                m_count.fetch_sub(1);
+            }
+
+            InternalFiring(InternalFiring const&) = delete;
+            InternalFiring& operator=(InternalFiring const&) = delete;
+        };
+
+        std::atomic<Node*> m_current = nullptr;
+        mutable std::atomic<unsigned> m_epoch = 0;
+        mutable Stripe m_stripes[Stripes];
+        mutable std::atomic<bool> m_retiring = false;
+        mutable std::mutex m_lock;
+        mutable Node* m_retired = nullptr;      // Replaced, maybe being fired
+        DWORD m_cookie = 0;
+
+        // Moves the replaced nodes that no thread can still be firing to
+        // released. Threads that loaded a node replaced in epoch t started
+        // firing in epoch t - 1 or t: the epoch only advances from e to e + 1
+        // once no thread that started in e - 1 is firing. The node is free
+        // once the epoch reaches t + 2. Called with m_lock held.
+        void InternalCollect(InternalReleased& released) const noexcept
+        {
+            for (;;)
+            {
+                unsigned const epoch = m_epoch.load(std::memory_order_relaxed);
+                for (Node** link = &m_retired; *link;)
+                {
+                    Node* node = *link;
+                    if (epoch - node->epoch >= 2)
+                    {
+                        *link = node->next;
+                        released.push(node);
+                    }
+                    else
+                    {
+                        link = &node->next;
+                    }
+                }
+
+                if (!m_retired)
+                {
+                    m_retiring.store(false, std::memory_order_relaxed);
+                    return;
+                }
+
+                for (auto const& stripe : m_stripes)
+                {
+                    if (stripe.firing[(epoch + 1) & 1].load() != 0) return;
+                }
+
+                m_epoch.store(epoch + 1);
+            }
+        }
+
+        // Makes node current. Called with m_lock held.
+        void InternalReplace(Node* node, InternalReleased& released) noexcept
+        {
+            Node* old = m_current.exchange(node);
+            if (old)
+            {
+                old->epoch = m_epoch.load(std::memory_order_relaxed);
+                old->next = m_retired;
+                m_retired = old;
+                m_retiring.store(true, std::memory_order_relaxed);
+            }
+
+            InternalCollect(released);
+        }
+
+    public:
+        EventSource() noexcept = default;
+
+        ~EventSource() noexcept
+        {
+            InternalReleased released;
+            if (Node* node = m_current.load()) released.push(node);
+            while (m_retired)
+            {
+                Node* node = m_retired;
+                m_retired = node->next;
+                released.push(node);
+            }
+        }
+
+        EventSource(EventSource const&) = delete;
+        EventSource& operator=(EventSource const&) = delete;
+
+        // Queries unk for riid, the IID of I, and advises the result
+        HRESULT Advise(IUnknown* unk, REFIID riid, DWORD* cookie) noexcept
+        {
+            if (!cookie) return E_POINTER;
+            *cookie = 0;
+            if (!unk) return E_POINTER;
+
+            IPtr<I> sink;
+            if (FAILED(unk->QueryInterface(riid, reinterpret_cast<void**>(set(sink)))))
+            {
+                return CONNECT_E_CANNOTCONNECT;
+            }
+
+            return Advise(sink, cookie);
+        }
+
+        HRESULT Advise(IPtr<I> const& sink, DWORD* cookie) noexcept
+        {
+            if (!cookie) return E_POINTER;
+            *cookie = 0;
+            if (!sink) return E_POINTER;
+
+            InternalReleased released;
+            try
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                if (m_cookie == MAXDWORD) return CONNECT_E_ADVISELIMIT;
+
+                Node const* current = m_current.load(std::memory_order_relaxed);
+                auto sinks = std::make_shared<std::vector<Connection>>();
+                sinks->reserve((current ? current->sinks->size() : 0) + 1);
+                if (current) sinks->assign(current->sinks->begin(), current->sinks->end());
+                sinks->push_back({ m_cookie + 1, sink });
+
+                auto node = std::make_unique<Node>();
+                node->sinks = std::move(sinks);
+                InternalReplace(node.release(), released);
+                *cookie = ++m_cookie;
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        HRESULT Unadvise(DWORD cookie) noexcept
+        {
+            InternalReleased released;
+            try
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                Node const* current = m_current.load(std::memory_order_relaxed);
+                if (!current) return CONNECT_E_NOCONNECTION;
+
+                auto const& connections = *current->sinks;
+                auto it = connections.begin();
+                while (it != connections.end() && it->cookie != cookie) ++it;
+                if (it == connections.end()) return CONNECT_E_NOCONNECTION;
+
+                std::unique_ptr<Node> node;
+                if (connections.size() > 1)
+                {
+                    auto sinks = std::make_shared<std::vector<Connection>>();
+                    sinks->reserve(connections.size() - 1);
+                    sinks->insert(sinks->end(), connections.begin(), it);
+                    sinks->insert(sinks->end(), it + 1, connections.end());
+                    node = std::make_unique<Node>();
+                    node->sinks = std::move(sinks);
+                }
+
+                InternalReplace(node.release(), released);
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        void Clear() noexcept
+        {
+            InternalReleased released;
+            try
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                InternalReplace(nullptr, released);
+            }
+            catch (...)
+            {
+                // The lock could not be taken; the sinks stay advised
+            }
+        }
+
+        // The sinks advised now, for enumerating connections
+        Snapshot Sinks() const noexcept
+        {
+            InternalFiring firing(*this);
+            Node const* current = m_current.load();
+            return current ? current->sinks : nullptr;
+        }
+
+        size_t Count() const noexcept
+        {
+            InternalFiring firing(*this);
+            Node const* current = m_current.load();
+            return current ? current->sinks->size() : 0;
+        }
+
+        // Calls f(I*) for each sink advised when Fire() is called and
+        // returns the number of sinks called
+        template<typename F>
+        size_t Fire(F&& f) const
+        {
+            size_t fired = 0;
+            {
+                InternalFiring firing(*this);
+                if (Node const* current = m_current.load())
+                {
+                    for (auto const& connection : *current->sinks) f(get(connection.sink));
+                    fired = current->sinks->size();
+                }
+            }
+
+            // Release the snapshots replaced while firing, unless another
+            // thread holds the lock and will do so itself
+            if (m_retiring.load(std::memory_order_relaxed))
+            {
+                InternalReleased released;
+                std::unique_lock<std::mutex> lock(m_lock, std::try_to_lock);
+                if (lock.owns_lock()) InternalCollect(released);
+            }
+
+            return fired;
+        }
+    };
+}
+
+#endif  // EVENTSRC_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,405 @@
+// executor.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::Executor: Thread pool whose workers live in a COM apartment
+//
+// ComTools::Executor is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ComTools {
+
+    // ComApartment: Enters each worker thread into a COM apartment
+    struct ComApartment {
+        static HRESULT Initialize(DWORD coinit) noexcept
+        {
+            return CoInitializeEx(nullptr, coinit);
+        }
+
+        static void Uninitialize() noexcept
+        {
+            CoUninitialize();
+        }
+    };
+
+    // Work: Move-only callable run by an Executor. Because Work is not
+    // copied, interface pointers captured by value are moved into the work
+    // and released on the worker thread when it finishes. Callables of up to
+    // three pointers that can be moved without throwing are stored inline;
+    // larger ones are allocated.
+    class Work {
+        struct VTable {
+            void (*invoke)(void* p);
+            void (*move)(void* dst, void* src) noexcept;
+            void (*destroy)(void* p) noexcept;
+        };
+
+        template<typename F>
+        static constexpr bool InternalInline = sizeof(F) <= 3 * sizeof(void*) &&
+            alignof(F) <= alignof(void*) && std::is_nothrow_move_constructible_v<F>;
+
+        template<typename F>
+        struct Ops {
+            static F* Get(void* p) noexcept
+            {
+                if constexpr (InternalInline<F>) return std::launder(static_cast<F*>(p));
+                else return *static_cast<F**>(p);
+            }
+
+            static void Invoke(void* p)
+            {
+                (*Get(p))();
+            }
+
+            static void Move(void* dst, void* src) noexcept
+            {
+                if constexpr (InternalInline<F>)
+                {
+                    ::new (dst) F(std::move(*Get(src)));
+                    Get(src)->~F();
+                }
+                else
+                {
+                    *static_cast<F**>(dst) = Get(src);
+                }
+            }
+
+            static void Destroy(void* p) noexcept
+            {
+                if constexpr (InternalInline<F>) Get(p)->~F();
+                else delete Get(p);
+            }
+
+            static constexpr VTable table = { &Invoke, &Move, &Destroy };
+        };
+
+        alignas(void*) unsigned char m_storage[3 * sizeof(void*)];
+        VTable const* m_vt = nullptr;
+
+        void InternalReset() noexcept
+        {
+            if (m_vt) m_vt->destroy(m_storage);
+            m_vt = nullptr;
+        }
+
+        void InternalMove(Work& other) noexcept
+        {
+            if (other.m_vt) other.m_vt->move(m_storage, other.m_storage);
+            m_vt = other.m_vt;
+            other.m_vt = nullptr;
+        }
+
+    public:
+        Work() noexcept = default;
+
+        template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Work>>>
+        Work(F&& f)
+        {
+            using T = std::decay_t<F>;
+            if constexpr (InternalInline<T>) ::new (static_cast<void*>(m_storage)) T(std::forward<F>(f));
+            else *reinterpret_cast<T**>(m_storage) = new T(std::forward<F>(f));
+            m_vt = &Ops<T>::table;
+        }
+
+        ~Work() noexcept
+        {
+            InternalReset();
+        }
+
+        Work(Work&& other) noexcept
+        {
+            InternalMove(other);
+        }
+
+        Work& operator=(Work&& other) noexcept
+        {
+            if (this != &other)
+            {
+                InternalReset();
+                InternalMove(other);
+            }
+
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return m_vt != nullptr; }
+
+        void operator()()
+        {
+            m_vt->invoke(m_storage);
+        }
+    };
+
+    // Executor: Fixed set of worker threads, each initialized once into the
+    // apartment given by coinit (COINIT_MULTITHREADED by default) and
+    // uninitialized when the executor is destroyed. Init supplies
+    // Initialize(coinit) and Uninitialize() and defaults to ComApartment.
+    //
+    // Each worker has its own queue. Work submitted from a worker goes to
+    // that worker's queue and is taken newest first; work submitted from
+    // other threads is spread over the queues. A worker whose queue is empty
+    // steals the oldest work from the other queues before it sleeps.
+    //
+    // Objects reached through interface pointers captured by work must be
+    // usable from the workers' apartment; pointers to single-threaded
+    // objects must be marshaled. Exceptions thrown by work are discarded.
+    //
+    // If a worker cannot be started or initialized, the executor is empty,
+    // Status() returns the error, and Submit() returns E_UNEXPECTED.
+    template<typename Init = ComApartment>
+    class Executor {
+        struct alignas(64) Queue {
+            std::mutex lock;
+            std::deque<Work> items;
+        };
+
+        std::unique_ptr<Queue[]> m_queues;
+        std::vector<std::thread> m_threads;
+        size_t m_count = 0;
+
+        alignas(64) std::atomic<unsigned> m_epoch = 0;  // Changes when work is queued
+        std::atomic<unsigned> m_sleepers = 0;
+        alignas(64) std::atomic<size_t> m_outstanding = 0;
+        std::atomic<size_t> m_next = 0;
+        std::atomic<size_t> m_ready = 0;
+        std::atomic<size_t> m_stolen = 0;
+        std::atomic<HRESULT> m_hr = S_OK;
+        std::atomic<bool> m_stop = false;
+
+        static inline thread_local Executor* t_owner = nullptr;
+        static inline thread_local size_t t_index = 0;
+
+        bool InternalPop(size_t index, Work& work) noexcept
+        {
+            auto& queue = m_queues[index];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.items.empty()) return false;
+            work = std::move(queue.items.back());
+            queue.items.pop_back();
+            return true;
+        }
+
+        bool InternalSteal(size_t index, Work& work) noexcept
+        {
+            for (size_t i = 1; i < m_count; ++i)
+            {
+                auto& queue = m_queues[(index + i) % m_count];
+                std::lock_guard<std::mutex> guard(queue.lock);
+                if (queue.items.empty()) continue;
+                work = std::move(queue.items.front());
+                queue.items.pop_front();
+                m_stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            return false;
+        }
+
+        void InternalDone() noexcept
+        {
+            if (m_outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                m_outstanding.notify_all();
+            }
+        }
+
+        void InternalRun(size_t index, DWORD coinit) noexcept
+        {
+            HRESULT hr = Init::Initialize(coinit);
+            if (FAILED(hr))
+            {
+                HRESULT expected = S_OK;
+                m_hr.compare_exchange_strong(expected, hr);
+            }
+
+            m_ready.fetch_add(1, std::memory_order_release);
+            m_ready.notify_all();
+            if (FAILED(hr)) return;
+
+            t_owner = this;
+            t_index = index;
+            for (;;)
+            {
+                unsigned epoch = m_epoch.load(std::memory_order_acquire);
+                Work work;
+                if (InternalPop(index, work) || InternalSteal(index, work))
+                {
+                    try
+                    {
+                        work();
+                    }
+                    catch (...)
+                    {
+                    }
+
+                    // Release the captures before the work counts as done
+                    work = Work();
+                    InternalDone();
+                    continue;
+                }
+
+                if (m_stop.load(std::memory_order_acquire)) break;
+
+                // Submit() only notifies when a worker may be sleeping
+                m_sleepers.fetch_add(1);
+                if (m_epoch.load() == epoch) m_epoch.wait(epoch);
+                m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            t_owner = nullptr;
+            Init::Uninitialize();
+        }
+
+        void InternalStop() noexcept
+        {
+            m_stop.store(true, std::memory_order_release);
+            m_epoch.fetch_add(1, std::memory_order_release);
+            m_epoch.notify_all();
+            for (auto& thread : m_threads) thread.join();
+            m_threads.clear();
+        }
+
+    public:
+        // Starts threads workers, or one per processor if threads is zero
+        explicit Executor(size_t threads = 0, DWORD coinit = COINIT_MULTITHREADED) noexcept
+        {
+            if (threads == 0) threads = (std::max)(std::thread::hardware_concurrency(), 1U);
+
+            try
+            {
+                m_queues = std::make_unique<Queue[]>(threads);
+                m_count = threads;
+                m_threads.reserve(threads);
+                for (size_t i = 0; i < threads; ++i)
+                {
+                    m_threads.emplace_back(&Executor::InternalRun, this, i, coinit);
+                }
+            }
+            catch (std::bad_alloc&)
+            {
+                m_hr = E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                m_hr = E_UNEXPECTED;
+            }
+
+            // Wait for the started workers to enter their apartments
+            for (size_t n; (n = m_ready.load(std::memory_order_acquire)) < m_threads.size(); )
+            {
+                m_ready.wait(n, std::memory_order_acquire);
+            }
+
+            if (FAILED(m_hr.load()))
+            {
+                InternalStop();
+                m_queues.reset();
+                m_count = 0;
+            }
+        }
+
+        // Runs the work that has been submitted, then stops the workers
+        ~Executor() noexcept
+        {
+            InternalStop();
+        }
+
+        Executor(Executor const&) = delete;
+        Executor& operator=(Executor const&) = delete;
+
+        explicit operator bool() const noexcept { return m_count != 0; }
+
+        HRESULT Status() const noexcept { return m_hr.load(); }
+
+        size_t Size() const noexcept { return m_count; }
+
+        // Number of times a worker took work from another worker's queue
+        size_t Stolen() const noexcept { return m_stolen.load(std::memory_order_relaxed); }
+
+        // Queues f(), which is moved into the executor
+        template<typename F>
+        HRESULT Submit(F&& f) noexcept
+        {
+            if (!m_count) return E_UNEXPECTED;
+
+            try
+            {
+                Work work(std::forward<F>(f));
+                size_t index = t_owner == this ? t_index :
+                    m_next.fetch_add(1, std::memory_order_relaxed) % m_count;
+
+                m_outstanding.fetch_add(1, std::memory_order_relaxed);
+                try
+                {
+                    auto& queue = m_queues[index];
+                    std::lock_guard<std::mutex> guard(queue.lock);
+                    queue.items.push_back(std::move(work));
+                }
+                catch (...)
+                {
+                    InternalDone();
+                    throw;
+                }
+
+                m_epoch.fetch_add(1);
+                if (m_sleepers.load()) m_epoch.notify_one();
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Waits until all submitted work, including work submitted by work,
+        // has finished. Must not be called from a worker.
+        void Wait() const noexcept
+        {
+            for (size_t n; (n = m_outstanding.load(std::memory_order_acquire)) != 0; )
+            {
+                m_outstanding.wait(n, std::memory_order_acquire);
+            }
+        }
+    };
+}
+
+#endif  // EXECUTOR_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,480 @@
+// identity.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::IdentityPtr, IdentitySet, IdentityMap: COM object identity
+//
+// ComTools::IdentityPtr, IdentitySet, and IdentityMap are released under the
+// MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef IDENTITY_H
+#define IDENTITY_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#include "iptr.h"
+
+namespace ComTools {
+
+    // Returns the IUnknown pointer that identifies the object p belongs to,
+    // or nullptr if p is nullptr or the query fails. COM requires every
+    // interface of an object to return the same IUnknown pointer for as
+    // long as the object exists, so the result does not hold a reference.
+    inline IUnknown* IdentityOf(IUnknown* p) noexcept
+    {
+        if (!p) return nullptr;
+
+        IUnknown* id = nullptr;
+        if (FAILED(p->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&id)))) return nullptr;
+        id->Release();
+        return id;
+    }
+
+    // True if left and right are interfaces of the same object
+    template<typename T, typename U>
+    bool SameObject(IPtr<T> const& left, IPtr<U> const& right) noexcept
+    {
+        if (static_cast<void*>(get(left)) == static_cast<void*>(get(right))) return true;
+        IUnknown* id = IdentityOf(get(left));
+        return id && id == IdentityOf(get(right));
+    }
+
+    // IdentityPtr: IPtr with the identity of its object, which is queried
+    // once, when the IdentityPtr is created. IdentityPtrs compare and hash
+    // by identity, so pointers to different interfaces of one object are
+    // equal.
+    template<typename T>
+    class IdentityPtr {
+        IPtr<T> m_ptr;
+        IUnknown* m_id = nullptr;
+
+    public:
+        IdentityPtr() noexcept = default;
+
+        explicit IdentityPtr(IPtr<T> const& p) noexcept : m_ptr(p), m_id(IdentityOf(get(p))) { }
+
+        explicit operator bool() const noexcept { return m_id != nullptr; }
+
+        IPtr<T> const& Ptr() const noexcept { return m_ptr; }
+
+        IUnknown* Id() const noexcept { return m_id; }
+    };
+
+    template<typename T, typename U>
+    bool operator==(IdentityPtr<T> const& left, IdentityPtr<U> const& right) noexcept
+    {
+        return left.Id() == right.Id();
+    }
+
+    template<typename T, typename U>
+    bool operator!=(IdentityPtr<T> const& left, IdentityPtr<U> const& right) noexcept
+    {
+        return !(left == right);
+    }
+
+    template<typename T, typename U>
+    bool operator<(IdentityPtr<T> const& left, IdentityPtr<U> const& right) noexcept
+    {
+        return std::less<IUnknown*>()(left.Id(), right.Id());
+    }
+
+    // IdentityTable: Entries with distinct identities, each holding a
+    // reference to an interface of its object. Base of IdentitySet and
+    // IdentityMap.
+    //
+    // The entries are stored contiguously, in insertion order except that
+    // erasing an entry moves the last entry into its place. They are
+    // indexed by identity in an open-addressing hash table. Lookups first
+    // look for the argument itself, which is found without a query if it
+    // is the identity of an object in the table, and then query it for its
+    // identity.
+    //
+    // The bulk Insert() and Erase() overloads take arrays of pointers.
+    // Pointers to objects already in the table, or repeated in the array,
+    // are dropped without AddRef() or Release(). Erased entries are
+    // released together after the table is updated.
+    template<typename T, typename Entry>
+    class IdentityTable {
+        struct Slot {
+            IUnknown* id;       // nullptr if the slot is empty
+            size_t pos;         // Position of the entry in m_entries
+        };
+
+        std::vector<Slot> m_slots;
+        size_t m_mask = 0;
+
+        static size_t InternalHash(IUnknown* id) noexcept
+        {
+            size_t h = reinterpret_cast<size_t>(id);
+            h ^= h >> 16;
+            h *= 0x45D9F3B;
+            return h ^ (h >> 16);
+        }
+
+        // The slot for id, or the empty slot where id would be inserted
+        size_t InternalProbe(IUnknown* id) const noexcept
+        {
+            size_t i = InternalHash(id) & m_mask;
+            while (m_slots[i].id && m_slots[i].id != id) i = (i + 1) & m_mask;
+            return i;
+        }
+
+        // Empties slot i, moving later slots in its probe sequence back
+        void InternalRemoveSlot(size_t i) noexcept
+        {
+            size_t j = i;
+            for (;;)
+            {
+                j = (j + 1) & m_mask;
+                if (!m_slots[j].id) break;
+
+                // The slot at j moves back unless its home is in (i, j]
+                size_t home = InternalHash(m_slots[j].id) & m_mask;
+                if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+                m_slots[i] = m_slots[j];
+                i = j;
+            }
+
+            m_slots[i].id = nullptr;
+        }
+
+        // Makes room for one more entry, keeping the table at most half full
+        void InternalGrow()
+        {
+            if ((m_entries.size() + 1) * 2 <= m_slots.size()) return;
+
+            std::vector<Slot> slots((std::max)(m_slots.size() * 2, size_t(16)), Slot{ nullptr, 0 });
+            m_slots.swap(slots);
+            m_mask = m_slots.size() - 1;
+            for (size_t pos = 0; pos < m_entries.size(); ++pos)
+            {
+                m_slots[InternalProbe(m_entries[pos].id)] = { m_entries[pos].id, pos };
+            }
+        }
+
+    protected:
+        std::vector<Entry> m_entries;
+
+        // The slot for the object p belongs to, or m_slots.size()
+        size_t InternalFind(IUnknown* p) const noexcept
+        {
+            if (!p || m_slots.empty()) return m_slots.size();
+
+            size_t i = InternalProbe(p);
+            if (m_slots[i].id) return i;
+
+            IUnknown* id = IdentityOf(p);
+            if (!id || id == p) return m_slots.size();
+
+            i = InternalProbe(id);
+            return m_slots[i].id ? i : m_slots.size();
+        }
+
+        Entry const* InternalEntry(IUnknown* p) const noexcept
+        {
+            size_t i = InternalFind(p);
+            return i < m_slots.size() ? &m_entries[m_slots[i].pos] : nullptr;
+        }
+
+        // Inserts the entry that make(id) returns for p, unless the object
+        // is already in the table. Returns S_OK, S_FALSE if the object is
+        // already in the table, or E_NOINTERFACE if the identity query
+        // fails. May throw.
+        template<typename Make>
+        HRESULT InternalInsert(T* p, Make&& make)
+        {
+            if (!m_slots.empty() && m_slots[InternalProbe(p)].id) return S_FALSE;
+
+            IUnknown* id = IdentityOf(p);
+            if (!id) return E_NOINTERFACE;
+
+            InternalGrow();
+            size_t i = InternalProbe(id);
+            if (m_slots[i].id) return S_FALSE;
+
+            m_entries.push_back(make(id));
+            m_slots[i] = { id, m_entries.size() - 1 };
+            p->AddRef();
+            return S_OK;
+        }
+
+        // Inserts count items, where ptr(i) is the pointer for item i and
+        // make(i, id) returns its entry
+        template<typename Ptr, typename Make>
+        HRESULT InternalInsert(size_t count, size_t* inserted, Ptr&& ptr, Make&& make) noexcept
+        {
+            if (inserted) *inserted = 0;
+
+            try
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    T* p = ptr(i);
+                    if (!p) continue;
+
+                    HRESULT hr = InternalInsert(p, [&](IUnknown* id) { return make(i, id); });
+                    if (hr == S_OK && inserted) ++*inserted;
+                }
+
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Removes the entry in slot i and returns its pointer, which the
+        // caller must release
+        T* InternalErase(size_t i) noexcept
+        {
+            size_t pos = m_slots[i].pos;
+            T* ptr = m_entries[pos].ptr;
+            InternalRemoveSlot(i);
+
+            if (pos + 1 < m_entries.size())
+            {
+                m_entries[pos] = std::move(m_entries.back());
+                m_slots[InternalProbe(m_entries[pos].id)].pos = pos;
+            }
+
+            m_entries.pop_back();
+            return ptr;
+        }
+
+    public:
+        IdentityTable() noexcept = default;
+
+        ~IdentityTable() noexcept
+        {
+            Clear();
+        }
+
+        IdentityTable(IdentityTable const&) = delete;
+        IdentityTable& operator=(IdentityTable const&) = delete;
+
+        size_t Size() const noexcept { return m_entries.size(); }
+
+        bool Empty() const noexcept { return m_entries.empty(); }
+
+        Entry const* begin() const noexcept { return m_entries.data(); }
+        Entry const* end() const noexcept { return m_entries.data() + m_entries.size(); }
+
+        bool Contains(IUnknown* p) const noexcept
+        {
+            return InternalFind(p) < m_slots.size();
+        }
+
+        template<typename U>
+        bool Contains(IPtr<U> const& p) const noexcept
+        {
+            return Contains(static_cast<IUnknown*>(get(p)));
+        }
+
+        // Returns S_OK, or S_FALSE if the object is not in the table
+        HRESULT Erase(IUnknown* p) noexcept
+        {
+            size_t i = InternalFind(p);
+            if (i == m_slots.size()) return S_FALSE;
+            InternalErase(i)->Release();
+            return S_OK;
+        }
+
+        template<typename U>
+        HRESULT Erase(IPtr<U> const* items, size_t count, size_t* erased = nullptr) noexcept
+        {
+            if (erased) *erased = 0;
+            if (!items && count) return E_POINTER;
+
+            try
+            {
+                std::vector<T*> released;
+                released.reserve((std::min)(count, m_entries.size()));
+                for (size_t i = 0; i < count; ++i)
+                {
+                    size_t slot = InternalFind(get(items[i]));
+                    if (slot < m_slots.size()) released.push_back(InternalErase(slot));
+                }
+
+                for (auto ptr : released) ptr->Release();
+                if (erased) *erased = released.size();
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        void Clear() noexcept
+        {
+            std::vector<Entry> old;
+            old.swap(m_entries);
+            for (auto& slot : m_slots) slot.id = nullptr;
+            for (auto& entry : old) entry.ptr->Release();
+        }
+    };
+
+    // Entry of an IdentitySet
+    template<typename T>
+    struct IdentityEntry {
+        IUnknown* id;
+        T* ptr;         // Holds a reference
+    };
+
+    // IdentitySet: Set of interface pointers with at most one per object
+    template<typename T>
+    class IdentitySet : public IdentityTable<T, IdentityEntry<T>> {
+        using Entry = IdentityEntry<T>;
+
+    public:
+        // Returns S_OK, S_FALSE if the object is already in the set,
+        // E_POINTER if p is empty, or E_NOINTERFACE if the identity query
+        // fails
+        HRESULT Insert(IPtr<T> const& p) noexcept
+        {
+            if (!p) return E_POINTER;
+
+            try
+            {
+                return this->InternalInsert(get(p), [&p](IUnknown* id) { return Entry{ id, get(p) }; });
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Inserts count pointers, skipping empty pointers and objects
+        // already in the set
+        HRESULT Insert(IPtr<T> const* items, size_t count, size_t* inserted = nullptr) noexcept
+        {
+            if (inserted) *inserted = 0;
+            if (!items && count) return E_POINTER;
+
+            return this->InternalInsert(count, inserted,
+                [items](size_t i) { return get(items[i]); },
+                [items](size_t i, IUnknown* id) { return Entry{ id, get(items[i]) }; });
+        }
+    };
+
+    // Entry of an IdentityMap
+    template<typename T, typename V>
+    struct IdentityMapEntry {
+        IUnknown* id;
+        T* ptr;         // Holds a reference
+        V value;
+    };
+
+    // IdentityMap: Map from objects, each represented by one interface
+    // pointer, to values of type V
+    template<typename T, typename V>
+    class IdentityMap : public IdentityTable<T, IdentityMapEntry<T, V>> {
+        using Entry = IdentityMapEntry<T, V>;
+
+    public:
+        // Returns S_OK, S_FALSE if the object is already in the map (the
+        // value is not changed), E_POINTER if p is empty, or E_NOINTERFACE
+        // if the identity query fails
+        HRESULT Insert(IPtr<T> const& p, V value) noexcept
+        {
+            if (!p) return E_POINTER;
+
+            try
+            {
+                return this->InternalInsert(get(p), [&](IUnknown* id) { return Entry{ id, get(p), std::move(value) }; });
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Inserts count pointers and values, skipping empty pointers and
+        // objects already in the map
+        HRESULT Insert(std::pair<IPtr<T>, V> const* items, size_t count, size_t* inserted = nullptr) noexcept
+        {
+            if (inserted) *inserted = 0;
+            if (!items && count) return E_POINTER;
+
+            return this->InternalInsert(count, inserted,
+                [items](size_t i) { return get(items[i].first); },
+                [items](size_t i, IUnknown* id) { return Entry{ id, get(items[i].first), items[i].second }; });
+        }
+
+        // The value for the object p belongs to, or nullptr
+        V* Find(IUnknown* p) noexcept
+        {
+            return const_cast<V*>(std::as_const(*this).Find(p));
+        }
+
+        V const* Find(IUnknown* p) const noexcept
+        {
+            auto entry = this->InternalEntry(p);
+            return entry ? &entry->value : nullptr;
+        }
+
+        template<typename U>
+        V* Find(IPtr<U> const& p) noexcept
+        {
+            return Find(static_cast<IUnknown*>(get(p)));
+        }
+    };
+}
+
+namespace std {
+
+    // Hashes an IdentityPtr by identity
+    template<typename T>
+    struct hash<ComTools::IdentityPtr<T>> {
+        size_t operator()(ComTools::IdentityPtr<T> const& p) const noexcept
+        {
+            return hash<IUnknown*>()(p.Id());
+        }
+    };
+}
+
+#endif  // IDENTITY_H
+
+///////////////////////////////////////////////////////////////////////////////
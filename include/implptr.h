@@ -0,0 +1,304 @@
+// implptr.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::ImplPtr: Smart pointer to a COM object of a known final class
+//
+// ComTools::ImplPtr is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef IMPLPTR_H
+#define IMPLPTR_H
+
+#include <Windows.h>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include "iptr.h"
+
+namespace ComTools {
+
+    // Reference counting policies for ImplPtr. Each provides:
+    //
+    //     template<typename Impl> static void AddRef(Impl* p) noexcept;
+    //     template<typename Impl> static void Release(Impl* p) noexcept;
+
+    // AtomicRefs: Calls the class's own AddRef() and Release() directly,
+    // so the compiler can inline them
+    struct AtomicRefs {
+        template<typename Impl>
+        static void AddRef(Impl* p) noexcept
+        {
+            p->Impl::AddRef();
+        }
+
+        template<typename Impl>
+        static void Release(Impl* p) noexcept
+        {
+            p->Impl::Release();
+        }
+    };
+
+    // UnsyncRefs: Counts without interlocked instructions. Only for objects
+    // that are never used by more than one thread. Impl derives from
+    // Object or PooledObject (comobject.h).
+    struct UnsyncRefs {
+        template<typename Impl>
+        static void AddRef(Impl* p) noexcept
+        {
+            p->AddRefUnsync();
+        }
+
+        template<typename Impl>
+        static void Release(Impl* p) noexcept
+        {
+            p->ReleaseUnsync();
+        }
+    };
+
+    // TracedRefs: Counts the calls made through Policy for each class and
+    // passes them to IPTR_TRACE
+    template<typename Policy = AtomicRefs>
+    struct TracedRefs {
+        template<typename Impl>
+        static inline std::atomic<size_t> addrefs = 0;
+
+        template<typename Impl>
+        static inline std::atomic<size_t> releases = 0;
+
+        template<typename Impl>
+        static void AddRef(Impl* p) noexcept
+        {
+            IPTR_TRACE("ImplPtr: AddRef");
+            addrefs<Impl>.fetch_add(1, std::memory_order_relaxed);
+            Policy::AddRef(p);
+        }
+
+        template<typename Impl>
+        static void Release(Impl* p) noexcept
+        {
+            IPTR_TRACE("ImplPtr: Release");
+            releases<Impl>.fetch_add(1, std::memory_order_relaxed);
+            Policy::Release(p);
+        }
+    };
+
+    // ImplPtr: Smart pointer to an object of the final class Impl. IPtr
+    // reaches AddRef() and Release() through the interface's vtable, which
+    // the compiler cannot see through; ImplPtr calls them on Impl itself,
+    // through Policy, so they can be inlined.
+    //
+    // ImplPtr converts to and from IPtr: moving transfers the reference
+    // without AddRef() or Release(), and copying adds one. An IPtr that is
+    // converted to an ImplPtr must point to an Impl; the conversion is a
+    // static_cast and is not checked.
+    template<typename Impl, typename Policy = AtomicRefs>
+    class ImplPtr {
+        static_assert(std::is_final_v<Impl>, "ImplPtr requires a final class");
+
+        template<typename U, typename P>
+        friend class ImplPtr;
+
+        Impl* m_ptr = nullptr;
+
+        void InternalAddRef() const noexcept
+        {
+            if (m_ptr) Policy::AddRef(m_ptr);
+        }
+
+        void InternalRelease() noexcept
+        {
+            Impl* temp = m_ptr;
+            if (temp)
+            {
+                m_ptr = nullptr;
+                Policy::Release(temp);
+            }
+        }
+
+    public:
+        ImplPtr() noexcept = default;
+
+        ImplPtr(ImplPtr const& other) noexcept : m_ptr(other.m_ptr)
+        {
+            InternalAddRef();
+        }
+
+        ImplPtr(ImplPtr&& other) noexcept : m_ptr(other.m_ptr)
+        {
+            other.m_ptr = nullptr;
+        }
+
+        // The policies use the same count, so pointers with different
+        // policies convert to each other
+        template<typename P>
+        explicit ImplPtr(ImplPtr<Impl, P> const& other) noexcept : m_ptr(other.m_ptr)
+        {
+            InternalAddRef();
+        }
+
+        template<typename P>
+        explicit ImplPtr(ImplPtr<Impl, P>&& other) noexcept : m_ptr(other.m_ptr)
+        {
+            other.m_ptr = nullptr;
+        }
+
+        template<typename T>
+        explicit ImplPtr(IPtr<T> const& other) noexcept : m_ptr(static_cast<Impl*>(get(other)))
+        {
+            InternalAddRef();
+        }
+
+        template<typename T>
+        explicit ImplPtr(IPtr<T>&& other) noexcept : m_ptr(static_cast<Impl*>(detach(other))) { }
+
+        ~ImplPtr() noexcept
+        {
+            InternalRelease();
+        }
+
+        ImplPtr& operator=(ImplPtr const& other) noexcept
+        {
+            if (m_ptr != other.m_ptr)
+            {
+                ImplPtr temp(other);
+                swap(*this, temp);
+            }
+
+            return *this;
+        }
+
+        ImplPtr& operator=(ImplPtr&& other) noexcept
+        {
+            if (this != &other)
+            {
+                InternalRelease();
+                m_ptr = other.m_ptr;
+                other.m_ptr = nullptr;
+            }
+
+            return *this;
+        }
+
+        ImplPtr& operator=(std::nullptr_t) noexcept
+        {
+            InternalRelease();
+            return *this;
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return m_ptr != nullptr;
+        }
+
+        Impl* operator->() const noexcept
+        {
+            return m_ptr;
+        }
+
+        Impl& operator*() const noexcept
+        {
+            return *m_ptr;
+        }
+
+        friend Impl* get(ImplPtr const& obj) noexcept
+        {
+            return obj.m_ptr;
+        }
+
+        friend Impl** set(ImplPtr& obj) noexcept
+        {
+            if (obj) obj = nullptr;
+            return &obj.m_ptr;
+        }
+
+        friend void attach(ImplPtr& obj, Impl* p) noexcept
+        {
+            obj.InternalRelease();
+            obj.m_ptr = p;
+        }
+
+        friend Impl* detach(ImplPtr& obj) noexcept
+        {
+            Impl* temp = obj.m_ptr;
+            obj.m_ptr = nullptr;
+            return temp;
+        }
+
+        friend void swap(ImplPtr& left, ImplPtr& right) noexcept
+        {
+            Impl* temp = left.m_ptr;
+            left.m_ptr = right.m_ptr;
+            right.m_ptr = temp;
+        }
+
+        // Creates an Impl from args (see Object::CreateImpl)
+        template<typename... Args>
+        static HRESULT Create(ImplPtr* pp, Args&&... args) noexcept
+        {
+            if (!pp) return E_POINTER;
+            return Impl::CreateImpl(set(*pp), std::forward<Args>(args)...);
+        }
+
+        // Returns the object as its interface T, which Impl implements. The
+        // rvalue form moves the reference into the IPtr.
+        template<typename T>
+        IPtr<T> As() const& noexcept
+        {
+            IPtr<T> temp;
+            InternalAddRef();
+            attach(temp, static_cast<T*>(m_ptr));
+            return temp;
+        }
+
+        template<typename T>
+        IPtr<T> As() && noexcept
+        {
+            IPtr<T> temp;
+            attach(temp, static_cast<T*>(m_ptr));
+            m_ptr = nullptr;
+            return temp;
+        }
+    };
+
+    template<typename Impl, typename P, typename Q>
+    bool operator==(ImplPtr<Impl, P> const& left, ImplPtr<Impl, Q> const& right) noexcept
+    {
+        return get(left) == get(right);
+    }
+
+    template<typename Impl, typename P, typename Q>
+    bool operator!=(ImplPtr<Impl, P> const& left, ImplPtr<Impl, Q> const& right) noexcept
+    {
+        return !(left == right);
+    }
+
+    template<typename Impl, typename P, typename Q>
+    bool operator<(ImplPtr<Impl, P> const& left, ImplPtr<Impl, Q> const& right) noexcept
+    {
+        return get(left) < get(right);
+    }
+}
+
+#endif  // IMPLPTR_H
+
+///////////////////////////////////////////////////////////////////////////////
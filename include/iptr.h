@@ -31,14 +31,25 @@
 //
 
 #ifndef IPTR_H
+#ifdef COMTOOLS_CALLTRACE
+#include "calltrace.h"
+#endif
 #define IPTR_H
 
 #include <Windows.h>
+#include <tuple>
+#include <utility>
 
 #ifndef IPTR_TRACE
 #define IPTR_TRACE(s) ((void)0)
 #endif
 
+// Recording hook for calltrace.h, which defining COMTOOLS_CALLTRACE for the
+// whole program turns on
+#ifndef COMTOOLS_RECORD
+#define COMTOOLS_RECORD(op, T, object, size) ((void)0)
+#endif
+
 namespace ComTools {
     // This class hides AddRef() and Release()
     template<typename T>
@@ -59,7 +70,11 @@ namespace ComTools {
 
         void InternalAddRef() const noexcept
         {
-            if (m_ptr) m_ptr->AddRef();
+            if (m_ptr)
+            {
+                COMTOOLS_RECORD(IPtrAddRef, T, m_ptr, 0);
+                m_ptr->AddRef();
+            }
         }
 
         void InternalRelease() noexcept
@@ -68,6 +83,7 @@ namespace ComTools {
             if (temp)
             {
                 m_ptr = nullptr;
+                COMTOOLS_RECORD(IPtrRelease, T, temp, 0);
                 temp->Release();
             }
         }
@@ -90,9 +106,40 @@ namespace ComTools {
                 InternalRelease();
                 m_ptr = other.m_ptr;
                 other.m_ptr = nullptr;
+                if (m_ptr) COMTOOLS_RECORD(IPtrMove, T, m_ptr, 0);
             }
         }
 
+        template<typename U>
+        static void InternalRecordQuery(IPtr<U> const& p) noexcept
+        {
+            if (p.m_ptr) COMTOOLS_RECORD(IPtrQuery, U, p.m_ptr, 0);
+        }
+
+        template<typename Tuple, size_t... I, typename... Iids>
+        void InternalAsMany(Tuple& temp, std::index_sequence<I...>, Iids const&... riids) const noexcept
+        {
+            IMultiQI* multi = nullptr;
+            if (sizeof...(I) > 1 &&
+                SUCCEEDED(m_ptr->QueryInterface(IID_IMultiQI, reinterpret_cast<void**>(&multi))))
+            {
+                MULTI_QI mqi[] = { { &riids, nullptr, E_NOINTERFACE }... };
+                HRESULT hr = multi->QueryMultipleInterfaces(static_cast<ULONG>(sizeof...(I)), mqi);
+                multi->Release();
+
+                // E_NOINTERFACE answers every entry; other failures, such as
+                // a lost connection, leave the entries unanswered
+                if (SUCCEEDED(hr) || hr == E_NOINTERFACE)
+                {
+                    (attach(std::get<I>(temp), SUCCEEDED(mqi[I].hr) ?
+                        reinterpret_cast<decltype(get(std::get<I>(temp)))>(mqi[I].pItf) : nullptr), ...);
+                    return;
+                }
+            }
+
+            (m_ptr->QueryInterface(riids, reinterpret_cast<void**>(set(std::get<I>(temp)))), ...);
+        }
+
     public:
         IPtr() noexcept = default;
 
@@ -114,6 +161,7 @@ namespace ComTools {
         {
             IPTR_TRACE("IPtr: Move constructor");
             other.m_ptr = nullptr;
+            if (m_ptr) COMTOOLS_RECORD(IPtrMove, T, m_ptr, 0);
         }
 
         ~IPtr() noexcept
@@ -200,6 +248,24 @@ namespace ComTools {
             m_ptr->QueryInterface(
                 riid,
                 reinterpret_cast<void**>(set(temp)));
+            InternalRecordQuery(temp);
+            return temp;
+        }
+
+        // Queries for the interfaces Us, whose IIDs are riids, in the same
+        // order. If the object implements IMultiQI, as COM proxies do, all
+        // of the interfaces are requested with one QueryMultipleInterfaces()
+        // call, which is one round trip instead of one per interface.
+        // Otherwise, or if that call fails, each interface is requested with
+        // QueryInterface(). The IPtr for an interface that the object does
+        // not implement is empty.
+        template<typename... Us, typename... Iids>
+        std::tuple<IPtr<Us>...> AsMany(Iids const&... riids) const noexcept
+        {
+            static_assert(sizeof...(Us) == sizeof...(Iids), "AsMany() takes one IID per interface");
+            std::tuple<IPtr<Us>...> temp;
+            if (m_ptr) InternalAsMany(temp, std::index_sequence_for<Us...>(), riids...);
+            std::apply([](auto const&... p) { (InternalRecordQuery(p), ...); }, temp);
             return temp;
         }
 
@@ -0,0 +1,351 @@
+// mmstream.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::MappedStream: Read-only IStream backed by a memory-mapped file
+//
+// ComTools::MappedStream is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef MMSTREAM_H
+#define MMSTREAM_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <string>
+#include "comobject.h"
+
+namespace ComTools {
+
+    // IMappedView: Direct access to the data behind a MappedStream. The
+    // pointers remain valid while any reference to the stream (or to one of
+    // its clones) is held.
+    struct IMappedView : public IUnknown {
+        // Returns the entire mapping
+        STDMETHOD(GetView)(BYTE const** ppData, ULONGLONG* pcb) PURE;
+
+        // Returns up to cb bytes at the current position without copying
+        // and advances the position past them
+        STDMETHOD(ReadView)(ULONG cb, BYTE const** ppData, ULONG* pcbRead) PURE;
+    };
+
+    // {8796BDB4-72CB-429C-BE1C-609CBB74C3D7}
+    inline constexpr IID IID_IMappedView =
+    { 0x8796bdb4, 0x72cb, 0x429c, { 0xbe, 0x1c, 0x60, 0x9c, 0xbb, 0x74, 0xc3, 0xd7 } };
+
+    // FileMapping: Read-only view of an entire file. The view is shared by
+    // a stream and its clones through std::shared_ptr.
+    class FileMapping {
+        BYTE const* m_data = nullptr;
+        ULONGLONG m_size = 0;
+        FILETIME m_ctime = { };
+        FILETIME m_atime = { };
+        FILETIME m_mtime = { };
+        std::wstring m_name;
+
+        FileMapping() = default;
+
+    public:
+        ~FileMapping() noexcept
+        {
+            if (m_data) UnmapViewOfFile(m_data);
+        }
+
+        FileMapping(FileMapping const&) = delete;
+        FileMapping& operator=(FileMapping const&) = delete;
+
+        BYTE const* data() const noexcept { return m_data; }
+        ULONGLONG size() const noexcept { return m_size; }
+        std::wstring const& name() const noexcept { return m_name; }
+        FILETIME const& ctime() const noexcept { return m_ctime; }
+        FILETIME const& atime() const noexcept { return m_atime; }
+        FILETIME const& mtime() const noexcept { return m_mtime; }
+
+        // Maps the file at path. An empty file has no view.
+        static HRESULT Open(
+            wchar_t const* path,
+            std::shared_ptr<FileMapping const>* ppMapping) noexcept
+        {
+            if (!ppMapping) return E_POINTER;
+            ppMapping->reset();
+            if (!path) return E_INVALIDARG;
+
+            std::shared_ptr<FileMapping> mapping;
+            try
+            {
+                mapping.reset(new FileMapping);
+                mapping->m_name = path;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ,
+                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (hFile == INVALID_HANDLE_VALUE)
+            {
+                return HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            HRESULT hr = S_OK;
+            LARGE_INTEGER size = { };
+            if (!GetFileSizeEx(hFile, &size) ||
+                !GetFileTime(hFile, &mapping->m_ctime, &mapping->m_atime, &mapping->m_mtime))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else if (size.QuadPart > 0)
+            {
+                // The view keeps the mapping object alive after its handle
+                // is closed
+                HANDLE hMap = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                if (!hMap)
+                {
+                    hr = HRESULT_FROM_WIN32(GetLastError());
+                }
+                else
+                {
+                    mapping->m_data = static_cast<BYTE const*>(
+                        MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0));
+                    if (!mapping->m_data) hr = HRESULT_FROM_WIN32(GetLastError());
+                    else mapping->m_size = static_cast<ULONGLONG>(size.QuadPart);
+                    CloseHandle(hMap);
+                }
+            }
+
+            CloseHandle(hFile);
+            if (SUCCEEDED(hr)) *ppMapping = std::move(mapping);
+            return hr;
+        }
+    };
+
+    // MappedStream: IStream over a FileMapping. Reads, seeks, and clones do
+    // not touch the file system. The stream is read-only: Write and SetSize
+    // fail with STG_E_ACCESSDENIED.
+    class MappedStream final : public Object<MappedStream, IStream, IMappedView> {
+        std::shared_ptr<FileMapping const> m_map;
+        ULONGLONG m_pos = 0;
+
+        // Number of bytes available at the current position, at most cb
+        ULONGLONG InternalAvailable(ULONGLONG cb) const noexcept
+        {
+            return m_pos < m_map->size() ? (std::min)(cb, m_map->size() - m_pos) : 0;
+        }
+
+    public:
+        MappedStream(std::shared_ptr<FileMapping const> map, ULONGLONG pos = 0) noexcept
+            : m_map(std::move(map)), m_pos(pos) { }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            if (riid == IID_IStream || riid == IID_ISequentialStream)
+            {
+                return static_cast<IStream*>(this);
+            }
+
+            if (riid == IID_IMappedView) return static_cast<IMappedView*>(this);
+            return nullptr;
+        }
+
+        // ISequentialStream
+
+        STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) noexcept override
+        {
+            if (pcbRead) *pcbRead = 0;
+            if (!pv && cb) return STG_E_INVALIDPOINTER;
+
+            auto n = static_cast<ULONG>(InternalAvailable(cb));
+            if (n) std::memcpy(pv, m_map->data() + m_pos, n);
+            m_pos += n;
+            if (pcbRead) *pcbRead = n;
+            return S_OK;
+        }
+
+        STDMETHODIMP Write(void const*, ULONG, ULONG* pcbWritten) noexcept override
+        {
+            if (pcbWritten) *pcbWritten = 0;
+            return STG_E_ACCESSDENIED;
+        }
+
+        // IStream
+
+        STDMETHODIMP Seek(
+            LARGE_INTEGER dlibMove,
+            DWORD dwOrigin,
+            ULARGE_INTEGER* plibNewPosition) noexcept override
+        {
+            LONGLONG base = 0;
+            switch (dwOrigin)
+            {
+            case STREAM_SEEK_SET: base = 0; break;
+            case STREAM_SEEK_CUR: base = static_cast<LONGLONG>(m_pos); break;
+            case STREAM_SEEK_END: base = static_cast<LONGLONG>(m_map->size()); break;
+            default: return STG_E_INVALIDFUNCTION;
+            }
+
+            // Seeking past the end is allowed; reads there return no data
+            LONGLONG pos = base + dlibMove.QuadPart;
+            if (pos < 0) return STG_E_INVALIDFUNCTION;
+
+            m_pos = static_cast<ULONGLONG>(pos);
+            if (plibNewPosition) plibNewPosition->QuadPart = m_pos;
+            return S_OK;
+        }
+
+        STDMETHODIMP SetSize(ULARGE_INTEGER) noexcept override
+        {
+            return STG_E_ACCESSDENIED;
+        }
+
+        STDMETHODIMP CopyTo(
+            IStream* pstm,
+            ULARGE_INTEGER cb,
+            ULARGE_INTEGER* pcbRead,
+            ULARGE_INTEGER* pcbWritten) noexcept override
+        {
+            if (pcbRead) pcbRead->QuadPart = 0;
+            if (pcbWritten) pcbWritten->QuadPart = 0;
+            if (!pstm) return STG_E_INVALIDPOINTER;
+
+            // Write directly from the mapping in chunks that fit in a ULONG
+            ULONGLONG const chunk = 0x40000000;
+            ULONGLONG remaining = InternalAvailable(cb.QuadPart);
+            ULONGLONG read = 0;
+            ULONGLONG written = 0;
+            HRESULT hr = S_OK;
+            while (remaining)
+            {
+                auto n = static_cast<ULONG>((std::min)(remaining, chunk));
+                ULONG cbWritten = 0;
+                hr = pstm->Write(m_map->data() + m_pos, n, &cbWritten);
+                m_pos += n;
+                read += n;
+                written += cbWritten;
+                remaining -= n;
+                if (FAILED(hr)) break;
+            }
+
+            if (pcbRead) pcbRead->QuadPart = read;
+            if (pcbWritten) pcbWritten->QuadPart = written;
+            return hr;
+        }
+
+        STDMETHODIMP Commit(DWORD) noexcept override
+        {
+            return S_OK;
+        }
+
+        STDMETHODIMP Revert() noexcept override
+        {
+            return S_OK;
+        }
+
+        STDMETHODIMP LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) noexcept override
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        STDMETHODIMP UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) noexcept override
+        {
+            return STG_E_INVALIDFUNCTION;
+        }
+
+        STDMETHODIMP Stat(STATSTG* pstatstg, DWORD grfStatFlag) noexcept override
+        {
+            if (!pstatstg) return STG_E_INVALIDPOINTER;
+            std::memset(pstatstg, 0, sizeof(STATSTG));
+
+            if (!(grfStatFlag & STATFLAG_NONAME))
+            {
+                auto const& name = m_map->name();
+                size_t const cb = (name.size() + 1) * sizeof(wchar_t);
+                pstatstg->pwcsName = static_cast<LPOLESTR>(CoTaskMemAlloc(cb));
+                if (!pstatstg->pwcsName) return E_OUTOFMEMORY;
+                std::memcpy(pstatstg->pwcsName, name.c_str(), cb);
+            }
+
+            pstatstg->type = STGTY_STREAM;
+            pstatstg->cbSize.QuadPart = m_map->size();
+            pstatstg->mtime = m_map->mtime();
+            pstatstg->ctime = m_map->ctime();
+            pstatstg->atime = m_map->atime();
+            pstatstg->grfMode = STGM_READ | STGM_SHARE_DENY_WRITE;
+            return S_OK;
+        }
+
+        STDMETHODIMP Clone(IStream** ppstm) noexcept override
+        {
+            return Create(IID_IStream, reinterpret_cast<void**>(ppstm), m_map, m_pos);
+        }
+
+        // IMappedView
+
+        STDMETHODIMP GetView(BYTE const** ppData, ULONGLONG* pcb) noexcept override
+        {
+            if (!ppData || !pcb) return E_POINTER;
+            *ppData = m_map->data();
+            *pcb = m_map->size();
+            return S_OK;
+        }
+
+        STDMETHODIMP ReadView(ULONG cb, BYTE const** ppData, ULONG* pcbRead) noexcept override
+        {
+            if (!ppData || !pcbRead) return E_POINTER;
+            auto n = static_cast<ULONG>(InternalAvailable(cb));
+            *ppData = n ? m_map->data() + m_pos : nullptr;
+            *pcbRead = n;
+            m_pos += n;
+            return S_OK;
+        }
+    };
+
+    // Opens a MappedStream over the file at path
+    inline HRESULT CreateMappedStream(wchar_t const* path, IStream** ppstm) noexcept
+    {
+        if (!ppstm) return E_POINTER;
+        *ppstm = nullptr;
+
+        std::shared_ptr<FileMapping const> mapping;
+        HRESULT hr = FileMapping::Open(path, &mapping);
+        if (FAILED(hr)) return hr;
+
+        return MappedStream::Create(IID_IStream, reinterpret_cast<void**>(ppstm),
+            std::move(mapping));
+    }
+
+    // Returns the entire mapping behind an IMappedView as a span
+    inline std::span<BYTE const> to_span(IMappedView* p) noexcept
+    {
+        BYTE const* data = nullptr;
+        ULONGLONG cb = 0;
+        if (!p || FAILED(p->GetView(&data, &cb)) || !data) return { };
+        return { data, static_cast<size_t>(cb) };
+    }
+}
+
+#endif  // MMSTREAM_H
+
+///////////////////////////////////////////////////////////////////////////////
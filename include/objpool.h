@@ -0,0 +1,254 @@
+// objpool.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::PooledObject: Object that is recycled instead of deleted
+//
+// ComTools::PooledObject is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef OBJPOOL_H
+#define OBJPOOL_H
+
+#include <Windows.h>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include "comobject.h"
+
+namespace ComTools {
+
+    // PoolStats: Pool activity on one thread
+    struct PoolStats {
+        size_t allocated = 0;   // Creations that allocated a new object
+        size_t reused = 0;      // Creations that reused a pooled object
+        size_t recycled = 0;    // Final releases that pooled the object
+        size_t freed = 0;       // Final releases that deleted the object
+    };
+
+    // PooledObject: Object whose final Release() keeps the object for reuse
+    // instead of deleting it. Use it in place of Object:
+    //
+    //     class CRow final : public PooledObject<CRow, IRow> { ... };
+    //
+    // Derived may provide these hooks, which hide the defaults here:
+    //
+    //     void Recycle() noexcept;     // Called by the final Release()
+    //     void Reset(Args...);         // Called when Create(riid, ppv,
+    //                                  // args...) reuses the object
+    //
+    // Recycle() should release interface pointers and other resources that
+    // must not be held by an idle object; containers can keep their
+    // capacity. Reset() takes the constructor arguments and must leave the
+    // object as the constructor would.
+    //
+    // Each thread keeps up to Derived::PoolLimit objects. Objects released
+    // on a thread whose pool is full go to a pool shared by all threads
+    // (also bounded by PoolLimit), from which any thread refills its own
+    // pool when it is empty, so objects created on one thread and released
+    // on another are still reused. Objects beyond both limits are deleted.
+    template<typename Derived, typename First, typename... Rest>
+    class PooledObject : public Object<Derived, First, Rest...> {
+        friend class Object<Derived, First, Rest...>;
+
+        Derived* m_poolNext = nullptr;
+
+        struct LocalPool {
+            Derived* head = nullptr;
+            size_t count = 0;
+            PoolStats stats;
+
+            ~LocalPool() noexcept
+            {
+                t_dead = true;
+                InternalFree(head);
+            }
+        };
+
+        struct SharedPool {
+            std::atomic<Derived*> head = nullptr;
+            std::atomic<size_t> count = 0;
+
+            ~SharedPool() noexcept
+            {
+                s_dead = true;
+                InternalFree(head.exchange(nullptr));
+            }
+        };
+
+        // Set when the pools have been destroyed at thread or process exit.
+        // Later final releases delete the object.
+        static inline thread_local bool t_dead = false;
+        static inline bool s_dead = false;
+
+        static LocalPool& InternalLocal() noexcept
+        {
+            thread_local LocalPool pool;
+            return pool;
+        }
+
+        static SharedPool& InternalShared() noexcept
+        {
+            static SharedPool pool;
+            return pool;
+        }
+
+        static Derived*& InternalNext(Derived* p) noexcept
+        {
+            return static_cast<PooledObject*>(p)->m_poolNext;
+        }
+
+        static void InternalFree(Derived* p) noexcept
+        {
+            while (p)
+            {
+                Derived* next = InternalNext(p);
+                delete p;
+                p = next;
+            }
+        }
+
+        // Moves every object in the shared pool to the local pool
+        static void InternalRefill(LocalPool& local) noexcept
+        {
+            if (s_dead) return;
+
+            auto& shared = InternalShared();
+            Derived* p = shared.head.exchange(nullptr, std::memory_order_acquire);
+            if (!p) return;
+
+            size_t n = 1;
+            Derived* tail = p;
+            while (InternalNext(tail))
+            {
+                tail = InternalNext(tail);
+                ++n;
+            }
+
+            shared.count.fetch_sub(n, std::memory_order_relaxed);
+            InternalNext(tail) = local.head;
+            local.head = p;
+            local.count += n;
+        }
+
+    protected:
+        PooledObject() noexcept = default;
+        ~PooledObject() noexcept = default;
+
+        void Recycle() noexcept { }
+        void Reset() noexcept { }
+
+        template<typename... Args>
+        static Derived* Construct(Args&&... args)
+        {
+            if (t_dead) return new Derived(std::forward<Args>(args)...);
+
+            auto& local = InternalLocal();
+            if (!local.head) InternalRefill(local);
+            if (Derived* p = local.head)
+            {
+                local.head = InternalNext(p);
+                --local.count;
+                try
+                {
+                    p->Reset(std::forward<Args>(args)...);
+                }
+                catch (...)
+                {
+                    delete p;
+                    throw;
+                }
+
+                static_cast<PooledObject*>(p)->InternalRevive();
+                ++local.stats.reused;
+                return p;
+            }
+
+            auto p = new Derived(std::forward<Args>(args)...);
+            ++local.stats.allocated;
+            return p;
+        }
+
+        static void Destroy(Derived* p) noexcept
+        {
+            p->Recycle();
+            if (!t_dead)
+            {
+                auto& local = InternalLocal();
+                if (local.count < Derived::PoolLimit)
+                {
+                    InternalNext(p) = local.head;
+                    local.head = p;
+                    ++local.count;
+                    ++local.stats.recycled;
+                    return;
+                }
+
+                if (!s_dead)
+                {
+                    auto& shared = InternalShared();
+                    if (shared.count.load(std::memory_order_relaxed) < Derived::PoolLimit)
+                    {
+                        shared.count.fetch_add(1, std::memory_order_relaxed);
+                        Derived* head = shared.head.load(std::memory_order_relaxed);
+                        do
+                        {
+                            InternalNext(p) = head;
+                        } while (!shared.head.compare_exchange_weak(head, p,
+                            std::memory_order_release, std::memory_order_relaxed));
+
+                        ++local.stats.recycled;
+                        return;
+                    }
+                }
+
+                ++local.stats.freed;
+            }
+
+            delete p;
+        }
+
+    public:
+        // Maximum number of idle objects per thread, and in the shared pool
+        static constexpr size_t PoolLimit = 64;
+
+        // Pool activity on the calling thread
+        static PoolStats Stats() noexcept
+        {
+            return t_dead ? PoolStats() : InternalLocal().stats;
+        }
+
+        // Deletes the idle objects in the calling thread's pool
+        static void Trim() noexcept
+        {
+            if (t_dead) return;
+
+            auto& local = InternalLocal();
+            InternalFree(local.head);
+            local.head = nullptr;
+            local.count = 0;
+        }
+    };
+}
+
+#endif  // OBJPOOL_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,319 @@
+// ptrqueue.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::SpscQueue, MpscQueue, BoundedQueue: Queues of interface pointers
+//
+// ComTools::SpscQueue, MpscQueue, and BoundedQueue are released under the MIT
+// license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef PTRQUEUE_H
+#define PTRQUEUE_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include "iptr.h"
+
+namespace ComTools {
+
+    // The queues move interface pointers between threads without AddRef()
+    // or Release(): Push() detaches the caller's IPtr into the queue, and
+    // Pop() attaches the queued pointer to the caller's IPtr. Pointers still
+    // queued when a queue is destroyed are released.
+    //
+    // Push() returns S_OK, S_FALSE if a bounded queue is full (the caller
+    // keeps the pointer), E_POINTER for an empty IPtr, or E_OUTOFMEMORY.
+    // Pop() returns S_OK, or S_FALSE if the queue is empty. PopBatch() pops
+    // up to max pointers and returns the number popped.
+
+    // SpscQueue: Bounded queue for one producer thread and one consumer
+    // thread. The capacity is rounded up to a power of two. The producer
+    // and consumer indexes are on separate cache lines, and each side keeps
+    // a cached copy of the other's index so that it reads the shared index
+    // only when the queue appears full or empty.
+    template<typename T>
+    class SpscQueue {
+        std::unique_ptr<T*[]> m_slots;
+        size_t m_mask = 0;
+
+        alignas(64) std::atomic<size_t> m_head = 0;  // Next slot to pop
+        size_t m_tailCache = 0;
+
+        alignas(64) std::atomic<size_t> m_tail = 0;  // Next slot to push
+        size_t m_headCache = 0;
+
+    public:
+        explicit SpscQueue(size_t capacity) noexcept
+        {
+            capacity = std::bit_ceil((std::max)(capacity, size_t(2)));
+            m_slots.reset(new (std::nothrow) T*[capacity]);
+            if (m_slots) m_mask = capacity - 1;
+        }
+
+        ~SpscQueue() noexcept
+        {
+            IPtr<T> p;
+            while (Pop(p) == S_OK) p = nullptr;
+        }
+
+        SpscQueue(SpscQueue const&) = delete;
+        SpscQueue& operator=(SpscQueue const&) = delete;
+
+        explicit operator bool() const noexcept { return m_slots != nullptr; }
+
+        size_t Capacity() const noexcept { return m_slots ? m_mask + 1 : 0; }
+
+        // Called by the producer
+        HRESULT Push(IPtr<T>&& p) noexcept
+        {
+            if (!p) return E_POINTER;
+            if (!m_slots) return E_OUTOFMEMORY;
+
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_headCache > m_mask)
+            {
+                m_headCache = m_head.load(std::memory_order_acquire);
+                if (tail - m_headCache > m_mask) return S_FALSE;
+            }
+
+            m_slots[tail & m_mask] = detach(p);
+            m_tail.store(tail + 1, std::memory_order_release);
+            return S_OK;
+        }
+
+        // Called by the consumer
+        HRESULT Pop(IPtr<T>& p) noexcept
+        {
+            return PopBatch(&p, 1) ? S_OK : S_FALSE;
+        }
+
+        // Called by the consumer. Pops the pointers available now, up to
+        // max, and publishes the freed slots to the producer once.
+        size_t PopBatch(IPtr<T>* out, size_t max) noexcept
+        {
+            if (!m_slots) return 0;
+
+            size_t head = m_head.load(std::memory_order_relaxed);
+            if (m_tailCache - head < max) m_tailCache = m_tail.load(std::memory_order_acquire);
+
+            size_t n = (std::min)(m_tailCache - head, max);
+            for (size_t i = 0; i < n; ++i) attach(out[i], m_slots[(head + i) & m_mask]);
+            if (n) m_head.store(head + n, std::memory_order_release);
+            return n;
+        }
+    };
+
+    // MpscQueue: Unbounded queue for any number of producer threads and one
+    // consumer thread. Push() allocates a node and never blocks or waits for
+    // other producers. A push that has not finished when Pop() is called may
+    // not be seen by that Pop().
+    template<typename T>
+    class MpscQueue {
+        struct Node {
+            std::atomic<Node*> next = nullptr;
+            T* p = nullptr;
+        };
+
+        alignas(64) std::atomic<Node*> m_head;  // Last node pushed
+        alignas(64) Node* m_tail;               // Node before the next to pop
+        Node m_stub;
+
+    public:
+        MpscQueue() noexcept : m_head(&m_stub), m_tail(&m_stub) { }
+
+        ~MpscQueue() noexcept
+        {
+            IPtr<T> p;
+            while (Pop(p) == S_OK) p = nullptr;
+            if (m_tail != &m_stub) delete m_tail;
+        }
+
+        MpscQueue(MpscQueue const&) = delete;
+        MpscQueue& operator=(MpscQueue const&) = delete;
+
+        HRESULT Push(IPtr<T>&& p) noexcept
+        {
+            if (!p) return E_POINTER;
+
+            auto node = new (std::nothrow) Node;
+            if (!node) return E_OUTOFMEMORY;
+
+            node->p = detach(p);
+            Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+            return S_OK;
+        }
+
+        // Called by the consumer
+        HRESULT Pop(IPtr<T>& p) noexcept
+        {
+            Node* next = m_tail->next.load(std::memory_order_acquire);
+            if (!next) return S_FALSE;
+
+            // next becomes the node before the next to pop
+            attach(p, next->p);
+            next->p = nullptr;
+            if (m_tail != &m_stub) delete m_tail;
+            m_tail = next;
+            return S_OK;
+        }
+
+        // Called by the consumer
+        size_t PopBatch(IPtr<T>* out, size_t max) noexcept
+        {
+            size_t n = 0;
+            while (n < max && Pop(out[n]) == S_OK) ++n;
+            return n;
+        }
+    };
+
+    // BoundedQueue: Bounded queue for any number of producer and consumer
+    // threads. The capacity is rounded up to a power of two. Each slot has
+    // its own sequence number and occupies a cache line, so producers and
+    // consumers working on neighboring slots do not contend.
+    template<typename T>
+    class BoundedQueue {
+        struct alignas(64) Slot {
+            std::atomic<size_t> seq;
+            T* p;
+        };
+
+        std::unique_ptr<Slot[]> m_slots;
+        size_t m_mask = 0;
+
+        alignas(64) std::atomic<size_t> m_enqueue = 0;
+        alignas(64) std::atomic<size_t> m_dequeue = 0;
+
+    public:
+        explicit BoundedQueue(size_t capacity) noexcept
+        {
+            capacity = std::bit_ceil((std::max)(capacity, size_t(2)));
+            m_slots.reset(new (std::nothrow) Slot[capacity]);
+            if (!m_slots) return;
+
+            m_mask = capacity - 1;
+            for (size_t i = 0; i < capacity; ++i)
+            {
+                m_slots[i].seq.store(i, std::memory_order_relaxed);
+                m_slots[i].p = nullptr;
+            }
+        }
+
+        ~BoundedQueue() noexcept
+        {
+            IPtr<T> p;
+            while (Pop(p) == S_OK) p = nullptr;
+        }
+
+        BoundedQueue(BoundedQueue const&) = delete;
+        BoundedQueue& operator=(BoundedQueue const&) = delete;
+
+        explicit operator bool() const noexcept { return m_slots != nullptr; }
+
+        size_t Capacity() const noexcept { return m_slots ? m_mask + 1 : 0; }
+
+        HRESULT Push(IPtr<T>&& p) noexcept
+        {
+            if (!p) return E_POINTER;
+            if (!m_slots) return E_OUTOFMEMORY;
+
+            size_t pos = m_enqueue.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                auto& slot = m_slots[pos & m_mask];
+                size_t seq = slot.seq.load(std::memory_order_acquire);
+                if (seq == pos)
+                {
+                    if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        slot.p = detach(p);
+                        slot.seq.store(pos + 1, std::memory_order_release);
+                        return S_OK;
+                    }
+                }
+                else if (seq < pos)
+                {
+                    return S_FALSE;
+                }
+                else
+                {
+                    pos = m_enqueue.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        HRESULT Pop(IPtr<T>& p) noexcept
+        {
+            return PopBatch(&p, 1) ? S_OK : S_FALSE;
+        }
+
+        // Claims the run of filled slots at the head of the queue, up to
+        // max, with one compare-exchange
+        size_t PopBatch(IPtr<T>* out, size_t max) noexcept
+        {
+            if (!m_slots || !max) return 0;
+
+            size_t pos = m_dequeue.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                size_t n = 0;
+                while (n < max && n <= m_mask &&
+                    m_slots[(pos + n) & m_mask].seq.load(std::memory_order_acquire) == pos + n + 1)
+                {
+                    ++n;
+                }
+
+                if (n == 0)
+                {
+                    size_t seq = m_slots[pos & m_mask].seq.load(std::memory_order_acquire);
+                    if (seq < pos + 1) return 0;
+
+                    // Another consumer took the slot
+                    pos = m_dequeue.load(std::memory_order_relaxed);
+                    continue;
+                }
+
+                if (m_dequeue.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                {
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        auto& slot = m_slots[(pos + i) & m_mask];
+                        attach(out[i], slot.p);
+                        slot.p = nullptr;
+                        slot.seq.store(pos + i + m_mask + 1, std::memory_order_release);
+                    }
+
+                    return n;
+                }
+            }
+        }
+    };
+}
+
+#endif  // PTRQUEUE_H
+
+///////////////////////////////////////////////////////////////////////////////
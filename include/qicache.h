@@ -0,0 +1,194 @@
+// qicache.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::QICache: Cache of QueryInterface() results
+//
+// ComTools::QICache is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef QICACHE_H
+#define QICACHE_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include "iptr.h"
+
+namespace ComTools {
+
+    // QICacheStats: Cache activity
+    struct QICacheStats {
+        size_t hits = 0;        // Lookups answered from the cache
+        size_t misses = 0;      // Lookups that called QueryInterface()
+        size_t evictions = 0;   // Entries replaced by a later miss
+    };
+
+    // QICache: Cache of QueryInterface() results, keyed by the interface
+    // pointer queried and the IID. Caching is opt-in: use a cache in place
+    // of As() on hot paths that query the same objects for the same
+    // interfaces. A cache is not thread safe. There is no cache per thread,
+    // because one destroyed at thread exit would release its objects after
+    // the thread called CoUninitialize(); give each cache a scope that ends
+    // before that.
+    //
+    // Each entry holds a reference to the pointer queried and to the result,
+    // so a pointer in the cache cannot be destroyed and its address reused
+    // by another object, and an entry never refers to a destroyed object.
+    // QueryInterface() results for a given pointer and IID do not change,
+    // so E_NOINTERFACE results are cached too.
+    //
+    // Borrow() returns the cached result without AddRef(). The borrowed
+    // pointer is valid until its entry is evicted by Evict(), Clear(), or a
+    // later miss that maps to the same entry; for objects that do not use
+    // tear-off interfaces, it is valid while the caller holds a reference
+    // to the object. As() returns an IPtr that holds its own reference.
+    //
+    // The cache is direct mapped: capacity is rounded up to a power of two,
+    // and a miss replaces the entry in its slot. Objects held by the cache
+    // are released when they are evicted, so call Clear() before releasing
+    // the last references that the program expects to destroy an object,
+    // and before CoUninitialize().
+    class QICache {
+        struct Entry {
+            IUnknown* source;   // Pointer queried (holds a reference)
+            IID iid;
+            IUnknown* result;   // Result (holds a reference) or nullptr
+            HRESULT hr;
+        };
+
+        std::unique_ptr<Entry[]> m_entries;
+        size_t m_mask = 0;
+        QICacheStats m_stats;
+
+        size_t InternalSlot(IUnknown* p, REFIID riid) const noexcept
+        {
+            size_t h = reinterpret_cast<size_t>(p) >> 4;
+            h ^= riid.Data1 ^ (static_cast<size_t>(riid.Data2) << 7) ^ (static_cast<size_t>(riid.Data3) << 13);
+            h *= 0x9E3779B9u;
+            return (h ^ (h >> 15)) & m_mask;
+        }
+
+        static void InternalRelease(Entry& entry) noexcept
+        {
+            IUnknown* source = entry.source;
+            IUnknown* result = entry.result;
+            entry.source = nullptr;
+            entry.result = nullptr;
+            if (result) result->Release();
+            if (source) source->Release();
+        }
+
+    public:
+        explicit QICache(size_t capacity = 256) noexcept
+        {
+            capacity = std::bit_ceil((std::max)(capacity, size_t(1)));
+            m_entries.reset(new (std::nothrow) Entry[capacity]());
+            if (m_entries) m_mask = capacity - 1;
+        }
+
+        ~QICache() noexcept
+        {
+            Clear();
+        }
+
+        QICache(QICache const&) = delete;
+        QICache& operator=(QICache const&) = delete;
+
+        explicit operator bool() const noexcept { return m_entries != nullptr; }
+
+        size_t Capacity() const noexcept { return m_entries ? m_mask + 1 : 0; }
+
+        // Queries p for riid through the cache. On success, *ppv receives
+        // the result without AddRef().
+        HRESULT Borrow(IUnknown* p, REFIID riid, void** ppv) noexcept
+        {
+            if (!ppv) return E_POINTER;
+            *ppv = nullptr;
+            if (!p) return E_POINTER;
+            if (!m_entries) return E_OUTOFMEMORY;
+
+            auto& entry = m_entries[InternalSlot(p, riid)];
+            if (entry.source == p && entry.iid == riid)
+            {
+                ++m_stats.hits;
+                *ppv = entry.result;
+                return entry.hr;
+            }
+
+            ++m_stats.misses;
+            IUnknown* result = nullptr;
+            HRESULT hr = p->QueryInterface(riid, reinterpret_cast<void**>(&result));
+            if (FAILED(hr)) result = nullptr;
+
+            // Release the evicted entry last, in case that reenters the
+            // cache
+            Entry old = entry;
+            if (old.source) ++m_stats.evictions;
+            p->AddRef();
+            entry = { p, riid, result, hr };
+            InternalRelease(old);
+
+            *ppv = result;
+            return hr;
+        }
+
+        template<typename U, typename T>
+        U* Borrow(IPtr<T> const& p, REFIID riid) noexcept
+        {
+            void* temp = nullptr;
+            Borrow(get(p), riid, &temp);
+            return static_cast<U*>(temp);
+        }
+
+        template<typename U, typename T>
+        IPtr<U> As(IPtr<T> const& p, REFIID riid) noexcept
+        {
+            IPtr<U> temp;
+            temp.CopyFrom(Borrow<U>(p, riid));
+            return temp;
+        }
+
+        // Evicts the entries for p
+        void Evict(IUnknown* p) noexcept
+        {
+            for (size_t i = 0; m_entries && i <= m_mask; ++i)
+            {
+                if (m_entries[i].source == p) InternalRelease(m_entries[i]);
+            }
+        }
+
+        void Clear() noexcept
+        {
+            for (size_t i = 0; m_entries && i <= m_mask; ++i) InternalRelease(m_entries[i]);
+        }
+
+        QICacheStats const& Stats() const noexcept { return m_stats; }
+    };
+}
+
+#endif  // QICACHE_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,508 @@
+// stacall.h //////////////////////////////////////////////////////////////////
+//
+// ComTools::StaBound, StaBatch, StaDispatcher: Batched calls into objects
+// that live on a single-threaded apartment (STA) thread
+//
+// ComTools::StaBound, StaBatch, and StaDispatcher are released under the MIT
+// license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef STACALL_H
+#define STACALL_H
+
+#include <Windows.h>
+#include <memory>
+#include <new>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "executor.h"
+#include "iptr.h"
+
+namespace ComTools {
+
+    // StaDispatcher: Runs work on the thread that created it. Work is posted
+    // to a message-only window, so it runs when the thread pumps messages,
+    // as an STA thread does, including inside modal loops.
+    //
+    // Create the dispatcher on the owner thread. It can be released from
+    // any thread; the window is destroyed on the owner thread after the
+    // work posted before it. Work that is still queued when the window is
+    // destroyed is destroyed without being run.
+    //
+    // StaBound takes any Dispatcher with the same two members, ThreadId()
+    // and Post(), so that calls can be tested without a message loop.
+    class StaDispatcher {
+        static constexpr UINT RunMessage = WM_USER;
+
+        HWND m_hwnd = nullptr;
+        DWORD m_thread = 0;
+
+        StaDispatcher() = default;
+
+        static LRESULT CALLBACK InternalWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) noexcept
+        {
+            if (msg == WM_DESTROY)
+            {
+                // The system would discard the queued work without freeing
+                // it; destroying it releases any callers waiting on it
+                MSG queued;
+                while (PeekMessageW(&queued, hwnd, RunMessage, RunMessage, PM_REMOVE))
+                {
+                    delete reinterpret_cast<Work*>(queued.lParam);
+                }
+            }
+
+            if (msg != RunMessage) return DefWindowProcW(hwnd, msg, wParam, lParam);
+
+            std::unique_ptr<Work> work(reinterpret_cast<Work*>(lParam));
+            try
+            {
+                (*work)();
+            }
+            catch (...)
+            {
+            }
+
+            return 0;
+        }
+
+        // Registers the window class once per module. The class belongs to
+        // the module that contains this code, so two modules that include
+        // this header do not share a window procedure.
+        static HRESULT InternalRegister(HINSTANCE* phInstance) noexcept
+        {
+            static HINSTANCE hInstance = nullptr;
+            static HRESULT const hr = []() noexcept {
+                if (!GetModuleHandleExW(
+                    GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                    reinterpret_cast<LPCWSTR>(&InternalWndProc), &hInstance))
+                {
+                    return HRESULT_FROM_WIN32(GetLastError());
+                }
+
+                WNDCLASSEXW wc = { sizeof(wc) };
+                wc.lpfnWndProc = &InternalWndProc;
+                wc.hInstance = hInstance;
+                wc.lpszClassName = L"ComTools.StaDispatcher";
+                if (!RegisterClassExW(&wc)) return HRESULT_FROM_WIN32(GetLastError());
+                return S_OK;
+            }();
+
+            *phInstance = hInstance;
+            return hr;
+        }
+
+    public:
+        ~StaDispatcher() noexcept
+        {
+            if (!m_hwnd) return;
+            if (GetCurrentThreadId() == m_thread) DestroyWindow(m_hwnd);
+            else PostMessageW(m_hwnd, WM_CLOSE, 0, 0);
+        }
+
+        StaDispatcher(StaDispatcher const&) = delete;
+        StaDispatcher& operator=(StaDispatcher const&) = delete;
+
+        // Creates a dispatcher for the calling thread
+        static HRESULT Create(std::shared_ptr<StaDispatcher>* ppDispatcher) noexcept
+        {
+            if (!ppDispatcher) return E_POINTER;
+            ppDispatcher->reset();
+
+            HINSTANCE hInstance = nullptr;
+            HRESULT hr = InternalRegister(&hInstance);
+            if (FAILED(hr)) return hr;
+
+            std::shared_ptr<StaDispatcher> dispatcher;
+            try
+            {
+                dispatcher.reset(new StaDispatcher);
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            dispatcher->m_hwnd = CreateWindowExW(0, L"ComTools.StaDispatcher", nullptr, 0,
+                0, 0, 0, 0, HWND_MESSAGE, nullptr, hInstance, nullptr);
+            if (!dispatcher->m_hwnd) return HRESULT_FROM_WIN32(GetLastError());
+
+            dispatcher->m_thread = GetCurrentThreadId();
+            *ppDispatcher = std::move(dispatcher);
+            return S_OK;
+        }
+
+        DWORD ThreadId() const noexcept { return m_thread; }
+
+        // Queues work to run on the owner thread
+        HRESULT Post(Work work) noexcept
+        {
+            Work* p = new (std::nothrow) Work(std::move(work));
+            if (!p) return E_OUTOFMEMORY;
+
+            if (!PostMessageW(m_hwnd, RunMessage, 0, reinterpret_cast<LPARAM>(p)))
+            {
+                HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+                delete p;
+                return hr;
+            }
+
+            return S_OK;
+        }
+    };
+
+    template<typename T, typename Dispatcher>
+    class StaBound;
+
+    // StaBatch: List of calls to run on an STA object in one trip to its
+    // thread. Each call takes the object's T* and returns an HRESULT; calls
+    // that produce values write them through references they capture:
+    //
+    //     StaBatch<IItem> batch;
+    //     UBSTR name;
+    //     LONG size = 0;
+    //     batch.Add([&](IItem* p) { return p->get_Name(set(name)); });
+    //     batch.Add([&](IItem* p) { return p->get_Size(&size); });
+    //     if (SUCCEEDED(item.Run(batch))) ... batch.Results() ...
+    //
+    // A batch can be run again, or cleared and reused. Calls refer to the
+    // batch, so it cannot be copied or moved.
+    template<typename T>
+    class StaBatch {
+        template<typename U, typename Dispatcher>
+        friend class StaBound;
+
+        std::vector<Work> m_calls;
+        std::vector<HRESULT> m_results;
+        T* m_target = nullptr;
+
+        // Runs the calls in order; a call that throws gets an error result
+        void InternalRun(T* p) noexcept
+        {
+            m_target = p;
+            for (size_t i = 0; i < m_calls.size(); ++i)
+            {
+                try
+                {
+                    m_calls[i]();
+                }
+                catch (std::bad_alloc&)
+                {
+                    m_results[i] = E_OUTOFMEMORY;
+                }
+                catch (...)
+                {
+                    m_results[i] = E_UNEXPECTED;
+                }
+            }
+
+            m_target = nullptr;
+        }
+
+    public:
+        StaBatch() noexcept = default;
+
+        StaBatch(StaBatch const&) = delete;
+        StaBatch& operator=(StaBatch const&) = delete;
+
+        size_t Size() const noexcept { return m_calls.size(); }
+
+        // Adds f, which is moved into the batch. Its result is E_PENDING
+        // until the batch runs.
+        template<typename F>
+        HRESULT Add(F&& f) noexcept
+        {
+            static_assert(std::is_same_v<std::invoke_result_t<std::decay_t<F>&, T*>, HRESULT>,
+                "A batched call takes T* and returns HRESULT");
+
+            try
+            {
+                size_t const i = m_calls.size();
+                m_results.push_back(E_PENDING);
+                try
+                {
+                    m_calls.emplace_back([this, i, f = std::forward<F>(f)]() mutable {
+                        m_results[i] = f(m_target);
+                    });
+                }
+                catch (...)
+                {
+                    m_results.pop_back();
+                    throw;
+                }
+
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // The result of each call, in the order the calls were added
+        std::span<HRESULT const> Results() const noexcept { return m_results; }
+
+        void Clear() noexcept
+        {
+            m_calls.clear();
+            m_results.clear();
+        }
+    };
+
+    // StaBound: Interface pointer to an object on an STA thread, bound to
+    // that thread's dispatcher. A call from another thread is one trip to
+    // the owner thread: the call is posted, the owner thread switches in and
+    // runs it, and the caller waits. Call() makes one trip per call; Run()
+    // and Invoke() make one trip for a whole batch.
+    //
+    // Calls run on the owner thread with the object's own T*, so no proxy
+    // is involved. A call made on the owner thread runs immediately. The
+    // caller must not be the owner thread's only message pump while it
+    // waits, and calls must not wait on the caller. A caller in an STA
+    // pumps COM calls while it waits. If the owner thread exits, or the
+    // dispatcher drops the call unrun, the call fails with
+    // RPC_E_DISCONNECTED.
+    //
+    // The StaBound must be created on the owner thread. The object is
+    // released on the owner thread when the StaBound is destroyed.
+    template<typename T, typename Dispatcher = StaDispatcher>
+    class StaBound {
+        IPtr<T> m_ptr;
+        std::shared_ptr<Dispatcher> m_dispatcher;
+
+        // Shared by a caller and the work it posts, because the owner
+        // thread may still be signaling when the caller wakes and returns
+        struct InternalHopState {
+            HANDLE event = nullptr;
+            HRESULT hr = RPC_E_DISCONNECTED;
+
+            ~InternalHopState() noexcept
+            {
+                if (event) CloseHandle(event);
+            }
+        };
+
+        // Part of the posted work that signals the caller when the work is
+        // destroyed, whether or not it ran
+        class InternalHopSignal {
+            std::shared_ptr<InternalHopState> m_state;
+
+        public:
+            explicit InternalHopSignal(std::shared_ptr<InternalHopState> state) noexcept :
+                m_state(std::move(state)) { }
+
+            InternalHopSignal(InternalHopSignal&&) noexcept = default;
+            InternalHopSignal& operator=(InternalHopSignal&&) = delete;
+
+            ~InternalHopSignal() noexcept
+            {
+                if (m_state) SetEvent(m_state->event);
+            }
+
+            void Ran() noexcept { m_state->hr = S_OK; }
+        };
+
+        // Runs run() on the owner thread and waits for it, or for the owner
+        // thread to exit. run() must not throw.
+        template<typename F>
+        HRESULT InternalHop(F& run) const noexcept
+        {
+            if (!m_ptr || !m_dispatcher) return E_POINTER;
+
+            if (GetCurrentThreadId() == m_dispatcher->ThreadId())
+            {
+                run();
+                return S_OK;
+            }
+
+            // The handle is opened before posting, so it cannot refer to a
+            // later thread that reuses the ID
+            HANDLE const owner = OpenThread(SYNCHRONIZE, FALSE, m_dispatcher->ThreadId());
+            if (!owner) return RPC_E_DISCONNECTED;
+
+            std::shared_ptr<InternalHopState> state;
+            try
+            {
+                state = std::make_shared<InternalHopState>();
+            }
+            catch (std::bad_alloc&)
+            {
+                CloseHandle(owner);
+                return E_OUTOFMEMORY;
+            }
+
+            state->event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            if (!state->event)
+            {
+                HRESULT const hr = HRESULT_FROM_WIN32(GetLastError());
+                CloseHandle(owner);
+                return hr;
+            }
+
+            HRESULT hr = m_dispatcher->Post([&run, signal = InternalHopSignal(state)]() mutable noexcept {
+                run();
+                signal.Ran();
+            });
+
+            if (SUCCEEDED(hr))
+            {
+                HANDLE handles[] = { state->event, owner };
+                DWORD index = 0;
+                hr = CoWaitForMultipleHandles(0, INFINITE, 2, handles, &index);
+                if (hr == CO_E_NOTINITIALIZED)
+                {
+                    index = WaitForMultipleObjects(2, handles, FALSE, INFINITE) - WAIT_OBJECT_0;
+                    hr = index < 2 ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+                }
+
+                // The event comes first, so a call that ran before the
+                // owner thread exited is not reported as lost
+                if (SUCCEEDED(hr)) hr = index == 0 ? state->hr : RPC_E_DISCONNECTED;
+            }
+
+            CloseHandle(owner);
+            return hr;
+        }
+
+        template<typename Tuple, typename Fs, size_t... I>
+        void InternalInvoke(Tuple& results, Fs& fs, std::index_sequence<I...>) const
+        {
+            T* p = get(m_ptr);
+            ((std::get<I>(results) = std::get<I>(fs)(p)), ...);
+        }
+
+    public:
+        StaBound() noexcept = default;
+
+        // Binds p, which lives on the calling thread, to dispatcher
+        StaBound(IPtr<T> p, std::shared_ptr<Dispatcher> dispatcher) noexcept :
+            m_ptr(std::move(p)), m_dispatcher(std::move(dispatcher)) { }
+
+        ~StaBound() noexcept
+        {
+            if (!m_ptr || !m_dispatcher) return;
+            if (GetCurrentThreadId() == m_dispatcher->ThreadId()) return;
+
+            // If the release cannot be posted, it is made here instead
+            T* p = detach(m_ptr);
+            if (FAILED(m_dispatcher->Post([p]() noexcept { p->Release(); }))) p->Release();
+        }
+
+        StaBound(StaBound const&) = delete;
+        StaBound& operator=(StaBound const&) = delete;
+
+        StaBound(StaBound&& other) noexcept = default;
+
+        StaBound& operator=(StaBound&& other) noexcept
+        {
+            if (this != &other)
+            {
+                StaBound temp(std::move(*this));
+                m_ptr = std::move(other.m_ptr);
+                m_dispatcher = std::move(other.m_dispatcher);
+            }
+
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return m_ptr && m_dispatcher; }
+
+        // Runs f(p) on the owner thread and returns its result, or the error
+        // if the trip failed
+        template<typename F>
+        HRESULT Call(F&& f) const noexcept
+        {
+            static_assert(std::is_same_v<std::invoke_result_t<F&, T*>, HRESULT>,
+                "A call takes T* and returns HRESULT");
+
+            HRESULT result = E_PENDING;
+            auto run = [&]() noexcept {
+                try
+                {
+                    result = f(get(m_ptr));
+                }
+                catch (std::bad_alloc&)
+                {
+                    result = E_OUTOFMEMORY;
+                }
+                catch (...)
+                {
+                    result = E_UNEXPECTED;
+                }
+            };
+
+            HRESULT hr = InternalHop(run);
+            return FAILED(hr) ? hr : result;
+        }
+
+        // Runs the calls in batch in one trip. The results are in
+        // batch.Results(). Returns an error only if the trip failed.
+        HRESULT Run(StaBatch<T>& batch) const noexcept
+        {
+            if (batch.m_calls.empty()) return S_OK;
+
+            auto run = [&]() noexcept { batch.InternalRun(get(m_ptr)); };
+            return InternalHop(run);
+        }
+
+        // Runs fs(p)... in order in one trip and stores their results, which
+        // may be of any type, in *pResults. If a call throws, the calls after
+        // it do not run and the error is returned.
+        template<typename... Fs>
+        HRESULT Invoke(std::tuple<std::invoke_result_t<Fs&, T*>...>* pResults, Fs&&... fs) const noexcept
+        {
+            if (!pResults) return E_POINTER;
+
+            HRESULT result = S_OK;
+            std::tuple<Fs&...> calls(fs...);
+            auto run = [&]() noexcept {
+                try
+                {
+                    InternalInvoke(*pResults, calls, std::index_sequence_for<Fs...>());
+                }
+                catch (std::bad_alloc&)
+                {
+                    result = E_OUTOFMEMORY;
+                }
+                catch (...)
+                {
+                    result = E_UNEXPECTED;
+                }
+            };
+
+            HRESULT hr = InternalHop(run);
+            return FAILED(hr) ? hr : result;
+        }
+    };
+}
+
+#endif  // STACALL_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,458 @@
+// task.h /////////////////////////////////////////////////////////////////////
+//
+// ComTools::Task: Coroutine task that carries an HRESULT
+//
+// ComTools::Task is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <Windows.h>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "comexcept.h"
+
+namespace ComTools {
+
+    // FramePool: Per-thread free lists of coroutine frames, by size in
+    // multiples of 64 bytes up to 1 KiB. Larger frames are not pooled.
+    // Frames freed on another thread join that thread's lists.
+    class FramePool {
+        static constexpr size_t Granularity = 64;
+        static constexpr size_t Classes = 16;
+        static constexpr size_t Limit = 64;
+
+        struct Node {
+            Node* next;
+        };
+
+        struct Lists {
+            Node* heads[Classes] = { };
+            size_t counts[Classes] = { };
+
+            ~Lists() noexcept
+            {
+                t_dead = true;
+                for (Node* head : heads)
+                {
+                    while (head)
+                    {
+                        Node* next = head->next;
+                        ::operator delete(head);
+                        head = next;
+                    }
+                }
+            }
+        };
+
+        // Set when the calling thread's lists have been destroyed
+        static inline thread_local bool t_dead = false;
+
+        static Lists& InternalLists() noexcept
+        {
+            thread_local Lists lists;
+            return lists;
+        }
+
+    public:
+        // Returns nullptr if memory cannot be allocated
+        static void* Allocate(size_t size) noexcept
+        {
+            size_t c = (size + Granularity - 1) / Granularity - 1;
+            if (c >= Classes || t_dead) return ::operator new(size, std::nothrow);
+
+            auto& lists = InternalLists();
+            if (Node* node = lists.heads[c])
+            {
+                lists.heads[c] = node->next;
+                --lists.counts[c];
+                return node;
+            }
+
+            return ::operator new((c + 1) * Granularity, std::nothrow);
+        }
+
+        static void Free(void* p, size_t size) noexcept
+        {
+            size_t c = (size + Granularity - 1) / Granularity - 1;
+            if (c < Classes && !t_dead)
+            {
+                auto& lists = InternalLists();
+                if (lists.counts[c] < Limit)
+                {
+                    auto node = static_cast<Node*>(p);
+                    node->next = lists.heads[c];
+                    lists.heads[c] = node;
+                    ++lists.counts[c];
+                    return;
+                }
+            }
+
+            ::operator delete(p);
+        }
+    };
+
+    // TaskResult: Outcome of a Task that is observed without exceptions
+    template<typename T>
+    struct TaskResult {
+        HRESULT hr = S_OK;
+        std::optional<T> value;
+    };
+
+    template<>
+    struct TaskResult<void> {
+        HRESULT hr = S_OK;
+    };
+
+    template<typename T = void>
+    class Task;
+
+    // TaskPromiseBase: State shared by all Task promises
+    class TaskPromiseBase {
+        struct SyncState {
+            std::mutex lock;
+            std::condition_variable cv;
+            bool done = false;
+        };
+
+    protected:
+        std::coroutine_handle<> m_continuation;
+        SyncState* m_sync = nullptr;
+        std::exception_ptr m_error;
+        HRESULT m_hr = S_OK;
+        bool m_complete = false;
+
+    private:
+        template<typename T>
+        friend class Task;
+
+        struct FinalAwaiter {
+            bool await_ready() const noexcept { return false; }
+
+            template<typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+            {
+                return h.promise().InternalComplete();
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+    protected:
+        void InternalRethrow() const
+        {
+            if (m_error) std::rethrow_exception(m_error);
+            if (FAILED(m_hr)) throw ComException(m_hr);
+        }
+
+    public:
+        static void* operator new(size_t size) noexcept
+        {
+            return FramePool::Allocate(size);
+        }
+
+        static void operator delete(void* p, size_t size) noexcept
+        {
+            FramePool::Free(p, size);
+        }
+
+        std::suspend_always initial_suspend() const noexcept { return { }; }
+        FinalAwaiter final_suspend() const noexcept { return { }; }
+
+        void unhandled_exception() noexcept
+        {
+            m_error = std::current_exception();
+            try
+            {
+                throw;
+            }
+            catch (ComException& e)
+            {
+                m_hr = e.hr();
+            }
+            catch (std::bad_alloc&)
+            {
+                m_hr = E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                m_hr = E_UNEXPECTED;
+            }
+        }
+
+        // Ends the task with hr, which is a failure code, and returns the
+        // coroutine to resume. Used by Check().
+        std::coroutine_handle<> InternalFail(HRESULT hr) noexcept
+        {
+            m_hr = hr;
+            return InternalComplete();
+        }
+
+        std::coroutine_handle<> InternalComplete() noexcept
+        {
+            m_complete = true;
+            if (m_continuation) return m_continuation;
+
+            if (m_sync)
+            {
+                std::lock_guard<std::mutex> guard(m_sync->lock);
+                m_sync->done = true;
+                m_sync->cv.notify_all();
+            }
+
+            return std::noop_coroutine();
+        }
+    };
+
+    template<typename T>
+    class TaskPromise : public TaskPromiseBase {
+        std::optional<T> m_value;
+
+    public:
+        Task<T> get_return_object() noexcept;
+        static Task<T> get_return_object_on_allocation_failure() noexcept;
+
+        template<typename U>
+        void return_value(U&& value)
+        {
+            m_value.emplace(std::forward<U>(value));
+        }
+
+        T InternalResult()
+        {
+            InternalRethrow();
+            return std::move(*m_value);
+        }
+
+        TaskResult<T> InternalTryResult()
+        {
+            TaskResult<T> result{ m_hr };
+            if (SUCCEEDED(m_hr)) result.value = std::move(m_value);
+            return result;
+        }
+    };
+
+    template<>
+    class TaskPromise<void> : public TaskPromiseBase {
+    public:
+        Task<void> get_return_object() noexcept;
+        static Task<void> get_return_object_on_allocation_failure() noexcept;
+
+        void return_void() const noexcept { }
+
+        void InternalResult()
+        {
+            InternalRethrow();
+        }
+
+        TaskResult<void> InternalTryResult() const noexcept
+        {
+            return { m_hr };
+        }
+    };
+
+    // Task: Lazily started coroutine that produces a T or fails with an
+    // HRESULT. Awaiting a task starts it and resumes the awaiting coroutine
+    // by symmetric transfer when it finishes, so chains of tasks neither
+    // allocate closures nor grow the stack. Frames come from FramePool.
+    //
+    //     co_await task               Returns the T; rethrows the task's
+    //                                 exception, or throws ComException if
+    //                                 the task failed through Check()
+    //     co_await Try(task)          Returns a TaskResult<T>; never throws
+    //     co_await Check(hr)          Ends the task with hr if it is a
+    //                                 failure; never throws
+    //     task.Wait()                 Runs the task from outside a coroutine
+    //                                 and blocks until it finishes
+    //
+    // Exceptions that escape the coroutine end the task with the HRESULT of
+    // a ComException, E_OUTOFMEMORY for std::bad_alloc, or E_UNEXPECTED. A
+    // task whose frame could not be allocated is empty and fails with
+    // E_OUTOFMEMORY.
+    template<typename T>
+    class [[nodiscard]] Task {
+        static_assert(!std::is_reference_v<T>, "Task<T> requires a non-reference type");
+
+    public:
+        using promise_type = TaskPromise<T>;
+
+    private:
+        std::coroutine_handle<promise_type> m_h;
+
+        struct Awaiter {
+            std::coroutine_handle<promise_type> h;
+
+            bool await_ready() const noexcept { return !h || h.promise().m_complete; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                h.promise().m_continuation = continuation;
+                return h;
+            }
+
+            T await_resume()
+            {
+                if (!h) throw ComException(E_OUTOFMEMORY);
+                return h.promise().InternalResult();
+            }
+        };
+
+        struct TryAwaiter {
+            std::coroutine_handle<promise_type> h;
+
+            bool await_ready() const noexcept { return !h || h.promise().m_complete; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                h.promise().m_continuation = continuation;
+                return h;
+            }
+
+            TaskResult<T> await_resume()
+            {
+                if (!h) return { E_OUTOFMEMORY };
+                return h.promise().InternalTryResult();
+            }
+        };
+
+    public:
+        Task() noexcept = default;
+        explicit Task(std::coroutine_handle<promise_type> h) noexcept : m_h(h) { }
+
+        ~Task() noexcept
+        {
+            if (m_h) m_h.destroy();
+        }
+
+        Task(Task const&) = delete;
+        Task& operator=(Task const&) = delete;
+
+        Task(Task&& other) noexcept : m_h(std::exchange(other.m_h, nullptr)) { }
+
+        Task& operator=(Task&& other) noexcept
+        {
+            if (this != &other)
+            {
+                if (m_h) m_h.destroy();
+                m_h = std::exchange(other.m_h, nullptr);
+            }
+
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return static_cast<bool>(m_h); }
+
+        bool Done() const noexcept { return m_h && m_h.promise().m_complete; }
+
+        Awaiter operator co_await() && noexcept
+        {
+            return { m_h };
+        }
+
+        TryAwaiter InternalTry() noexcept
+        {
+            return { m_h };
+        }
+
+        // Starts the task on the calling thread and waits for it to finish,
+        // wherever it is resumed
+        TaskResult<T> Wait()
+        {
+            if (!m_h) return { E_OUTOFMEMORY };
+
+            auto& promise = m_h.promise();
+            if (!promise.m_complete)
+            {
+                TaskPromiseBase::SyncState sync;
+                promise.m_sync = &sync;
+                m_h.resume();
+
+                std::unique_lock<std::mutex> lock(sync.lock);
+                sync.cv.wait(lock, [&]() { return sync.done; });
+            }
+
+            return promise.InternalTryResult();
+        }
+    };
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object() noexcept
+    {
+        return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+    }
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object_on_allocation_failure() noexcept
+    {
+        return Task<T>();
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object() noexcept
+    {
+        return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object_on_allocation_failure() noexcept
+    {
+        return Task<void>();
+    }
+
+    // Awaits task and returns its TaskResult instead of throwing
+    template<typename T>
+    auto Try(Task<T>&& task) noexcept
+    {
+        return task.InternalTry();
+    }
+
+    // CheckAwaiter: Ends the awaiting task if hr is a failure code
+    struct CheckAwaiter {
+        HRESULT hr;
+
+        bool await_ready() const noexcept { return SUCCEEDED(hr); }
+
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            return h.promise().InternalFail(hr);
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+    inline CheckAwaiter Check(HRESULT hr) noexcept
+    {
+        return { hr };
+    }
+}
+
+#endif  // TASK_H
+
+///////////////////////////////////////////////////////////////////////////////
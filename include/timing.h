@@ -0,0 +1,443 @@
+// timing.h ///////////////////////////////////////////////////////////////////
+//
+// ComTools::TimingProxy: Per-method latency histograms for an interface
+//
+// ComTools::TimingProxy is released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <Windows.h>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include "comobject.h"
+#include "iptr.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// TIMING_PROXY(Class, Interface, METHODS) declares Class, a TimingProxy for
+// Interface. METHODS is the name of a macro that applies its argument to
+// each method of Interface after IUnknown, as
+// M(ReturnType, Name, (Parameters), (Arguments)). For an interface with
+// the methods Add(long value, long* total) and Reset():
+//
+//     #define IACCUMULATOR_METHODS(M) M(HRESULT, Add, (long value,
+//         long* total), (value, total)) M(HRESULT, Reset, (), ())
+//
+//     TIMING_PROXY(TimedAccumulator, IAccumulator, IACCUMULATOR_METHODS)
+//
+// with the #define written on one line or continued with backslashes.
+//
+// Each method of Class times the call and forwards it to the target.
+#define TIMING_PROXY(Class, Interface, METHODS) \
+    class Class final : public ComTools::TimingProxy<Class, Interface> { \
+    public: \
+        enum Method : size_t { METHODS(TIMING_PROXY_ENUM) MethodCount }; \
+        static constexpr char const* MethodNames[] = { METHODS(TIMING_PROXY_NAME) }; \
+        using ComTools::TimingProxy<Class, Interface>::TimingProxy; \
+        METHODS(TIMING_PROXY_METHOD) \
+    }
+
+#define TIMING_PROXY_ENUM(Return, Name, Parameters, Arguments) Method_##Name,
+#define TIMING_PROXY_NAME(Return, Name, Parameters, Arguments) #Name,
+#define TIMING_PROXY_METHOD(Return, Name, Parameters, Arguments) \
+    Return __stdcall Name Parameters noexcept override \
+    { \
+        auto timer = InternalTime(Method_##Name); \
+        return InternalTarget()->Name Arguments; \
+    }
+
+namespace ComTools {
+
+    // The time stamp counter on x86 and x64, or the performance counter
+    inline unsigned long long TimingTicks() noexcept
+    {
+#if defined(_M_IX86) || defined(_M_X64)
+        return __rdtsc();
+#else
+        LARGE_INTEGER ticks;
+        QueryPerformanceCounter(&ticks);
+        return static_cast<unsigned long long>(ticks.QuadPart);
+#endif
+    }
+
+    // Ticks of TimingTicks() per nanosecond. The time stamp counter is
+    // measured against the performance counter the first time this is
+    // called, which takes about 10 ms.
+    inline double TimingTicksPerNs() noexcept
+    {
+        static double const rate = []() {
+            LARGE_INTEGER frequency;
+            QueryPerformanceFrequency(&frequency);
+#if defined(_M_IX86) || defined(_M_X64)
+            LARGE_INTEGER start;
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&start);
+            unsigned long long ticks = __rdtsc();
+            do
+            {
+                QueryPerformanceCounter(&now);
+            } while (now.QuadPart - start.QuadPart < frequency.QuadPart / 100);
+
+            ticks = __rdtsc() - ticks;
+            double ns = 1e9 * static_cast<double>(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+            return static_cast<double>(ticks) / ns;
+#else
+            return static_cast<double>(frequency.QuadPart) / 1e9;
+#endif
+        }();
+
+        return rate;
+    }
+
+    // LatencyHistogram: Histogram of durations in ticks, recorded by one
+    // thread and readable by any thread without locking. The buckets are
+    // log-linear: each power of two is split into four buckets, so a
+    // bucket's bounds are within 25% of each other.
+    class LatencyHistogram {
+    public:
+        static constexpr size_t Buckets = 252;
+
+        static size_t BucketOf(unsigned long long ticks) noexcept
+        {
+            if (ticks < 4) return static_cast<size_t>(ticks);
+            int bit = static_cast<int>(std::bit_width(ticks)) - 1;
+            return static_cast<size_t>((bit - 1) * 4 + ((ticks >> (bit - 2)) & 3));
+        }
+
+        // The smallest duration in bucket
+        static unsigned long long BucketFloor(size_t bucket) noexcept
+        {
+            if (bucket < 4) return bucket;
+            return (4ULL + bucket % 4) << (bucket / 4 - 1);
+        }
+
+        // Called by the recording thread. The counters are atomic only so
+        // that other threads can read them; they are not incremented with
+        // locked instructions.
+        void Record(unsigned long long ticks) noexcept
+        {
+            auto& count = m_counts[BucketOf(ticks)];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            m_total.store(m_total.load(std::memory_order_relaxed) + ticks, std::memory_order_relaxed);
+        }
+
+        // A reset from another thread can be lost to a concurrent Record()
+        void Reset() noexcept
+        {
+            for (auto& count : m_counts) count.store(0, std::memory_order_relaxed);
+            m_total.store(0, std::memory_order_relaxed);
+        }
+
+        unsigned long long Total() const noexcept
+        {
+            return m_total.load(std::memory_order_relaxed);
+        }
+
+        unsigned long long Count(size_t bucket) const noexcept
+        {
+            return m_counts[bucket].load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<unsigned long long> m_counts[Buckets] = { };
+        std::atomic<unsigned long long> m_total = 0;
+    };
+
+    // MethodTiming: Snapshot of the calls to one method. The counts are
+    // read while calls may be recorded, so they may differ slightly from
+    // any single moment.
+    struct MethodTiming {
+        char const* name = nullptr;
+        unsigned long long calls = 0;
+        double totalNs = 0;
+        unsigned long long counts[LatencyHistogram::Buckets] = { };
+        double nsPerTick = 0;
+
+        double MeanNs() const noexcept
+        {
+            return calls ? totalNs / calls : 0;
+        }
+
+        // The lower bound of the bucket holding the call at fraction
+        // (0 to 1) of the calls, in nanoseconds
+        double PercentileNs(double fraction) const noexcept
+        {
+            if (!calls) return 0;
+
+            auto rank = static_cast<unsigned long long>(fraction * (calls - 1));
+            unsigned long long seen = 0;
+            for (size_t i = 0; i < LatencyHistogram::Buckets; ++i)
+            {
+                seen += counts[i];
+                if (seen > rank) return LatencyHistogram::BucketFloor(i) * nsPerTick;
+            }
+
+            return LatencyHistogram::BucketFloor(LatencyHistogram::Buckets - 1) * nsPerTick;
+        }
+    };
+
+    // TimingProxy: Object that forwards the calls on interface T to a
+    // target object and records the latency of each method. Declare proxy
+    // classes with TIMING_PROXY. All proxies of one class record into the
+    // same statistics, which Snapshot(), Export(), and Reset() access.
+    //
+    // Each calling thread records into its own histograms, so recording
+    // takes no locks or locked instructions. A thread's histograms are
+    // handed to a later thread when it exits. A snapshot adds up the
+    // histograms of all threads that have made calls, including threads
+    // that have exited.
+    //
+    // A proxy answers only for IUnknown and T, so it keeps its own
+    // identity. Query the target for its other interfaces.
+    template<typename Derived, typename T>
+    class TimingProxy : public Object<Derived, T> {
+        IPtr<T> m_target;
+        IID m_iid;
+
+        // The histograms of one thread
+        struct Shard {
+            LatencyHistogram histograms[Derived::MethodCount];
+            Shard* next = nullptr;      // Every shard, for snapshots
+            Shard* nextFree = nullptr;  // Shards of exited threads
+        };
+
+        struct Shards {
+            std::atomic<Shard*> head = nullptr;
+            std::mutex lock;
+            Shard* free = nullptr;
+
+            ~Shards() noexcept
+            {
+                s_dead.store(true);
+                Shard* shard = head.exchange(nullptr);
+                while (shard)
+                {
+                    Shard* next = shard->next;
+                    delete shard;
+                    shard = next;
+                }
+            }
+
+            // Reuses the shard of an exited thread, or adds a new one
+            Shard* Acquire() noexcept
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (Shard* shard = free)
+                    {
+                        free = shard->nextFree;
+                        return shard;
+                    }
+                }
+
+                Shard* shard = new (std::nothrow) Shard;
+                if (!shard) return nullptr;
+
+                shard->next = head.load(std::memory_order_relaxed);
+                while (!head.compare_exchange_weak(shard->next, shard, std::memory_order_release)) { }
+                return shard;
+            }
+
+            void Release(Shard* shard) noexcept
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                shard->nextFree = free;
+                free = shard;
+            }
+        };
+
+        // Returns the calling thread's shard when the thread exits
+        struct LocalShard {
+            Shard* shard = nullptr;
+
+            ~LocalShard() noexcept
+            {
+                if (shard && !s_dead.load()) InternalShards().Release(shard);
+            }
+        };
+
+        // Set when the shards have been destroyed at process exit. Later
+        // calls are not recorded.
+        static inline std::atomic<bool> s_dead = false;
+
+        static Shards& InternalShards() noexcept
+        {
+            static Shards shards;
+            return shards;
+        }
+
+        // The histograms of the calling thread, or nullptr
+        static LatencyHistogram* InternalHistograms() noexcept
+        {
+            thread_local LocalShard local;
+            if (s_dead.load(std::memory_order_relaxed)) return nullptr;
+            if (!local.shard)
+            {
+                local.shard = InternalShards().Acquire();
+                if (!local.shard) return nullptr;
+            }
+
+            return local.shard->histograms;
+        }
+
+    protected:
+        // Records the time from construction to destruction
+        struct Timer {
+            LatencyHistogram* histogram;
+            unsigned long long start;
+
+            ~Timer() noexcept
+            {
+                if (histogram) histogram->Record(TimingTicks() - start);
+            }
+        };
+
+        static Timer InternalTime(size_t method) noexcept
+        {
+            auto histograms = InternalHistograms();
+            return { histograms ? histograms + method : nullptr, TimingTicks() };
+        }
+
+        T* InternalTarget() const noexcept
+        {
+            return get(m_target);
+        }
+
+    public:
+        TimingProxy(IPtr<T> const& target, REFIID riid) noexcept : m_target(target), m_iid(riid) { }
+
+        // Wraps target, whose interface T has the IID riid. Returns an
+        // empty IPtr if target is empty or the proxy cannot be created.
+        static IPtr<T> Wrap(IPtr<T> const& target, REFIID riid) noexcept
+        {
+            IPtr<T> proxy;
+            if (target) Derived::Create(riid, reinterpret_cast<void**>(set(proxy)), target, riid);
+            return proxy;
+        }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == m_iid ? static_cast<T*>(this) : nullptr;
+        }
+
+        static HRESULT Snapshot(std::vector<MethodTiming>& timings) noexcept
+        {
+            try
+            {
+                double nsPerTick = 1 / TimingTicksPerNs();
+                timings.assign(Derived::MethodCount, MethodTiming());
+                for (size_t m = 0; m < Derived::MethodCount; ++m)
+                {
+                    timings[m].name = Derived::MethodNames[m];
+                    timings[m].nsPerTick = nsPerTick;
+                }
+
+                if (s_dead.load()) return S_OK;
+                auto shard = InternalShards().head.load(std::memory_order_acquire);
+                for (; shard; shard = shard->next)
+                {
+                    for (size_t m = 0; m < Derived::MethodCount; ++m)
+                    {
+                        auto& histogram = shard->histograms[m];
+                        auto& timing = timings[m];
+                        timing.totalNs += histogram.Total() * nsPerTick;
+                        for (size_t i = 0; i < LatencyHistogram::Buckets; ++i)
+                        {
+                            auto count = histogram.Count(i);
+                            timing.counts[i] += count;
+                            timing.calls += count;
+                        }
+                    }
+                }
+
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Exports a snapshot as CSV, one line per method:
+        // method,calls,total_ns,mean_ns,p50_ns,p90_ns,p99_ns
+        static HRESULT Export(std::string& csv) noexcept
+        {
+            std::vector<MethodTiming> timings;
+            HRESULT hr = Snapshot(timings);
+            if (FAILED(hr)) return hr;
+
+            try
+            {
+                csv = "method,calls,total_ns,mean_ns,p50_ns,p90_ns,p99_ns\n";
+                for (auto const& timing : timings)
+                {
+                    char line[256];
+                    snprintf(line, sizeof(line), "%s,%llu,%.0f,%.1f,%.1f,%.1f,%.1f\n",
+                        timing.name, timing.calls, timing.totalNs, timing.MeanNs(),
+                        timing.PercentileNs(0.5), timing.PercentileNs(0.9), timing.PercentileNs(0.99));
+                    csv += line;
+                }
+
+                return S_OK;
+            }
+            catch (std::bad_alloc&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_UNEXPECTED;
+            }
+        }
+
+        // Clears the statistics. Calls that are recorded while Reset()
+        // runs may survive it.
+        static void Reset() noexcept
+        {
+            if (s_dead.load()) return;
+            auto shard = InternalShards().head.load(std::memory_order_acquire);
+            for (; shard; shard = shard->next)
+            {
+                for (auto& histogram : shard->histograms) histogram.Reset();
+            }
+        }
+    };
+}
+
+#endif  // TIMING_H
+
+///////////////////////////////////////////////////////////////////////////////
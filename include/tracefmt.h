@@ -0,0 +1,274 @@
+// tracefmt.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::Trace, ReplayTrace: Traces of IPtr, UBSTR, and ComException
+// operations, and a driver that replays them
+//
+// ComTools::Trace and ReplayTrace are released under the MIT license.
+//
+// Copyright 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+// This header does not use Windows.h, so that traces recorded on Windows
+// (see calltrace.h) can be replayed on other platforms
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ComTools {
+
+    enum class TraceOp : std::uint8_t {
+        IPtrAddRef = 1,     // An IPtr added a reference to object
+        IPtrRelease,        // An IPtr released object
+        IPtrMove,           // An IPtr to object was moved
+        IPtrQuery,          // A query returned object, with a reference
+        BstrAlloc,          // A UBSTR allocated string, of size characters
+        BstrFree,           // A UBSTR freed string
+        Error               // A ComException was created for an HRESULT
+    };
+
+    // A trace file is laid out as follows:
+    //
+    //     TraceHeader header;
+    //     TraceRecord records[header.records];
+    //     For each type, its name: the length (UINT32) and UTF-8 bytes
+    //
+    // Records from one thread are in the order they happened. Records from
+    // different threads are not ordered with respect to each other.
+
+    constexpr std::uint32_t TraceMagic = 0x52544354;    // "CTTR"
+    constexpr std::uint32_t TraceVersion = 2;
+
+    struct TraceHeader {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint32_t types;        // Number of type names
+        std::uint32_t reserved;
+        std::uint64_t records;      // Number of records
+    };
+
+    struct TraceRecord {
+        TraceOp op;
+        std::uint8_t reserved;
+        std::uint16_t thread;       // Thread number, from 0
+        std::uint32_t type;         // Type number, from 0
+        std::uint32_t object;       // Object or string number; HRESULT for
+                                    // Error (set by Trace::Load())
+        std::uint32_t size;         // Characters for BstrAlloc and Error
+        std::uint64_t address;      // Object or string address, or HRESULT
+                                    // for Error, as recorded
+    };
+
+    static_assert(sizeof(TraceRecord) == 24, "TraceRecord is packed");
+
+    // Trace: A trace file in memory. Load() numbers the objects from 0 by
+    // address, in the order they first appear, and gives each string
+    // allocation its own number, so a replay can keep them in arrays.
+    struct Trace {
+        std::vector<TraceRecord> records;
+        std::vector<std::string> types;
+        std::uint32_t objects = 0;      // Number of objects
+        std::uint32_t strings = 0;      // Number of strings
+        std::uint16_t threads = 0;      // Number of threads
+
+        bool Save(std::filesystem::path const& path) const
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            TraceHeader header = { TraceMagic, TraceVersion,
+                static_cast<std::uint32_t>(types.size()), 0, records.size() };
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            out.write(reinterpret_cast<char const*>(records.data()),
+                static_cast<std::streamsize>(records.size() * sizeof(TraceRecord)));
+            for (auto const& name : types)
+            {
+                std::uint32_t const length = static_cast<std::uint32_t>(name.size());
+                out.write(reinterpret_cast<char const*>(&length), sizeof(length));
+                out.write(name.data(), length);
+            }
+
+            return static_cast<bool>(out.flush());
+        }
+
+        // Returns false if the file cannot be read or is not a trace
+        bool Load(std::filesystem::path const& path)
+        {
+            *this = Trace();
+            std::ifstream in(path, std::ios::binary);
+            TraceHeader header = { };
+            if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+            if (header.magic != TraceMagic || header.version != TraceVersion) return false;
+
+            std::error_code ec;
+            auto const size = std::filesystem::file_size(path, ec);
+            if (ec || (size - sizeof(header)) / sizeof(TraceRecord) < header.records) return false;
+
+            records.resize(static_cast<size_t>(header.records));
+            in.read(reinterpret_cast<char*>(records.data()),
+                static_cast<std::streamsize>(records.size() * sizeof(TraceRecord)));
+
+            for (std::uint32_t i = 0; in && i < header.types; ++i)
+            {
+                std::uint32_t length = 0;
+                if (!in.read(reinterpret_cast<char*>(&length), sizeof(length)) || length > size) break;
+                std::string name(length, '\0');
+                in.read(name.data(), length);
+                types.push_back(std::move(name));
+            }
+
+            if (!in) return false;
+
+            std::unordered_map<std::uint64_t, std::uint32_t> objects;
+            std::unordered_map<std::uint64_t, std::uint32_t> strings;
+            for (auto& record : records)
+            {
+                if (record.type >= types.size()) return false;
+                if (record.thread >= threads) threads = record.thread + 1;
+
+                switch (record.op)
+                {
+                case TraceOp::IPtrAddRef:
+                case TraceOp::IPtrRelease:
+                case TraceOp::IPtrMove:
+                case TraceOp::IPtrQuery:
+                    record.object = objects.try_emplace(record.address, this->objects).first->second;
+                    this->objects = static_cast<std::uint32_t>(objects.size());
+                    break;
+
+                case TraceOp::BstrAlloc:
+                    record.object = strings.insert_or_assign(record.address, this->strings++).first->second;
+                    break;
+
+                case TraceOp::BstrFree:
+                    if (auto it = strings.find(record.address); it != strings.end())
+                    {
+                        record.object = it->second;
+                        strings.erase(it);
+                    }
+                    else
+                    {
+                        record.object = this->strings++;
+                    }
+                    break;
+
+                case TraceOp::Error:
+                    record.object = static_cast<std::uint32_t>(record.address);
+                    break;
+
+                default:
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    };
+
+    // Replays trace on threads threads (at least one) and returns once they
+    // have finished. The records of recorded thread t run in order on
+    // thread t % threads. Env provides the operations:
+    //
+    //     void AddRef(uint32_t object, uint32_t type);     // IPtrAddRef,
+    //                                                      // IPtrQuery
+    //     void Release(uint32_t object, uint32_t type);    // IPtrRelease
+    //     void Alloc(uint32_t string, uint32_t size);      // BstrAlloc
+    //     void Free(uint32_t string);                      // BstrFree
+    //     void Error(uint32_t hr, uint32_t size);          // Error
+    //
+    // Objects and strings are numbered as in Trace. The trace may start
+    // with references and strings that were created before recording began,
+    // and strings returned through set() or given up by detach() are only
+    // recorded at one end (see UBSTR), so Env should tolerate a release or
+    // free that has no match, and strings that are never freed. Env is
+    // shared by the threads. IPtrMove records are skipped.
+    template<typename Env>
+    void ReplayTrace(Trace const& trace, size_t threads, Env& env)
+    {
+        if (threads == 0) threads = 1;
+
+        std::vector<std::vector<TraceRecord const*>> work(threads);
+        for (auto const& record : trace.records)
+        {
+            if (record.op != TraceOp::IPtrMove) work[record.thread % threads].push_back(&record);
+        }
+
+        auto run = [&env](std::vector<TraceRecord const*> const& items) {
+            for (auto record : items)
+            {
+                switch (record->op)
+                {
+                case TraceOp::IPtrAddRef:
+                case TraceOp::IPtrQuery:
+                    env.AddRef(record->object, record->type);
+                    break;
+
+                case TraceOp::IPtrRelease:
+                    env.Release(record->object, record->type);
+                    break;
+
+                case TraceOp::BstrAlloc:
+                    env.Alloc(record->object, record->size);
+                    break;
+
+                case TraceOp::BstrFree:
+                    env.Free(record->object);
+                    break;
+
+                case TraceOp::Error:
+                    env.Error(record->object, record->size);
+                    break;
+
+                default:
+                    break;
+                }
+            }
+        };
+
+        // The threads start together, so the replay measures contention
+        std::atomic<bool> go = false;
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (size_t i = 1; i < threads; ++i)
+        {
+            workers.emplace_back([&, i]() {
+                go.wait(false);
+                run(work[i]);
+            });
+        }
+
+        go = true;
+        go.notify_all();
+        run(work[0]);
+        for (auto& worker : workers) worker.join();
+    }
+}
+
+#endif  // TRACEFMT_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -29,13 +29,182 @@
 //
 
 #ifndef UBSTR_H
+#ifdef COMTOOLS_CALLTRACE
+#include "calltrace.h"
+#endif
 #define UBSTR_H
 
 #include <Windows.h>
+#include <bit>
+#include <cstddef>
 #include <utility>
 #include <string>
+#include <string_view>
+#include <type_traits>
+
+// On x64, text is converted between UTF-16 and UTF-32 eight code units at a
+// time with SSE2, which every x64 processor has
+#if defined(_M_X64) || defined(__x86_64__)
+#define UBSTR_SSE2
+#include <emmintrin.h>
+#endif
+
+// Recording hook for calltrace.h, which defining COMTOOLS_CALLTRACE for the
+// whole program turns on
+#ifndef COMTOOLS_RECORD
+#define COMTOOLS_RECORD(op, T, object, size) ((void)0)
+#endif
 
 namespace ComTools {
+
+    // BSTRs hold UTF-16. Where wchar_t is 16 bits, as on Windows, wchar_t
+    // text is UTF-16 and is passed through as is. Where wchar_t is 32 bits,
+    // as on Linux, wchar_t text is UTF-32 and is converted on the way in and
+    // out. The char16_t forms (u16view(), to_u16string(), and the char16_t
+    // constructors) never convert.
+
+    static_assert(sizeof(OLECHAR) == sizeof(char16_t), "A BSTR holds UTF-16 code units");
+
+    constexpr bool WideIsUtf16 = sizeof(wchar_t) == sizeof(char16_t);
+
+    // wchar_t where it is 32 bits. The conversions below only run there, but
+    // they must still compile where wchar_t is 16 bits.
+    using InternalWide32 = std::conditional_t<WideIsUtf16, char32_t, wchar_t>;
+
+    // Converts n UTF-16 code units at src to UTF-32 at dst, which must have
+    // room for n code points, and returns the number of code points written.
+    // A surrogate that is not part of a pair is copied as is.
+    template<typename Ch>
+    size_t InternalUtf16ToUtf32(char16_t const* src, size_t n, Ch* dst) noexcept
+    {
+        static_assert(sizeof(Ch) == sizeof(char32_t));
+
+        size_t i = 0;
+        size_t o = 0;
+        while (i < n)
+        {
+#ifdef UBSTR_SSE2
+            if (i + 8 <= n)
+            {
+                // Blocks without surrogates are zero-extended in registers
+                __m128i const zero = _mm_setzero_si128();
+                __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+                __m128i s = _mm_cmpeq_epi16(
+                    _mm_and_si128(x, _mm_set1_epi16(static_cast<short>(0xF800))),
+                    _mm_set1_epi16(static_cast<short>(0xD800)));
+                unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(s));
+                if (!mask)
+                {
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o), _mm_unpacklo_epi16(x, zero));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o + 4), _mm_unpackhi_epi16(x, zero));
+                    i += 8;
+                    o += 8;
+                    continue;
+                }
+
+                // Copy the units before the first surrogate
+                for (size_t k = std::countr_zero(mask) / 2; k; --k) dst[o++] = static_cast<Ch>(src[i++]);
+            }
+#endif
+            char32_t c = src[i++];
+            if (c >= 0xD800 && c < 0xDC00 && i < n && src[i] >= 0xDC00 && src[i] < 0xE000)
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (src[i++] - 0xDC00);
+            }
+
+            dst[o++] = static_cast<Ch>(c);
+        }
+
+        return o;
+    }
+
+    // Converts n UTF-32 code points at src to UTF-16 at dst, which must have
+    // room for 2 * n code units, and returns the number of code units
+    // written. A code point above U+10FFFF becomes U+FFFD.
+    template<typename Ch>
+    size_t InternalUtf32ToUtf16(Ch const* src, size_t n, char16_t* dst) noexcept
+    {
+        static_assert(sizeof(Ch) == sizeof(char32_t));
+
+        size_t i = 0;
+        size_t o = 0;
+        while (i < n)
+        {
+#ifdef UBSTR_SSE2
+            if (i + 8 <= n)
+            {
+                // Blocks of code points below U+D800 are narrowed in
+                // registers. SSE2 only packs with signed saturation, so the
+                // values are biased into the signed range and back.
+                __m128i const sign = _mm_set1_epi32(static_cast<int>(0x80000000));
+                __m128i const limit = _mm_set1_epi32(static_cast<int>(0x80000000 + 0xD7FF));
+                __m128i const bias32 = _mm_set1_epi32(0x8000);
+                __m128i const bias16 = _mm_set1_epi16(static_cast<short>(0x8000));
+                __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i + 4));
+                __m128i over = _mm_or_si128(
+                    _mm_cmpgt_epi32(_mm_xor_si128(a, sign), limit),
+                    _mm_cmpgt_epi32(_mm_xor_si128(b, sign), limit));
+                if (!_mm_movemask_epi8(over))
+                {
+                    __m128i x = _mm_packs_epi32(_mm_sub_epi32(a, bias32), _mm_sub_epi32(b, bias32));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + o), _mm_add_epi16(x, bias16));
+                    i += 8;
+                    o += 8;
+                    continue;
+                }
+            }
+#endif
+            char32_t c = static_cast<char32_t>(src[i++]);
+            if (c < 0x10000)
+            {
+                dst[o++] = static_cast<char16_t>(c);
+            }
+            else if (c < 0x110000)
+            {
+                c -= 0x10000;
+                dst[o++] = static_cast<char16_t>(0xD800 + (c >> 10));
+                dst[o++] = static_cast<char16_t>(0xDC00 + (c & 0x3FF));
+            }
+            else
+            {
+                dst[o++] = u'\uFFFD';
+            }
+        }
+
+        return o;
+    }
+
+    // UTF-16 text as a std::wstring
+    inline std::wstring Utf16ToWide(std::u16string_view s)
+    {
+        if constexpr (WideIsUtf16)
+        {
+            return std::wstring(reinterpret_cast<wchar_t const*>(s.data()), s.size());
+        }
+        else
+        {
+            std::wstring ws(s.size(), L'\0');
+            ws.resize(InternalUtf16ToUtf32(s.data(), s.size(), reinterpret_cast<InternalWide32*>(ws.data())));
+            return ws;
+        }
+    }
+
+    // wchar_t text as a std::u16string
+    inline std::u16string WideToUtf16(std::wstring_view ws)
+    {
+        if constexpr (WideIsUtf16)
+        {
+            return std::u16string(reinterpret_cast<char16_t const*>(ws.data()), ws.size());
+        }
+        else
+        {
+            std::u16string s(2 * ws.size(), u'\0');
+            s.resize(InternalUtf32ToUtf16(reinterpret_cast<InternalWide32 const*>(ws.data()), ws.size(), s.data()));
+            return s;
+        }
+    }
+
     class UBSTR {
         BSTR m_bstr = nullptr;
 
@@ -49,24 +218,53 @@ namespace ComTools {
         {
             if (obj.m_bstr)
             {
+                obj.InternalRecordFree();
                 SysFreeString(obj.m_bstr);
                 obj.m_bstr = nullptr;
             }
             return &obj.m_bstr;
         }
 
+        friend void attach(UBSTR& obj, BSTR bstr) noexcept
+        {
+            obj.InternalRecordFree();
+            SysFreeString(obj.m_bstr);
+            obj.m_bstr = bstr;
+            obj.InternalRecordAlloc();
+        }
+
+        friend BSTR detach(UBSTR& obj) noexcept
+        {
+            BSTR temp = obj.m_bstr;
+            obj.m_bstr = nullptr;
+            return temp;
+        }
+
         UBSTR() noexcept = default;
 
-        ~UBSTR() noexcept { SysFreeString(m_bstr); }
+        ~UBSTR() noexcept
+        {
+            InternalRecordFree();
+            SysFreeString(m_bstr);
+        }
 
         explicit UBSTR(wchar_t const* const wsz) noexcept :
-            m_bstr(SysAllocString(wsz)) { }
+            m_bstr(InternalAlloc(wsz)) { InternalRecordAlloc(); }
 
         explicit UBSTR(std::wstring const& ws) noexcept :
-            m_bstr(SysAllocString(ws.c_str())) { }
+            m_bstr(InternalAlloc(ws.c_str())) { InternalRecordAlloc(); }
+
+        explicit UBSTR(char16_t const* const sz) noexcept :
+            m_bstr(SysAllocString(reinterpret_cast<OLECHAR const*>(sz))) { InternalRecordAlloc(); }
+
+        // Copies all of s, including any embedded nulls
+        explicit UBSTR(std::u16string_view const s) noexcept :
+            m_bstr(s.size() <= MAXUINT ?
+                SysAllocStringLen(reinterpret_cast<OLECHAR const*>(s.data()), static_cast<UINT>(s.size())) :
+                nullptr) { InternalRecordAlloc(); }
 
         UBSTR(UBSTR const& obj) noexcept :
-            m_bstr(SysAllocString(obj.m_bstr)) { }
+            m_bstr(SysAllocString(obj.m_bstr)) { InternalRecordAlloc(); }
 
         UBSTR(UBSTR&& obj) noexcept : m_bstr() { swap(*this, obj); }
 
@@ -81,15 +279,74 @@ namespace ComTools {
         size_t length() const noexcept
         {
             if (!*this) return 0;
-            return wcslen(m_bstr);
+            return std::char_traits<char16_t>::length(InternalChars());
         }
 
         std::wstring to_wstring() const
         {
-            return *this ? std::wstring(m_bstr) : std::wstring();
+            return *this ? Utf16ToWide(InternalChars()) : std::wstring();
+        }
+
+        // The whole BSTR, up to SysStringLen(), without copying. The view is
+        // valid until the UBSTR is changed or destroyed.
+        std::u16string_view u16view() const noexcept
+        {
+            return *this ? std::u16string_view(InternalChars(), SysStringLen(m_bstr)) : std::u16string_view();
+        }
+
+        std::u16string to_u16string() const
+        {
+            return std::u16string(u16view());
         }
 
         BSTR get() const noexcept { return m_bstr; }
+
+    private:
+        char16_t const* InternalChars() const noexcept
+        {
+            return reinterpret_cast<char16_t const*>(m_bstr);
+        }
+
+        // A BSTR that a callee stores through set() is not recorded until
+        // it is freed, and one taken by detach() is not recorded as freed,
+        // so a trace can have a BstrFree without a BstrAlloc and the reverse.
+        // attach() records the BSTR it takes as allocated.
+        void InternalRecordAlloc() const noexcept
+        {
+            if (m_bstr) COMTOOLS_RECORD(BstrAlloc, UBSTR, m_bstr, SysStringLen(m_bstr));
+        }
+
+        void InternalRecordFree() const noexcept
+        {
+            if (m_bstr) COMTOOLS_RECORD(BstrFree, UBSTR, m_bstr, 0);
+        }
+
+        static BSTR InternalAlloc(wchar_t const* const wsz) noexcept
+        {
+            if constexpr (WideIsUtf16)
+            {
+                return SysAllocString(reinterpret_cast<OLECHAR const*>(wsz));
+            }
+            else
+            {
+                if (!wsz) return nullptr;
+
+                // Counts the UTF-16 length first, so the text is converted
+                // straight into the new BSTR
+                auto const src = reinterpret_cast<InternalWide32 const*>(wsz);
+                size_t const n = std::char_traits<InternalWide32>::length(src);
+                size_t cch = n;
+                for (size_t i = 0; i < n; ++i)
+                {
+                    if (static_cast<char32_t>(src[i]) - 0x10000 < 0x100000) ++cch;
+                }
+
+                if (cch > MAXUINT) return nullptr;
+                BSTR bstr = SysAllocStringLen(nullptr, static_cast<UINT>(cch));
+                if (bstr) InternalUtf32ToUtf16(src, n, reinterpret_cast<char16_t*>(bstr));
+                return bstr;
+            }
+        }
     };
 }
 
@@ -0,0 +1,364 @@
+// usafearray.h ///////////////////////////////////////////////////////////////
+//
+// ComTools::USafeArray C++ wrapper for SAFEARRAYs
+//
+// ComTools::USafeArray is released under the MIT license.
+//
+// Copyright (c) 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef USAFEARRAY_H
+#define USAFEARRAY_H
+
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <initializer_list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ComTools {
+
+    // SafeArrayTraits: VARTYPE of the elements of a USafeArray<T>
+    template<typename T>
+    struct SafeArrayTraits;
+
+    template<> struct SafeArrayTraits<unsigned char> { static VARTYPE const vt = VT_UI1; };
+    template<> struct SafeArrayTraits<short> { static VARTYPE const vt = VT_I2; };
+    template<> struct SafeArrayTraits<unsigned short> { static VARTYPE const vt = VT_UI2; };
+    template<> struct SafeArrayTraits<int> { static VARTYPE const vt = VT_I4; };
+    template<> struct SafeArrayTraits<long> { static VARTYPE const vt = VT_I4; };
+    template<> struct SafeArrayTraits<unsigned long> { static VARTYPE const vt = VT_UI4; };
+    template<> struct SafeArrayTraits<long long> { static VARTYPE const vt = VT_I8; };
+    template<> struct SafeArrayTraits<float> { static VARTYPE const vt = VT_R4; };
+    template<> struct SafeArrayTraits<double> { static VARTYPE const vt = VT_R8; };
+    template<> struct SafeArrayTraits<BSTR> { static VARTYPE const vt = VT_BSTR; };
+    template<> struct SafeArrayTraits<VARIANT> { static VARTYPE const vt = VT_VARIANT; };
+    template<> struct SafeArrayTraits<IUnknown*> { static VARTYPE const vt = VT_UNKNOWN; };
+    template<> struct SafeArrayTraits<IDispatch*> { static VARTYPE const vt = VT_DISPATCH; };
+
+    // SafeArrayAccess: Keeps a SAFEARRAY locked with SafeArrayAccessData
+    // while it is in scope, so element access is a plain memory access. Each
+    // accessor holds its own lock and copy of the layout, so threads can read
+    // one array through accessors of their own, and the array can be resized
+    // or destroyed by others once the accessors are gone. Elements that own
+    // resources (BSTRs, VARIANTs, and interface pointers) are accessed raw:
+    // assigning to one does not free its previous value. T may be const.
+    template<typename T>
+    class SafeArrayAccess {
+        using Element = std::remove_const_t<T>;
+        static UINT const max_dims = 8;
+
+        SAFEARRAY* m_psa = nullptr;     // Locked, or nullptr
+        T* m_data = nullptr;
+        size_t m_size = 0;
+        UINT m_dims = 0;
+        LONG m_lbound[max_dims] = {};
+        size_t m_extent[max_dims] = {};
+        size_t m_stride[max_dims] = {};
+
+        template<typename... Indices>
+        size_t InternalOffset(Indices... indices) const noexcept
+        {
+            size_t offset = 0;
+            UINT d = 0;
+            ((offset += static_cast<size_t>(static_cast<LONG>(indices) - m_lbound[d]) * m_stride[d], ++d), ...);
+            return offset;
+        }
+
+    public:
+        // Arrays that are null or whose elements are not of type T are not
+        // locked and have no elements
+        explicit SafeArrayAccess(SAFEARRAY* psa) noexcept
+        {
+            if (!psa) return;
+
+            VARTYPE vt = VT_EMPTY;
+            if (FAILED(SafeArrayGetVartype(psa, &vt))) return;
+            if (vt != SafeArrayTraits<Element>::vt) return;
+            if (SafeArrayGetElemsize(psa) != sizeof(T)) return;
+
+            UINT const dims = SafeArrayGetDim(psa);
+            if (dims == 0 || dims > max_dims) return;
+
+            // Elements are stored with the left-most index varying fastest
+            size_t size = 1;
+            for (UINT d = 0; d < dims; ++d)
+            {
+                LONG lb = 0;
+                LONG ub = 0;
+                if (FAILED(SafeArrayGetLBound(psa, d + 1, &lb))) return;
+                if (FAILED(SafeArrayGetUBound(psa, d + 1, &ub))) return;
+                m_lbound[d] = lb;
+                m_extent[d] = ub < lb ? 0 : static_cast<size_t>(ub) - lb + 1;
+                m_stride[d] = size;
+                size *= m_extent[d];
+            }
+
+            void* pv = nullptr;
+            if (FAILED(SafeArrayAccessData(psa, &pv))) return;
+            m_psa = psa;
+            m_data = static_cast<T*>(pv);
+            m_size = size;
+            m_dims = dims;
+        }
+
+        ~SafeArrayAccess() noexcept
+        {
+            if (m_psa) SafeArrayUnaccessData(m_psa);
+        }
+
+        SafeArrayAccess(SafeArrayAccess const&) = delete;
+        SafeArrayAccess& operator=(SafeArrayAccess const&) = delete;
+
+        explicit operator bool() const noexcept { return m_psa != nullptr; }
+
+        UINT dims() const noexcept { return m_dims; }
+
+        size_t size() const noexcept { return m_size; }
+
+        // dim is zero-based, from the left-most dimension
+        size_t extent(UINT dim) const noexcept
+        {
+            return dim < m_dims ? m_extent[dim] : 0;
+        }
+
+        LONG lbound(UINT dim) const noexcept
+        {
+            return dim < m_dims ? m_lbound[dim] : 0;
+        }
+
+        T* data() const noexcept { return m_data; }
+
+        std::span<T> span() const noexcept { return { m_data, m_size }; }
+
+        T* begin() const noexcept { return m_data; }
+        T* end() const noexcept { return m_data + m_size; }
+
+        // Element i of the data in storage order (not bounds checked)
+        T& operator[](size_t i) const noexcept { return m_data[i]; }
+
+        // Element at the given indices, which include the lower bounds and
+        // are listed from the left-most dimension (not bounds checked)
+        template<typename... Indices>
+        T& operator()(Indices... indices) const noexcept
+        {
+            return m_data[InternalOffset(indices...)];
+        }
+    };
+
+    // USafeArray: Owns a SAFEARRAY whose elements are of type T. The array
+    // is not kept locked; access() locks it for as long as the returned
+    // SafeArrayAccess is in scope.
+    template<typename T>
+    class USafeArray {
+        SAFEARRAY* m_psa = nullptr;
+
+        void InternalRelease() noexcept
+        {
+            SAFEARRAY* temp = m_psa;
+            if (temp)
+            {
+                m_psa = nullptr;
+                SafeArrayDestroy(temp);
+            }
+        }
+
+    public:
+        friend void swap(USafeArray& a, USafeArray& b) noexcept
+        {
+            std::swap(a.m_psa, b.m_psa);
+        }
+
+        friend SAFEARRAY** set(USafeArray& obj) noexcept
+        {
+            obj.InternalRelease();
+            return &obj.m_psa;
+        }
+
+        friend void attach(USafeArray& obj, SAFEARRAY* psa) noexcept
+        {
+            obj.InternalRelease();
+            obj.m_psa = psa;
+        }
+
+        friend SAFEARRAY* detach(USafeArray& obj) noexcept
+        {
+            SAFEARRAY* temp = obj.m_psa;
+            obj.m_psa = nullptr;
+            return temp;
+        }
+
+        USafeArray() noexcept = default;
+
+        ~USafeArray() noexcept { InternalRelease(); }
+
+        // One-dimensional array
+        explicit USafeArray(ULONG count, LONG lbound = 0) noexcept :
+            m_psa(SafeArrayCreateVector(SafeArrayTraits<T>::vt, lbound, count)) { }
+
+        // Bounds are listed from the left-most dimension, as in
+        // SafeArrayCreate
+        explicit USafeArray(std::initializer_list<SAFEARRAYBOUND> bounds) noexcept :
+            m_psa(SafeArrayCreate(
+                SafeArrayTraits<T>::vt,
+                static_cast<UINT>(bounds.size()),
+                const_cast<SAFEARRAYBOUND*>(bounds.begin()))) { }
+
+        USafeArray(USafeArray const& obj) noexcept
+        {
+            if (obj.m_psa && FAILED(SafeArrayCopy(obj.m_psa, &m_psa))) m_psa = nullptr;
+        }
+
+        USafeArray(USafeArray&& obj) noexcept { swap(*this, obj); }
+
+        USafeArray& operator=(USafeArray obj) noexcept
+        {
+            swap(*this, obj);
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return m_psa != nullptr; }
+
+        SAFEARRAY* get() const noexcept { return m_psa; }
+
+        // The elements, locked while the result is in scope. The result has
+        // no elements if the array is null or its elements are not of type T.
+        SafeArrayAccess<T> access() noexcept { return SafeArrayAccess<T>(m_psa); }
+        SafeArrayAccess<T const> access() const noexcept { return SafeArrayAccess<T const>(m_psa); }
+    };
+
+    // Calls f(begin, end) for consecutive ranges that together cover
+    // [0, count), on the system thread pool and the calling thread, if there
+    // are at least min_per_thread items per range. The calling thread takes
+    // ranges too, so the call finishes even if the pool is busy. Exceptions
+    // thrown by f are rethrown after all ranges have finished.
+    template<typename F>
+    void ParallelRanges(size_t count, size_t min_per_thread, F&& f)
+    {
+        size_t ranges = min_per_thread ? count / min_per_thread : count;
+        ranges = std::min<size_t>(ranges, std::thread::hardware_concurrency());
+        if (ranges <= 1)
+        {
+            f(size_t(0), count);
+            return;
+        }
+
+        struct Shared {
+            std::remove_reference_t<F>& f;
+            size_t count;
+            size_t chunk;
+            size_t ranges;
+            std::atomic<size_t> next;
+            std::vector<std::exception_ptr> errors;
+
+            void Run() noexcept
+            {
+                for (size_t r; (r = next.fetch_add(1)) < ranges;)
+                {
+                    try
+                    {
+                        f(r * chunk, std::min(count, (r + 1) * chunk));
+                    }
+                    catch (...)
+                    {
+                        errors[r] = std::current_exception();
+                    }
+                }
+            }
+
+            static void CALLBACK Work(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WORK) noexcept
+            {
+                static_cast<Shared*>(context)->Run();
+            }
+        };
+
+        Shared shared{ f, count, (count + ranges - 1) / ranges, ranges, 0, std::vector<std::exception_ptr>(ranges) };
+
+        // If the work cannot be created, the ranges are processed here
+        PTP_WORK work = CreateThreadpoolWork(&Shared::Work, &shared, nullptr);
+        if (work)
+        {
+            for (size_t i = 1; i < ranges; ++i) SubmitThreadpoolWork(work);
+        }
+
+        shared.Run();
+        if (work)
+        {
+            WaitForThreadpoolWorkCallbacks(work, FALSE);
+            CloseThreadpoolWork(work);
+        }
+
+        for (auto& e : shared.errors)
+        {
+            if (e) std::rethrow_exception(e);
+        }
+    }
+
+    // Borrowed views of the strings in a BSTR array. The views are valid
+    // until the array is modified or released.
+    inline std::vector<std::wstring_view> to_wstring_views(USafeArray<BSTR> const& a)
+    {
+        auto const access = a.access();
+        auto const in = access.span();
+        std::vector<std::wstring_view> out(in.size());
+        ParallelRanges(in.size(), 65536, [&in, &out](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                out[i] = std::wstring_view(in[i], SysStringLen(in[i]));
+            }
+        });
+        return out;
+    }
+
+    // UTF-8 copies of the strings in a BSTR array
+    inline std::vector<std::string> to_utf8(USafeArray<BSTR> const& a)
+    {
+        auto const access = a.access();
+        auto const in = access.span();
+        std::vector<std::string> out(in.size());
+        ParallelRanges(in.size(), 4096, [&in, &out](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                int const cch = static_cast<int>(SysStringLen(in[i]));
+                if (cch == 0) continue;
+                int const cb = WideCharToMultiByte(
+                    CP_UTF8, 0, in[i], cch, nullptr, 0, nullptr, nullptr);
+                out[i].resize(static_cast<size_t>(cb));
+                WideCharToMultiByte(
+                    CP_UTF8, 0, in[i], cch, out[i].data(), cb, nullptr, nullptr);
+            }
+        });
+        return out;
+    }
+}
+
+#endif  // USAFEARRAY_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,381 @@
+// uvariant.h /////////////////////////////////////////////////////////////////
+//
+// ComTools::UVARIANT C++ wrapper for VARIANTs
+//
+// ComTools::UVARIANT is released under the MIT license.
+//
+// Copyright (c) 2022, Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#ifndef UVARIANT_H
+#define UVARIANT_H
+
+#include <Windows.h>
+#include <utility>
+#include <type_traits>
+#include "iptr.h"
+#include "ubstr.h"
+
+namespace ComTools {
+
+    // VariantTraits: VARTYPE and union member for each scalar type that a
+    // UVARIANT can hold without allocating
+    template<typename T>
+    struct VariantTraits;
+
+    template<>
+    struct VariantTraits<bool> {
+        static VARTYPE const vt = VT_BOOL;
+        static bool load(VARIANT const& v) noexcept { return v.boolVal != VARIANT_FALSE; }
+        static void store(VARIANT& v, bool b) noexcept { v.boolVal = b ? VARIANT_TRUE : VARIANT_FALSE; }
+    };
+
+    template<>
+    struct VariantTraits<char> {
+        static VARTYPE const vt = VT_I1;
+        static char load(VARIANT const& v) noexcept { return v.cVal; }
+        static void store(VARIANT& v, char c) noexcept { v.cVal = c; }
+    };
+
+    template<>
+    struct VariantTraits<unsigned char> {
+        static VARTYPE const vt = VT_UI1;
+        static unsigned char load(VARIANT const& v) noexcept { return v.bVal; }
+        static void store(VARIANT& v, unsigned char b) noexcept { v.bVal = b; }
+    };
+
+    template<>
+    struct VariantTraits<short> {
+        static VARTYPE const vt = VT_I2;
+        static short load(VARIANT const& v) noexcept { return v.iVal; }
+        static void store(VARIANT& v, short i) noexcept { v.iVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<unsigned short> {
+        static VARTYPE const vt = VT_UI2;
+        static unsigned short load(VARIANT const& v) noexcept { return v.uiVal; }
+        static void store(VARIANT& v, unsigned short i) noexcept { v.uiVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<int> {
+        static VARTYPE const vt = VT_I4;
+        static int load(VARIANT const& v) noexcept { return v.lVal; }
+        static void store(VARIANT& v, int i) noexcept { v.lVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<unsigned int> {
+        static VARTYPE const vt = VT_UI4;
+        static unsigned int load(VARIANT const& v) noexcept { return v.ulVal; }
+        static void store(VARIANT& v, unsigned int i) noexcept { v.ulVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<long> {
+        static VARTYPE const vt = VT_I4;
+        static long load(VARIANT const& v) noexcept { return v.lVal; }
+        static void store(VARIANT& v, long i) noexcept { v.lVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<unsigned long> {
+        static VARTYPE const vt = VT_UI4;
+        static unsigned long load(VARIANT const& v) noexcept { return v.ulVal; }
+        static void store(VARIANT& v, unsigned long i) noexcept { v.ulVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<long long> {
+        static VARTYPE const vt = VT_I8;
+        static long long load(VARIANT const& v) noexcept { return v.llVal; }
+        static void store(VARIANT& v, long long i) noexcept { v.llVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<unsigned long long> {
+        static VARTYPE const vt = VT_UI8;
+        static unsigned long long load(VARIANT const& v) noexcept { return v.ullVal; }
+        static void store(VARIANT& v, unsigned long long i) noexcept { v.ullVal = i; }
+    };
+
+    template<>
+    struct VariantTraits<float> {
+        static VARTYPE const vt = VT_R4;
+        static float load(VARIANT const& v) noexcept { return v.fltVal; }
+        static void store(VARIANT& v, float f) noexcept { v.fltVal = f; }
+    };
+
+    template<>
+    struct VariantTraits<double> {
+        static VARTYPE const vt = VT_R8;
+        static double load(VARIANT const& v) noexcept { return v.dblVal; }
+        static void store(VARIANT& v, double d) noexcept { v.dblVal = d; }
+    };
+
+    // Arguments passed to UVARIANT::visit() for VT_EMPTY and VT_NULL
+    struct VariantEmpty { };
+    struct VariantNull { };
+
+    class UVARIANT {
+        VARIANT m_var;
+
+        template<typename T>
+        using EnableScalar = decltype(VariantTraits<T>::vt, void());
+
+        void InternalInit() noexcept
+        {
+            m_var.vt = VT_EMPTY;
+            m_var.wReserved1 = m_var.wReserved2 = m_var.wReserved3 = 0;
+        }
+
+        // The common cases are handled inline. Everything else goes through
+        // VariantClear and VariantCopy.
+        void InternalClear() noexcept
+        {
+            switch (m_var.vt)
+            {
+            case VT_BSTR:
+                SysFreeString(m_var.bstrVal);
+                break;
+
+            case VT_UNKNOWN:
+            case VT_DISPATCH:
+                if (m_var.punkVal) m_var.punkVal->Release();
+                break;
+
+            default:
+                if (!IsScalar(m_var.vt)) VariantClear(&m_var);
+                break;
+            }
+
+            m_var.vt = VT_EMPTY;
+        }
+
+        void InternalCopy(VARIANT const& other) noexcept
+        {
+            switch (other.vt)
+            {
+            case VT_BSTR:
+                m_var = other;
+                m_var.bstrVal = other.bstrVal ?
+                    SysAllocStringLen(other.bstrVal, SysStringLen(other.bstrVal)) :
+                    nullptr;
+                if (other.bstrVal && !m_var.bstrVal) m_var.vt = VT_EMPTY;
+                break;
+
+            case VT_UNKNOWN:
+            case VT_DISPATCH:
+                m_var = other;
+                if (m_var.punkVal) m_var.punkVal->AddRef();
+                break;
+
+            default:
+                if (IsScalar(other.vt))
+                {
+                    m_var = other;
+                }
+                else
+                {
+                    InternalInit();
+                    if (FAILED(VariantCopy(&m_var, &other))) m_var.vt = VT_EMPTY;
+                }
+                break;
+            }
+        }
+
+    public:
+        // True if the VARTYPE owns no resources, so that the VARIANT can be
+        // copied and destroyed bitwise
+        static bool IsScalar(VARTYPE vt) noexcept
+        {
+            if (vt & VT_BYREF) return true;
+            if (vt & VT_ARRAY) return false;
+            switch (vt)
+            {
+            case VT_BSTR:
+            case VT_UNKNOWN:
+            case VT_DISPATCH:
+            case VT_RECORD:
+                return false;
+            default:
+                return true;
+            }
+        }
+
+        friend void swap(UVARIANT& a, UVARIANT& b) noexcept
+        {
+            std::swap(a.m_var, b.m_var);
+        }
+
+        friend VARIANT* set(UVARIANT& obj) noexcept
+        {
+            obj.InternalClear();
+            return &obj.m_var;
+        }
+
+        friend void attach(UVARIANT& obj, VARIANT const& var) noexcept
+        {
+            obj.InternalClear();
+            obj.m_var = var;
+        }
+
+        friend VARIANT detach(UVARIANT& obj) noexcept
+        {
+            VARIANT temp = obj.m_var;
+            obj.InternalInit();
+            return temp;
+        }
+
+        UVARIANT() noexcept { InternalInit(); }
+
+        ~UVARIANT() noexcept { InternalClear(); }
+
+        template<typename T, typename = EnableScalar<T>>
+        UVARIANT(T value) noexcept
+        {
+            InternalInit();
+            m_var.vt = VariantTraits<T>::vt;
+            VariantTraits<T>::store(m_var, value);
+        }
+
+        explicit UVARIANT(wchar_t const* const wsz) noexcept
+        {
+            InternalInit();
+            m_var.bstrVal = SysAllocString(wsz);
+            if (m_var.bstrVal || !wsz) m_var.vt = VT_BSTR;
+        }
+
+        explicit UVARIANT(UBSTR const& s) noexcept : UVARIANT(UBSTR(s)) { }
+
+        // Takes ownership of the BSTR without copying it
+        UVARIANT(UBSTR&& s) noexcept
+        {
+            InternalInit();
+            m_var.vt = VT_BSTR;
+            m_var.bstrVal = detach(s);
+        }
+
+        // T is a COM interface
+        template<typename T>
+        explicit UVARIANT(IPtr<T> const& p) noexcept : UVARIANT(IPtr<T>(p)) { }
+
+        // Takes ownership of the interface pointer without AddRef
+        template<typename T>
+        UVARIANT(IPtr<T>&& p) noexcept
+        {
+            InternalInit();
+            if constexpr (std::is_base_of<IDispatch, T>::value)
+            {
+                m_var.vt = VT_DISPATCH;
+                m_var.pdispVal = detach(p);
+            }
+            else
+            {
+                m_var.vt = VT_UNKNOWN;
+                m_var.punkVal = detach(p);
+            }
+        }
+
+        explicit UVARIANT(VARIANT const& var) noexcept { InternalCopy(var); }
+
+        UVARIANT(UVARIANT const& obj) noexcept { InternalCopy(obj.m_var); }
+
+        UVARIANT(UVARIANT&& obj) noexcept : m_var(obj.m_var) { obj.InternalInit(); }
+
+        UVARIANT& operator=(UVARIANT obj) noexcept
+        {
+            swap(*this, obj);
+            return *this;
+        }
+
+        // Scalars are assigned in place
+        template<typename T, typename = EnableScalar<T>>
+        UVARIANT& operator=(T value) noexcept
+        {
+            InternalClear();
+            m_var.vt = VariantTraits<T>::vt;
+            VariantTraits<T>::store(m_var, value);
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return m_var.vt != VT_EMPTY; }
+
+        VARTYPE vt() const noexcept { return m_var.vt; }
+
+        VARIANT const& get() const noexcept { return m_var; }
+
+        template<typename T, typename = EnableScalar<T>>
+        bool holds() const noexcept
+        {
+            return m_var.vt == VariantTraits<T>::vt;
+        }
+
+        // Precondition: holds<T>()
+        template<typename T, typename = EnableScalar<T>>
+        T as() const noexcept
+        {
+            return VariantTraits<T>::load(m_var);
+        }
+
+        // Calls f with the contents of the VARIANT as a C++ type. BSTRs and
+        // interface pointers are borrowed. Types without a C++ counterpart
+        // (for example, VT_CY, VT_DATE, arrays, and references) are passed
+        // as VARIANT const&. All calls to f must return the same type.
+        template<typename F>
+        decltype(auto) visit(F&& f) const
+        {
+            switch (m_var.vt)
+            {
+            case VT_EMPTY:      return f(VariantEmpty());
+            case VT_NULL:       return f(VariantNull());
+            case VT_BOOL:       return f(VariantTraits<bool>::load(m_var));
+            case VT_I1:         return f(m_var.cVal);
+            case VT_UI1:        return f(m_var.bVal);
+            case VT_I2:         return f(m_var.iVal);
+            case VT_UI2:        return f(m_var.uiVal);
+            case VT_I4:         return f(m_var.lVal);
+            case VT_UI4:        return f(m_var.ulVal);
+            case VT_INT:        return f(m_var.intVal);
+            case VT_UINT:       return f(m_var.uintVal);
+            case VT_I8:         return f(m_var.llVal);
+            case VT_UI8:        return f(m_var.ullVal);
+            case VT_R4:         return f(m_var.fltVal);
+            case VT_R8:         return f(m_var.dblVal);
+            case VT_BSTR:       return f(m_var.bstrVal);
+            case VT_UNKNOWN:    return f(m_var.punkVal);
+            case VT_DISPATCH:   return f(m_var.pdispVal);
+            default:            return f(m_var);
+            }
+        }
+    };
+
+    // Passes a UVARIANT to Dispatch (dispatch.h) without copying it
+    inline void to_variantarg(VARIANTARG& v, UVARIANT const& var) noexcept
+    {
+        v = var.get();
+    }
+}
+
+#endif  // UVARIANT_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,183 @@
+// test_bstrcmp.cpp: Test ComTools::BstrEqual, BstrCompareNoCase, BstrFind ////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "bstrcmp.h"
+#include <algorithm>
+#include <chrono>
+#include <cwctype>
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // Case-insensitive comparison by copying and lowercasing, for comparison
+    bool LowerEqual(BSTR a, BSTR b)
+    {
+        std::wstring x(a, SysStringLen(a));
+        std::wstring y(b, SysStringLen(b));
+        std::transform(x.begin(), x.end(), x.begin(), [](wchar_t c) { return static_cast<wchar_t>(towlower(c)); });
+        std::transform(y.begin(), y.end(), y.begin(), [](wchar_t c) { return static_cast<wchar_t>(towlower(c)); });
+        return x == y;
+    }
+
+    TEST_CLASS(TestBstrCmp)
+    {
+    public:
+        TEST_METHOD(Equal)
+        {
+            UBSTR a(L"This is a string.");
+            UBSTR b(L"This is a string.");
+            UBSTR c(L"This is a String.");
+            Assert::IsTrue(BstrEqual(a, b));
+            Assert::IsFalse(BstrEqual(a, c));
+            Assert::IsTrue(BstrEqualNoCase(a, c));
+            Assert::IsFalse(BstrEqualNoCase(a, UBSTR(L"This is a string")));
+
+            // A null BSTR is empty
+            UBSTR empty(L"");
+            Assert::IsTrue(BstrEqual(UBSTR(), empty));
+            Assert::IsTrue(BstrEqualNoCase(UBSTR(), UBSTR()));
+            Assert::AreEqual(0, BstrCompareNoCase(UBSTR(), empty));
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(), a) < 0);
+
+            // Embedded nulls are compared
+            UBSTR x;
+            UBSTR y;
+            attach(x, SysAllocStringLen(L"ab\0cd", 5));
+            attach(y, SysAllocStringLen(L"AB\0CE", 5));
+            Assert::IsFalse(BstrEqualNoCase(x, y));
+            Assert::IsTrue(BstrCompareNoCase(x, y) < 0);
+            Assert::AreEqual(size_t(3), BstrFind(x, UBSTR(L"cd")));
+        }
+
+        TEST_METHOD(NonAscii)
+        {
+            UBSTR a(L"Café мир αβγ");
+            UBSTR b(L"CAFÉ МИР ΑΒΓ");
+            Assert::IsFalse(BstrEqual(a, b));
+            Assert::IsTrue(BstrEqualNoCase(a, b));
+            Assert::AreEqual(0, BstrCompareNoCase(a, b));
+            Assert::AreEqual(BstrHashNoCase(a), BstrHashNoCase(b));
+
+            Assert::IsFalse(BstrEqualNoCase(UBSTR(L"café"), UBSTR(L"cafe")));
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(L"cafe"), UBSTR(L"café")) < 0);
+        }
+
+        TEST_METHOD(Ordering)
+        {
+            // Strings are ordered by the uppercase of each code unit, so '_'
+            // sorts after letters, and a prefix sorts first
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(L"apple"), UBSTR(L"BANANA")) < 0);
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(L"Banana"), UBSTR(L"apple")) > 0);
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(L"a_b"), UBSTR(L"AZB")) > 0);
+            Assert::IsTrue(BstrCompareNoCase(UBSTR(L"abc"), UBSTR(L"ABCD")) < 0);
+
+            // Differences at every position of strings that span several
+            // vector blocks, with and without non-ASCII characters
+            for (size_t n = 1; n < 100; ++n)
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    std::wstring lower(n, L'q');
+                    std::wstring upper(n, L'Q');
+                    if (n > 40) lower[n / 2] = L'é', upper[n / 2] = L'É';
+
+                    UBSTR a(lower);
+                    Assert::IsTrue(BstrEqualNoCase(a, UBSTR(upper)));
+                    Assert::AreEqual(BstrHashNoCase(a), BstrHashNoCase(UBSTR(upper)));
+
+                    std::wstring other(upper);
+                    other[i] = other[i] == L'Q' ? L'R' : L'Ê';
+                    UBSTR b(other);
+                    Assert::IsFalse(BstrEqual(a, b));
+                    Assert::IsFalse(BstrEqualNoCase(a, b));
+                    Assert::IsTrue(BstrCompareNoCase(a, b) < 0);
+                    Assert::IsTrue(BstrCompareNoCase(b, a) > 0);
+
+                    other = lower;
+                    other[i] = L'p';
+                    Assert::IsFalse(BstrEqual(a, UBSTR(other)));
+                }
+            }
+        }
+
+        TEST_METHOD(Find)
+        {
+            UBSTR s(L"The quick brown fox jumps over the lazy dog. The quick brown fox.");
+            Assert::AreEqual(size_t(0), BstrFind(s, UBSTR(L"The")));
+            Assert::AreEqual(size_t(16), BstrFind(s, UBSTR(L"fox")));
+            Assert::AreEqual(size_t(43), BstrFind(s, UBSTR(L".")));
+            Assert::AreEqual(size_t(40), BstrFind(s, UBSTR(L"dog. The quick")));
+            Assert::AreEqual(size_t(63), BstrFind(s, UBSTR(L"x.")));
+            Assert::AreEqual(BstrNotFound, BstrFind(s, UBSTR(L"cat")));
+            Assert::AreEqual(BstrNotFound, BstrFind(s, UBSTR(L"the quick")));
+            Assert::AreEqual(size_t(0), BstrFind(s, UBSTR()));
+            Assert::AreEqual(BstrNotFound, BstrFind(UBSTR(), s));
+
+            // Matches at every position
+            for (size_t n = 1; n < 80; ++n)
+            {
+                for (size_t m = 1; m <= n && m < 20; ++m)
+                {
+                    std::wstring pattern(m, L'b');
+                    pattern[0] = L'a';
+                    for (size_t i = 0; i + m <= n; ++i)
+                    {
+                        std::wstring text(n, L'b');
+                        text.replace(i, m, pattern);
+                        Assert::AreEqual(i, BstrFind(text.data(), n, pattern.data(), m));
+                    }
+                }
+            }
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Case-insensitive comparison of mostly-equal identifiers
+            std::vector<UBSTR> names;
+            std::vector<UBSTR> upper;
+            for (int i = 0; i < 1000; ++i)
+            {
+                std::wstring name = L"Property_Name_For_Object_Number_" + std::to_wstring(i);
+                names.emplace_back(name);
+                std::transform(name.begin(), name.end(), name.begin(), [](wchar_t c) { return static_cast<wchar_t>(towupper(c)); });
+                upper.emplace_back(name);
+            }
+
+            int const rounds = 100;
+            long long matches1 = 0;
+            long long matches2 = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (size_t i = 0; i < names.size(); ++i) matches1 += LowerEqual(names[i].get(), upper[(i + r % 2) % names.size()].get());
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (size_t i = 0; i < names.size(); ++i) matches2 += BstrEqualNoCase(names[i], upper[(i + r % 2) % names.size()]);
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            Assert::AreEqual(matches1, matches2);
+            Assert::AreEqual(static_cast<long long>(names.size() * rounds / 2), matches2);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / (rounds * names.size())); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Case-insensitive equality: copy and lowercase %lld ns, BstrEqualNoCase %lld ns\r\n",
+                per(t1 - t0), per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
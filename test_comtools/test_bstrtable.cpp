@@ -0,0 +1,210 @@
+// test_bstrtable.cpp: Test ComTools::BstrTableWriter, BstrTable //////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "bstrtable.h"
+#include "ubstr.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // Path in the temporary directory, removed on destruction
+    class TablePath {
+        std::filesystem::path m_path;
+
+    public:
+        explicit TablePath(wchar_t const* name)
+            : m_path(std::filesystem::temp_directory_path() / name) { }
+
+        ~TablePath()
+        {
+            std::error_code ec;
+            std::filesystem::remove(m_path, ec);
+        }
+
+        std::filesystem::path const& file() const noexcept
+        {
+            return m_path;
+        }
+
+        std::wstring path() const
+        {
+            return m_path.wstring();
+        }
+    };
+
+    GUID RowGuid(unsigned long i)
+    {
+        return { static_cast<unsigned long>(i * 2654435761UL & 0xFFFFFFFF), static_cast<unsigned short>(i), 0x4A5B,
+            { 0x8C, 0x1D, 0x2E, 0x3F, 0x40, 0x51, 0x62, static_cast<unsigned char>(i) } };
+    }
+
+    std::wstring RowName(unsigned long i)
+    {
+        return L"IInterfaceName" + std::to_wstring(i) + L" (localized description of the interface)";
+    }
+
+    TEST_CLASS(TestBstrTable)
+    {
+    public:
+        TEST_METHOD(RoundTrip)
+        {
+            TablePath file(L"comtools_bstrtable.bin");
+            BstrTableWriter writer;
+            Assert::AreEqual(S_OK, writer.Add(RowGuid(3), L"Third"));
+            Assert::AreEqual(S_OK, writer.Add(RowGuid(1), L"First"));
+            Assert::AreEqual(S_OK, writer.Add(RowGuid(2), L""));
+            Assert::AreEqual(S_OK, writer.Add(RowGuid(4), L"First"));
+            Assert::AreEqual(S_OK, writer.Save(file.path().c_str()));
+
+            std::shared_ptr<BstrTable const> table;
+            Assert::AreEqual(S_OK, BstrTable::Open(file.path().c_str(), &table));
+            Assert::AreEqual(size_t(4), table->Size());
+            Assert::IsTrue(RowGuid(3) == table->Guid(0));
+            Assert::IsTrue(table->View(0) == L"Third");
+            Assert::IsTrue(table->View(2).empty());
+
+            // The strings are BSTRs
+            BSTR bstr = table->Bstr(1);
+            Assert::AreEqual(5U, static_cast<unsigned>(SysStringLen(bstr)));
+            Assert::AreEqual(L"First", bstr);
+            Assert::AreEqual(0U, static_cast<unsigned>(SysStringLen(table->Bstr(2))));
+            Assert::IsNull(table->Bstr(4));
+
+            // Identical strings are stored once
+            Assert::IsTrue(table->Bstr(1) == table->Bstr(3));
+
+            Assert::AreEqual(size_t(1), table->Find(RowGuid(1)));
+            Assert::AreEqual(size_t(3), table->Find(RowGuid(4)));
+            Assert::AreEqual(BstrTableNotFound, table->Find(RowGuid(5)));
+        }
+
+        TEST_METHOD(BadImage)
+        {
+            TablePath file(L"comtools_bstrtable_bad.bin");
+            BstrTableWriter writer;
+            writer.Add(RowGuid(1), L"First");
+            std::vector<BYTE> image;
+            Assert::AreEqual(S_OK, writer.Build(image));
+
+            auto save = [&](std::vector<BYTE> const& data) {
+                std::ofstream out(file.file(), std::ios::binary | std::ios::trunc);
+                out.write(reinterpret_cast<char const*>(data.data()), static_cast<std::streamsize>(data.size()));
+            };
+
+            std::shared_ptr<BstrTable const> table;
+            auto damaged = image;
+            damaged[0] ^= 1;
+            save(damaged);
+            Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_BAD_FORMAT), BstrTable::Open(file.path().c_str(), &table));
+            Assert::IsFalse((bool)table);
+
+            damaged = image;
+            damaged.pop_back();
+            save(damaged);
+            Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_BAD_FORMAT), BstrTable::Open(file.path().c_str(), &table));
+
+            // A row whose string is damaged has no string
+            damaged = image;
+            damaged[damaged.size() - 16] ^= 1;
+            save(damaged);
+            Assert::AreEqual(S_OK, BstrTable::Open(file.path().c_str(), &table));
+            Assert::IsNull(table->Bstr(0));
+            Assert::IsTrue(table->View(0).empty());
+
+            // So does a row whose string is not terminated
+            table.reset();
+            wchar_t const first[] = L"First";
+            auto const* bytes = reinterpret_cast<BYTE const*>(first);
+            auto it = std::search(image.begin(), image.end(), bytes, bytes + sizeof(first));
+            Assert::IsTrue(it != image.end());
+            damaged = image;
+            damaged[(it - image.begin()) + sizeof(first) - sizeof(wchar_t)] = 'x';
+            save(damaged);
+            Assert::AreEqual(S_OK, BstrTable::Open(file.path().c_str(), &table));
+            Assert::IsNull(table->Bstr(0));
+            Assert::IsTrue(table->View(0).empty());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Load 20000 names from text, allocating a BSTR for each, or
+            // from an image
+            unsigned long const count = 20000;
+            TablePath text(L"comtools_bstrtable.txt");
+            TablePath binary(L"comtools_bstrtable_timing.bin");
+            {
+                std::wofstream out(text.file(), std::ios::trunc);
+                BstrTableWriter writer;
+                for (unsigned long i = 0; i < count; ++i)
+                {
+                    GUID guid = RowGuid(i);
+                    out << std::hex << guid.Data1 << L' ' << guid.Data2 << L' ' << guid.Data3;
+                    for (auto b : guid.Data4) out << L' ' << b;
+                    out << std::dec << L'\t' << RowName(i) << L'\n';
+                    writer.Add(guid, RowName(i));
+                }
+
+                Assert::AreEqual(S_OK, writer.Save(binary.path().c_str()));
+            }
+
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<std::pair<GUID, UBSTR>> parsed;
+            {
+                std::wifstream in(text.file());
+                std::wstring line;
+                while (std::getline(in, line))
+                {
+                    GUID guid = { };
+                    wchar_t* p = line.data();
+                    guid.Data1 = std::wcstoul(p, &p, 16);
+                    guid.Data2 = static_cast<unsigned short>(std::wcstoul(p, &p, 16));
+                    guid.Data3 = static_cast<unsigned short>(std::wcstoul(p, &p, 16));
+                    for (auto& b : guid.Data4) b = static_cast<unsigned char>(std::wcstoul(p, &p, 16));
+                    parsed.emplace_back(guid, UBSTR(p + 1));
+                }
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            std::shared_ptr<BstrTable const> table;
+            Assert::AreEqual(S_OK, BstrTable::Open(binary.path().c_str(), &table));
+            auto t2 = std::chrono::steady_clock::now();
+
+            // Check every string, which also reads every page of the image
+            Assert::AreEqual(size_t(count), parsed.size());
+            Assert::AreEqual(size_t(count), table->Size());
+            for (unsigned long i = 0; i < count; ++i)
+            {
+                Assert::IsTrue(parsed[i].first == table->Guid(i));
+                Assert::AreEqual(SysStringLen(parsed[i].second.get()), SysStringLen(table->Bstr(i)));
+                Assert::IsTrue(table->View(i) == parsed[i].second.get());
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(size_t(count / 2), table->Find(RowGuid(count / 2)));
+
+            using us = std::chrono::microseconds;
+            auto micro = [](auto d) { return static_cast<long long>(std::chrono::duration_cast<us>(d).count()); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Load %lu strings: parse and allocate %lld us, BstrTable::Open %lld us (check all strings %lld us)\r\n",
+                count, micro(t1 - t0), micro(t2 - t1), micro(t3 - t2));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,353 @@
+// test_bufstream.cpp: Test ComTools::BufferedStream //////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "bufstream.h"
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // In-memory stream that counts calls and charges a fixed latency for
+    // each Read and Write
+    class CSlowStream final : public Object<CSlowStream, IStream> {
+        std::vector<BYTE> m_data;
+        size_t m_pos = 0;
+        std::chrono::nanoseconds m_latency;
+
+        void Charge() const noexcept
+        {
+            if (m_latency.count() == 0) return;
+            auto until = std::chrono::steady_clock::now() + m_latency;
+            while (std::chrono::steady_clock::now() < until) { }
+        }
+
+    public:
+        std::atomic<long> reads = 0;
+        std::atomic<long> writes = 0;
+
+        CSlowStream(size_t cb, std::chrono::nanoseconds latency) : m_data(cb), m_latency(latency)
+        {
+            for (size_t i = 0; i < cb; ++i) m_data[i] = static_cast<BYTE>(i % 251);
+        }
+
+        std::vector<BYTE> const& data() const noexcept { return m_data; }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            if (riid == IID_IStream || riid == IID_ISequentialStream) return static_cast<IStream*>(this);
+            return nullptr;
+        }
+
+        STDMETHODIMP Read(void* pv, ULONG cb, ULONG* pcbRead) noexcept override
+        {
+            ++reads;
+            Charge();
+            size_t n = m_pos < m_data.size() ? (std::min)(static_cast<size_t>(cb), m_data.size() - m_pos) : 0;
+            if (n) std::memcpy(pv, m_data.data() + m_pos, n);
+            m_pos += n;
+            if (pcbRead) *pcbRead = static_cast<ULONG>(n);
+            return S_OK;
+        }
+
+        STDMETHODIMP Write(void const* pv, ULONG cb, ULONG* pcbWritten) noexcept override
+        {
+            ++writes;
+            Charge();
+            if (m_pos + cb > m_data.size()) m_data.resize(m_pos + cb);
+            std::memcpy(m_data.data() + m_pos, pv, cb);
+            m_pos += cb;
+            if (pcbWritten) *pcbWritten = cb;
+            return S_OK;
+        }
+
+        STDMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER* plibNewPosition) noexcept override
+        {
+            LONGLONG base = dwOrigin == STREAM_SEEK_CUR ? static_cast<LONGLONG>(m_pos) :
+                dwOrigin == STREAM_SEEK_END ? static_cast<LONGLONG>(m_data.size()) : 0;
+            if (base + dlibMove.QuadPart < 0) return STG_E_INVALIDFUNCTION;
+            m_pos = static_cast<size_t>(base + dlibMove.QuadPart);
+            if (plibNewPosition) plibNewPosition->QuadPart = m_pos;
+            return S_OK;
+        }
+
+        STDMETHODIMP SetSize(ULARGE_INTEGER libNewSize) noexcept override
+        {
+            m_data.resize(static_cast<size_t>(libNewSize.QuadPart));
+            return S_OK;
+        }
+
+        STDMETHODIMP CopyTo(IStream*, ULARGE_INTEGER, ULARGE_INTEGER*, ULARGE_INTEGER*) noexcept override { return E_NOTIMPL; }
+        STDMETHODIMP Commit(DWORD) noexcept override { return S_OK; }
+        STDMETHODIMP Revert() noexcept override { return S_OK; }
+        STDMETHODIMP LockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) noexcept override { return STG_E_INVALIDFUNCTION; }
+        STDMETHODIMP UnlockRegion(ULARGE_INTEGER, ULARGE_INTEGER, DWORD) noexcept override { return STG_E_INVALIDFUNCTION; }
+
+        STDMETHODIMP Stat(STATSTG* pstatstg, DWORD) noexcept override
+        {
+            std::memset(pstatstg, 0, sizeof(STATSTG));
+            pstatstg->type = STGTY_STREAM;
+            pstatstg->cbSize.QuadPart = m_data.size();
+            return S_OK;
+        }
+
+        STDMETHODIMP Clone(IStream**) noexcept override { return E_NOTIMPL; }
+    };
+
+    TEST_CLASS(TestBufferedStream)
+    {
+        static CSlowStream* MakeStream(IPtr<IStream>& stream, size_t cb,
+            std::chrono::nanoseconds latency = std::chrono::nanoseconds(0))
+        {
+            auto p = new CSlowStream(cb, latency);
+            attach(stream, static_cast<IStream*>(p));
+            return p;
+        }
+
+        static ULONGLONG Tell(IStream* stream)
+        {
+            LARGE_INTEGER move = { };
+            ULARGE_INTEGER pos = { };
+            Assert::AreEqual(S_OK, stream->Seek(move, STREAM_SEEK_CUR, &pos));
+            return pos.QuadPart;
+        }
+
+    public:
+        TEST_METHOD(ReaderGet)
+        {
+            IPtr<IStream> stream;
+            auto p = MakeStream(stream, 10000);
+            StreamReader reader(stream, { 256, false });
+
+            BYTE b = 0;
+            size_t count = 0;
+            bool same = true;
+            while (reader.Get(&b) == S_OK) same = same && b == static_cast<BYTE>(count++ % 251);
+            Assert::IsTrue(same);
+            Assert::AreEqual((size_t)10000, count);
+
+            // One call per block, plus one that finds the end
+            Assert::AreEqual(41L, p->reads.load());
+        }
+
+        TEST_METHOD(ReaderLargeRead)
+        {
+            IPtr<IStream> stream;
+            auto p = MakeStream(stream, 10000);
+            StreamReader reader(stream, { 256, false });
+
+            BYTE b = 0;
+            Assert::AreEqual(S_OK, reader.Get(&b));
+
+            // The rest of the buffer is copied, then the stream is read
+            // directly into the destination
+            std::vector<BYTE> buf(5000);
+            ULONG n = 0;
+            Assert::AreEqual(S_OK, reader.Read(buf.data(), 5000, &n));
+            Assert::AreEqual(5000UL, static_cast<unsigned long>(n));
+            Assert::AreEqual(2L, p->reads.load());
+            Assert::AreEqual(static_cast<int>(5000 % 251), static_cast<int>(buf[4999]));
+        }
+
+        TEST_METHOD(ReaderReadAhead)
+        {
+            IPtr<IStream> stream;
+            auto p = MakeStream(stream, 100000);
+            StreamReader reader(stream, { 1000, true });
+
+            std::vector<BYTE> buf(300);
+            std::vector<BYTE> all;
+            for (ULONG n; SUCCEEDED(reader.Read(buf.data(), 300, &n)) && n; )
+            {
+                all.insert(all.end(), buf.begin(), buf.begin() + n);
+            }
+
+            // One call per block, plus the read-ahead that finds the end and
+            // the final call that returns no data
+            Assert::IsTrue(all == p->data());
+            Assert::AreEqual(102L, p->reads.load());
+        }
+
+        TEST_METHOD(ReaderPeekSkipDiscard)
+        {
+            IPtr<IStream> stream;
+            MakeStream(stream, 1000);
+            StreamReader reader(stream, { 100, true });
+
+            BYTE const* data = nullptr;
+            ULONG cb = 0;
+            Assert::AreEqual(S_OK, reader.Peek(&data, &cb));
+            Assert::AreEqual(100UL, static_cast<unsigned long>(cb));
+            reader.Skip(30);
+            Assert::AreEqual(S_OK, reader.Peek(&data, &cb));
+            Assert::AreEqual(70UL, static_cast<unsigned long>(cb));
+            Assert::AreEqual(30, static_cast<int>(data[0]));
+
+            // Discard returns the stream to the reader's position, including
+            // any block that was read ahead
+            Assert::AreEqual(S_OK, reader.Discard());
+            Assert::AreEqual(30ULL, static_cast<unsigned long long>(Tell(get(stream))));
+        }
+
+        TEST_METHOD(WriterCoalesces)
+        {
+            IPtr<IStream> stream;
+            auto p = MakeStream(stream, 0);
+            {
+                StreamWriter writer(stream, { 1024, false });
+                for (int i = 0; i < 10000; ++i) Assert::AreEqual(S_OK, writer.Put(static_cast<BYTE>(i % 251)));
+                Assert::AreEqual(9L, p->writes.load());
+                Assert::AreEqual(784UL, static_cast<unsigned long>(writer.Pending()));
+
+                // Writes of a block or more bypass the buffer
+                std::vector<BYTE> big(4096, 7);
+                ULONG n = 0;
+                Assert::AreEqual(S_OK, writer.Write(big.data(), 4096, &n));
+                Assert::AreEqual(4096UL, static_cast<unsigned long>(n));
+                Assert::AreEqual(11L, p->writes.load());
+                Assert::AreEqual(0UL, static_cast<unsigned long>(writer.Pending()));
+
+                Assert::AreEqual(S_OK, writer.Put(1));
+            }
+
+            // The destructor flushes
+            Assert::AreEqual(12L, p->writes.load());
+            Assert::AreEqual((size_t)14097, p->data().size());
+            Assert::AreEqual(static_cast<int>(9999 % 251), static_cast<int>(p->data()[9999]));
+            Assert::AreEqual(1, static_cast<int>(p->data().back()));
+        }
+
+        TEST_METHOD(Facade)
+        {
+            IPtr<IStream> inner;
+            auto p = MakeStream(inner, 0);
+            IPtr<IStream> stream;
+            Assert::AreEqual(S_OK, CreateBufferedStream(get(inner), { 64, false }, set(stream)));
+
+            for (BYTE i = 0; i < 200; ++i) Assert::AreEqual(S_OK, stream->Write(&i, 1, nullptr));
+            Assert::AreEqual(200ULL, static_cast<unsigned long long>(Tell(get(stream))));
+            Assert::AreEqual(3L, p->writes.load());
+
+            // Seeking flushes the writer
+            LARGE_INTEGER move = { };
+            move.QuadPart = 10;
+            Assert::AreEqual(S_OK, stream->Seek(move, STREAM_SEEK_SET, nullptr));
+            Assert::AreEqual((size_t)200, p->data().size());
+
+            BYTE b = 0;
+            Assert::AreEqual(S_OK, stream->Read(&b, 1, nullptr));
+            Assert::AreEqual(10, static_cast<int>(b));
+            Assert::AreEqual(11ULL, static_cast<unsigned long long>(Tell(get(stream))));
+
+            // Writing after reading goes to the logical position
+            b = 99;
+            Assert::AreEqual(S_OK, stream->Write(&b, 1, nullptr));
+            STATSTG stat;
+            Assert::AreEqual(S_OK, stream->Stat(&stat, STATFLAG_NONAME));
+            Assert::AreEqual(99, static_cast<int>(p->data()[11]));
+            Assert::AreEqual(12, static_cast<int>(p->data()[12]));
+        }
+
+        TEST_METHOD(FacadeReadAhead)
+        {
+            // The inner stream is slow, so the read-ahead started by the
+            // first Read is still running when the stream is next used
+            auto open = [](IPtr<IStream>& stream) {
+                IPtr<IStream> inner;
+                MakeStream(inner, 10000, std::chrono::milliseconds(20));
+                Assert::AreEqual(S_OK, CreateBufferedStream(get(inner), { 1000, true }, set(stream)));
+
+                BYTE buf[10] = { };
+                ULONG n = 0;
+                Assert::AreEqual(S_OK, stream->Read(buf, 10, &n));
+                Assert::AreEqual(10UL, static_cast<unsigned long>(n));
+            };
+
+            IPtr<IStream> stream;
+            open(stream);
+            Assert::AreEqual(10ULL, static_cast<unsigned long long>(Tell(get(stream))));
+
+            open(stream);
+            STATSTG stat;
+            Assert::AreEqual(S_OK, stream->Stat(&stat, STATFLAG_NONAME));
+            Assert::AreEqual(10000ULL, static_cast<unsigned long long>(stat.cbSize.QuadPart));
+            Assert::AreEqual(10ULL, static_cast<unsigned long long>(Tell(get(stream))));
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Parse a 1 MB stream byte by byte and write it back, charging
+            // 200 ns per call
+            size_t const cb = 1 << 20;
+            auto const latency = std::chrono::nanoseconds(200);
+
+            IPtr<IStream> s1, s2, s3;
+            MakeStream(s1, cb, latency);
+            MakeStream(s2, cb, latency);
+            MakeStream(s3, cb, latency);
+
+            auto t0 = std::chrono::steady_clock::now();
+            unsigned sum1 = 0;
+            BYTE b = 0;
+            for (ULONG n; SUCCEEDED(s1->Read(&b, 1, &n)) && n; ) sum1 += b;
+
+            auto t1 = std::chrono::steady_clock::now();
+            unsigned sum2 = 0;
+            {
+                StreamReader reader(s2, { 0x10000, false });
+                while (reader.Get(&b) == S_OK) sum2 += b;
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            unsigned sum3 = 0;
+            {
+                StreamReader reader(s3, { 0x10000, true });
+                while (reader.Get(&b) == S_OK) sum3 += b;
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(sum1, sum2);
+            Assert::AreEqual(sum1, sum3);
+
+            IPtr<IStream> w1, w2;
+            MakeStream(w1, 0, latency);
+            auto p2 = MakeStream(w2, 0, latency);
+
+            auto t4 = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < cb; ++i)
+            {
+                b = static_cast<BYTE>(i);
+                w1->Write(&b, 1, nullptr);
+            }
+
+            auto t5 = std::chrono::steady_clock::now();
+            {
+                StreamWriter writer(w2, { 0x10000, false });
+                for (size_t i = 0; i < cb; ++i) writer.Put(static_cast<BYTE>(i));
+                Assert::AreEqual(S_OK, writer.Flush());
+            }
+
+            auto t6 = std::chrono::steady_clock::now();
+            Assert::AreEqual(16L, p2->writes.load());
+
+            using ns = std::chrono::nanoseconds;
+            auto count = [](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count()); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Read: direct %lld ns, buffered %lld ns, read-ahead %lld ns\r\n",
+                count(t1 - t0), count(t2 - t1), count(t3 - t2));
+            Logger::WriteMessage(buf);
+            sprintf_s(buf, "Write: direct %lld ns, coalesced %lld ns\r\n",
+                count(t5 - t4), count(t6 - t5));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
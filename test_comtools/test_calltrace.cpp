@@ -0,0 +1,319 @@
+// test_calltrace.cpp: Test ComTools::TraceRecorder, Trace, ReplayTrace //////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+// Recording is tested only in the Trace configuration, which defines
+// COMTOOLS_CALLTRACE for the whole test project; the other configurations
+// test the trace format alone.
+#include "CppUnitTest.h"
+#include "tracefmt.h"
+#ifdef COMTOOLS_CALLTRACE
+#include "calltrace.h"
+#include "comexcept.h"
+#include "iptr.h"
+#include "comobject.h"
+#include "ubstr.h"
+#endif
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <typeinfo>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    std::filesystem::path TracePath()
+    {
+        return std::filesystem::temp_directory_path() / L"test_calltrace.trace";
+    }
+
+    // Environment for ReplayTrace that counts the operations
+    struct CountingEnv {
+        std::atomic<long> refs = 0;
+        std::atomic<long> allocs = 0;
+        std::atomic<long> frees = 0;
+        std::atomic<long> errors = 0;
+
+        void AddRef(std::uint32_t, std::uint32_t) noexcept { ++refs; }
+        void Release(std::uint32_t, std::uint32_t) noexcept { --refs; }
+        void Alloc(std::uint32_t, std::uint32_t) noexcept { ++allocs; }
+        void Free(std::uint32_t) noexcept { ++frees; }
+        void Error(std::uint32_t, std::uint32_t) noexcept { ++errors; }
+    };
+
+    TEST_CLASS(TestTraceFormat)
+    {
+    public:
+        TEST_METHOD(SaveAndLoad)
+        {
+            Trace trace;
+            trace.types = { "IFoo", "UBSTR", "ComException" };
+            trace.records = {
+                { TraceOp::IPtrAddRef, 0, 0, 0, 0, 0, 0x7FF600001000 },
+                { TraceOp::BstrAlloc, 0, 0, 1, 0, 5, 0x2000 },
+                { TraceOp::IPtrAddRef, 0, 1, 0, 0, 0, 0x7FF700001000 },
+                { TraceOp::BstrFree, 0, 1, 1, 0, 0, 0x2000 },
+                { TraceOp::BstrAlloc, 0, 0, 1, 0, 7, 0x2000 },
+                { TraceOp::Error, 0, 1, 2, 0, 12, 0x80004005 },
+                { TraceOp::IPtrRelease, 0, 0, 0, 0, 0, 0x7FF600001000 },
+            };
+
+            Assert::IsTrue(trace.Save(TracePath()));
+            Trace loaded;
+            Assert::IsTrue(loaded.Load(TracePath()));
+            Assert::AreEqual(size_t(7), loaded.records.size());
+            Assert::AreEqual(size_t(3), loaded.types.size());
+            Assert::AreEqual(std::string("UBSTR"), loaded.types[1]);
+            Assert::AreEqual(2U, static_cast<unsigned>(loaded.threads));
+
+            // Objects are numbered from 0 by their full address, so objects
+            // whose addresses share the low 32 bits stay apart; each
+            // allocation of a string gets its own number, even at the same
+            // address
+            Assert::AreEqual(2U, loaded.objects);
+            Assert::AreEqual(2U, loaded.strings);
+            Assert::AreEqual(1U, loaded.records[2].object);
+            Assert::AreEqual(0U, loaded.records[3].object);
+            Assert::AreEqual(1U, loaded.records[4].object);
+            Assert::AreEqual(0x80004005U, loaded.records[5].object);
+            Assert::AreEqual(0U, loaded.records[6].object);
+
+            // A file that is not a trace is rejected
+            {
+                std::ofstream out(TracePath(), std::ios::binary | std::ios::trunc);
+                out << "not a trace";
+            }
+
+            Assert::IsFalse(loaded.Load(TracePath()));
+            Assert::IsFalse(loaded.Load(TracePath().wstring() + L".missing"));
+        }
+
+        TEST_METHOD(Replay)
+        {
+            Trace trace;
+            trace.types = { "IFoo", "UBSTR", "ComException" };
+            for (std::uint16_t thread = 0; thread < 8; ++thread)
+            {
+                for (std::uint32_t i = 0; i < 100; ++i)
+                {
+                    trace.records.push_back({ TraceOp::IPtrAddRef, 0, thread, 0, i, 0 });
+                    trace.records.push_back({ TraceOp::BstrAlloc, 0, thread, 1, i, 4 });
+                    trace.records.push_back({ TraceOp::IPtrMove, 0, thread, 0, i, 0 });
+                    trace.records.push_back({ TraceOp::BstrFree, 0, thread, 1, i, 0 });
+                    trace.records.push_back({ TraceOp::IPtrRelease, 0, thread, 0, i, 0 });
+                }
+
+                trace.records.push_back({ TraceOp::Error, 0, thread, 2, 0x80004005, 0 });
+            }
+
+            for (size_t threads : { 0, 1, 3, 8 })
+            {
+                CountingEnv env;
+                ReplayTrace(trace, threads, env);
+                Assert::AreEqual(0L, env.refs.load());
+                Assert::AreEqual(800L, env.allocs.load());
+                Assert::AreEqual(800L, env.frees.load());
+                Assert::AreEqual(8L, env.errors.load());
+            }
+        }
+    };
+}
+
+#ifdef COMTOOLS_CALLTRACE
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE ITraced
+DECLARE_INTERFACE_IID_(ITraced, IUnknown, "8F3A6C21-4D7E-4B95-A1C8-2E9B5D7F0A34")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CTraced final : public Object<CTraced, ITraced> {
+    public:
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(ITraced) ? static_cast<ITraced*>(this) : nullptr;
+        }
+    };
+
+    IPtr<ITraced> MakeTraced()
+    {
+        IPtr<ITraced> p;
+        CTraced::Create(__uuidof(ITraced), reinterpret_cast<void**>(set(p)));
+        return p;
+    }
+
+    // Counts the records of op for T
+    template<typename T>
+    size_t Count(Trace const& trace, TraceOp op)
+    {
+        size_t n = 0;
+        for (auto const& record : trace.records)
+        {
+            if (record.op == op && trace.types[record.type] == typeid(T).name()) ++n;
+        }
+
+        return n;
+    }
+
+    TEST_CLASS(TestCallTrace)
+    {
+    public:
+        TEST_METHOD(Record)
+        {
+            auto p = MakeTraced();
+            {
+                IPtr<ITraced> before(p);
+            }
+
+            TraceRecorder::Start();
+            {
+                IPtr<ITraced> q(p);
+                IPtr<ITraced> r;
+                r = std::move(q);
+                auto s = p.As<ITraced>(__uuidof(ITraced));
+                Assert::IsTrue((bool)s);
+            }
+
+            TraceRecorder::Stop();
+            {
+                IPtr<ITraced> after(p);
+            }
+
+            Assert::AreEqual(S_OK, TraceRecorder::Save(TracePath()));
+            Trace trace;
+            Assert::IsTrue(trace.Load(TracePath()));
+            Assert::AreEqual(size_t(1), Count<ITraced>(trace, TraceOp::IPtrAddRef));
+            Assert::AreEqual(size_t(1), Count<ITraced>(trace, TraceOp::IPtrMove));
+            Assert::AreEqual(size_t(1), Count<ITraced>(trace, TraceOp::IPtrQuery));
+            Assert::AreEqual(size_t(2), Count<ITraced>(trace, TraceOp::IPtrRelease));
+            Assert::AreEqual(1U, trace.objects);
+        }
+
+        TEST_METHOD(StringsAndErrors)
+        {
+            SetErrorInfo(0, nullptr);
+            TraceRecorder::Start();
+            {
+                UBSTR a(L"abc");
+                UBSTR b(a);
+                attach(b, SysAllocString(L"wxyz"));
+                ComException e(E_FAIL);
+            }
+
+            TraceRecorder::Stop();
+            Assert::AreEqual(S_OK, TraceRecorder::Save(TracePath()));
+            Trace trace;
+            Assert::IsTrue(trace.Load(TracePath()));
+
+            // The string taken by attach() is recorded as allocated, so each
+            // free has its allocation
+            Assert::AreEqual(size_t(3), Count<UBSTR>(trace, TraceOp::BstrAlloc));
+            Assert::AreEqual(size_t(3), Count<UBSTR>(trace, TraceOp::BstrFree));
+            Assert::AreEqual(3U, trace.strings);
+            Assert::AreEqual(size_t(1), Count<ComException>(trace, TraceOp::Error));
+        }
+
+        TEST_METHOD(Threads)
+        {
+            auto p = MakeTraced();
+            TraceRecorder::Start();
+            auto work = [&p]() {
+                for (int i = 0; i < 3000; ++i) IPtr<ITraced> q(p);
+            };
+
+            std::thread a(work);
+            std::thread b(work);
+            a.join();
+            b.join();
+            TraceRecorder::Stop();
+
+            // The threads handed their records over when they exited
+            Assert::AreEqual(S_OK, TraceRecorder::Save(TracePath()));
+            Trace trace;
+            Assert::IsTrue(trace.Load(TracePath()));
+            Assert::AreEqual(size_t(6000), Count<ITraced>(trace, TraceOp::IPtrAddRef));
+            Assert::AreEqual(size_t(6000), Count<ITraced>(trace, TraceOp::IPtrRelease));
+            Assert::IsTrue(trace.threads >= 2);
+        }
+
+        TEST_METHOD(StaleRecords)
+        {
+            // A thread that recorded in an earlier session hands its records
+            // over after the next Start(); they are not in the new trace
+            auto p = MakeTraced();
+            std::atomic<int> step = 0;
+            TraceRecorder::Start();
+            std::thread t([&]() {
+                for (int i = 0; i < 10; ++i) IPtr<ITraced> q(p);
+                step = 1;
+                step.notify_all();
+                step.wait(1);
+            });
+
+            step.wait(0);
+            TraceRecorder::Stop();
+            TraceRecorder::Start();
+            step = 2;
+            step.notify_all();
+            t.join();
+            TraceRecorder::Stop();
+
+            Assert::AreEqual(S_OK, TraceRecorder::Save(TracePath()));
+            Trace trace;
+            Assert::IsTrue(trace.Load(TracePath()));
+            Assert::AreEqual(size_t(0), Count<ITraced>(trace, TraceOp::IPtrAddRef));
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Copies of an IPtr, without recording and while recording
+            int const count = 1000000;
+            auto p = MakeTraced();
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i) IPtr<ITraced> q(p);
+            auto t1 = std::chrono::steady_clock::now();
+            TraceRecorder::Start();
+            for (int i = 0; i < count; ++i) IPtr<ITraced> q(p);
+            TraceRecorder::Stop();
+            auto t2 = std::chrono::steady_clock::now();
+
+            Assert::AreEqual(S_OK, TraceRecorder::Save(TracePath()));
+            Trace trace;
+            Assert::IsTrue(trace.Load(TracePath()));
+            Assert::AreEqual(size_t(count), Count<ITraced>(trace, TraceOp::IPtrAddRef));
+            std::filesystem::remove(TracePath());
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<double>(std::chrono::duration_cast<ns>(d).count()) / count; };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Per IPtr copy: not recording %.1f ns, recording %.1f ns\r\n",
+                per(t1 - t0), per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+#endif  // COMTOOLS_CALLTRACE
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,201 @@
+// test_classreg.cpp: Test ComTools::ClassRegistry ////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "classreg.h"
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <utility>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE INumbered
+DECLARE_INTERFACE_IID_(INumbered, IUnknown, "6C1F3E20-5B7A-4D0E-9A41-0D2B8E6F7C11")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(int, Number)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    template<int K>
+    class CNumbered final : public Object<CNumbered<K>, INumbered> {
+    public:
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(INumbered) ? static_cast<INumbered*>(this) : nullptr;
+        }
+
+        STDMETHODIMP_(int) Number() noexcept override
+        {
+            return K;
+        }
+    };
+
+    // CLSIDs that differ only in a few bytes, as generated CLSIDs often do
+    constexpr CLSID MakeClsid(int k) noexcept
+    {
+        return { 0x6c1f0000U + static_cast<unsigned>(k), 0x5b7a, 0x4d0e,
+            { 0x9a, 0x41, 0x0d, 0x2b, 0x8e, 0x6f, 0x7c, static_cast<unsigned char>(k) } };
+    }
+
+    template<size_t... K>
+    constexpr auto MakeTable(std::index_sequence<K...>)
+    {
+        return ClassTable<sizeof...(K)>({ ClassEntry{ MakeClsid(K), &CNumbered<K>::template Create<> }... });
+    }
+
+    constexpr auto table = MakeTable(std::make_index_sequence<32>());
+
+    // The table is usable at compile time
+    static_assert(table.Find(MakeClsid(0)) != nullptr);
+    static_assert(table.Find(MakeClsid(31)) != nullptr);
+    static_assert(table.Find(MakeClsid(32)) == nullptr);
+
+    struct GuidLess {
+        bool operator()(GUID const& a, GUID const& b) const noexcept
+        {
+            return std::memcmp(&a, &b, sizeof(GUID)) < 0;
+        }
+    };
+
+    TEST_CLASS(TestClassRegistry)
+    {
+    public:
+        TEST_METHOD(Lookup)
+        {
+            for (int k = 0; k < 32; ++k)
+            {
+                auto entry = table.Find(MakeClsid(k));
+                Assert::IsNotNull(entry);
+                Assert::IsTrue(entry->clsid == MakeClsid(k));
+            }
+
+            Assert::IsNull(table.Find(MakeClsid(100)));
+            Assert::IsNull(table.Find(CLSID_NULL));
+        }
+
+        TEST_METHOD(SingleClass)
+        {
+            constexpr ClassTable one({ ClassEntry{ MakeClsid(7), &CNumbered<7>::Create<> } });
+            Assert::IsNotNull(one.Find(MakeClsid(7)));
+            Assert::IsNull(one.Find(MakeClsid(8)));
+        }
+
+        TEST_METHOD(CreateInstance)
+        {
+            ClassRegistry registry(table);
+            auto p = registry.CreateInstance<INumbered>(MakeClsid(12), __uuidof(INumbered));
+            Assert::IsTrue((bool)p);
+            Assert::AreEqual(12, p->Number());
+
+            void* pv = nullptr;
+            Assert::AreEqual(REGDB_E_CLASSNOTREG, registry.CreateInstance(MakeClsid(40), IID_IUnknown, &pv));
+            Assert::AreEqual(E_NOINTERFACE, registry.CreateInstance(MakeClsid(12), IID_IClassFactory, &pv));
+            Assert::IsNull(pv);
+        }
+
+        TEST_METHOD(ClassFactories)
+        {
+            ClassRegistry registry(table);
+            IPtr<IClassFactory> f1, f2, f3;
+            Assert::AreEqual(S_OK, registry.GetClassObject(MakeClsid(3), IID_IClassFactory, reinterpret_cast<void**>(set(f1))));
+            Assert::AreEqual(S_OK, registry.GetClassObject(MakeClsid(3), IID_IClassFactory, reinterpret_cast<void**>(set(f2))));
+            Assert::AreEqual(S_OK, registry.GetClassObject(MakeClsid(4), IID_IClassFactory, reinterpret_cast<void**>(set(f3))));
+
+            // One factory per class, reused by every caller
+            Assert::IsTrue(f1 == f2);
+            Assert::IsTrue(f1 != f3);
+
+            IPtr<INumbered> p;
+            Assert::AreEqual(S_OK, f3->CreateInstance(nullptr, __uuidof(INumbered), reinterpret_cast<void**>(set(p))));
+            Assert::AreEqual(4, p->Number());
+
+            IPtr<IUnknown> inner;
+            Assert::AreEqual(CLASS_E_NOAGGREGATION,
+                f3->CreateInstance(get(p), IID_IUnknown, reinterpret_cast<void**>(set(inner))));
+
+            IPtr<IClassFactory> f4;
+            Assert::AreEqual(CLASS_E_CLASSNOTAVAILABLE,
+                registry.GetClassObject(MakeClsid(99), IID_IClassFactory, reinterpret_cast<void**>(set(f4))));
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Look up and activate each class in turn through the perfect
+            // hash and through a std::map
+            int const rounds = 20000;
+            std::map<CLSID, CreateFunction, GuidLess> map;
+            for (int k = 0; k < 32; ++k) map[MakeClsid(k)] = table.Find(MakeClsid(k))->create;
+            ClassRegistry registry(table);
+
+            CLSID clsids[32];
+            for (int k = 0; k < 32; ++k) clsids[k] = MakeClsid(k);
+
+            auto t0 = std::chrono::steady_clock::now();
+            size_t found1 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (auto const& clsid : clsids) found1 += map.find(clsid) != map.end();
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            size_t found2 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (auto const& clsid : clsids) found2 += registry.Contains(clsid);
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            long sum1 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (auto const& clsid : clsids)
+                {
+                    IPtr<INumbered> p;
+                    map.find(clsid)->second(__uuidof(INumbered), reinterpret_cast<void**>(set(p)));
+                    sum1 += p->Number();
+                }
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            long sum2 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (auto const& clsid : clsids)
+                {
+                    sum2 += registry.CreateInstance<INumbered>(clsid, __uuidof(INumbered))->Number();
+                }
+            }
+
+            auto t4 = std::chrono::steady_clock::now();
+            Assert::AreEqual(found1, found2);
+            Assert::AreEqual(sum1, sum2);
+
+            using ns = std::chrono::nanoseconds;
+            long long const ops = 32LL * rounds;
+            auto count = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / ops); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Lookup: std::map %lld ns, ClassTable %lld ns; activation: std::map %lld ns, ClassRegistry %lld ns\r\n",
+                count(t1 - t0), count(t2 - t1), count(t3 - t2), count(t4 - t3));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -81,6 +81,9 @@ namespace TestCOMExcept
             Assert::AreEqual(demo_source, e.source().c_str());
             Assert::AreEqual(demo_description, e.description().c_str());
             Assert::AreEqual(demo_help_file, e.help_file().c_str());
+            Assert::IsTrue(e.u16source() == reinterpret_cast<char16_t const*>(demo_source));
+            Assert::IsTrue(e.u16description() == reinterpret_cast<char16_t const*>(demo_description));
+            Assert::IsTrue(e.u16help_file() == reinterpret_cast<char16_t const*>(demo_help_file));
             Assert::AreEqual(demo_help_context, e.help_context());
             Assert::IsTrue(demo_guid == e.guid());
         }
@@ -0,0 +1,148 @@
+// test_comobject.cpp: Test ComTools::Object //////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "comobject.h"
+#include "iptr.h"
+#include <stdexcept>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IValue
+DECLARE_INTERFACE_IID_(IValue, IUnknown, "A3C06A61-3E0F-4C9B-9D4D-2F6E2B5E3A01")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(long, Value)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+#define INTERFACE IScale
+DECLARE_INTERFACE_IID_(IScale, IUnknown, "A3C06A62-3E0F-4C9B-9D4D-2F6E2B5E3A01")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD(Scale)(THIS_ long factor) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CValue final : public Object<CValue, IValue, IScale> {
+        long m_value;
+
+    public:
+        static int live;
+
+        explicit CValue(long value)
+            : m_value(value)
+        {
+            if (value < 0) throw std::invalid_argument("value");
+            ++live;
+        }
+
+        ~CValue() noexcept
+        {
+            --live;
+        }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            if (riid == __uuidof(IValue)) return static_cast<IValue*>(this);
+            if (riid == __uuidof(IScale)) return static_cast<IScale*>(this);
+            return nullptr;
+        }
+
+        STDMETHODIMP_(long) Value() noexcept override
+        {
+            return m_value;
+        }
+
+        STDMETHODIMP Scale(long factor) noexcept override
+        {
+            m_value *= factor;
+            return S_OK;
+        }
+    };
+
+    int CValue::live = 0;
+
+    TEST_CLASS(TestObject)
+    {
+    public:
+        TEST_METHOD(CreateAndRelease)
+        {
+            {
+                IPtr<IValue> p;
+                Assert::AreEqual(S_OK, CValue::Create(__uuidof(IValue),
+                    reinterpret_cast<void**>(set(p)), 42L));
+                Assert::AreEqual(1, CValue::live);
+                Assert::AreEqual(42L, p->Value());
+            }
+
+            Assert::AreEqual(0, CValue::live);
+        }
+
+        TEST_METHOD(QueryInterfaces)
+        {
+            IPtr<IValue> v;
+            Assert::AreEqual(S_OK, CValue::Create(__uuidof(IValue),
+                reinterpret_cast<void**>(set(v)), 3L));
+
+            auto s = v.As<IScale>(__uuidof(IScale));
+            Assert::IsTrue((bool)s);
+            Assert::AreEqual(S_OK, s->Scale(5));
+            Assert::AreEqual(15L, v->Value());
+
+            // IUnknown has one identity
+            auto u1 = v.As<IUnknown>(IID_IUnknown);
+            auto u2 = s.As<IUnknown>(IID_IUnknown);
+            Assert::IsTrue((bool)u1);
+            Assert::IsTrue(u1 == u2);
+
+            Assert::IsFalse((bool)v.As<IDispatch>(IID_IDispatch));
+        }
+
+        TEST_METHOD(ReferenceCount)
+        {
+            IValue* p = nullptr;
+            Assert::AreEqual(S_OK, CValue::Create(__uuidof(IValue),
+                reinterpret_cast<void**>(&p), 1L));
+            Assert::AreEqual(2UL, static_cast<unsigned long>(p->AddRef()));
+            Assert::AreEqual(1UL, static_cast<unsigned long>(p->Release()));
+            Assert::AreEqual(0UL, static_cast<unsigned long>(p->Release()));
+            Assert::AreEqual(0, CValue::live);
+        }
+
+        TEST_METHOD(CreateFails)
+        {
+            // Unsupported interface: the new object is destroyed
+            void* pv = reinterpret_cast<void*>(1);
+            Assert::AreEqual(E_NOINTERFACE, CValue::Create(IID_IDispatch, &pv, 1L));
+            Assert::IsNull(pv);
+            Assert::AreEqual(0, CValue::live);
+
+            // Constructor exceptions are converted to HRESULTs
+            Assert::AreEqual(E_UNEXPECTED, CValue::Create(IID_IUnknown, &pv, -1L));
+            Assert::IsNull(pv);
+
+            Assert::AreEqual(E_POINTER, CValue::Create(IID_IUnknown, nullptr, 1L));
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,178 @@
+// test_cotaskmem.cpp: Test ComTools::UCoTaskMem, CoTaskMemScope //////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "cotaskmem.h"
+#include <chrono>
+#include <cstring>
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // Returns a copy of name allocated with CoTaskMemAlloc(), as a COM method
+    // returns a string
+    HRESULT AllocName(wchar_t const* name, LPWSTR* ppsz)
+    {
+        size_t cb = (wcslen(name) + 1) * sizeof(wchar_t);
+        *ppsz = static_cast<LPWSTR>(CoTaskMemAlloc(cb));
+        if (!*ppsz) return E_OUTOFMEMORY;
+        memcpy(*ppsz, name, cb);
+        return S_OK;
+    }
+
+    // Returns count values allocated with CoTaskMemAlloc()
+    HRESULT AllocValues(ULONG count, ULONG* pcount, long** ppvalues)
+    {
+        *pcount = 0;
+        *ppvalues = static_cast<long*>(CoTaskMemAlloc(count * sizeof(long)));
+        if (!*ppvalues) return E_OUTOFMEMORY;
+        for (ULONG i = 0; i < count; ++i) (*ppvalues)[i] = static_cast<long>(i * i);
+        *pcount = count;
+        return S_OK;
+    }
+
+    TEST_CLASS(TestCoTaskMem)
+    {
+    public:
+        TEST_METHOD(Strings)
+        {
+            UCoTaskMem<wchar_t> name;
+            Assert::IsFalse((bool)name);
+            Assert::IsTrue(name.view().empty());
+
+            Assert::AreEqual(S_OK, AllocName(L"First", set(name)));
+            Assert::AreEqual(std::wstring(L"First"), name.to_wstring());
+
+            // set() frees the previous buffer
+            Assert::AreEqual(S_OK, AllocName(L"Second", set(name)));
+            Assert::IsTrue(name.view() == L"Second");
+
+            LPWSTR p = detach(name);
+            Assert::IsFalse((bool)name);
+            attach(name, p);
+            Assert::AreEqual(L'S', name[0]);
+        }
+
+        TEST_METHOD(Arrays)
+        {
+            UCoTaskMem<long> values;
+            ULONG count = 0;
+            Assert::AreEqual(S_OK, AllocValues(5, &count, set(values)));
+            Assert::AreEqual(size_t(0), values.size());
+            values.set_size(count);
+
+            long sum = 0;
+            for (long v : values.span()) sum += v;
+            Assert::AreEqual(30L, sum);
+            Assert::AreEqual(16L, values[4]);
+
+            auto buffer = UCoTaskMem<long>::Alloc(3);
+            Assert::AreEqual(size_t(3), buffer.size());
+            buffer[2] = 7;
+
+            // Moving transfers the buffer and its size
+            UCoTaskMem<long> moved(std::move(buffer));
+            Assert::IsFalse((bool)buffer);
+            Assert::AreEqual(size_t(0), buffer.size());
+            Assert::AreEqual(size_t(3), moved.size());
+            Assert::AreEqual(7L, moved.span()[2]);
+
+            moved = std::move(values);
+            Assert::AreEqual(size_t(5), moved.size());
+            Assert::IsFalse((bool)UCoTaskMem<long>::Alloc(0));
+        }
+
+        TEST_METHOD(Scope)
+        {
+            CoTaskMemScope outer;
+            {
+                UCoTaskMem<wchar_t> a;
+                AllocName(L"a", set(a));
+            }
+
+            Assert::AreEqual(size_t(1), outer.Pending());
+            {
+                CoTaskMemScope inner;
+                for (int i = 0; i < 3; ++i)
+                {
+                    UCoTaskMem<wchar_t> b;
+                    AllocName(L"b", set(b));
+                    AllocName(L"c", set(b));
+                }
+
+                Assert::AreEqual(size_t(6), inner.Pending());
+                Assert::AreEqual(size_t(1), outer.Pending());
+            }
+
+            // A full scope frees its buffers
+            for (size_t i = 0; i < CoTaskMemScope::Capacity; ++i)
+            {
+                UCoTaskMem<long> values = UCoTaskMem<long>::Alloc(4);
+            }
+
+            Assert::AreEqual(size_t(1), outer.Pending());
+            outer.Flush();
+            Assert::AreEqual(size_t(0), outer.Pending());
+
+            // Detached buffers are not freed by the scope
+            UCoTaskMem<wchar_t> d;
+            AllocName(L"d", set(d));
+            CoTaskMemFree(detach(d));
+            Assert::AreEqual(size_t(0), outer.Pending());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Get a short string from a method in a loop, freeing each one
+            // at once or at the end of a scope
+            int const count = 200000;
+            size_t length = 0;
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                LPWSTR psz = nullptr;
+                AllocName(L"Property", &psz);
+                length += wcslen(psz);
+                CoTaskMemFree(psz);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                UCoTaskMem<wchar_t> name;
+                AllocName(L"Property", set(name));
+                length += name.view().size();
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            {
+                CoTaskMemScope scope;
+                for (int i = 0; i < count; ++i)
+                {
+                    UCoTaskMem<wchar_t> name;
+                    AllocName(L"Property", set(name));
+                    length += name.view().size();
+                }
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(size_t(24) * count, length);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / count); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Get and free a string: CoTaskMemFree %lld ns, UCoTaskMem %lld ns, UCoTaskMem in CoTaskMemScope %lld ns\r\n",
+                per(t1 - t0), per(t2 - t1), per(t3 - t2));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,329 @@
+// test_dispatch.cpp: Test ComTools::Dispatch /////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "dispatch.h"
+#include "comexcept.h"
+#include <chrono>
+#include <cwchar>
+#include <functional>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate an automation object
+//
+
+namespace TestComTools
+{
+    wchar_t const calc_source[] = L"SimulatedProgID.Calc.1";
+    wchar_t const calc_description[] = L"Division by zero";
+
+    class CCalc : public IDispatch {
+        ULONG m_rc = 1;
+        double m_value = 0.0;
+
+    public:
+        enum : DISPID { DISPID_CALC_ADD = 1, DISPID_CALC_VALUE = 2, DISPID_CALC_ECHO = 3, DISPID_CALC_DIVIDE = 4 };
+
+        ULONG names = 0;        // Number of GetIDsOfNames calls
+        ULONG invokes = 0;      // Number of Invoke calls
+        std::function<void()> on_add;   // Called by Add before it reads its arguments
+
+        virtual ~CCalc() noexcept { }
+
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv) noexcept override
+        {
+            if (!ppv) return E_POINTER;
+            if (riid == IID_IUnknown || riid == IID_IDispatch) *ppv = static_cast<IDispatch*>(this);
+            else return (*ppv = nullptr), E_NOINTERFACE;
+            AddRef();
+            return S_OK;
+        }
+
+        STDMETHODIMP_(ULONG) AddRef() noexcept override
+        {
+            return ++m_rc;
+        }
+
+        STDMETHODIMP_(ULONG) Release() noexcept override
+        {
+            auto rc = --m_rc;
+            if (rc == 0) delete this;
+            return rc;
+        }
+
+        STDMETHODIMP GetTypeInfoCount(UINT* pctinfo) noexcept override
+        {
+            if (!pctinfo) return E_POINTER;
+            *pctinfo = 0;
+            return S_OK;
+        }
+
+        STDMETHODIMP GetTypeInfo(UINT, LCID, ITypeInfo** ppti) noexcept override
+        {
+            if (!ppti) return E_POINTER;
+            *ppti = nullptr;
+            return E_NOTIMPL;
+        }
+
+        STDMETHODIMP GetIDsOfNames(REFIID, LPOLESTR* names_in, UINT cNames, LCID, DISPID* ids) noexcept override
+        {
+            ++names;
+            if (cNames != 1) return E_INVALIDARG;
+            if (wcscmp(names_in[0], L"Add") == 0) ids[0] = DISPID_CALC_ADD;
+            else if (wcscmp(names_in[0], L"Value") == 0) ids[0] = DISPID_CALC_VALUE;
+            else if (wcscmp(names_in[0], L"Echo") == 0) ids[0] = DISPID_CALC_ECHO;
+            else if (wcscmp(names_in[0], L"Divide") == 0) ids[0] = DISPID_CALC_DIVIDE;
+            else return (ids[0] = DISPID_UNKNOWN), DISP_E_UNKNOWNNAME;
+            return S_OK;
+        }
+
+        STDMETHODIMP Invoke(DISPID id, REFIID, LCID, WORD flags, DISPPARAMS* dp,
+            VARIANT* result, EXCEPINFO* ei, UINT*) noexcept override
+        {
+            ++invokes;
+            switch (id)
+            {
+            case DISPID_CALC_ADD:
+                // Add(a, b): arguments arrive in reverse order
+                if (dp->cArgs != 2) return DISP_E_BADPARAMCOUNT;
+                if (on_add) on_add();
+                if (dp->rgvarg[0].vt != VT_I4 || dp->rgvarg[1].vt != VT_I4) return DISP_E_TYPEMISMATCH;
+                if (result)
+                {
+                    result->vt = VT_I4;
+                    result->lVal = dp->rgvarg[1].lVal + dp->rgvarg[0].lVal;
+                }
+                return S_OK;
+
+            case DISPID_CALC_VALUE:
+                if (flags & DISPATCH_PROPERTYPUT)
+                {
+                    if (dp->cArgs != 1 || dp->cNamedArgs != 1) return DISP_E_BADPARAMCOUNT;
+                    if (dp->rgdispidNamedArgs[0] != DISPID_PROPERTYPUT) return DISP_E_BADPARAMCOUNT;
+                    if (dp->rgvarg[0].vt != VT_R8) return DISP_E_TYPEMISMATCH;
+                    m_value = dp->rgvarg[0].dblVal;
+                    return S_OK;
+                }
+                if (!result) return E_POINTER;
+                result->vt = VT_R8;
+                result->dblVal = m_value;
+                return S_OK;
+
+            case DISPID_CALC_ECHO:
+                // Echo(s, [out] n): returns a copy of s and its length
+                if (dp->cArgs != 2) return DISP_E_BADPARAMCOUNT;
+                if (dp->rgvarg[1].vt != VT_BSTR) return DISP_E_TYPEMISMATCH;
+                if (dp->rgvarg[0].vt != (VT_I4 | VT_BYREF)) return DISP_E_TYPEMISMATCH;
+                *dp->rgvarg[0].plVal = static_cast<LONG>(SysStringLen(dp->rgvarg[1].bstrVal));
+                if (result)
+                {
+                    result->vt = VT_BSTR;
+                    result->bstrVal = SysAllocString(dp->rgvarg[1].bstrVal);
+                }
+                return S_OK;
+
+            case DISPID_CALC_DIVIDE:
+                if (ei)
+                {
+                    *ei = EXCEPINFO{};
+                    ei->bstrSource = SysAllocString(calc_source);
+                    ei->bstrDescription = SysAllocString(calc_description);
+                    ei->scode = E_INVALIDARG;
+                }
+                return DISP_E_EXCEPTION;
+
+            default:
+                return DISP_E_MEMBERNOTFOUND;
+            }
+        }
+    };
+
+    TEST_CLASS(TestDispatch)
+    {
+        CCalc* pCalc = nullptr;
+        IPtr<IDispatch> pDisp;
+
+    public:
+        TEST_METHOD_INITIALIZE(Initialize)
+        {
+            pCalc = new CCalc;
+            attach(pDisp, pCalc);
+        }
+
+        TEST_METHOD(CallWithArguments)
+        {
+            Dispatch d(pDisp);
+            Assert::IsTrue((bool)d);
+
+            VARIANT v;
+            VariantInit(&v);
+            Assert::IsTrue(SUCCEEDED(d.Call(L"Add", &v, 2, 3)));
+            Assert::IsTrue(v.vt == VT_I4);
+            Assert::AreEqual(5L, static_cast<long>(v.lVal));
+            VariantClear(&v);
+        }
+
+        TEST_METHOD(Reentrant)
+        {
+            // A call made from inside another call, with more arguments,
+            // does not disturb the outer call's arguments
+            Dispatch d(pDisp);
+            HRESULT inner = S_OK;
+            pCalc->on_add = [&]() {
+                pCalc->on_add = nullptr;
+                inner = d.Invoke(CCalc::DISPID_CALC_ADD, DISPATCH_METHOD, nullptr, 1, 2, 3, 4, 5, 6, 7, 8);
+            };
+
+            VARIANT v;
+            VariantInit(&v);
+            Assert::IsTrue(SUCCEEDED(d.Call(L"Add", &v, 20, 22)));
+            Assert::AreEqual(DISP_E_BADPARAMCOUNT, inner);
+            Assert::IsTrue(v.vt == VT_I4);
+            Assert::AreEqual(42L, static_cast<long>(v.lVal));
+        }
+
+        TEST_METHOD(CachedDispIds)
+        {
+            Dispatch d(pDisp);
+            for (int i = 0; i < 10; ++i)
+            {
+                VARIANT v;
+                VariantInit(&v);
+                Assert::IsTrue(SUCCEEDED(d.Call(L"Add", &v, i, i)));
+                Assert::AreEqual(static_cast<long>(2 * i), static_cast<long>(v.lVal));
+            }
+
+            Assert::AreEqual(1UL, static_cast<unsigned long>(pCalc->names));
+            Assert::AreEqual(10UL, static_cast<unsigned long>(pCalc->invokes));
+        }
+
+        TEST_METHOD(SharedCache)
+        {
+            // Objects of the same type can share one cache
+            auto cache = std::make_shared<DispIdCache>();
+            Dispatch d1(pDisp, cache);
+            DISPID id = DISPID_UNKNOWN;
+            Assert::IsTrue(SUCCEEDED(d1.GetDispId(L"Value", &id)));
+            Assert::AreEqual(static_cast<long>(CCalc::DISPID_CALC_VALUE), static_cast<long>(id));
+
+            IPtr<IDispatch> p2;
+            attach(p2, static_cast<IDispatch*>(new CCalc));
+            Dispatch d2(p2, cache);
+            id = DISPID_UNKNOWN;
+            Assert::IsTrue(SUCCEEDED(d2.GetDispId(L"Value", &id)));
+            Assert::AreEqual(static_cast<long>(CCalc::DISPID_CALC_VALUE), static_cast<long>(id));
+            Assert::AreEqual(1UL, static_cast<unsigned long>(pCalc->names));
+
+            // Names are not case sensitive
+            id = DISPID_UNKNOWN;
+            Assert::IsTrue(SUCCEEDED(d2.GetDispId(L"VALUE", &id)));
+            Assert::AreEqual(static_cast<long>(CCalc::DISPID_CALC_VALUE), static_cast<long>(id));
+            Assert::AreEqual(1UL, static_cast<unsigned long>(pCalc->names));
+        }
+
+        TEST_METHOD(UnknownName)
+        {
+            Dispatch d(pDisp);
+            VARIANT v;
+            VariantInit(&v);
+            Assert::AreEqual(DISP_E_UNKNOWNNAME, d.Call(L"Subtract", &v, 1, 2));
+        }
+
+        TEST_METHOD(PropertyPutGet)
+        {
+            Dispatch d(pDisp);
+            Assert::IsTrue(SUCCEEDED(d.Put(L"Value", 2.5)));
+
+            VARIANT v;
+            VariantInit(&v);
+            Assert::IsTrue(SUCCEEDED(d.Get(L"Value", &v)));
+            Assert::IsTrue(v.vt == VT_R8);
+            Assert::AreEqual(2.5, v.dblVal);
+        }
+
+        TEST_METHOD(StringAndOutArguments)
+        {
+            Dispatch d(pDisp);
+            UBSTR s(L"This is a string.");
+            long n = 0;
+
+            VARIANT v;
+            VariantInit(&v);
+            Assert::IsTrue(SUCCEEDED(d.Call(L"Echo", &v, s, &n)));
+            Assert::IsTrue(v.vt == VT_BSTR);
+            Assert::AreEqual(L"This is a string.", v.bstrVal);
+            Assert::AreEqual(static_cast<long>(s.length()), n);
+
+            // The result is cleared before it is reused
+            Assert::IsTrue(SUCCEEDED(d.Call(L"Echo", &v, s, &n)));
+            Assert::AreEqual(L"This is a string.", v.bstrVal);
+            VariantClear(&v);
+        }
+
+        TEST_METHOD(ExceptionToErrorInfo)
+        {
+            Dispatch d(pDisp);
+            HRESULT hr = d.Call(L"Divide", nullptr, 1, 0);
+            Assert::AreEqual(E_INVALIDARG, hr);
+
+            ComException e(hr);
+            Assert::AreEqual(calc_source, e.source().c_str());
+            Assert::AreEqual(calc_description, e.description().c_str());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Compare with GetIDsOfNames and a new DISPPARAMS for every call
+            int const n = 100000;
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; ++i)
+            {
+                wchar_t const* name = L"Add";
+                DISPID id = DISPID_UNKNOWN;
+                pDisp->GetIDsOfNames(IID_NULL, const_cast<LPOLESTR*>(&name), 1, LOCALE_USER_DEFAULT, &id);
+                VARIANTARG args[2];
+                VariantInit(&args[0]);
+                VariantInit(&args[1]);
+                args[0].vt = VT_I4;
+                args[0].lVal = i;
+                args[1].vt = VT_I4;
+                args[1].lVal = i;
+                DISPPARAMS dp{ args, nullptr, 2, 0 };
+                VARIANT v;
+                VariantInit(&v);
+                pDisp->Invoke(id, IID_NULL, LOCALE_USER_DEFAULT, DISPATCH_METHOD, &dp, &v, nullptr, nullptr);
+                VariantClear(&v);
+                VariantClear(&args[0]);
+                VariantClear(&args[1]);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            Dispatch d(pDisp);
+            VARIANT v;
+            VariantInit(&v);
+            for (int i = 0; i < n; ++i)
+            {
+                d.Call(L"Add", &v, i, i);
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            VariantClear(&v);
+
+            Assert::AreEqual(static_cast<unsigned long>(n + 1), static_cast<unsigned long>(pCalc->names));
+
+            using ns = std::chrono::nanoseconds;
+            size_t const cch = 128;
+            char buf[cch];
+            sprintf_s(buf, "Naive: %lld ns/call, Dispatch: %lld ns/call\r\n",
+                static_cast<long long>(std::chrono::duration_cast<ns>(t1 - t0).count() / n),
+                static_cast<long long>(std::chrono::duration_cast<ns>(t2 - t1).count() / n));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,167 @@
+// test_errinfo.cpp: Test ComTools::ErrorInfo, StaticError, RaiseError ////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "errinfo.h"
+#include "comexcept.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    wchar_t const error_source[] = L"SimulatedProgID.Object.1";
+    wchar_t const error_help_file[] = L"C:\\Path\\To\\Simulated\\Help.chm";
+    GUID const error_guid =
+    { 0x5c1e8a37, 0x2b94, 0x4d6f, { 0x9e, 0x03, 0x7a, 0x41, 0xd8, 0x6b, 0x2f, 0xc5 } };
+
+    // Raises an error with CreateErrorInfo(), for comparison
+    HRESULT RaiseWithCreateErrorInfo(HRESULT hr, wchar_t const* source, wchar_t const* description)
+    {
+        IPtr<ICreateErrorInfo> pcei;
+        if (SUCCEEDED(CreateErrorInfo(set(pcei))) && pcei)
+        {
+            pcei->SetSource(const_cast<wchar_t*>(source));
+            pcei->SetDescription(const_cast<wchar_t*>(description));
+            auto pei = pcei.As<IErrorInfo>(IID_IErrorInfo);
+            SetErrorInfo(0, get(pei));
+        }
+
+        return hr;
+    }
+
+    HRESULT RaiseNotFound()
+    {
+        static StaticError const not_found(E_INVALIDARG, error_source,
+            L"The item was not found.", error_guid, error_help_file, 7);
+        return not_found.Raise();
+    }
+
+    // Takes the thread's error object
+    IPtr<IErrorInfo> TakeErrorInfo()
+    {
+        IPtr<IErrorInfo> pei;
+        GetErrorInfo(0, set(pei));
+        return pei;
+    }
+
+    TEST_CLASS(TestErrorInfo)
+    {
+    public:
+        TEST_METHOD(Static)
+        {
+            HRESULT hr = RaiseNotFound();
+            Assert::AreEqual(E_INVALIDARG, hr);
+
+            ComException e(hr);
+            Assert::AreEqual(E_INVALIDARG, e.hr());
+            Assert::AreEqual(error_source, e.source().c_str());
+            Assert::AreEqual(L"The item was not found.", e.description().c_str());
+            Assert::AreEqual(error_help_file, e.help_file().c_str());
+            Assert::AreEqual(7UL, e.help_context());
+            Assert::IsTrue(error_guid == e.guid());
+
+            // The same error object is raised each time
+            RaiseNotFound();
+            auto first = TakeErrorInfo();
+            RaiseNotFound();
+            auto second = TakeErrorInfo();
+            Assert::IsTrue((bool)first);
+            Assert::IsTrue(first == second);
+        }
+
+        TEST_METHOD(Dynamic)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                std::wstring description = L"Item " + std::to_wstring(i) + L" was not found.";
+                HRESULT hr = RaiseError(E_FAIL, error_source, description);
+                Assert::AreEqual(E_FAIL, hr);
+
+                ComException e(hr);
+                Assert::AreEqual(error_source, e.source().c_str());
+                Assert::AreEqual(description, e.description());
+                Assert::IsTrue(e.help_file().empty());
+                Assert::AreEqual(0UL, e.help_context());
+                Assert::IsTrue(GUID_NULL == e.guid());
+            }
+
+            // The error objects are reused once the caller releases them
+            auto stats = ErrorInfo::Stats();
+            RaiseError(E_FAIL, error_source, L"Another error.", error_guid);
+            TakeErrorInfo();
+            Assert::AreEqual(stats.reused + 1, ErrorInfo::Stats().reused);
+        }
+
+        TEST_METHOD(Threads)
+        {
+            std::vector<std::thread> threads;
+            std::atomic<int> failures = 0;
+            for (int t = 0; t < 4; ++t)
+            {
+                threads.emplace_back([&failures, t]() {
+                    for (int i = 0; i < 1000; ++i)
+                    {
+                        HRESULT hr = (i % 2) ? RaiseNotFound() : RaiseError(E_FAIL, error_source, std::to_wstring(t));
+                        ComException e(hr);
+                        bool ok = (i % 2) ?
+                            e.description() == L"The item was not found." :
+                            e.description() == std::to_wstring(t);
+                        if (!ok) ++failures;
+                    }
+                });
+            }
+
+            for (auto& thread : threads) thread.join();
+            Assert::AreEqual(0, failures.load());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Raise an error and take the error object, as a caller would
+            int const count = 200000;
+            wchar_t const description[] = L"The item was not found.";
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                RaiseWithCreateErrorInfo(E_INVALIDARG, error_source, description);
+                TakeErrorInfo();
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                RaiseError(E_INVALIDARG, error_source, description);
+                TakeErrorInfo();
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                RaiseNotFound();
+                TakeErrorInfo();
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(E_INVALIDARG, RaiseNotFound());
+            Assert::IsTrue((bool)TakeErrorInfo());
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / count); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Raise an error: CreateErrorInfo %lld ns, RaiseError %lld ns, StaticError %lld ns\r\n",
+                per(t1 - t0), per(t2 - t1), per(t3 - t2));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
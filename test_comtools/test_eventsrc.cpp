@@ -0,0 +1,315 @@
+// test_eventsrc.cpp: Test ComTools::EventSource //////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "eventsrc.h"
+#include "comobject.h"
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IEventSink
+DECLARE_INTERFACE_IID_(IEventSink, IUnknown, "C7A2D5E8-1B94-4F36-8D0C-3E6F9A1B2C47")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD(OnEvent)(THIS_ long value) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CSink final : public Object<CSink, IEventSink> {
+    public:
+        static inline std::atomic<int> live = 0;
+
+        std::atomic<long> events = 0;
+        std::atomic<long> sum = 0;
+        EventSource<IEventSink>* source = nullptr;
+        DWORD cookie = 0;
+
+        CSink() noexcept { ++live; }
+        ~CSink() noexcept { --live; }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(IEventSink) ? static_cast<IEventSink*>(this) : nullptr;
+        }
+
+        // If source is set, the sink unadvises when it receives an event
+        STDMETHODIMP OnEvent(long value) noexcept override
+        {
+            ++events;
+            sum += value;
+            if (source) source->Unadvise(cookie);
+            return S_OK;
+        }
+    };
+
+    IPtr<IEventSink> MakeSink(CSink** obj = nullptr)
+    {
+        IPtr<IEventSink> p;
+        CSink::Create(__uuidof(IEventSink), reinterpret_cast<void**>(set(p)));
+        if (obj) *obj = static_cast<CSink*>(get(p));
+        return p;
+    }
+
+    // Sink list guarded by a mutex that is held while firing, for comparison
+    class LockedSinks {
+        std::mutex m_lock;
+        std::vector<std::pair<DWORD, IPtr<IEventSink>>> m_sinks;
+        DWORD m_cookie = 0;
+
+    public:
+        DWORD Advise(IPtr<IEventSink> const& sink)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_sinks.emplace_back(++m_cookie, sink);
+            return m_cookie;
+        }
+
+        void Unadvise(DWORD cookie)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (auto it = m_sinks.begin(); it != m_sinks.end(); ++it)
+            {
+                if (it->first == cookie)
+                {
+                    m_sinks.erase(it);
+                    return;
+                }
+            }
+        }
+
+        void Fire(long value)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (auto& sink : m_sinks) sink.second->OnEvent(value);
+        }
+    };
+
+    TEST_CLASS(TestEventSource)
+    {
+    public:
+        TEST_METHOD(AdviseAndUnadvise)
+        {
+            int live = CSink::live;
+            {
+                EventSource<IEventSink> source;
+                Assert::AreEqual(size_t(0), source.Fire([](IEventSink* p) { p->OnEvent(1); }));
+
+                CSink* obj1 = nullptr;
+                CSink* obj2 = nullptr;
+                auto sink1 = MakeSink(&obj1);
+                auto sink2 = MakeSink(&obj2);
+
+                DWORD cookie1 = 0;
+                DWORD cookie2 = 0;
+                Assert::AreEqual(S_OK, source.Advise(sink1, &cookie1));
+                Assert::AreEqual(S_OK, source.Advise(get(sink2), __uuidof(IEventSink), &cookie2));
+                Assert::AreNotEqual(0UL, static_cast<unsigned long>(cookie1));
+                Assert::AreNotEqual(cookie1, cookie2);
+                Assert::AreEqual(size_t(2), source.Count());
+
+                Assert::AreEqual(size_t(2), source.Fire([](IEventSink* p) { p->OnEvent(5); }));
+                Assert::AreEqual(5L, obj1->sum.load());
+                Assert::AreEqual(5L, obj2->sum.load());
+
+                Assert::AreEqual(S_OK, source.Unadvise(cookie1));
+                Assert::AreEqual(CONNECT_E_NOCONNECTION, source.Unadvise(cookie1));
+                Assert::AreEqual(size_t(1), source.Fire([](IEventSink* p) { p->OnEvent(2); }));
+                Assert::AreEqual(5L, obj1->sum.load());
+                Assert::AreEqual(7L, obj2->sum.load());
+
+                DWORD cookie = 0;
+                Assert::AreEqual(E_POINTER, source.Advise(IPtr<IEventSink>(), &cookie));
+                Assert::AreEqual(CONNECT_E_CANNOTCONNECT, source.Advise(get(sink1), IID_IDispatch, &cookie));
+                Assert::AreEqual(0UL, static_cast<unsigned long>(cookie));
+
+                // The source holds a reference until it is cleared
+                sink2 = nullptr;
+                Assert::AreEqual(live + 2, CSink::live.load());
+                source.Clear();
+                Assert::AreEqual(size_t(0), source.Count());
+                Assert::AreEqual(live + 1, CSink::live.load());
+            }
+
+            Assert::AreEqual(live, CSink::live.load());
+        }
+
+        TEST_METHOD(Snapshot)
+        {
+            EventSource<IEventSink> source;
+            auto sink = MakeSink();
+            DWORD cookie = 0;
+            source.Advise(sink, &cookie);
+
+            auto sinks = source.Sinks();
+            source.Unadvise(cookie);
+            Assert::AreEqual(size_t(0), source.Count());
+
+            // A snapshot does not change after it is taken
+            Assert::AreEqual(size_t(1), sinks->size());
+            Assert::AreEqual(cookie, (*sinks)[0].cookie);
+            Assert::IsTrue((*sinks)[0].sink == sink);
+        }
+
+        TEST_METHOD(UnadviseWhileFiring)
+        {
+            int live = CSink::live;
+            EventSource<IEventSink> source;
+            {
+                for (int i = 0; i < 4; ++i)
+                {
+                    CSink* obj = nullptr;
+                    auto sink = MakeSink(&obj);
+                    source.Advise(sink, &obj->cookie);
+                    obj->source = &source;
+                }
+            }
+
+            // Every sink unadvises itself; the snapshot being fired keeps
+            // them alive until firing finishes
+            Assert::AreEqual(size_t(4), source.Fire([](IEventSink* p) { p->OnEvent(1); }));
+            Assert::AreEqual(size_t(0), source.Count());
+            Assert::AreEqual(live, CSink::live.load());
+        }
+
+        TEST_METHOD(UnadviseUnderLoad)
+        {
+            // Threads fire without pause, and their events overlap, so there
+            // is never a moment when no thread is firing. Unadvised sinks
+            // are still released once the events in progress finish.
+            int live = CSink::live;
+            EventSource<IEventSink> source;
+            DWORD cookie = 0;
+            source.Advise(MakeSink(), &cookie);
+
+            std::atomic<bool> stop = false;
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i)
+            {
+                threads.emplace_back([&]() {
+                    while (!stop)
+                    {
+                        source.Fire([](IEventSink* p) {
+                            p->OnEvent(1);
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        });
+                    }
+                });
+            }
+
+            bool released = true;
+            for (int i = 0; released && i < 20; ++i)
+            {
+                DWORD added = 0;
+                source.Advise(MakeSink(), &added);
+                source.Unadvise(added);
+                auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                while (CSink::live != live + 1 && std::chrono::steady_clock::now() < deadline)
+                {
+                    std::this_thread::yield();
+                }
+
+                released = CSink::live == live + 1;
+            }
+
+            stop = true;
+            for (auto& thread : threads) thread.join();
+            Assert::IsTrue(released);
+            source.Clear();
+            Assert::AreEqual(live, CSink::live.load());
+        }
+
+        TEST_METHOD(AdviseWhileFiring)
+        {
+            EventSource<IEventSink> source;
+            auto sink = MakeSink();
+            DWORD cookie = 0;
+            source.Advise(sink, &cookie);
+
+            // Sinks advised while firing receive the next event
+            size_t fired = source.Fire([&](IEventSink* p) {
+                DWORD added = 0;
+                source.Advise(MakeSink(), &added);
+                p->OnEvent(1);
+            });
+
+            Assert::AreEqual(size_t(1), fired);
+            Assert::AreEqual(size_t(2), source.Count());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Fire to eight sinks while another thread advises and
+            // unadvises a ninth
+            int const sinks = 8;
+            int const events = 100000;
+            std::vector<IPtr<IEventSink>> objects;
+            for (int i = 0; i < sinks; ++i) objects.push_back(MakeSink());
+            auto extra = MakeSink();
+
+            LockedSinks locked;
+            EventSource<IEventSink> source;
+            for (auto& p : objects)
+            {
+                DWORD cookie = 0;
+                locked.Advise(p);
+                source.Advise(p, &cookie);
+            }
+
+            std::atomic<bool> stop = false;
+            std::atomic<long> churn1 = 0;
+            std::thread thread1([&]() {
+                while (!stop) locked.Unadvise(locked.Advise(extra)), ++churn1;
+            });
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < events; ++i) locked.Fire(1);
+            auto t1 = std::chrono::steady_clock::now();
+            stop = true;
+            thread1.join();
+
+            stop = false;
+            std::atomic<long> churn2 = 0;
+            std::thread thread2([&]() {
+                DWORD cookie = 0;
+                while (!stop) source.Advise(extra, &cookie), source.Unadvise(cookie), ++churn2;
+            });
+
+            auto t2 = std::chrono::steady_clock::now();
+            size_t fired = 0;
+            for (int i = 0; i < events; ++i) fired += source.Fire([](IEventSink* p) { p->OnEvent(1); });
+            auto t3 = std::chrono::steady_clock::now();
+            stop = true;
+            thread2.join();
+
+            Assert::IsTrue(fired >= static_cast<size_t>(sinks) * events);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / events); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Fire to %d sinks: mutex %lld ns (%ld advise/unadvise), EventSource %lld ns (%ld advise/unadvise)\r\n",
+                sinks, per(t1 - t0), churn1.load(), per(t3 - t2), churn2.load());
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,278 @@
+// test_executor.cpp: Test ComTools::Executor /////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "executor.h"
+#include "comobject.h"
+#include "iptr.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE ICounter
+DECLARE_INTERFACE_IID_(ICounter, IUnknown, "9B4E2F17-3C6A-4D85-A0F1-7E2C5B8D4A93")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(LONG, Increment)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CCounter final : public Object<CCounter, ICounter> {
+        LONG m_count = 0;
+
+    public:
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(ICounter) ? static_cast<ICounter*>(this) : nullptr;
+        }
+
+        STDMETHODIMP_(LONG) Increment() noexcept override
+        {
+            return InterlockedIncrement(&m_count);
+        }
+    };
+
+    // Stand-in for CoInitializeEx and CoUninitialize
+    struct TestApartment {
+        static inline std::atomic<int> inits = 0;
+        static inline std::atomic<int> uninits = 0;
+        static inline thread_local bool t_entered = false;
+
+        static HRESULT Initialize(DWORD coinit) noexcept
+        {
+            if (coinit == COINIT_APARTMENTTHREADED) return RPC_E_CHANGED_MODE;
+            t_entered = true;
+            ++inits;
+            return S_OK;
+        }
+
+        static void Uninitialize() noexcept
+        {
+            t_entered = false;
+            ++uninits;
+        }
+    };
+
+    // Thread pool with one queue, for comparison
+    class MutexPool {
+        std::mutex m_lock;
+        std::condition_variable m_cv;
+        std::condition_variable m_idle;
+        std::deque<std::function<void()>> m_items;
+        std::vector<std::thread> m_threads;
+        size_t m_outstanding = 0;
+        bool m_stop = false;
+
+    public:
+        explicit MutexPool(size_t threads)
+        {
+            for (size_t i = 0; i < threads; ++i)
+            {
+                m_threads.emplace_back([this]() {
+                    std::unique_lock<std::mutex> lock(m_lock);
+                    for (;;)
+                    {
+                        m_cv.wait(lock, [this]() { return m_stop || !m_items.empty(); });
+                        if (m_items.empty()) break;
+                        auto f = std::move(m_items.front());
+                        m_items.pop_front();
+                        lock.unlock();
+                        f();
+                        lock.lock();
+                        if (--m_outstanding == 0) m_idle.notify_all();
+                    }
+                });
+            }
+        }
+
+        ~MutexPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stop = true;
+            }
+
+            m_cv.notify_all();
+            for (auto& thread : m_threads) thread.join();
+        }
+
+        void Submit(std::function<void()> f)
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_items.push_back(std::move(f));
+                ++m_outstanding;
+            }
+
+            m_cv.notify_one();
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_idle.wait(lock, [this]() { return m_outstanding == 0; });
+        }
+    };
+
+    TEST_CLASS(TestExecutor)
+    {
+    public:
+        TEST_METHOD(InitOnce)
+        {
+            int inits = TestApartment::inits;
+            int uninits = TestApartment::uninits;
+            std::atomic<int> ran = 0;
+            std::atomic<int> outside = 0;
+            {
+                Executor<TestApartment> executor(4);
+                Assert::IsTrue((bool)executor);
+                Assert::AreEqual(S_OK, executor.Status());
+                Assert::AreEqual(size_t(4), executor.Size());
+                Assert::AreEqual(4, TestApartment::inits - inits);
+
+                for (int i = 0; i < 1000; ++i)
+                {
+                    Assert::AreEqual(S_OK, executor.Submit([&]() {
+                        ++ran;
+                        if (!TestApartment::t_entered) ++outside;
+                    }));
+                }
+
+                executor.Wait();
+                Assert::AreEqual(1000, ran.load());
+                Assert::AreEqual(0, TestApartment::uninits - uninits);
+            }
+
+            // Each worker entered its apartment once
+            Assert::AreEqual(0, outside.load());
+            Assert::AreEqual(4, TestApartment::inits - inits);
+            Assert::AreEqual(4, TestApartment::uninits - uninits);
+        }
+
+        TEST_METHOD(InitFails)
+        {
+            int uninits = TestApartment::uninits;
+            Executor<TestApartment> executor(2, COINIT_APARTMENTTHREADED);
+            Assert::IsFalse((bool)executor);
+            Assert::AreEqual(RPC_E_CHANGED_MODE, executor.Status());
+            Assert::AreEqual(E_UNEXPECTED, executor.Submit([]() {}));
+            Assert::AreEqual(0, TestApartment::uninits - uninits);
+        }
+
+        TEST_METHOD(CapturesIPtr)
+        {
+            IPtr<ICounter> counter;
+            Assert::AreEqual(S_OK, CCounter::Create(__uuidof(ICounter), reinterpret_cast<void**>(set(counter))));
+
+            Executor<TestApartment> executor(4);
+            for (int i = 0; i < 100; ++i)
+            {
+                executor.Submit([p = counter]() { p->Increment(); });
+            }
+
+            executor.Wait();
+
+            // Every captured reference was released when its work finished
+            get(counter)->AddRef();
+            Assert::AreEqual(1UL, get(counter)->Release());
+            Assert::AreEqual(101L, counter->Increment());
+        }
+
+        TEST_METHOD(Stealing)
+        {
+            // Work submitted from a worker goes to its own queue; while that
+            // worker is busy, the other workers must steal it
+            Executor<TestApartment> executor(4);
+            std::atomic<int> done = 0;
+            executor.Submit([&]() {
+                for (int i = 0; i < 100; ++i) executor.Submit([&]() { ++done; });
+                while (done.load() < 100) std::this_thread::yield();
+            });
+
+            executor.Wait();
+            Assert::AreEqual(100, done.load());
+            Assert::IsTrue(executor.Stolen() >= 100);
+        }
+
+        TEST_METHOD(Drain)
+        {
+            // Work queued when the executor is destroyed still runs
+            std::atomic<int> ran = 0;
+            {
+                Executor<TestApartment> executor(2);
+                for (int i = 0; i < 100; ++i)
+                {
+                    executor.Submit([&]() {
+                        executor.Submit([&]() { ++ran; });
+                        ++ran;
+                    });
+                }
+            }
+
+            Assert::AreEqual(200, ran.load());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Small work items, fanned out from one thread and from workers
+            size_t const threads = 4;
+            int const count = 200000;
+            std::atomic<long> sum1 = 0;
+            std::atomic<long> sum2 = 0;
+            std::atomic<long> sum3 = 0;
+
+            auto t0 = std::chrono::steady_clock::now();
+            {
+                MutexPool pool(threads);
+                for (int i = 0; i < count; ++i) pool.Submit([&sum1]() { sum1.fetch_add(1, std::memory_order_relaxed); });
+                pool.Wait();
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            Executor<TestApartment> executor(threads);
+            for (int i = 0; i < count; ++i) executor.Submit([&sum2]() { sum2.fetch_add(1, std::memory_order_relaxed); });
+            executor.Wait();
+
+            auto t2 = std::chrono::steady_clock::now();
+            for (int i = 0; i < 100; ++i)
+            {
+                executor.Submit([&]() {
+                    for (int j = 0; j < count / 100; ++j) executor.Submit([&sum3]() { sum3.fetch_add(1, std::memory_order_relaxed); });
+                });
+            }
+
+            executor.Wait();
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(static_cast<long>(count), sum1.load());
+            Assert::AreEqual(static_cast<long>(count), sum2.load());
+            Assert::AreEqual(static_cast<long>(count), sum3.load());
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / count); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Per work item: mutex queue %lld ns, Executor %lld ns, Executor from workers %lld ns (%zu stolen)\r\n",
+                per(t1 - t0), per(t2 - t1), per(t3 - t2), executor.Stolen());
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,266 @@
+// test_identity.cpp: Test ComTools::IdentityPtr, IdentitySet, IdentityMap ////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "identity.h"
+#include "comobject.h"
+#include <chrono>
+#include <set>
+#include <unordered_set>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE INode
+DECLARE_INTERFACE_IID_(INode, IUnknown, "3D9C4B71-0E6A-4F25-8B13-A7C2E5F0D948")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(long, Key)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+#define INTERFACE ILabel
+DECLARE_INTERFACE_IID_(ILabel, IUnknown, "3D9C4B72-0E6A-4F25-8B13-A7C2E5F0D948")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(wchar_t const*, Text)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CNode final : public Object<CNode, INode, ILabel> {
+        long m_key;
+
+    public:
+        static inline long live = 0;
+
+        explicit CNode(long key) noexcept : m_key(key) { ++live; }
+        ~CNode() noexcept { --live; }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            if (riid == __uuidof(INode)) return static_cast<INode*>(this);
+            if (riid == __uuidof(ILabel)) return static_cast<ILabel*>(this);
+            return nullptr;
+        }
+
+        STDMETHODIMP_(long) Key() noexcept override { return m_key; }
+        STDMETHODIMP_(wchar_t const*) Text() noexcept override { return L"node"; }
+    };
+
+    // Returns the node as IUnknown through INode or ILabel
+    IPtr<IUnknown> MakeNode(long key, IPtr<IUnknown>* label = nullptr)
+    {
+        IPtr<INode> node;
+        CNode::Create(__uuidof(INode), reinterpret_cast<void**>(set(node)), key);
+        if (label) *label = IPtr<IUnknown>(node.As<ILabel>(__uuidof(ILabel)));
+        return IPtr<IUnknown>(node);
+    }
+
+    ULONG NodeRefs(IPtr<IUnknown> const& p)
+    {
+        get(p)->AddRef();
+        return get(p)->Release();
+    }
+
+    TEST_CLASS(TestIdentity)
+    {
+    public:
+        TEST_METHOD(IdentityPtrs)
+        {
+            IPtr<IUnknown> label;
+            auto node = MakeNode(1, &label);
+            auto other = MakeNode(2);
+
+            // The raw pointers differ, but the object is the same
+            Assert::IsTrue(node != label);
+            Assert::IsTrue(SameObject(node, label));
+            Assert::IsFalse(SameObject(node, other));
+            Assert::IsFalse(SameObject(node, IPtr<IUnknown>()));
+
+            IdentityPtr<IUnknown> a(node);
+            IdentityPtr<IUnknown> b(label);
+            IdentityPtr<IUnknown> c(other);
+            Assert::IsTrue(a == b);
+            Assert::IsTrue(a != c);
+            Assert::IsTrue(a < c || c < a);
+            Assert::IsTrue(b.Ptr() == label);
+            Assert::IsFalse((bool)IdentityPtr<IUnknown>());
+
+            std::unordered_set<IdentityPtr<IUnknown>> objects{ a, b, c };
+            Assert::AreEqual(size_t(2), objects.size());
+        }
+
+        TEST_METHOD(Set)
+        {
+            long live = CNode::live;
+            {
+                IPtr<IUnknown> label;
+                auto node = MakeNode(1, &label);
+                ULONG refs = NodeRefs(node);
+
+                IdentitySet<IUnknown> nodes;
+                Assert::AreEqual(S_OK, nodes.Insert(node));
+                Assert::AreEqual(S_FALSE, nodes.Insert(label));
+                Assert::AreEqual(E_POINTER, nodes.Insert(IPtr<IUnknown>()));
+                Assert::AreEqual(size_t(1), nodes.Size());
+                Assert::IsTrue(nodes.Contains(label));
+                Assert::IsTrue(nodes.begin()->ptr == get(node));
+                Assert::AreEqual(refs + 1, NodeRefs(node));
+
+                Assert::AreEqual(S_OK, nodes.Erase(get(label)));
+                Assert::AreEqual(S_FALSE, nodes.Erase(get(label)));
+                Assert::IsTrue(nodes.Empty());
+                Assert::AreEqual(refs, NodeRefs(node));
+            }
+
+            Assert::AreEqual(live, CNode::live);
+        }
+
+        TEST_METHOD(SetBulk)
+        {
+            long live = CNode::live;
+            {
+                IdentitySet<IUnknown> nodes;
+                std::vector<IPtr<IUnknown>> items;
+                for (long i = 0; i < 4; ++i)
+                {
+                    IPtr<IUnknown> label;
+                    items.push_back(MakeNode(i, &label));
+                    items.push_back(label);
+                    items.push_back(items.back());
+                }
+
+                items.push_back(IPtr<IUnknown>());
+                Assert::AreEqual(S_OK, nodes.Insert(items[0]));
+
+                // Only the first pointer to each new object is inserted
+                size_t inserted = 0;
+                Assert::AreEqual(S_OK, nodes.Insert(items.data(), items.size(), &inserted));
+                Assert::AreEqual(size_t(3), inserted);
+                Assert::AreEqual(size_t(4), nodes.Size());
+                for (auto& entry : nodes) Assert::IsTrue(entry.id == IdentityOf(entry.ptr));
+
+                // The set holds one reference to each object
+                ULONG refs = NodeRefs(items[0]);
+                for (size_t i = 0; i < 12; i += 3) Assert::AreEqual(refs, NodeRefs(items[i]));
+
+                size_t erased = 0;
+                {
+                    IPtr<IUnknown> erase[] = { items[2], items[3], items[4] };
+                    Assert::AreEqual(S_OK, nodes.Erase(erase, 3, &erased));
+                }
+
+                Assert::AreEqual(size_t(2), erased);
+                Assert::AreEqual(size_t(2), nodes.Size());
+                Assert::IsFalse(nodes.Contains(items[3]));
+                Assert::IsTrue(nodes.Contains(items[6]));
+
+                items.clear();
+                Assert::AreEqual(live + 2, CNode::live);
+            }
+
+            Assert::AreEqual(live, CNode::live);
+        }
+
+        TEST_METHOD(Map)
+        {
+            long live = CNode::live;
+            {
+                IPtr<IUnknown> label1;
+                IPtr<IUnknown> label2;
+                auto node1 = MakeNode(1, &label1);
+                auto node2 = MakeNode(2, &label2);
+
+                IdentityMap<IUnknown, int> values;
+                Assert::AreEqual(S_OK, values.Insert(node1, 10));
+                Assert::AreEqual(S_FALSE, values.Insert(label1, 11));
+                Assert::AreEqual(10, *values.Find(label1));
+                Assert::IsNull(values.Find(node2));
+
+                // The first value for each new object is inserted
+                std::pair<IPtr<IUnknown>, int> items[] = {
+                    { label2, 20 }, { node1, 12 }, { node2, 21 } };
+                size_t inserted = 0;
+                Assert::AreEqual(S_OK, values.Insert(items, 3, &inserted));
+                Assert::AreEqual(size_t(1), inserted);
+                Assert::AreEqual(10, *values.Find(node1));
+                Assert::AreEqual(20, *values.Find(node2));
+
+                *values.Find(label2) = 22;
+                Assert::AreEqual(22, *std::as_const(values).Find(get(node2)));
+                Assert::AreEqual(S_OK, values.Erase(get(node1)));
+                Assert::AreEqual(size_t(1), values.Size());
+            }
+
+            Assert::AreEqual(live, CNode::live);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Deduplicate 1M pointers to 4096 objects, through both of
+            // their interfaces
+            size_t const count = 1 << 20;
+            long const objects = 4096;
+            std::vector<IPtr<IUnknown>> pointers[2];
+            for (long i = 0; i < objects; ++i)
+            {
+                IPtr<IUnknown> label;
+                pointers[0].push_back(MakeNode(i, &label));
+                pointers[1].push_back(label);
+            }
+
+            std::vector<IPtr<IUnknown>> items;
+            items.reserve(count);
+            unsigned seed = 1;
+            for (size_t i = 0; i < count; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                items.push_back(pointers[i & 1][(seed >> 8) % objects]);
+            }
+
+            auto t0 = std::chrono::steady_clock::now();
+            std::set<IPtr<IUnknown>> raw(items.begin(), items.end());
+            auto t1 = std::chrono::steady_clock::now();
+            std::unordered_set<IdentityPtr<IUnknown>> hashed;
+            for (auto& p : items) hashed.insert(IdentityPtr<IUnknown>(p));
+            auto t2 = std::chrono::steady_clock::now();
+            IdentitySet<IUnknown> set;
+            size_t inserted = 0;
+            Assert::AreEqual(S_OK, set.Insert(items.data(), items.size(), &inserted));
+            auto t3 = std::chrono::steady_clock::now();
+
+            Assert::AreEqual(size_t(2 * objects), raw.size());
+            Assert::AreEqual(size_t(objects), hashed.size());
+            Assert::AreEqual(size_t(objects), inserted);
+
+            using ms = std::chrono::milliseconds;
+            auto in = [](auto d) { return static_cast<long long>(std::chrono::duration_cast<ms>(d).count()); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Dedup of %zu pointers: std::set by pointer %lld ms (%zu left), "
+                "unordered_set of IdentityPtr %lld ms, IdentitySet bulk insert %lld ms (%zu left)\r\n",
+                count, in(t1 - t0), raw.size(), in(t2 - t1), in(t3 - t2), set.Size());
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
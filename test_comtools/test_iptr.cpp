@@ -2,6 +2,7 @@
 // Copyright (c) 2022, Jeffrey M. Engelmann
 
 #include "CppUnitTest.h"
+#include <chrono>
 #include <cstdio>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -161,6 +162,71 @@ HRESULT NewCAB(REFIID riid, void** ppv)
     }
 }
 
+// Stands in for a COM proxy to a CAB. Each QueryInterface() call that the
+// proxy cannot answer itself, and each QueryMultipleInterfaces() call, is a
+// round trip to the object that takes latency microseconds.
+class CProxy final : public IMultiQI {
+    ULONG m_rc = 0;
+    IPtr<IA> m_object;
+
+    void RoundTrip() noexcept
+    {
+        ++roundTrips;
+        auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(latency);
+        while (std::chrono::steady_clock::now() < end) { }
+    }
+
+public:
+    ULONG roundTrips = 0;
+    long latency;
+    HRESULT multiFails = S_OK;  // Error returned by QueryMultipleInterfaces()
+
+    CProxy(IPtr<IA> const& object, long latency) noexcept : m_object(object), latency(latency) { }
+
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv) noexcept override
+    {
+        if (!ppv) return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_IMultiQI)
+        {
+            *ppv = static_cast<IMultiQI*>(this);
+            AddRef();
+            return S_OK;
+        }
+
+        RoundTrip();
+        return m_object->QueryInterface(riid, ppv);
+    }
+
+    STDMETHODIMP_(ULONG) AddRef() noexcept override
+    {
+        return ++m_rc;
+    }
+
+    STDMETHODIMP_(ULONG) Release() noexcept override
+    {
+        auto rc = --m_rc;
+        if (rc == 0) delete this;
+        return rc;
+    }
+
+    STDMETHODIMP QueryMultipleInterfaces(ULONG cMQIs, MULTI_QI* pMQIs) noexcept override
+    {
+        if (!pMQIs) return E_POINTER;
+        RoundTrip();
+        if (FAILED(multiFails)) return multiFails;
+
+        ULONG found = 0;
+        for (ULONG i = 0; i < cMQIs; ++i)
+        {
+            pMQIs[i].hr = m_object->QueryInterface(*pMQIs[i].pIID, reinterpret_cast<void**>(&pMQIs[i].pItf));
+            if (SUCCEEDED(pMQIs[i].hr)) ++found;
+        }
+
+        if (found == cMQIs) return S_OK;
+        return found ? CO_S_NOTALLINTERFACES : E_NOINTERFACE;
+    }
+};
+
 namespace test_iptr
 {
     TEST_CLASS(TestIPtr)
@@ -401,6 +467,84 @@ namespace test_iptr
             Assert::IsTrue((bool)p);
             p->Method1(L"I came from CopyFrom");
         }
+
+        TEST_METHOD(AsMany)
+        {
+            // CAB does not implement IMultiQI, so each interface is queried
+            auto [a, b, e] = pB.AsMany<IA, IB, ISupportErrorInfo>(
+                __uuidof(IA), __uuidof(IB), __uuidof(ISupportErrorInfo));
+            Assert::IsTrue(a == pA);
+            Assert::IsTrue(b == pB);
+            Assert::IsFalse((bool)e);
+
+            auto [none] = IPtr<IA>().AsMany<IB>(__uuidof(IB));
+            Assert::IsFalse((bool)none);
+        }
+
+        TEST_METHOD(AsManyProxy)
+        {
+            auto proxy = new CProxy(pA, 0);
+            IPtr<IUnknown> p;
+            proxy->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(set(p)));
+
+            // One round trip for all of the interfaces
+            auto [a, b, e] = p.AsMany<IA, IB, ISupportErrorInfo>(
+                __uuidof(IA), __uuidof(IB), __uuidof(ISupportErrorInfo));
+            Assert::AreEqual(1UL, proxy->roundTrips);
+            Assert::IsTrue(a == pA);
+            Assert::IsTrue(b == pB);
+            Assert::IsFalse((bool)e);
+
+            // A single interface does not need QueryMultipleInterfaces()
+            auto [a2] = p.AsMany<IA>(__uuidof(IA));
+            Assert::AreEqual(2UL, proxy->roundTrips);
+            Assert::IsTrue(a2 == pA);
+
+            // If QueryMultipleInterfaces() fails, each interface is queried
+            proxy->multiFails = RPC_E_DISCONNECTED;
+            auto [a3, b3, e3] = p.AsMany<IA, IB, ISupportErrorInfo>(
+                __uuidof(IA), __uuidof(IB), __uuidof(ISupportErrorInfo));
+            Assert::AreEqual(6UL, proxy->roundTrips);
+            Assert::IsTrue(a3 == pA);
+            Assert::IsTrue(b3 == pB);
+            Assert::IsFalse((bool)e3);
+        }
+
+        TEST_METHOD(AsManyTiming)
+        {
+            // Query a proxy with 20 us of latency for three interfaces
+            int const rounds = 200;
+            auto proxy = new CProxy(pA, 20);
+            IPtr<IUnknown> p;
+            proxy->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(set(p)));
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+            {
+                auto a = p.As<IA>(__uuidof(IA));
+                auto b = p.As<IB>(__uuidof(IB));
+                auto e = p.As<ISupportErrorInfo>(__uuidof(ISupportErrorInfo));
+                Assert::IsTrue(a && b && !e);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+            {
+                auto [a, b, e] = p.AsMany<IA, IB, ISupportErrorInfo>(
+                    __uuidof(IA), __uuidof(IB), __uuidof(ISupportErrorInfo));
+                Assert::IsTrue(a && b && !e);
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            Assert::AreEqual(static_cast<ULONG>(4 * rounds), proxy->roundTrips);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / rounds); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Three interfaces through a proxy: As %lld ns, AsMany %lld ns\r\n", per(t1 - t0), per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
     };
 }
 
@@ -0,0 +1,301 @@
+// test_mmstream.cpp: Test ComTools::MappedStream /////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "mmstream.h"
+#include "iptr.h"
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // Temporary file with predictable contents, removed on destruction
+    class TempFile {
+        std::filesystem::path m_path;
+
+    public:
+        TempFile(wchar_t const* name, size_t cb)
+            : m_path(std::filesystem::temp_directory_path() / name)
+        {
+            std::vector<char> data(cb);
+            for (size_t i = 0; i < cb; ++i) data[i] = Byte(i);
+            std::ofstream file(m_path, std::ios::binary | std::ios::trunc);
+            file.write(data.data(), static_cast<std::streamsize>(cb));
+        }
+
+        ~TempFile()
+        {
+            std::error_code ec;
+            std::filesystem::remove(m_path, ec);
+        }
+
+        static char Byte(size_t i) noexcept
+        {
+            return static_cast<char>((i * 31) ^ (i >> 8));
+        }
+
+        std::wstring path() const
+        {
+            return m_path.wstring();
+        }
+    };
+
+    TEST_CLASS(TestMappedStream)
+    {
+        static IPtr<IStream> Open(TempFile const& file)
+        {
+            IPtr<IStream> stream;
+            Assert::AreEqual(S_OK, CreateMappedStream(file.path().c_str(), set(stream)));
+            return stream;
+        }
+
+        static ULONGLONG Seek(IStream* stream, LONGLONG offset, DWORD origin)
+        {
+            LARGE_INTEGER move = { };
+            move.QuadPart = offset;
+            ULARGE_INTEGER pos = { };
+            Assert::AreEqual(S_OK, stream->Seek(move, origin, &pos));
+            return pos.QuadPart;
+        }
+
+    public:
+        TEST_METHOD(ReadAndSeek)
+        {
+            TempFile file(L"comtools_mmstream_read.bin", 1000);
+            auto stream = Open(file);
+
+            char buf[100];
+            ULONG cbRead = 0;
+            Assert::AreEqual(S_OK, stream->Read(buf, sizeof(buf), &cbRead));
+            Assert::AreEqual(100UL, static_cast<unsigned long>(cbRead));
+            Assert::AreEqual(TempFile::Byte(99), buf[99]);
+
+            Assert::AreEqual(500ULL, static_cast<unsigned long long>(Seek(get(stream), 400, STREAM_SEEK_CUR)));
+            Assert::AreEqual(S_OK, stream->Read(buf, 1, &cbRead));
+            Assert::AreEqual(TempFile::Byte(500), buf[0]);
+
+            Assert::AreEqual(990ULL, static_cast<unsigned long long>(Seek(get(stream), -10, STREAM_SEEK_END)));
+            Assert::AreEqual(S_OK, stream->Read(buf, sizeof(buf), &cbRead));
+            Assert::AreEqual(10UL, static_cast<unsigned long>(cbRead));
+
+            // Past the end: no data
+            Assert::AreEqual(2000ULL, static_cast<unsigned long long>(Seek(get(stream), 2000, STREAM_SEEK_SET)));
+            Assert::AreEqual(S_OK, stream->Read(buf, sizeof(buf), &cbRead));
+            Assert::AreEqual(0UL, static_cast<unsigned long>(cbRead));
+
+            LARGE_INTEGER move = { };
+            move.QuadPart = -1;
+            Assert::AreEqual(STG_E_INVALIDFUNCTION, stream->Seek(move, STREAM_SEEK_SET, nullptr));
+        }
+
+        TEST_METHOD(ReadOnly)
+        {
+            TempFile file(L"comtools_mmstream_readonly.bin", 10);
+            auto stream = Open(file);
+
+            ULONG cbWritten = 1;
+            Assert::AreEqual(STG_E_ACCESSDENIED, stream->Write("x", 1, &cbWritten));
+            Assert::AreEqual(0UL, static_cast<unsigned long>(cbWritten));
+
+            ULARGE_INTEGER size = { };
+            Assert::AreEqual(STG_E_ACCESSDENIED, stream->SetSize(size));
+        }
+
+        TEST_METHOD(Stat)
+        {
+            TempFile file(L"comtools_mmstream_stat.bin", 1234);
+            auto stream = Open(file);
+
+            STATSTG stat;
+            Assert::AreEqual(S_OK, stream->Stat(&stat, STATFLAG_DEFAULT));
+            Assert::AreEqual(1234ULL, static_cast<unsigned long long>(stat.cbSize.QuadPart));
+            Assert::AreEqual(static_cast<DWORD>(STGTY_STREAM), stat.type);
+            Assert::AreEqual(file.path().c_str(), stat.pwcsName);
+            CoTaskMemFree(stat.pwcsName);
+
+            Assert::AreEqual(S_OK, stream->Stat(&stat, STATFLAG_NONAME));
+            Assert::IsNull(stat.pwcsName);
+        }
+
+        TEST_METHOD(Clone)
+        {
+            TempFile file(L"comtools_mmstream_clone.bin", 1000);
+            auto stream = Open(file);
+            Seek(get(stream), 300, STREAM_SEEK_SET);
+
+            IPtr<IStream> clone;
+            Assert::AreEqual(S_OK, stream->Clone(set(clone)));
+            Assert::IsTrue(clone != stream);
+
+            // The clone starts at the same position but moves independently
+            Assert::AreEqual(300ULL, static_cast<unsigned long long>(Seek(get(clone), 0, STREAM_SEEK_CUR)));
+            Seek(get(clone), 0, STREAM_SEEK_SET);
+            Assert::AreEqual(300ULL, static_cast<unsigned long long>(Seek(get(stream), 0, STREAM_SEEK_CUR)));
+
+            // Both streams share the mapping, which outlives the original
+            auto view1 = to_span(get(stream.As<IMappedView>(IID_IMappedView)));
+            auto view2 = to_span(get(clone.As<IMappedView>(IID_IMappedView)));
+            Assert::IsTrue(view1.data() == view2.data());
+
+            stream = nullptr;
+            Assert::AreEqual(TempFile::Byte(999), static_cast<char>(view2[999]));
+        }
+
+        TEST_METHOD(MappedView)
+        {
+            TempFile file(L"comtools_mmstream_view.bin", 1000);
+            auto stream = Open(file);
+            auto view = stream.As<IMappedView>(IID_IMappedView);
+            Assert::IsTrue((bool)view);
+
+            auto span = to_span(get(view));
+            Assert::AreEqual((size_t)1000, span.size());
+
+            // ReadView returns pointers into the mapping and advances
+            BYTE const* p = nullptr;
+            ULONG cbRead = 0;
+            Assert::AreEqual(S_OK, view->ReadView(600, &p, &cbRead));
+            Assert::IsTrue(p == span.data());
+            Assert::AreEqual(600UL, static_cast<unsigned long>(cbRead));
+
+            Assert::AreEqual(S_OK, view->ReadView(600, &p, &cbRead));
+            Assert::IsTrue(p == span.data() + 600);
+            Assert::AreEqual(400UL, static_cast<unsigned long>(cbRead));
+
+            Assert::AreEqual(S_OK, view->ReadView(600, &p, &cbRead));
+            Assert::IsNull(p);
+            Assert::AreEqual(0UL, static_cast<unsigned long>(cbRead));
+        }
+
+        TEST_METHOD(EmptyFile)
+        {
+            TempFile file(L"comtools_mmstream_empty.bin", 0);
+            auto stream = Open(file);
+
+            char buf[10];
+            ULONG cbRead = 1;
+            Assert::AreEqual(S_OK, stream->Read(buf, sizeof(buf), &cbRead));
+            Assert::AreEqual(0UL, static_cast<unsigned long>(cbRead));
+            Assert::IsTrue(to_span(get(stream.As<IMappedView>(IID_IMappedView))).empty());
+        }
+
+        TEST_METHOD(MissingFile)
+        {
+            IPtr<IStream> stream;
+            auto path = std::filesystem::temp_directory_path() / L"comtools_mmstream_missing.bin";
+            Assert::AreEqual(HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND),
+                CreateMappedStream(path.wstring().c_str(), set(stream)));
+            Assert::IsFalse((bool)stream);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Sequential 4 KB reads and random 64 byte reads from a 16 MB
+            // file through FILE*, IStream::Read, and IMappedView::ReadView
+            size_t const cb = 16 << 20;
+            ULONG const chunk = 4096;
+            ULONG const record = 64;
+            int const lookups = 100000;
+            TempFile file(L"comtools_mmstream_timing.bin", cb);
+
+            std::vector<size_t> offsets(lookups);
+            unsigned long long seed = 12345;
+            for (auto& offset : offsets)
+            {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                offset = static_cast<size_t>((seed >> 16) % (cb - record));
+            }
+
+            auto checksum = [](unsigned sum, void const* pv, size_t n)
+            {
+                auto p = static_cast<unsigned char const*>(pv);
+                for (size_t i = 0; i < n; i += 64) sum = sum * 31 + p[i];
+                return sum;
+            };
+
+            std::vector<char> buf(chunk);
+            unsigned seq[3] = { };
+            unsigned rnd[3] = { };
+
+            auto t0 = std::chrono::steady_clock::now();
+            FILE* fp = nullptr;
+            Assert::AreEqual(0, static_cast<int>(_wfopen_s(&fp, file.path().c_str(), L"rb")));
+            Assert::IsNotNull(fp);
+            for (size_t n; (n = fread(buf.data(), 1, chunk, fp)) > 0; )
+            {
+                seq[0] = checksum(seq[0], buf.data(), n);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (auto offset : offsets)
+            {
+                fseek(fp, static_cast<long>(offset), SEEK_SET);
+                fread(buf.data(), 1, record, fp);
+                rnd[0] = checksum(rnd[0], buf.data(), record);
+            }
+
+            fclose(fp);
+
+            auto t2 = std::chrono::steady_clock::now();
+            auto stream = Open(file);
+            for (ULONG n; SUCCEEDED(stream->Read(buf.data(), chunk, &n)) && n; )
+            {
+                seq[1] = checksum(seq[1], buf.data(), n);
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            for (auto offset : offsets)
+            {
+                ULONG n = 0;
+                Seek(get(stream), static_cast<LONGLONG>(offset), STREAM_SEEK_SET);
+                stream->Read(buf.data(), record, &n);
+                rnd[1] = checksum(rnd[1], buf.data(), n);
+            }
+
+            auto t4 = std::chrono::steady_clock::now();
+            auto view = stream.As<IMappedView>(IID_IMappedView);
+            Seek(get(stream), 0, STREAM_SEEK_SET);
+            BYTE const* p = nullptr;
+            for (ULONG n; SUCCEEDED(view->ReadView(chunk, &p, &n)) && n; )
+            {
+                seq[2] = checksum(seq[2], p, n);
+            }
+
+            auto t5 = std::chrono::steady_clock::now();
+            auto span = to_span(get(view));
+            for (auto offset : offsets)
+            {
+                rnd[2] = checksum(rnd[2], span.data() + offset, record);
+            }
+
+            auto t6 = std::chrono::steady_clock::now();
+
+            Assert::AreEqual(seq[0], seq[1]);
+            Assert::AreEqual(seq[0], seq[2]);
+            Assert::AreEqual(rnd[0], rnd[1]);
+            Assert::AreEqual(rnd[0], rnd[2]);
+
+            using ns = std::chrono::nanoseconds;
+            auto count = [](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count()); };
+            size_t const cch = 256;
+            char msg[cch];
+            sprintf_s(msg, "Sequential: FILE* %lld ns, Read %lld ns, ReadView %lld ns\r\n",
+                count(t1 - t0), count(t3 - t2), count(t5 - t4));
+            Logger::WriteMessage(msg);
+            sprintf_s(msg, "Random: FILE* %lld ns/op, Seek+Read %lld ns/op, span %lld ns/op\r\n",
+                count(t2 - t1) / lookups, count(t4 - t3) / lookups, count(t6 - t5) / lookups);
+            Logger::WriteMessage(msg);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
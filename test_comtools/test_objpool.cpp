@@ -0,0 +1,275 @@
+// test_objpool.cpp: Test ComTools::PooledObject //////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "objpool.h"
+#include "iptr.h"
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IRow
+DECLARE_INTERFACE_IID_(IRow, IUnknown, "2E7B9C41-8D35-4A6F-B1E2-5C0A7D3F9E61")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(long, Id)(THIS) PURE;
+    STDMETHOD_(long, Sum)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    // Row of cells that holds a reference to its parent row
+    template<typename Base>
+    class CRowImpl : public Base {
+    protected:
+        long m_id;
+        std::vector<long> m_cells;
+        IPtr<IRow> m_parent;
+
+    public:
+        explicit CRowImpl(long id, IPtr<IRow> parent = IPtr<IRow>())
+            : m_id(id), m_cells(16, id), m_parent(std::move(parent)) { }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(IRow) ? static_cast<IRow*>(this) : nullptr;
+        }
+
+        STDMETHODIMP_(long) Id() noexcept override
+        {
+            return m_id;
+        }
+
+        STDMETHODIMP_(long) Sum() noexcept override
+        {
+            long sum = 0;
+            for (long cell : m_cells) sum += cell;
+            return sum;
+        }
+    };
+
+    class CPlainRow final : public CRowImpl<Object<CPlainRow, IRow>> {
+    public:
+        using CRowImpl::CRowImpl;
+    };
+
+    class CRow final : public CRowImpl<PooledObject<CRow, IRow>> {
+    public:
+        static inline int resets = 0;
+        static inline int recycles = 0;
+
+        using CRowImpl::CRowImpl;
+
+        void Reset(long id, IPtr<IRow> parent = IPtr<IRow>())
+        {
+            m_id = id;
+            m_cells.assign(16, id);
+            m_parent = std::move(parent);
+            ++resets;
+        }
+
+        void Recycle() noexcept
+        {
+            m_parent = nullptr;
+            ++recycles;
+        }
+    };
+
+    class CSmallRow final : public CRowImpl<PooledObject<CSmallRow, IRow>> {
+    public:
+        static constexpr size_t PoolLimit = 2;
+
+        using CRowImpl::CRowImpl;
+
+        void Reset(long id, IPtr<IRow> parent) noexcept
+        {
+            m_id = id;
+            m_parent = std::move(parent);
+        }
+
+        void Recycle() noexcept
+        {
+            m_parent = nullptr;
+        }
+    };
+
+    template<typename T>
+    IPtr<IRow> MakeRow(long id, IPtr<IRow> parent = IPtr<IRow>())
+    {
+        IPtr<IRow> p;
+        T::Create(__uuidof(IRow), reinterpret_cast<void**>(set(p)), id, parent);
+        return p;
+    }
+
+    ULONG RefCount(IUnknown* p) noexcept
+    {
+        p->AddRef();
+        return p->Release();
+    }
+
+    TEST_CLASS(TestPooledObject)
+    {
+    public:
+        TEST_METHOD(Reuse)
+        {
+            CRow::Trim();
+            auto before = CRow::Stats();
+
+            auto p1 = MakeRow<CRow>(1);
+            Assert::IsTrue((bool)p1);
+            IRow* address = get(p1);
+            p1 = nullptr;
+
+            auto p2 = MakeRow<CRow>(2);
+            Assert::IsTrue(get(p2) == address);
+            Assert::AreEqual(2L, p2->Id());
+            Assert::AreEqual(32L, p2->Sum());
+            Assert::AreEqual(1UL, RefCount(get(p2)));
+
+            auto after = CRow::Stats();
+            Assert::AreEqual(size_t(1), after.allocated - before.allocated);
+            Assert::AreEqual(size_t(1), after.reused - before.reused);
+            Assert::AreEqual(size_t(1), after.recycled - before.recycled);
+            Assert::AreEqual(size_t(0), after.freed - before.freed);
+        }
+
+        TEST_METHOD(Hooks)
+        {
+            CRow::Trim();
+            int resets = CRow::resets;
+            int recycles = CRow::recycles;
+
+            auto parent = MakeRow<CRow>(1);
+            auto child = MakeRow<CRow>(2, parent);
+            Assert::AreEqual(2UL, RefCount(get(parent)));
+            Assert::AreEqual(0, CRow::resets - resets);
+
+            // Recycle() releases the parent even though the child is kept
+            child = nullptr;
+            Assert::AreEqual(1, CRow::recycles - recycles);
+            Assert::AreEqual(1UL, RefCount(get(parent)));
+
+            // Reset() receives the creation arguments
+            child = MakeRow<CRow>(3, parent);
+            Assert::AreEqual(1, CRow::resets - resets);
+            Assert::AreEqual(3L, child->Id());
+            Assert::AreEqual(48L, child->Sum());
+            Assert::AreEqual(2UL, RefCount(get(parent)));
+        }
+
+        TEST_METHOD(Limit)
+        {
+            CSmallRow::Trim();
+            auto before = CSmallRow::Stats();
+
+            // Two rows stay in the thread's pool, two go to the shared pool,
+            // and the rest are deleted
+            std::vector<IPtr<IRow>> rows;
+            for (long i = 0; i < 6; ++i) rows.push_back(MakeRow<CSmallRow>(i));
+            rows.clear();
+
+            auto mid = CSmallRow::Stats();
+            Assert::AreEqual(size_t(6), mid.allocated - before.allocated);
+            Assert::AreEqual(size_t(4), mid.recycled - before.recycled);
+            Assert::AreEqual(size_t(2), mid.freed - before.freed);
+
+            for (long i = 0; i < 6; ++i) rows.push_back(MakeRow<CSmallRow>(i));
+            for (long i = 0; i < 6; ++i) Assert::AreEqual(i, rows[i]->Id());
+
+            auto after = CSmallRow::Stats();
+            Assert::AreEqual(size_t(4), after.reused - mid.reused);
+            Assert::AreEqual(size_t(2), after.allocated - mid.allocated);
+        }
+
+        TEST_METHOD(CrossThread)
+        {
+            // Rows created here and released on another thread overflow
+            // that thread's pool into the shared pool, and are reused here
+            size_t const count = 3 * CRow::PoolLimit;
+            std::vector<IPtr<IRow>> rows;
+            for (long i = 0; i < static_cast<long>(count); ++i) rows.push_back(MakeRow<CRow>(i));
+
+            PoolStats released;
+            std::thread([&]() {
+                rows.clear();
+                released = CRow::Stats();
+            }).join();
+
+            Assert::AreEqual(size_t(0), released.allocated);
+            Assert::AreEqual(count, released.recycled + released.freed);
+            Assert::IsTrue(released.recycled >= CRow::PoolLimit);
+
+            CRow::Trim();
+            auto before = CRow::Stats();
+            for (long i = 0; i < static_cast<long>(CRow::PoolLimit); ++i)
+            {
+                rows.push_back(MakeRow<CRow>(i));
+                Assert::AreEqual(i, rows.back()->Id());
+            }
+
+            auto after = CRow::Stats();
+            Assert::AreEqual(CRow::PoolLimit, after.reused - before.reused);
+            Assert::AreEqual(size_t(0), after.allocated - before.allocated);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Create and release rows in batches, with and without pooling
+            int const rounds = 20000;
+            int const batch = 32;
+            std::vector<IPtr<IRow>> rows(batch);
+
+            auto t0 = std::chrono::steady_clock::now();
+            long sum1 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (int i = 0; i < batch; ++i) rows[i] = MakeRow<CPlainRow>(i);
+                for (auto& row : rows) sum1 += row->Sum();
+            }
+
+            rows.assign(batch, IPtr<IRow>());
+            CRow::Trim();
+            auto before = CRow::Stats();
+
+            auto t1 = std::chrono::steady_clock::now();
+            long sum2 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                for (int i = 0; i < batch; ++i) rows[i] = MakeRow<CRow>(i);
+                for (auto& row : rows) sum2 += row->Sum();
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            rows.assign(batch, IPtr<IRow>());
+            auto after = CRow::Stats();
+            Assert::AreEqual(sum1, sum2);
+            Assert::IsTrue(after.allocated - before.allocated <= size_t(2 * batch));
+
+            using ns = std::chrono::nanoseconds;
+            long long const ops = static_cast<long long>(batch) * rounds;
+            auto count = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / ops); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Create/Release: Object %lld ns, PooledObject %lld ns; %zu of %lld allocations avoided\r\n",
+                count(t1 - t0), count(t2 - t1), after.reused - before.reused, ops);
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,328 @@
+// test_ptrqueue.cpp: Test ComTools::SpscQueue, MpscQueue, BoundedQueue ///////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "ptrqueue.h"
+#include <chrono>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IItem
+DECLARE_INTERFACE_IID_(IItem, IUnknown, "E4B7C1A9-6D23-4F58-9A0E-1C8D3B5F7A26")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(long, Value)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    // Item that counts every AddRef() and Release() call on all items
+    class CItem final : public IItem {
+        std::atomic<ULONG> m_rc = 1;
+        long m_value;
+
+    public:
+        static inline std::atomic<long> calls = 0;
+        static inline std::atomic<long> live = 0;
+
+        explicit CItem(long value) noexcept : m_value(value) { ++live; }
+        ~CItem() noexcept { --live; }
+
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv) noexcept override
+        {
+            if (!ppv) return E_POINTER;
+            if (riid != IID_IUnknown && riid != __uuidof(IItem)) return (*ppv = nullptr), E_NOINTERFACE;
+            *ppv = static_cast<IItem*>(this);
+            AddRef();
+            return S_OK;
+        }
+
+        STDMETHODIMP_(ULONG) AddRef() noexcept override
+        {
+            calls.fetch_add(1, std::memory_order_relaxed);
+            return ++m_rc;
+        }
+
+        STDMETHODIMP_(ULONG) Release() noexcept override
+        {
+            calls.fetch_add(1, std::memory_order_relaxed);
+            auto rc = --m_rc;
+            if (rc == 0) delete this;
+            return rc;
+        }
+
+        STDMETHODIMP_(long) Value() noexcept override
+        {
+            return m_value;
+        }
+    };
+
+    IPtr<IItem> MakeItem(long value)
+    {
+        IPtr<IItem> p;
+        attach(p, new CItem(value));
+        return p;
+    }
+
+    // Mutex-guarded std::queue that copies the pointers, for comparison
+    class LockedQueue {
+        std::mutex m_lock;
+        std::queue<IPtr<IItem>> m_items;
+
+    public:
+        void Push(IPtr<IItem> const& p)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_items.push(p);
+        }
+
+        bool Pop(IPtr<IItem>& p)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (m_items.empty()) return false;
+            p = m_items.front();
+            m_items.pop();
+            return true;
+        }
+    };
+
+    // Pushes count items from each of producers threads, popping them in
+    // batches on the calling thread. Returns the sum of the values popped.
+    template<typename Q>
+    long long RunProducers(Q& queue, int producers, long count)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < producers; ++t)
+        {
+            threads.emplace_back([&queue, count]() {
+                for (long i = 0; i < count; ++i)
+                {
+                    auto p = MakeItem(i);
+                    while (queue.Push(std::move(p)) != S_OK) std::this_thread::yield();
+                }
+            });
+        }
+
+        long long sum = 0;
+        long popped = 0;
+        IPtr<IItem> batch[32];
+        while (popped < producers * count)
+        {
+            size_t n = queue.PopBatch(batch, 32);
+            if (!n) std::this_thread::yield();
+            for (size_t i = 0; i < n; ++i)
+            {
+                sum += batch[i]->Value();
+                batch[i] = nullptr;
+            }
+
+            popped += static_cast<long>(n);
+        }
+
+        for (auto& thread : threads) thread.join();
+        return sum;
+    }
+
+    TEST_CLASS(TestPtrQueue)
+    {
+    public:
+        TEST_METHOD(Spsc)
+        {
+            SpscQueue<IItem> queue(5);
+            Assert::IsTrue((bool)queue);
+            Assert::AreEqual(size_t(8), queue.Capacity());
+
+            std::vector<IPtr<IItem>> items;
+            for (long i = 0; i < 9; ++i) items.push_back(MakeItem(i));
+            long calls = CItem::calls;
+
+            for (long i = 0; i < 8; ++i) Assert::AreEqual(S_OK, queue.Push(std::move(items[i])));
+            Assert::IsFalse((bool)items[0]);
+
+            // The caller keeps the pointer when the queue is full
+            Assert::AreEqual(S_FALSE, queue.Push(std::move(items[8])));
+            Assert::IsTrue((bool)items[8]);
+            Assert::AreEqual(E_POINTER, queue.Push(IPtr<IItem>()));
+
+            IPtr<IItem> p;
+            Assert::AreEqual(S_OK, queue.Pop(p));
+            Assert::AreEqual(0L, p->Value());
+
+            IPtr<IItem> batch[4];
+            Assert::AreEqual(size_t(4), queue.PopBatch(batch, 4));
+            for (long i = 0; i < 4; ++i) Assert::AreEqual(i + 1, batch[i]->Value());
+            Assert::AreEqual(size_t(3), queue.PopBatch(batch, 4));
+            Assert::AreEqual(7L, batch[2]->Value());
+            Assert::AreEqual(S_FALSE, queue.Pop(p));
+
+            // Only the pointers replaced in batch were released
+            Assert::AreEqual(3L, CItem::calls - calls);
+        }
+
+        TEST_METHOD(Mpsc)
+        {
+            MpscQueue<IItem> queue;
+            long calls = CItem::calls;
+            int const producers = 4;
+            long const count = 10000;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < producers; ++t)
+            {
+                threads.emplace_back([&queue, t]() {
+                    for (long i = 0; i < count; ++i)
+                    {
+                        auto p = MakeItem(t * count + i);
+                        queue.Push(std::move(p));
+                    }
+                });
+            }
+
+            // Items from each producer arrive in order
+            std::vector<long> next(producers);
+            long popped = 0;
+            IPtr<IItem> p;
+            while (popped < producers * count)
+            {
+                if (queue.Pop(p) != S_OK)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                long value = p->Value();
+                long t = value / count;
+                Assert::AreEqual(next[t]++, value % count);
+                ++popped;
+            }
+
+            for (auto& thread : threads) thread.join();
+            p = nullptr;
+
+            // One Release() per item, and no other reference counting
+            Assert::AreEqual(static_cast<long>(producers) * count, CItem::calls - calls);
+        }
+
+        TEST_METHOD(Bounded)
+        {
+            BoundedQueue<IItem> queue(64);
+            Assert::AreEqual(size_t(64), queue.Capacity());
+
+            int const producers = 4;
+            int const consumers = 3;
+            long const count = 20000;
+            std::atomic<long long> sum = 0;
+            std::atomic<long> popped = 0;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < producers; ++t)
+            {
+                threads.emplace_back([&queue]() {
+                    for (long i = 1; i <= count; ++i)
+                    {
+                        auto p = MakeItem(i);
+                        while (queue.Push(std::move(p)) == S_FALSE) std::this_thread::yield();
+                    }
+                });
+            }
+
+            for (int t = 0; t < consumers; ++t)
+            {
+                threads.emplace_back([&]() {
+                    IPtr<IItem> batch[8];
+                    while (popped < producers * count)
+                    {
+                        size_t n = queue.PopBatch(batch, 8);
+                        if (!n) std::this_thread::yield();
+                        for (size_t i = 0; i < n; ++i) sum += batch[i]->Value();
+                        popped += static_cast<long>(n);
+                    }
+                });
+            }
+
+            for (auto& thread : threads) thread.join();
+            Assert::AreEqual(producers * (count * (count + 1) / 2), static_cast<long>(sum));
+        }
+
+        TEST_METHOD(ReleasesQueued)
+        {
+            long live = CItem::live;
+            {
+                SpscQueue<IItem> spsc(4);
+                MpscQueue<IItem> mpsc;
+                BoundedQueue<IItem> bounded(4);
+                for (long i = 0; i < 3; ++i)
+                {
+                    spsc.Push(MakeItem(i));
+                    mpsc.Push(MakeItem(i));
+                    bounded.Push(MakeItem(i));
+                }
+
+                IPtr<IItem> p;
+                mpsc.Pop(p);
+                Assert::AreEqual(live + 9, CItem::live.load());
+            }
+
+            Assert::AreEqual(live, CItem::live.load());
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Producers push items to one consumer through each queue
+            long const total = 1 << 16;
+            for (int producers = 1; producers <= 32; producers *= 2)
+            {
+                long const count = total / producers;
+                long long const expected = static_cast<long long>(producers) * count * (count - 1) / 2;
+
+                LockedQueue locked;
+                struct {
+                    LockedQueue* q;
+                    HRESULT Push(IPtr<IItem>&& p) { q->Push(p); return S_OK; }
+                    size_t PopBatch(IPtr<IItem>* out, size_t max)
+                    {
+                        size_t n = 0;
+                        while (n < max && q->Pop(out[n])) ++n;
+                        return n;
+                    }
+                } adapter{ &locked };
+
+                MpscQueue<IItem> mpsc;
+                BoundedQueue<IItem> bounded(1024);
+
+                auto t0 = std::chrono::steady_clock::now();
+                Assert::AreEqual(expected, RunProducers(adapter, producers, count));
+                auto t1 = std::chrono::steady_clock::now();
+                Assert::AreEqual(expected, RunProducers(mpsc, producers, count));
+                auto t2 = std::chrono::steady_clock::now();
+                Assert::AreEqual(expected, RunProducers(bounded, producers, count));
+                auto t3 = std::chrono::steady_clock::now();
+
+                using ns = std::chrono::nanoseconds;
+                auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / total); };
+                size_t const cch = 256;
+                char buf[cch];
+                sprintf_s(buf, "%2d producers: mutex queue %lld ns, MpscQueue %lld ns, BoundedQueue %lld ns per item\r\n",
+                    producers, per(t1 - t0), per(t2 - t1), per(t3 - t2));
+                Logger::WriteMessage(buf);
+            }
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,216 @@
+// test_qicache.cpp: Test ComTools::QICache ///////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "qicache.h"
+#include "comobject.h"
+#include <chrono>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IShape
+DECLARE_INTERFACE_IID_(IShape, IUnknown, "8F3A6D12-4C7E-4B09-A5D2-9E1B7C3F6A84")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(long, Sides)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+#define INTERFACE IColor
+DECLARE_INTERFACE_IID_(IColor, IUnknown, "8F3A6D13-4C7E-4B09-A5D2-9E1B7C3F6A84")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD_(DWORD, Rgb)(THIS) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    // Shape that counts the QueryInterface() calls on all shapes
+    class CShape final : public Object<CShape, IShape, IColor> {
+    public:
+        static inline long queries = 0;
+        static inline long live = 0;
+
+        CShape() noexcept { ++live; }
+        ~CShape() noexcept { --live; }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            ++queries;
+            if (riid == __uuidof(IShape)) return static_cast<IShape*>(this);
+            if (riid == __uuidof(IColor)) return static_cast<IColor*>(this);
+            return nullptr;
+        }
+
+        STDMETHODIMP_(long) Sides() noexcept override { return 4; }
+        STDMETHODIMP_(DWORD) Rgb() noexcept override { return 0xFF0000; }
+    };
+
+    IPtr<IShape> MakeShape()
+    {
+        IPtr<IShape> p;
+        CShape::Create(__uuidof(IShape), reinterpret_cast<void**>(set(p)));
+        return p;
+    }
+
+    ULONG References(IUnknown* p)
+    {
+        p->AddRef();
+        return p->Release();
+    }
+
+    TEST_CLASS(TestQICache)
+    {
+    public:
+        TEST_METHOD(Borrow)
+        {
+            QICache cache;
+            Assert::IsTrue((bool)cache);
+            Assert::AreEqual(size_t(256), cache.Capacity());
+
+            auto p = MakeShape();
+            long queries = CShape::queries;
+            IColor* color = cache.Borrow<IColor>(p, __uuidof(IColor));
+            Assert::IsNotNull(color);
+            Assert::AreEqual(DWORD(0xFF0000), color->Rgb());
+            Assert::AreEqual(1L, CShape::queries - queries);
+
+            // Hits call neither QueryInterface() nor AddRef()
+            ULONG references = References(get(p));
+            Assert::IsTrue(color == cache.Borrow<IColor>(p, __uuidof(IColor)));
+            Assert::IsTrue(color == cache.Borrow<IColor>(p, __uuidof(IColor)));
+            Assert::AreEqual(1L, CShape::queries - queries);
+            Assert::AreEqual(references, References(get(p)));
+
+            // As() returns its own reference
+            auto as = cache.As<IColor>(p, __uuidof(IColor));
+            Assert::IsTrue(get(as) == color);
+            Assert::AreEqual(references + 1, References(get(p)));
+
+            Assert::AreEqual(size_t(3), cache.Stats().hits);
+            Assert::AreEqual(size_t(1), cache.Stats().misses);
+
+            void* pv = nullptr;
+            Assert::AreEqual(E_POINTER, cache.Borrow(nullptr, __uuidof(IColor), &pv));
+            Assert::AreEqual(E_POINTER, cache.Borrow(get(p), __uuidof(IColor), nullptr));
+        }
+
+        TEST_METHOD(NoInterface)
+        {
+            QICache cache;
+            auto p = MakeShape();
+            long queries = CShape::queries;
+            void* pv = nullptr;
+            Assert::AreEqual(E_NOINTERFACE, cache.Borrow(get(p), IID_IDispatch, &pv));
+            Assert::IsNull(pv);
+            Assert::AreEqual(E_NOINTERFACE, cache.Borrow(get(p), IID_IDispatch, &pv));
+            Assert::IsNull(cache.Borrow<IDispatch>(p, IID_IDispatch));
+            Assert::AreEqual(1L, CShape::queries - queries);
+        }
+
+        TEST_METHOD(HoldsReferences)
+        {
+            long live = CShape::live;
+            QICache cache;
+            auto p1 = MakeShape();
+            auto p2 = MakeShape();
+            cache.Borrow<IColor>(p1, __uuidof(IColor));
+            cache.Borrow<IColor>(p2, __uuidof(IColor));
+            cache.Borrow<IShape>(p2, __uuidof(IShape));
+
+            // The cache keeps the objects alive until they are evicted
+            IUnknown* key = get(p1);
+            p1 = nullptr;
+            p2 = nullptr;
+            Assert::AreEqual(live + 2, CShape::live);
+            cache.Evict(key);
+            Assert::AreEqual(live + 1, CShape::live);
+            cache.Clear();
+            Assert::AreEqual(live, CShape::live);
+        }
+
+        TEST_METHOD(Eviction)
+        {
+            long live = CShape::live;
+            {
+                QICache cache(1);
+                Assert::AreEqual(size_t(1), cache.Capacity());
+                cache.Borrow<IColor>(MakeShape(), __uuidof(IColor));
+                cache.Borrow<IColor>(MakeShape(), __uuidof(IColor));
+                Assert::AreEqual(size_t(1), cache.Stats().evictions);
+                Assert::AreEqual(live + 1, CShape::live);
+            }
+
+            Assert::AreEqual(live, CShape::live);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Query eight objects for two interfaces in turn
+            int const objects = 8;
+            int const rounds = 200000;
+            IPtr<IShape> shapes[objects];
+            for (auto& p : shapes) p = MakeShape();
+
+            QICache cache;
+            long long sum1 = 0;
+            long long sum2 = 0;
+            long long sum3 = 0;
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+            {
+                auto& p = shapes[i % objects];
+                sum1 += p.As<IColor>(__uuidof(IColor))->Rgb() + p.As<IShape>(__uuidof(IShape))->Sides();
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+            {
+                auto& p = shapes[i % objects];
+                sum2 += cache.As<IColor>(p, __uuidof(IColor))->Rgb() + cache.As<IShape>(p, __uuidof(IShape))->Sides();
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+            {
+                auto& p = shapes[i % objects];
+                sum3 += cache.Borrow<IColor>(p, __uuidof(IColor))->Rgb() + cache.Borrow<IShape>(p, __uuidof(IShape))->Sides();
+            }
+
+            auto t3 = std::chrono::steady_clock::now();
+            Assert::AreEqual(sum1, sum2);
+            Assert::AreEqual(sum1, sum3);
+
+            auto const& stats = cache.Stats();
+            double rate = 100.0 * stats.hits / (stats.hits + stats.misses);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / rounds); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Two queries: As %lld ns, QICache::As %lld ns, QICache::Borrow %lld ns (%.3f%% hits)\r\n",
+                per(t1 - t0), per(t2 - t1), per(t3 - t2), rate);
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,355 @@
+// test_stacall.cpp: Test ComTools::StaBound, StaBatch, StaDispatcher /////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "stacall.h"
+#include "comobject.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IAccount
+DECLARE_INTERFACE_IID_(IAccount, IUnknown, "2D7B5E41-9A3C-4F16-8B0E-6C4A1D9F3E27")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD(Deposit)(THIS_ LONG amount) PURE;
+    STDMETHOD(get_Balance)(THIS_ LONG* pBalance) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    // Account that records the threads it is used and destroyed on
+    class CAccount final : public Object<CAccount, IAccount> {
+        LONG m_balance = 0;
+
+    public:
+        static inline std::atomic<DWORD> destroyed_on = 0;
+        DWORD last_thread = 0;
+
+        ~CAccount() noexcept { destroyed_on = GetCurrentThreadId(); }
+
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(IAccount) ? static_cast<IAccount*>(this) : nullptr;
+        }
+
+        STDMETHODIMP Deposit(LONG amount) noexcept override
+        {
+            last_thread = GetCurrentThreadId();
+            if (amount <= 0) return E_INVALIDARG;
+            m_balance += amount;
+            return S_OK;
+        }
+
+        STDMETHODIMP get_Balance(LONG* pBalance) noexcept override
+        {
+            last_thread = GetCurrentThreadId();
+            if (!pBalance) return E_POINTER;
+            *pBalance = m_balance;
+            return S_OK;
+        }
+    };
+
+    IPtr<IAccount> MakeAccount()
+    {
+        IPtr<IAccount> p;
+        CAccount::Create(__uuidof(IAccount), reinterpret_cast<void**>(set(p)));
+        return p;
+    }
+
+    // Stand-in for StaDispatcher: runs work on its own thread from a queue,
+    // without a message loop
+    class TestDispatcher {
+        std::mutex m_lock;
+        std::condition_variable m_cv;
+        std::deque<Work> m_items;
+        bool m_stop = false;
+        std::thread m_thread;
+        DWORD m_id = 0;
+
+    public:
+        TestDispatcher()
+        {
+            std::promise<DWORD> started;
+            m_thread = std::thread([this, &started]() {
+                started.set_value(GetCurrentThreadId());
+                std::unique_lock<std::mutex> lock(m_lock);
+                for (;;)
+                {
+                    m_cv.wait(lock, [this]() { return m_stop || !m_items.empty(); });
+                    if (m_items.empty()) break;
+                    Work work = std::move(m_items.front());
+                    m_items.pop_front();
+                    lock.unlock();
+                    work();
+                    work = Work();
+                    lock.lock();
+                }
+            });
+
+            m_id = started.get_future().get();
+        }
+
+        ~TestDispatcher()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_stop = true;
+            }
+
+            m_cv.notify_all();
+            m_thread.join();
+        }
+
+        DWORD ThreadId() const noexcept { return m_id; }
+
+        HRESULT Post(Work work) noexcept
+        {
+            try
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_items.push_back(std::move(work));
+            }
+            catch (...)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            m_cv.notify_one();
+            return S_OK;
+        }
+    };
+
+    // STA thread that pumps messages and owns a StaDispatcher and an
+    // account bound to it
+    class StaThread {
+        std::thread m_thread;
+        DWORD m_id = 0;
+
+    public:
+        StaBound<IAccount> account;
+
+        StaThread()
+        {
+            std::promise<StaBound<IAccount>> bound;
+            m_thread = std::thread([this, &bound]() {
+                CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+                {
+                    std::shared_ptr<StaDispatcher> dispatcher;
+                    StaDispatcher::Create(&dispatcher);
+                    m_id = GetCurrentThreadId();
+                    bound.set_value(StaBound<IAccount>(MakeAccount(), std::move(dispatcher)));
+
+                    MSG msg;
+                    while (GetMessageW(&msg, nullptr, 0, 0) > 0) DispatchMessageW(&msg);
+                }
+
+                CoUninitialize();
+            });
+
+            account = bound.get_future().get();
+        }
+
+        ~StaThread()
+        {
+            // Release the account, then stop the message loop once the
+            // release has run
+            account = StaBound<IAccount>();
+            PostThreadMessageW(m_id, WM_QUIT, 0, 0);
+            m_thread.join();
+        }
+
+        DWORD ThreadId() const noexcept { return m_id; }
+    };
+
+    TEST_CLASS(TestStaCall)
+    {
+    public:
+        TEST_METHOD(Call)
+        {
+            auto dispatcher = std::make_shared<TestDispatcher>();
+            DWORD const owner = dispatcher->ThreadId();
+            auto account = MakeAccount();
+            auto impl = static_cast<CAccount*>(get(account));
+            {
+                StaBound<IAccount, TestDispatcher> bound(account, dispatcher);
+                Assert::IsTrue((bool)bound);
+                Assert::AreEqual(S_OK, bound.Call([](IAccount* p) { return p->Deposit(5); }));
+                Assert::AreEqual(owner, impl->last_thread);
+                Assert::AreEqual(E_INVALIDARG, bound.Call([](IAccount* p) { return p->Deposit(-1); }));
+
+                // A call that throws gets an error result
+                Assert::AreEqual(E_UNEXPECTED, bound.Call([](IAccount*) -> HRESULT { throw 1; }));
+            }
+
+            // The bound reference was released on the owner thread, so this
+            // is the last one
+            dispatcher.reset();
+            CAccount::destroyed_on = 0;
+            account = nullptr;
+            Assert::AreEqual(GetCurrentThreadId(), CAccount::destroyed_on.load());
+
+            StaBound<IAccount, TestDispatcher> empty;
+            Assert::IsFalse((bool)empty);
+            Assert::AreEqual(E_POINTER, empty.Call([](IAccount* p) { return p->Deposit(1); }));
+        }
+
+        TEST_METHOD(ReleasedOnOwner)
+        {
+            auto dispatcher = std::make_shared<TestDispatcher>();
+            CAccount::destroyed_on = 0;
+            {
+                StaBound<IAccount, TestDispatcher> bound(MakeAccount(), dispatcher);
+                StaBound<IAccount, TestDispatcher> moved(std::move(bound));
+                Assert::IsFalse((bool)bound);
+                Assert::AreEqual(S_OK, moved.Call([](IAccount* p) { return p->Deposit(1); }));
+            }
+
+            DWORD const owner = dispatcher->ThreadId();
+            dispatcher.reset();
+            Assert::AreEqual(owner, CAccount::destroyed_on.load());
+        }
+
+        TEST_METHOD(Batch)
+        {
+            auto dispatcher = std::make_shared<TestDispatcher>();
+            StaBound<IAccount, TestDispatcher> bound(MakeAccount(), dispatcher);
+
+            StaBatch<IAccount> batch;
+            LONG balance = 0;
+            Assert::AreEqual(S_OK, batch.Add([](IAccount* p) { return p->Deposit(10); }));
+            Assert::AreEqual(S_OK, batch.Add([](IAccount* p) { return p->Deposit(0); }));
+            Assert::AreEqual(S_OK, batch.Add([](IAccount* p) { return p->Deposit(20); }));
+            Assert::AreEqual(S_OK, batch.Add([&](IAccount* p) { return p->get_Balance(&balance); }));
+            Assert::AreEqual(size_t(4), batch.Size());
+            Assert::AreEqual(E_PENDING, batch.Results()[0]);
+
+            Assert::AreEqual(S_OK, bound.Run(batch));
+            Assert::AreEqual(S_OK, batch.Results()[0]);
+            Assert::AreEqual(E_INVALIDARG, batch.Results()[1]);
+            Assert::AreEqual(S_OK, batch.Results()[2]);
+            Assert::AreEqual(S_OK, batch.Results()[3]);
+            Assert::AreEqual(30L, balance);
+
+            // A batch can be run again
+            Assert::AreEqual(S_OK, bound.Run(batch));
+            Assert::AreEqual(60L, balance);
+
+            batch.Clear();
+            Assert::AreEqual(size_t(0), batch.Size());
+            Assert::AreEqual(S_OK, bound.Run(batch));
+        }
+
+        TEST_METHOD(Invoke)
+        {
+            auto dispatcher = std::make_shared<TestDispatcher>();
+            StaBound<IAccount, TestDispatcher> bound(MakeAccount(), dispatcher);
+
+            std::tuple<HRESULT, LONG, DWORD> results;
+            Assert::AreEqual(S_OK, bound.Invoke(&results,
+                [](IAccount* p) { return p->Deposit(7); },
+                [](IAccount* p) { LONG b = 0; p->get_Balance(&b); return b; },
+                [](IAccount*) { return GetCurrentThreadId(); }));
+            Assert::AreEqual(S_OK, std::get<0>(results));
+            Assert::AreEqual(7L, std::get<1>(results));
+            Assert::AreEqual(dispatcher->ThreadId(), std::get<2>(results));
+        }
+
+        TEST_METHOD(MessageLoop)
+        {
+            StaThread sta;
+            Assert::IsTrue((bool)sta.account);
+
+            StaBatch<IAccount> batch;
+            LONG balance = 0;
+            DWORD thread = 0;
+            batch.Add([](IAccount* p) { return p->Deposit(3); });
+            batch.Add([&](IAccount* p) { thread = GetCurrentThreadId(); return p->get_Balance(&balance); });
+            Assert::AreEqual(S_OK, sta.account.Run(batch));
+            Assert::AreEqual(3L, balance);
+            Assert::AreEqual(sta.ThreadId(), thread);
+            Assert::AreEqual(S_OK, sta.account.Call([](IAccount* p) { return p->Deposit(4); }));
+        }
+
+        TEST_METHOD(OwnerExits)
+        {
+            // The owner thread exits without pumping messages while a call
+            // is queued for it
+            std::promise<StaBound<IAccount>> bound;
+            std::thread owner([&bound]() {
+                CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+                {
+                    std::shared_ptr<StaDispatcher> dispatcher;
+                    StaDispatcher::Create(&dispatcher);
+                    bound.set_value(StaBound<IAccount>(MakeAccount(), std::move(dispatcher)));
+
+                    MSG msg;
+                    while (!PeekMessageW(&msg, nullptr, WM_USER, WM_USER, PM_NOREMOVE)) Sleep(1);
+                }
+
+                CoUninitialize();
+            });
+
+            StaBound<IAccount> account = bound.get_future().get();
+            Assert::AreEqual(RPC_E_DISCONNECTED, account.Call([](IAccount* p) { return p->Deposit(1); }));
+            owner.join();
+
+            // Later calls fail without waiting
+            Assert::IsTrue(FAILED(account.Call([](IAccount* p) { return p->Deposit(1); })));
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Calls from a worker into an STA object, one trip per call or
+            // 50 calls per trip
+            int const count = 20000;
+            int const per_batch = 50;
+            StaThread sta;
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+            {
+                sta.account.Call([](IAccount* p) { return p->Deposit(1); });
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            StaBatch<IAccount> batch;
+            for (int i = 0; i < per_batch; ++i) batch.Add([](IAccount* p) { return p->Deposit(1); });
+            for (int i = 0; i < count / per_batch; ++i) sta.account.Run(batch);
+
+            auto t2 = std::chrono::steady_clock::now();
+            LONG balance = 0;
+            sta.account.Call([&](IAccount* p) { return p->get_Balance(&balance); });
+            Assert::AreEqual(static_cast<LONG>(2 * count), balance);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / count); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "Per call into an STA: one trip per call %lld ns, %d calls per trip %lld ns\r\n",
+                per(t1 - t0), per_batch, per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
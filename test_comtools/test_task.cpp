@@ -0,0 +1,303 @@
+// test_task.cpp: Test ComTools::Task /////////////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "task.h"
+#include "comobject.h"
+#include "iptr.h"
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IAccumulator
+DECLARE_INTERFACE_IID_(IAccumulator, IUnknown, "5D1A8E36-2F4B-4C97-8E03-B6A9C2D7F154")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD(Add)(THIS_ long value, long* total) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+namespace TestComTools
+{
+    class CAccumulator final : public Object<CAccumulator, IAccumulator> {
+        long m_total = 0;
+
+    public:
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(IAccumulator) ? static_cast<IAccumulator*>(this) : nullptr;
+        }
+
+        STDMETHODIMP Add(long value, long* total) noexcept override
+        {
+            if (!total) return E_POINTER;
+            if (value < 0) return E_INVALIDARG;
+            *total = m_total += value;
+            return S_OK;
+        }
+    };
+
+    IPtr<IAccumulator> MakeAccumulator()
+    {
+        IPtr<IAccumulator> p;
+        CAccumulator::Create(__uuidof(IAccumulator), reinterpret_cast<void**>(set(p)));
+        return p;
+    }
+
+    // Counts the locals destroyed when a task's frame is destroyed
+    struct Local {
+        static inline int destroyed = 0;
+        ~Local() { ++destroyed; }
+    };
+
+    // Resumes the awaiting coroutine on a new thread, as a completion
+    // callback would
+    struct ResumeOnThread {
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            std::thread([h]() { h.resume(); }).detach();
+        }
+
+        void await_resume() const noexcept { }
+    };
+
+    Task<long> Add(IPtr<IAccumulator> p, long value)
+    {
+        long total = 0;
+        co_await Check(p->Add(value, &total));
+        co_return total;
+    }
+
+    Task<long> AddTwice(IPtr<IAccumulator> p, long value)
+    {
+        co_await Add(p, value);
+        co_return co_await Add(p, value);
+    }
+
+    Task<> Throw(HRESULT hr)
+    {
+        Local local;
+        if (FAILED(hr)) throw ComException(hr);
+        co_return;
+    }
+
+    Task<int> ThrowStd()
+    {
+        throw std::runtime_error("not COM");
+        co_return 0;
+    }
+
+    Task<int> Fail(HRESULT hr)
+    {
+        Local local;
+        co_await Check(hr);
+        co_return 1;
+    }
+
+    Task<long> Step(IPtr<IAccumulator> p, int steps)
+    {
+        long total = 0;
+        co_await Check(p->Add(1, &total));
+        if (steps == 1) co_return total;
+        co_return co_await Step(std::move(p), steps - 1);
+    }
+
+    void StepCallback(IPtr<IAccumulator> p, int steps, std::function<void(HRESULT, long)> done)
+    {
+        long total = 0;
+        HRESULT hr = p->Add(1, &total);
+        if (FAILED(hr) || steps == 1)
+        {
+            done(hr, total);
+            return;
+        }
+
+        StepCallback(p, steps - 1, [done = std::move(done)](HRESULT hr, long total) { done(hr, total); });
+    }
+
+    TEST_CLASS(TestTask)
+    {
+    public:
+        TEST_METHOD(ReturnsValue)
+        {
+            auto p = MakeAccumulator();
+            auto result = AddTwice(p, 5).Wait();
+            Assert::AreEqual(S_OK, result.hr);
+            Assert::AreEqual(10L, *result.value);
+
+            // The tasks released their references to the accumulator
+            get(p)->AddRef();
+            Assert::AreEqual(1UL, get(p)->Release());
+        }
+
+        TEST_METHOD(Lazy)
+        {
+            auto p = MakeAccumulator();
+            auto task = Add(p, 3);
+            Assert::IsTrue((bool)task);
+            Assert::IsFalse(task.Done());
+
+            long total = 0;
+            p->Add(0, &total);
+            Assert::AreEqual(0L, total);
+
+            Assert::AreEqual(3L, *task.Wait().value);
+            Assert::IsTrue(task.Done());
+        }
+
+        TEST_METHOD(ExceptionPropagates)
+        {
+            auto caught = []() -> Task<HRESULT> {
+                try
+                {
+                    co_await Throw(E_ACCESSDENIED);
+                }
+                catch (ComException& e)
+                {
+                    co_return e.hr();
+                }
+
+                co_return S_OK;
+            };
+
+            Assert::AreEqual(E_ACCESSDENIED, *caught().Wait().value);
+
+            auto uncaught = []() -> Task<> {
+                co_await Throw(E_ACCESSDENIED);
+            };
+
+            Assert::AreEqual(E_ACCESSDENIED, uncaught().Wait().hr);
+            Assert::AreEqual(E_UNEXPECTED, ThrowStd().Wait().hr);
+
+            // The original exception is rethrown
+            auto rethrown = []() -> Task<bool> {
+                try
+                {
+                    co_await ThrowStd();
+                }
+                catch (std::runtime_error&)
+                {
+                    co_return true;
+                }
+
+                co_return false;
+            };
+
+            Assert::IsTrue(*rethrown().Wait().value);
+        }
+
+        TEST_METHOD(CheckAndTry)
+        {
+            int destroyed = Local::destroyed;
+            auto tried = []() -> Task<HRESULT> {
+                auto result = co_await Try(Fail(E_FAIL));
+                if (result.value) co_return E_UNEXPECTED;
+                co_return result.hr;
+            };
+
+            Assert::AreEqual(E_FAIL, *tried().Wait().value);
+            Assert::AreEqual(1, Local::destroyed - destroyed);
+
+            auto ok = Fail(S_FALSE).Wait();
+            Assert::AreEqual(S_OK, ok.hr);
+            Assert::AreEqual(1, *ok.value);
+
+            // Check() fails the task without an exception; awaiting the
+            // failed task throws
+            auto p = MakeAccumulator();
+            Assert::AreEqual(E_INVALIDARG, AddTwice(p, -1).Wait().hr);
+
+            auto thrown = []() -> Task<HRESULT> {
+                try
+                {
+                    co_await Fail(E_NOTIMPL);
+                }
+                catch (ComException& e)
+                {
+                    co_return e.hr();
+                }
+
+                co_return S_OK;
+            };
+
+            Assert::AreEqual(E_NOTIMPL, *thrown().Wait().value);
+        }
+
+        TEST_METHOD(ResumedOnAnotherThread)
+        {
+            auto p = MakeAccumulator();
+            auto task = [](IPtr<IAccumulator> p) -> Task<long> {
+                auto id = std::this_thread::get_id();
+                co_await ResumeOnThread();
+                if (std::this_thread::get_id() == id) co_return -1;
+                co_return co_await AddTwice(p, 4);
+            };
+
+            auto result = task(p).Wait();
+            Assert::AreEqual(S_OK, result.hr);
+            Assert::AreEqual(8L, *result.value);
+        }
+
+        TEST_METHOD(LongChain)
+        {
+            // Each task in the chain awaits the next
+            auto p = MakeAccumulator();
+            auto result = Step(p, 1000).Wait();
+            Assert::AreEqual(S_OK, result.hr);
+            Assert::AreEqual(1000L, *result.value);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Chains of ten dependent calls through tasks and through
+            // callbacks that capture the interface pointer
+            int const steps = 10;
+            int const rounds = 100000;
+            auto p1 = MakeAccumulator();
+            auto p2 = MakeAccumulator();
+
+            auto t0 = std::chrono::steady_clock::now();
+            long long sum1 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                StepCallback(p1, steps, [&sum1](HRESULT, long total) { sum1 += total; });
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            long long sum2 = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                sum2 += *Step(p2, steps).Wait().value;
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+            Assert::AreEqual(sum1, sum2);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return static_cast<long long>(std::chrono::duration_cast<ns>(d).count() / rounds); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "%d-step chain: callbacks %lld ns, Task %lld ns\r\n", steps, per(t1 - t0), per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
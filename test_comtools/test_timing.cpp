@@ -0,0 +1,207 @@
+// test_timing.cpp: Test ComTools::TimingProxy ////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "timing.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Simulate COM interfaces
+//
+
+#undef INTERFACE
+
+#define INTERFACE IMeter
+DECLARE_INTERFACE_IID_(IMeter, IUnknown, "A61E0C58-7B3D-4E92-B4F7-2D8C5A1E9036")
+{
+    BEGIN_INTERFACE
+    STDMETHOD(QueryInterface)(THIS_ REFIID riid, void** ppv) PURE;
+    STDMETHOD_(ULONG, AddRef)(THIS) PURE;
+    STDMETHOD_(ULONG, Release)(THIS) PURE;
+    STDMETHOD(Add)(THIS_ long value) PURE;
+    STDMETHOD(Read)(THIS_ long* value) PURE;
+    STDMETHOD(Settle)(THIS_ long microseconds) PURE;
+    END_INTERFACE
+};
+#undef INTERFACE
+
+#define IMETER_METHODS(M) \
+    M(HRESULT, Add, (long value), (value)) \
+    M(HRESULT, Read, (long* value), (value)) \
+    M(HRESULT, Settle, (long microseconds), (microseconds))
+
+namespace TestComTools
+{
+    TIMING_PROXY(TimedMeter, IMeter, IMETER_METHODS);
+
+    class CMeter final : public Object<CMeter, IMeter> {
+        std::atomic<long> m_value = 0;
+
+    public:
+        void* Cast(REFIID riid) noexcept
+        {
+            return riid == __uuidof(IMeter) ? static_cast<IMeter*>(this) : nullptr;
+        }
+
+        STDMETHODIMP Add(long value) noexcept override
+        {
+            m_value += value;
+            return S_OK;
+        }
+
+        STDMETHODIMP Read(long* value) noexcept override
+        {
+            if (!value) return E_POINTER;
+            *value = m_value;
+            return S_OK;
+        }
+
+        // Spins for the given time
+        STDMETHODIMP Settle(long microseconds) noexcept override
+        {
+            auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+            while (std::chrono::steady_clock::now() < end) { }
+            return S_OK;
+        }
+    };
+
+    IPtr<IMeter> MakeMeter()
+    {
+        IPtr<IMeter> p;
+        CMeter::Create(__uuidof(IMeter), reinterpret_cast<void**>(set(p)));
+        return p;
+    }
+
+    TEST_CLASS(TestTiming)
+    {
+    public:
+        TEST_METHOD(Forwards)
+        {
+            auto meter = MakeMeter();
+            auto proxy = TimedMeter::Wrap(meter, __uuidof(IMeter));
+            Assert::IsTrue((bool)proxy);
+            Assert::IsFalse(proxy == meter);
+
+            long value = 0;
+            Assert::AreEqual(S_OK, proxy->Add(5));
+            Assert::AreEqual(E_POINTER, proxy->Read(nullptr));
+            Assert::AreEqual(S_OK, meter->Read(&value));
+            Assert::AreEqual(5L, value);
+
+            // The proxy has its own identity and answers for IMeter
+            auto unknown = proxy.As<IUnknown>(IID_IUnknown);
+            auto same = unknown.As<IMeter>(__uuidof(IMeter));
+            Assert::IsTrue(same == proxy);
+            Assert::IsFalse((bool)proxy.As<IDispatch>(IID_IDispatch));
+
+            Assert::IsFalse((bool)TimedMeter::Wrap(IPtr<IMeter>(), __uuidof(IMeter)));
+        }
+
+        TEST_METHOD(Buckets)
+        {
+            // Each duration falls between the floors of its bucket and the
+            // next bucket
+            for (unsigned long long ticks = 0; ticks < 100000; ticks += 1 + ticks / 64)
+            {
+                size_t bucket = LatencyHistogram::BucketOf(ticks);
+                Assert::IsTrue(LatencyHistogram::BucketFloor(bucket) <= ticks);
+                Assert::IsTrue(ticks < LatencyHistogram::BucketFloor(bucket + 1));
+            }
+
+            Assert::AreEqual(LatencyHistogram::Buckets - 1, LatencyHistogram::BucketOf(~0ULL));
+        }
+
+        TEST_METHOD(Snapshot)
+        {
+            TimedMeter::Reset();
+            auto proxy = TimedMeter::Wrap(MakeMeter(), __uuidof(IMeter));
+            long value = 0;
+            for (int i = 0; i < 100; ++i) proxy->Add(1);
+            for (int i = 0; i < 10; ++i) proxy->Settle(20);
+            proxy->Read(&value);
+
+            std::vector<MethodTiming> timings;
+            Assert::AreEqual(S_OK, TimedMeter::Snapshot(timings));
+            Assert::AreEqual(size_t(3), timings.size());
+            Assert::AreEqual("Add", timings[TimedMeter::Method_Add].name);
+            Assert::AreEqual(100ULL, timings[TimedMeter::Method_Add].calls);
+            Assert::AreEqual(1ULL, timings[TimedMeter::Method_Read].calls);
+
+            auto const& settle = timings[TimedMeter::Method_Settle];
+            Assert::AreEqual(10ULL, settle.calls);
+            Assert::IsTrue(settle.PercentileNs(0.5) >= 15000);
+            Assert::IsTrue(settle.MeanNs() >= 20000);
+            Assert::IsTrue(settle.PercentileNs(0.5) > timings[TimedMeter::Method_Add].PercentileNs(0.99));
+
+            std::string csv;
+            Assert::AreEqual(S_OK, TimedMeter::Export(csv));
+            Assert::AreEqual(size_t(0), csv.find("method,calls,"));
+            Assert::AreNotEqual(std::string::npos, csv.find("\nAdd,100,"));
+            Logger::WriteMessage(csv.c_str());
+
+            TimedMeter::Reset();
+            TimedMeter::Snapshot(timings);
+            Assert::AreEqual(0ULL, timings[TimedMeter::Method_Add].calls);
+        }
+
+        TEST_METHOD(Concurrent)
+        {
+            TimedMeter::Reset();
+            auto meter = MakeMeter();
+            auto proxy = TimedMeter::Wrap(meter, __uuidof(IMeter));
+            int const threads = 4;
+            int const calls = 50000;
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; ++t)
+            {
+                workers.emplace_back([&proxy]() {
+                    for (int i = 0; i < calls; ++i) proxy->Add(1);
+                });
+            }
+
+            for (auto& worker : workers) worker.join();
+
+            std::vector<MethodTiming> timings;
+            TimedMeter::Snapshot(timings);
+            Assert::AreEqual(static_cast<unsigned long long>(threads) * calls, timings[TimedMeter::Method_Add].calls);
+
+            long value = 0;
+            meter->Read(&value);
+            Assert::AreEqual(static_cast<long>(threads) * calls, value);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Overhead of the proxy on a trivial method
+            int const calls = 1000000;
+            auto meter = MakeMeter();
+            auto proxy = TimedMeter::Wrap(meter, __uuidof(IMeter));
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < calls; ++i) meter->Add(1);
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < calls; ++i) proxy->Add(1);
+            auto t2 = std::chrono::steady_clock::now();
+
+            long value = 0;
+            meter->Read(&value);
+            Assert::AreEqual(2L * calls, value);
+
+            using ns = std::chrono::nanoseconds;
+            auto per = [&](auto d) { return std::chrono::duration_cast<ns>(d).count() / static_cast<double>(calls); };
+            size_t const cch = 256;
+            char buf[cch];
+            sprintf_s(buf, "IMeter::Add: direct %.1f ns, through TimingProxy %.1f ns\r\n", per(t1 - t0), per(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -3,6 +3,10 @@
 
 #include "CppUnitTest.h"
 #include "ubstr.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 using namespace ComTools;
@@ -95,6 +99,94 @@ namespace TestComTools
             s2 = std::move(s1);
             Assert::AreEqual(L"This is a string.", s2.to_wstring().c_str());
         }
+
+        TEST_METHOD(TestDetachAttach)
+        {
+            UBSTR s1(L"This is a string.");
+            BSTR bstr = detach(s1);
+            Assert::AreEqual(false, (bool)s1);
+            Assert::AreEqual(L"This is a string.", bstr);
+
+            UBSTR s2;
+            attach(s2, bstr);
+            Assert::AreEqual(L"This is a string.", s2.get());
+        }
+
+        TEST_METHOD(InitFromU16)
+        {
+            UBSTR s(u"This is a string.");
+            Assert::AreEqual(L"This is a string.", s.get());
+            Assert::AreEqual((size_t)17, s.length());
+
+            // The view covers the whole BSTR and points into it
+            std::u16string_view view = s.u16view();
+            Assert::AreEqual((size_t)17, view.size());
+            Assert::IsTrue(reinterpret_cast<wchar_t const*>(view.data()) == s.get());
+            Assert::IsTrue(s.to_u16string() == u"This is a string.");
+
+            // A u16string_view is copied with its embedded nulls
+            std::u16string_view const embedded(u"ab\0cd", 5);
+            UBSTR t(embedded);
+            Assert::AreEqual(5U, static_cast<unsigned>(SysStringLen(t.get())));
+            Assert::AreEqual((size_t)2, t.length());
+            Assert::IsTrue(t.u16view() == embedded);
+
+            UBSTR empty;
+            Assert::IsTrue(empty.u16view().empty());
+            Assert::IsTrue(empty.to_u16string().empty());
+        }
+
+        TEST_METHOD(Utf32)
+        {
+            // The conversions used where wchar_t is 32 bits, tested here
+            // with char32_t. The text is long enough to use the vector
+            // path, with a surrogate pair and a lone surrogate in the middle.
+            std::u16string const utf16 =
+                u"The quick brown fox \U0001F98A jumps \xD800 over the lazy dog.";
+            std::u32string const utf32 =
+                U"The quick brown fox \U0001F98A jumps \xD800 over the lazy dog.";
+
+            std::u32string wide(utf16.size(), U'\0');
+            wide.resize(InternalUtf16ToUtf32(utf16.data(), utf16.size(), wide.data()));
+            Assert::IsTrue(wide == utf32);
+
+            std::u16string narrow(2 * utf32.size(), u'\0');
+            narrow.resize(InternalUtf32ToUtf16(utf32.data(), utf32.size(), narrow.data()));
+            Assert::IsTrue(narrow == utf16);
+
+            char32_t const bad = 0x110000;
+            char16_t unit = 0;
+            Assert::AreEqual((size_t)1, InternalUtf32ToUtf16(&bad, 1, &unit));
+            Assert::IsTrue(unit == u'\xFFFD');
+
+            // wchar_t text round-trips through a BSTR on any platform
+            UBSTR s(L"Fox \U0001F98A");
+            Assert::IsTrue(s.u16view() == u"Fox \U0001F98A");
+            Assert::IsTrue(s.to_wstring() == L"Fox \U0001F98A");
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Read a typical error description as UTF-16 and as a wstring
+            UBSTR const s(L"The parameter is incorrect. Check the value passed to the method.");
+            int const n = 1000000;
+            size_t total = 0;
+
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; ++i) total += s.to_wstring().size();
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < n; ++i) total += s.u16view().size();
+            auto t2 = std::chrono::steady_clock::now();
+
+            Assert::AreEqual(size_t(2) * n * s.length(), total);
+
+            using ns = std::chrono::nanoseconds;
+            auto nano = [](auto d) { return static_cast<double>(std::chrono::duration_cast<ns>(d).count()) / n; };
+            size_t const cch = 128;
+            char buf[cch];
+            sprintf_s(buf, "Read a string: to_wstring %.1f ns, u16view %.1f ns\r\n", nano(t1 - t0), nano(t2 - t1));
+            Logger::WriteMessage(buf);
+        }
     };
 }
 
@@ -0,0 +1,233 @@
+// test_usafearray.cpp: Test ComTools::USafeArray /////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "usafearray.h"
+#include <chrono>
+#include <numeric>
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    TEST_CLASS(TestUSafeArray)
+    {
+        static USafeArray<BSTR> MakeStrings(ULONG n)
+        {
+            USafeArray<BSTR> a(n);
+            auto access = a.access();
+            for (ULONG i = 0; i < n; ++i)
+            {
+                access[i] = SysAllocString((L"String " + std::to_wstring(i)).c_str());
+            }
+            return a;
+        }
+
+    public:
+        TEST_METHOD(InitDefault)
+        {
+            USafeArray<double> a;
+            Assert::IsFalse((bool)a);
+            auto access = a.access();
+            Assert::IsFalse((bool)access);
+            Assert::AreEqual((size_t)0, access.size());
+            Assert::IsTrue(access.span().empty());
+        }
+
+        TEST_METHOD(Vector)
+        {
+            USafeArray<double> a(10, 1);
+            Assert::IsTrue((bool)a);
+            auto access = a.access();
+            Assert::AreEqual(1U, access.dims());
+            Assert::AreEqual((size_t)10, access.size());
+            Assert::AreEqual(1L, access.lbound(0));
+
+            auto s = access.span();
+            std::iota(s.begin(), s.end(), 0.0);
+            Assert::AreEqual(45.0, std::accumulate(access.begin(), access.end(), 0.0));
+
+            // Indices include the lower bound
+            Assert::AreEqual(0.0, access(1));
+            Assert::AreEqual(9.0, access(10));
+        }
+
+        TEST_METHOD(AgreesWithGetElement)
+        {
+            USafeArray<int> a(5);
+            auto access = a.access();
+            for (size_t i = 0; i < access.size(); ++i) access[i] = static_cast<int>(i * i);
+
+            for (LONG i = 0; i < 5; ++i)
+            {
+                int value = -1;
+                Assert::IsTrue(SUCCEEDED(SafeArrayGetElement(a.get(), &i, &value)));
+                Assert::AreEqual(access(i), value);
+            }
+        }
+
+        TEST_METHOD(MultiDimensional)
+        {
+            // 3 x 4 array with lower bounds 1 and 0
+            USafeArray<int> a({ { 3, 1 }, { 4, 0 } });
+            auto access = a.access();
+            Assert::AreEqual(2U, access.dims());
+            Assert::AreEqual((size_t)12, access.size());
+            Assert::AreEqual((size_t)3, access.extent(0));
+            Assert::AreEqual((size_t)4, access.extent(1));
+            Assert::AreEqual(1L, access.lbound(0));
+            Assert::AreEqual(0L, access.lbound(1));
+
+            // The left-most index varies fastest
+            for (LONG j = 0; j < 4; ++j)
+            {
+                for (LONG i = 1; i <= 3; ++i)
+                {
+                    access(i, j) = static_cast<int>(10 * i + j);
+                }
+            }
+
+            Assert::AreEqual(10, access[0]);
+            Assert::AreEqual(20, access[1]);
+            Assert::AreEqual(30, access[2]);
+            Assert::AreEqual(11, access[3]);
+            Assert::AreEqual(33, access[11]);
+        }
+
+        TEST_METHOD(WrongType)
+        {
+            // Elements are not accessible through a USafeArray of another type
+            USafeArray<double> a(4);
+            USafeArray<int> b;
+            attach(b, detach(a));
+            Assert::IsTrue((bool)b);
+            auto access = b.access();
+            Assert::IsFalse((bool)access);
+            Assert::IsNull(access.data());
+            Assert::AreEqual((size_t)0, access.size());
+            Assert::AreEqual(0UL, static_cast<unsigned long>(b.get()->cLocks));
+        }
+
+        TEST_METHOD(ScopedLock)
+        {
+            USafeArray<double> a(4);
+            SAFEARRAYBOUND bound = { 8, 0 };
+            {
+                auto access = a.access();
+                access[0] = 1.0;
+                Assert::AreEqual(1UL, static_cast<unsigned long>(a.get()->cLocks));
+
+                // Each accessor holds its own lock
+                USafeArray<double> const& c = a;
+                auto reader = c.access();
+                Assert::AreEqual(1.0, reader[0]);
+                Assert::AreEqual(2UL, static_cast<unsigned long>(a.get()->cLocks));
+                Assert::AreEqual(DISP_E_ARRAYISLOCKED, SafeArrayRedim(a.get(), &bound));
+            }
+
+            // Once the accessors are gone, a callee can resize the array
+            Assert::AreEqual(0UL, static_cast<unsigned long>(a.get()->cLocks));
+            Assert::AreEqual(S_OK, SafeArrayRedim(a.get(), &bound));
+            auto access = a.access();
+            Assert::AreEqual((size_t)8, access.size());
+            Assert::AreEqual(1.0, access[0]);
+        }
+
+        TEST_METHOD(Set)
+        {
+            USafeArray<double> a(4);
+            SAFEARRAY** ppsa = set(a);
+            Assert::IsFalse((bool)a);
+            *ppsa = SafeArrayCreateVector(VT_R8, 0, 2);
+            Assert::AreEqual((size_t)2, a.access().size());
+        }
+
+        TEST_METHOD(CopyAndMove)
+        {
+            auto a = MakeStrings(3);
+            USafeArray<BSTR> b(a);
+            Assert::IsTrue(a.access()[1] != b.access()[1]);
+            Assert::AreEqual(a.access()[1], b.access()[1]);
+
+            USafeArray<BSTR> c(std::move(b));
+            Assert::IsFalse((bool)b);
+            Assert::AreEqual(L"String 2", c.access()[2]);
+
+            USafeArray<BSTR> d;
+            d = std::move(c);
+            Assert::IsFalse((bool)c);
+            Assert::AreEqual(L"String 0", d.access()[0]);
+        }
+
+        TEST_METHOD(WStringViews)
+        {
+            auto a = MakeStrings(100000);
+            auto views = to_wstring_views(a);
+            Assert::AreEqual((size_t)100000, views.size());
+            Assert::IsTrue(views[0] == L"String 0");
+            Assert::IsTrue(views[99999] == L"String 99999");
+            Assert::IsTrue(views[12345].data() == a.access()[12345]);
+        }
+
+        TEST_METHOD(UTF8)
+        {
+            auto a = MakeStrings(20000);
+            {
+                auto access = a.access();
+                SysFreeString(access[1]);
+                access[1] = SysAllocString(L"\u00e9t\u00e9");
+                SysFreeString(access[2]);
+                access[2] = nullptr;
+            }
+
+            auto strings = to_utf8(a);
+            Assert::AreEqual((size_t)20000, strings.size());
+            Assert::AreEqual(std::string("String 0"), strings[0]);
+            Assert::AreEqual(std::string("\xc3\xa9t\xc3\xa9"), strings[1]);
+            Assert::IsTrue(strings[2].empty());
+            Assert::AreEqual(std::string("String 19999"), strings[19999]);
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Sum an array element by element and through the locked data
+            ULONG const n = 1000000;
+            USafeArray<double> a(n);
+            {
+                auto access = a.access();
+                std::iota(access.begin(), access.end(), 0.0);
+            }
+
+            auto t0 = std::chrono::steady_clock::now();
+            double sum1 = 0.0;
+            for (LONG i = 0; i < static_cast<LONG>(n); ++i)
+            {
+                double value = 0.0;
+                SafeArrayGetElement(a.get(), &i, &value);
+                sum1 += value;
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            double sum2 = 0.0;
+            for (double value : a.access()) sum2 += value;
+
+            auto t2 = std::chrono::steady_clock::now();
+            Assert::AreEqual(sum1, sum2);
+
+            using ns = std::chrono::nanoseconds;
+            size_t const cch = 128;
+            char buf[cch];
+            sprintf_s(buf, "SafeArrayGetElement: %lld ns, span: %lld ns (%lu elements)\r\n",
+                static_cast<long long>(std::chrono::duration_cast<ns>(t1 - t0).count()),
+                static_cast<long long>(std::chrono::duration_cast<ns>(t2 - t1).count()),
+                static_cast<unsigned long>(n));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
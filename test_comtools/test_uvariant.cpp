@@ -0,0 +1,274 @@
+// test_uvariant.cpp: Test ComTools::UVARIANT /////////////////////////////////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+
+#include "CppUnitTest.h"
+#include "uvariant.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+
+namespace TestComTools
+{
+    // Object with a visible reference count
+    class CCounted : public IUnknown {
+    public:
+        ULONG rc = 1;
+
+        virtual ~CCounted() noexcept { }
+
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv) noexcept override
+        {
+            if (!ppv) return E_POINTER;
+            if (riid == IID_IUnknown) *ppv = static_cast<IUnknown*>(this);
+            else return (*ppv = nullptr), E_NOINTERFACE;
+            AddRef();
+            return S_OK;
+        }
+
+        STDMETHODIMP_(ULONG) AddRef() noexcept override
+        {
+            return ++rc;
+        }
+
+        STDMETHODIMP_(ULONG) Release() noexcept override
+        {
+            auto temp = --rc;
+            if (temp == 0) delete this;
+            return temp;
+        }
+    };
+
+    TEST_CLASS(TestUVARIANT)
+    {
+    public:
+        TEST_METHOD(InitDefault)
+        {
+            UVARIANT v;
+            Assert::IsFalse((bool)v);
+            Assert::IsTrue(v.vt() == VT_EMPTY);
+        }
+
+        TEST_METHOD(Scalars)
+        {
+            UVARIANT v(42L);
+            Assert::IsTrue(v.vt() == VT_I4);
+            Assert::IsTrue(v.holds<long>());
+            Assert::AreEqual(42L, v.as<long>());
+
+            v = 2.5;
+            Assert::IsTrue(v.vt() == VT_R8);
+            Assert::IsFalse(v.holds<long>());
+            Assert::AreEqual(2.5, v.as<double>());
+
+            v = true;
+            Assert::IsTrue(v.vt() == VT_BOOL);
+            Assert::IsTrue(v.get().boolVal == VARIANT_TRUE);
+            Assert::IsTrue(v.as<bool>());
+
+            v = 1234567890123LL;
+            Assert::IsTrue(v.vt() == VT_I8);
+            Assert::AreEqual(1234567890123LL, v.as<long long>());
+        }
+
+        TEST_METHOD(FromString)
+        {
+            UVARIANT v(L"This is a string.");
+            Assert::IsTrue(v.vt() == VT_BSTR);
+            Assert::AreEqual(L"This is a string.", v.get().bstrVal);
+        }
+
+        TEST_METHOD(MoveUBSTR)
+        {
+            // The BSTR changes owners but is not copied
+            UBSTR s(L"This is a string.");
+            BSTR bstr = s.get();
+            UVARIANT v(std::move(s));
+            Assert::IsFalse((bool)s);
+            Assert::IsTrue(v.vt() == VT_BSTR);
+            Assert::IsTrue(v.get().bstrVal == bstr);
+        }
+
+        TEST_METHOD(CopyUBSTR)
+        {
+            UBSTR s(L"This is a string.");
+            UVARIANT v(s);
+            Assert::IsTrue((bool)s);
+            Assert::IsTrue(v.get().bstrVal != s.get());
+            Assert::AreEqual(s.get(), v.get().bstrVal);
+        }
+
+        TEST_METHOD(MoveIPtr)
+        {
+            auto obj = new CCounted;
+            IPtr<IUnknown> p;
+            attach(p, static_cast<IUnknown*>(obj));
+            {
+                UVARIANT v(std::move(p));
+                Assert::IsFalse((bool)p);
+                Assert::IsTrue(v.vt() == VT_UNKNOWN);
+                Assert::AreEqual(1UL, static_cast<unsigned long>(obj->rc));
+
+                // Copying the variant adds a reference
+                UVARIANT v2(v);
+                Assert::AreEqual(2UL, static_cast<unsigned long>(obj->rc));
+                obj->AddRef();
+            }
+
+            Assert::AreEqual(1UL, static_cast<unsigned long>(obj->rc));
+            obj->Release();
+        }
+
+        TEST_METHOD(CopyIPtr)
+        {
+            auto obj = new CCounted;
+            IPtr<IUnknown> p;
+            attach(p, static_cast<IUnknown*>(obj));
+            UVARIANT v(p);
+            Assert::IsTrue((bool)p);
+            Assert::AreEqual(2UL, static_cast<unsigned long>(obj->rc));
+            v = 0L;
+            Assert::AreEqual(1UL, static_cast<unsigned long>(obj->rc));
+        }
+
+        TEST_METHOD(Copy)
+        {
+            UVARIANT v1(L"This is a string.");
+            UVARIANT v2(v1);
+            Assert::IsTrue(v1.get().bstrVal != v2.get().bstrVal);
+            Assert::AreEqual(v1.get().bstrVal, v2.get().bstrVal);
+
+            UVARIANT v3;
+            v3 = v2;
+            Assert::AreEqual(v1.get().bstrVal, v3.get().bstrVal);
+        }
+
+        TEST_METHOD(Move)
+        {
+            UVARIANT v1(L"This is a string.");
+            BSTR bstr = v1.get().bstrVal;
+            UVARIANT v2(std::move(v1));
+            Assert::IsFalse((bool)v1);
+            Assert::IsTrue(v2.get().bstrVal == bstr);
+
+            UVARIANT v3;
+            v3 = std::move(v2);
+            Assert::IsFalse((bool)v2);
+            Assert::IsTrue(v3.get().bstrVal == bstr);
+        }
+
+        TEST_METHOD(Set)
+        {
+            UVARIANT v(L"This is a string.");
+            VARIANT* p = set(v);
+            Assert::IsTrue(p->vt == VT_EMPTY);
+            p->vt = VT_BSTR;
+            p->bstrVal = SysAllocString(L"Another string.");
+            Assert::AreEqual(L"Another string.", v.get().bstrVal);
+        }
+
+        TEST_METHOD(DetachAttach)
+        {
+            UVARIANT v1(L"This is a string.");
+            VARIANT var = detach(v1);
+            Assert::IsFalse((bool)v1);
+            Assert::IsTrue(var.vt == VT_BSTR);
+
+            UVARIANT v2;
+            attach(v2, var);
+            Assert::AreEqual(L"This is a string.", v2.get().bstrVal);
+        }
+
+        TEST_METHOD(Visit)
+        {
+            auto describe = [](auto const& value) -> std::wstring
+            {
+                using T = std::decay_t<decltype(value)>;
+                if constexpr (std::is_same<T, VariantEmpty>::value) return L"empty";
+                else if constexpr (std::is_same<T, bool>::value) return L"bool";
+                else if constexpr (std::is_same<T, BSTR>::value) return value;
+                else if constexpr (std::is_same<T, IUnknown*>::value) return L"unknown";
+                else if constexpr (std::is_same<T, VARIANT>::value) return L"other";
+                else if constexpr (std::is_arithmetic<T>::value) return std::to_wstring(value);
+                else return L"?";
+            };
+
+            Assert::AreEqual(std::wstring(L"empty"), UVARIANT().visit(describe));
+            Assert::AreEqual(std::wstring(L"bool"), UVARIANT(false).visit(describe));
+            Assert::AreEqual(std::wstring(L"42"), UVARIANT(42L).visit(describe));
+            Assert::AreEqual(std::wstring(L"text"), UVARIANT(L"text").visit(describe));
+
+            VARIANT cy;
+            VariantInit(&cy);
+            cy.vt = VT_CY;
+            cy.cyVal.int64 = 10000;
+            Assert::AreEqual(std::wstring(L"other"), UVARIANT(cy).visit(describe));
+        }
+
+        TEST_METHOD(Timing)
+        {
+            // Property bag: overwrite a set of values of mixed types
+            size_t const n = 1000;
+            int const rounds = 100;
+            UBSTR name(L"Property value");
+
+            auto t0 = std::chrono::steady_clock::now();
+            {
+                std::vector<VARIANT> bag(n);
+                for (auto& v : bag) VariantInit(&v);
+                for (int r = 0; r < rounds; ++r)
+                {
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        VARIANT temp;
+                        VariantInit(&temp);
+                        switch (i % 4)
+                        {
+                        case 0: temp.vt = VT_I4; temp.lVal = r; break;
+                        case 1: temp.vt = VT_R8; temp.dblVal = r; break;
+                        case 2: temp.vt = VT_BOOL; temp.boolVal = VARIANT_TRUE; break;
+                        case 3: temp.vt = VT_BSTR; temp.bstrVal = name.get(); break;
+                        }
+                        VariantCopy(&bag[i], &temp);
+                    }
+                }
+                for (auto& v : bag) VariantClear(&v);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            {
+                std::vector<UVARIANT> bag(n);
+                for (int r = 0; r < rounds; ++r)
+                {
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        switch (i % 4)
+                        {
+                        case 0: bag[i] = static_cast<long>(r); break;
+                        case 1: bag[i] = static_cast<double>(r); break;
+                        case 2: bag[i] = true; break;
+                        case 3: bag[i] = UVARIANT(name); break;
+                        }
+                    }
+                }
+            }
+
+            auto t2 = std::chrono::steady_clock::now();
+
+            using ns = std::chrono::nanoseconds;
+            long long const ops = static_cast<long long>(n) * rounds;
+            size_t const cch = 128;
+            char buf[cch];
+            sprintf_s(buf, "VARIANT: %lld ns/op, UVARIANT: %lld ns/op\r\n",
+                static_cast<long long>(std::chrono::duration_cast<ns>(t1 - t0).count() / ops),
+                static_cast<long long>(std::chrono::duration_cast<ns>(t2 - t1).count() / ops));
+            Logger::WriteMessage(buf);
+        }
+    };
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,473 @@
+// comtrace_replay.cpp: Replay a ComTools trace against stand-in objects /////
+// Copyright (c) 2022, Jeffrey M. Engelmann
+//
+// Replays a trace recorded with calltrace.h against stand-in objects and
+// strings, for each combination of reference counting, string allocation,
+// and error path, on each of the given thread counts, and prints the time per
+// record. It needs only tracefmt.h, so it builds on Linux:
+//
+//     g++ -std=c++20 -O2 -pthread -Iinclude tools/comtrace_replay.cpp -o comtrace_replay
+//
+// Usage:
+//
+//     comtrace_replay [options] trace
+//     comtrace_replay [options] --synthetic records
+//
+// Options:
+//
+//     --threads n[,n...]       Thread counts (default 1,2,4)
+//     --refs atomic|unsync     Reference counting (default both)
+//     --alloc malloc|pool      String allocation (default both)
+//     --errors throw|hresult   Error path (default both)
+//     --rounds n               Replays per result; the fastest is shown
+//                              (default 5)
+//
+// --synthetic makes a trace of the given number of records, on eight threads
+// sharing 64 objects, instead of reading one.
+
+#include "tracefmt.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace ComTools;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reference counting
+//
+
+// Interlocked, as Object::AddRef() and Release() are
+struct AtomicCount {
+    static void AddRef(std::atomic<long>& refs) noexcept
+    {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool Release(std::atomic<long>& refs) noexcept
+    {
+        return refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+};
+
+// Plain loads and stores, as Object::AddRefUnsync() and ReleaseUnsync() are.
+// Counts may be lost when threads share objects, but the costs are right.
+struct UnsyncCount {
+    static void AddRef(std::atomic<long>& refs) noexcept
+    {
+        refs.store(refs.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static bool Release(std::atomic<long>& refs) noexcept
+    {
+        long const n = refs.load(std::memory_order_relaxed) - 1;
+        refs.store(n, std::memory_order_relaxed);
+        return n == 0;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// String allocation. A string is laid out as a BSTR is: a 32-bit byte
+// count, the characters, and a null terminator.
+//
+
+struct MallocStrings {
+    static char16_t* Alloc(std::uint32_t cch) noexcept
+    {
+        auto p = static_cast<std::uint32_t*>(std::malloc(sizeof(std::uint32_t) + (cch + 1) * sizeof(char16_t)));
+        if (!p) return nullptr;
+        *p = cch * sizeof(char16_t);
+        auto s = reinterpret_cast<char16_t*>(p + 1);
+        std::fill_n(s, cch, u'x');
+        s[cch] = 0;
+        return s;
+    }
+
+    static void Free(char16_t* s) noexcept
+    {
+        if (s) std::free(reinterpret_cast<std::uint32_t*>(s) - 1);
+    }
+};
+
+// Per-thread free lists of blocks of 2^n bytes, from 32 to 4096 bytes; larger
+// strings use malloc. A block freed on another thread joins that thread's
+// list.
+struct PoolStrings {
+    static constexpr int Classes = 8;
+
+    struct Block {
+        Block* next;
+    };
+
+    struct Lists {
+        Block* heads[Classes] = { };
+
+        ~Lists()
+        {
+            for (auto head : heads)
+            {
+                while (head)
+                {
+                    Block* next = head->next;
+                    std::free(head);
+                    head = next;
+                }
+            }
+        }
+    };
+
+    static Lists& ThreadLists() noexcept
+    {
+        thread_local Lists lists;
+        return lists;
+    }
+
+    static int ClassOf(size_t bytes) noexcept
+    {
+        int c = 0;
+        while (c < Classes && (size_t(32) << c) < bytes) ++c;
+        return c;
+    }
+
+    static char16_t* Alloc(std::uint32_t cch) noexcept
+    {
+        size_t const bytes = sizeof(std::uint32_t) + (cch + 1) * sizeof(char16_t);
+        int const c = ClassOf(bytes);
+        void* block = nullptr;
+        if (c < Classes)
+        {
+            auto& head = ThreadLists().heads[c];
+            if (head)
+            {
+                block = head;
+                head = head->next;
+            }
+            else
+            {
+                block = std::malloc(size_t(32) << c);
+            }
+        }
+        else
+        {
+            block = std::malloc(bytes);
+        }
+
+        if (!block) return nullptr;
+        auto p = static_cast<std::uint32_t*>(block);
+        *p = cch * sizeof(char16_t);
+        auto s = reinterpret_cast<char16_t*>(p + 1);
+        std::fill_n(s, cch, u'x');
+        s[cch] = 0;
+        return s;
+    }
+
+    static void Free(char16_t* s) noexcept
+    {
+        if (!s) return;
+        auto p = reinterpret_cast<std::uint32_t*>(s) - 1;
+        int const c = ClassOf(sizeof(std::uint32_t) + *p + sizeof(char16_t));
+        if (c < Classes)
+        {
+            auto& head = ThreadLists().heads[c];
+            auto block = reinterpret_cast<Block*>(p);
+            block->next = head;
+            head = block;
+        }
+        else
+        {
+            std::free(p);
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Error paths. Each copies the error's text, as ComException does.
+//
+
+struct TraceError {
+    std::int32_t hr;
+    std::u16string description;
+};
+
+std::atomic<std::int64_t> g_sink = 0;
+
+struct ThrowErrors {
+    [[gnu::noinline]] static void Fail(std::uint32_t hr, std::uint32_t size)
+    {
+        throw TraceError{ static_cast<std::int32_t>(hr), std::u16string(size, u'x') };
+    }
+
+    static void Error(std::uint32_t hr, std::uint32_t size) noexcept
+    {
+        try
+        {
+            Fail(hr, size);
+        }
+        catch (TraceError const& e)
+        {
+            g_sink.fetch_add(e.hr + static_cast<std::int64_t>(e.description.size()), std::memory_order_relaxed);
+        }
+    }
+};
+
+struct HresultErrors {
+    [[gnu::noinline]] static std::int32_t Fail(std::uint32_t hr, std::uint32_t size, TraceError* pError) noexcept
+    {
+        try
+        {
+            *pError = TraceError{ static_cast<std::int32_t>(hr), std::u16string(size, u'x') };
+        }
+        catch (...)
+        {
+        }
+
+        return static_cast<std::int32_t>(hr);
+    }
+
+    static void Error(std::uint32_t hr, std::uint32_t size) noexcept
+    {
+        TraceError e;
+        if (Fail(hr, size, &e) < 0)
+        {
+            g_sink.fetch_add(e.hr + static_cast<std::int64_t>(e.description.size()), std::memory_order_relaxed);
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Stand-in environment for ReplayTrace
+//
+
+template<typename Count, typename Strings, typename Errors>
+class StandIns {
+    // Each object has its own cache line, as separately allocated COM
+    // objects would
+    struct alignas(64) Obj {
+        std::atomic<long> refs = 1;
+    };
+
+    std::unique_ptr<Obj[]> m_objects;
+    std::unique_ptr<std::atomic<char16_t*>[]> m_strings;
+    std::uint32_t m_string_count;
+
+public:
+    explicit StandIns(Trace const& trace) :
+        m_objects(new Obj[trace.objects + 1]),
+        m_strings(new std::atomic<char16_t*>[trace.strings + 1]),
+        m_string_count(trace.strings)
+    {
+        for (std::uint32_t i = 0; i < m_string_count; ++i) m_strings[i] = nullptr;
+    }
+
+    ~StandIns()
+    {
+        for (std::uint32_t i = 0; i < m_string_count; ++i) Strings::Free(m_strings[i].load());
+    }
+
+    StandIns(StandIns const&) = delete;
+    StandIns& operator=(StandIns const&) = delete;
+
+    void AddRef(std::uint32_t object, std::uint32_t) noexcept
+    {
+        Count::AddRef(m_objects[object].refs);
+    }
+
+    void Release(std::uint32_t object, std::uint32_t) noexcept
+    {
+        // The last reference is the one held by the replay, so a stand-in
+        // is never destroyed; a release for a reference made before
+        // recording began is made up for here
+        if (Count::Release(m_objects[object].refs)) Count::AddRef(m_objects[object].refs);
+    }
+
+    void Alloc(std::uint32_t string, std::uint32_t size) noexcept
+    {
+        Strings::Free(m_strings[string].exchange(Strings::Alloc(size), std::memory_order_acq_rel));
+    }
+
+    void Free(std::uint32_t string) noexcept
+    {
+        // Null for a string allocated before recording began
+        Strings::Free(m_strings[string].exchange(nullptr, std::memory_order_acq_rel));
+    }
+
+    void Error(std::uint32_t hr, std::uint32_t size) noexcept
+    {
+        Errors::Error(hr, size);
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Driver
+//
+
+// Eight threads sharing 64 objects. Each step copies and releases an
+// interface pointer, and one in four also makes a string; one in 200 fails.
+Trace MakeSynthetic(size_t count)
+{
+    Trace trace;
+    trace.types = { "IUnknown", "UBSTR", "ComException" };
+    trace.threads = 8;
+    trace.objects = 64;
+    std::mt19937 random(1);
+    std::vector<std::uint32_t> open(trace.threads, UINT32_MAX);
+    while (trace.records.size() < count)
+    {
+        auto const thread = static_cast<std::uint16_t>(random() % trace.threads);
+        auto const object = static_cast<std::uint32_t>(random() % trace.objects);
+        trace.records.push_back({ TraceOp::IPtrAddRef, 0, thread, 0, object, 0 });
+        trace.records.push_back({ TraceOp::IPtrRelease, 0, thread, 0, object, 0 });
+        if (random() % 4 == 0)
+        {
+            if (open[thread] != UINT32_MAX)
+            {
+                trace.records.push_back({ TraceOp::BstrFree, 0, thread, 1, open[thread], 0 });
+            }
+
+            open[thread] = trace.strings++;
+            trace.records.push_back({ TraceOp::BstrAlloc, 0, thread, 1, open[thread], 4 + static_cast<std::uint32_t>(random() % 60) });
+        }
+
+        if (random() % 200 == 0)
+        {
+            trace.records.push_back({ TraceOp::Error, 0, thread, 2, 0x80004005, 40 });
+        }
+    }
+
+    return trace;
+}
+
+struct Options {
+    std::vector<size_t> threads = { 1, 2, 4 };
+    std::string refs;
+    std::string alloc;
+    std::string errors;
+    int rounds = 5;
+};
+
+template<typename Count, typename Strings, typename Errors>
+void Run(Trace const& trace, Options const& options, char const* name)
+{
+    std::printf("%-24s", name);
+    for (auto threads : options.threads)
+    {
+        double best = 0;
+        for (int r = 0; r < options.rounds; ++r)
+        {
+            StandIns<Count, Strings, Errors> env(trace);
+            auto t0 = std::chrono::steady_clock::now();
+            ReplayTrace(trace, threads, env);
+            auto t1 = std::chrono::steady_clock::now();
+            double const ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+            if (r == 0 || ns < best) best = ns;
+        }
+
+        std::printf("  %8.1f", best / static_cast<double>(trace.records.size()));
+    }
+
+    std::printf("\n");
+}
+
+template<typename Count, typename Strings>
+void RunErrors(Trace const& trace, Options const& options, std::string const& name)
+{
+    if (options.errors.empty() || options.errors == "throw")
+    {
+        Run<Count, Strings, ThrowErrors>(trace, options, (name + " throw").c_str());
+    }
+
+    if (options.errors.empty() || options.errors == "hresult")
+    {
+        Run<Count, Strings, HresultErrors>(trace, options, (name + " hresult").c_str());
+    }
+}
+
+template<typename Count>
+void RunAlloc(Trace const& trace, Options const& options, std::string const& name)
+{
+    if (options.alloc.empty() || options.alloc == "malloc") RunErrors<Count, MallocStrings>(trace, options, name + " malloc");
+    if (options.alloc.empty() || options.alloc == "pool") RunErrors<Count, PoolStrings>(trace, options, name + " pool");
+}
+
+int Usage()
+{
+    std::fprintf(stderr,
+        "Usage: comtrace_replay [--threads n[,n...]] [--refs atomic|unsync] [--alloc malloc|pool]\n"
+        "                       [--errors throw|hresult] [--rounds n] (trace | --synthetic records)\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    std::string path;
+    size_t synthetic = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view const arg = argv[i];
+        bool const has_value = i + 1 < argc;
+        if (arg == "--threads" && has_value)
+        {
+            options.threads.clear();
+            for (char* p = argv[++i]; *p; )
+            {
+                char* end = nullptr;
+                size_t const n = std::strtoul(p, &end, 10);
+                if (end == p || n == 0) return Usage();
+                options.threads.push_back(n);
+                p = *end == ',' ? end + 1 : end;
+            }
+        }
+        else if (arg == "--refs" && has_value) options.refs = argv[++i];
+        else if (arg == "--alloc" && has_value) options.alloc = argv[++i];
+        else if (arg == "--errors" && has_value) options.errors = argv[++i];
+        else if (arg == "--rounds" && has_value) options.rounds = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--synthetic" && has_value) synthetic = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg.starts_with("--") || !path.empty()) return Usage();
+        else path = arg;
+    }
+
+    if (path.empty() == (synthetic == 0) || options.threads.empty()) return Usage();
+
+    Trace trace;
+    if (synthetic)
+    {
+        trace = MakeSynthetic(synthetic);
+    }
+    else if (!trace.Load(path))
+    {
+        std::fprintf(stderr, "comtrace_replay: %s is not a trace\n", path.c_str());
+        return 1;
+    }
+
+    size_t counts[8] = { };
+    for (auto const& record : trace.records) ++counts[static_cast<size_t>(record.op) & 7];
+    std::printf("%zu records on %u threads: %zu AddRef, %zu Release, %zu Move, %zu Query, "
+        "%zu BstrAlloc, %zu BstrFree, %zu Error\n",
+        trace.records.size(), static_cast<unsigned>(trace.threads),
+        counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7]);
+    std::printf("%u objects, %u strings, %zu types\n\n", trace.objects, trace.strings, trace.types.size());
+
+    std::printf("%-24s", "ns per record");
+    for (auto threads : options.threads) std::printf("  %5zu thr", threads);
+    std::printf("\n");
+
+    if (options.refs.empty() || options.refs == "atomic") RunAlloc<AtomicCount>(trace, options, "atomic");
+    if (options.refs.empty() || options.refs == "unsync") RunAlloc<UnsyncCount>(trace, options, "unsync");
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////